@@ -27,6 +27,8 @@
 #include "../utility/move_on_copy.h"
 #include "../log/log.h"
 
+#include "executor_pool.h"
+
 #include <tbb/atomic.h>
 #include <tbb/concurrent_queue.h>
 
@@ -35,6 +37,8 @@
 #include <boost/noncopyable.hpp>
 
 #include <functional>
+#include <new>
+#include <type_traits>
 
 namespace caspar {
 
@@ -64,6 +68,118 @@ inline void SetThreadName(DWORD dwThreadID, LPCSTR szThreadName)
 	__except (EXCEPTION_CONTINUE_EXECUTION){}	
 }
 
+// Type erased void() callable. Small callables are stored inline, which saves the heap allocation std::function makes
+// for every queued task. Copying transfers ownership since tbb::concurrent_queue does not support move semantics.
+class task
+{
+	struct callable
+	{
+		virtual ~callable(){}
+		virtual void operator()() = 0;
+		virtual callable* move_to(void* storage) = 0;
+	};
+
+	template<typename F>
+	struct model : public callable
+	{
+		F func;
+
+		template<typename G>
+		explicit model(G&& func) : func(std::forward<G>(func)){}
+
+		virtual void operator()()					{ func(); }
+		virtual callable* move_to(void* storage)	{ return new(storage) model(std::move(func)); }
+	};
+
+	typedef std::aligned_storage<48, std::alignment_of<double>::value>::type storage_type;
+
+	storage_type	storage_;
+	callable*		callable_;
+	bool			inline_;
+public:
+	task() : callable_(nullptr), inline_(false){}
+	task(std::nullptr_t) : callable_(nullptr), inline_(false){}
+
+	template<typename F>
+	task(F&& func, typename std::enable_if<!std::is_same<typename std::decay<F>::type, task>::value>::type* = nullptr)
+		: callable_(nullptr)
+		, inline_(false)
+	{
+		typedef model<typename std::decay<F>::type> model_type;
+		init<model_type>(std::forward<F>(func), std::integral_constant<bool, sizeof(model_type) <= sizeof(storage_type) && std::alignment_of<model_type>::value <= std::alignment_of<storage_type>::value>());
+	}
+
+	task(const task& other) : callable_(nullptr), inline_(false)
+	{
+		steal(const_cast<task&>(other));
+	}
+
+	~task()
+	{
+		reset();
+	}
+
+	task& operator=(const task& other)
+	{
+		if(&other != this)
+		{
+			reset();
+			steal(const_cast<task&>(other));
+		}
+		return *this;
+	}
+
+	void operator()() // An empty task does nothing.
+	{
+		if(callable_)
+			(*callable_)();
+	}
+private:
+	template<typename M, typename F>
+	void init(F&& func, std::true_type)
+	{
+		callable_	= new(&storage_) M(std::forward<F>(func));
+		inline_		= true;
+	}
+
+	template<typename M, typename F>
+	void init(F&& func, std::false_type)
+	{
+		callable_	= new M(std::forward<F>(func));
+		inline_		= false;
+	}
+
+	void steal(task& other)
+	{
+		if(!other.callable_)
+			return;
+
+		if(other.inline_)
+		{
+			callable_ = other.callable_->move_to(&storage_);
+			other.callable_->~callable();
+		}
+		else
+			callable_ = other.callable_;
+
+		inline_			= other.inline_;
+		other.callable_	= nullptr;
+	}
+
+	void reset()
+	{
+		if(!callable_)
+			return;
+
+		if(inline_)
+			callable_->~callable();
+		else
+			delete callable_;
+
+		callable_ = nullptr;
+	}
+};
+
 }
 
 enum task_priority
@@ -81,15 +197,37 @@ enum thread_priority
 	below_normal_priority_class
 };
 
+enum executor_mode
+{
+	dedicated_thread,
+	shared_pool		// Tasks run in order on the shared executor_pool. Only for executors which never block and are not thread affine.
+};
+
 class executor : boost::noncopyable
 {
 	const std::string name_;
+	const executor_mode mode_;
 	boost::thread thread_;
 	tbb::atomic<bool> is_running_;
 	
-	typedef tbb::concurrent_bounded_queue<std::function<void()>> function_queue;
+	typedef tbb::concurrent_bounded_queue<detail::task> function_queue;
 	function_queue execution_queue_[priority_count];
 
+	struct strand : public detail::pool_job
+	{
+		executor* self;
+		strand() : self(nullptr){}
+		virtual void run() { self->run_strand(); }
+	};
+
+	strand strand_;
+	tbb::atomic<int> pending_; // Tasks queued in shared_pool mode, the strand is scheduled on the transition from zero.
+	tbb::atomic<int> active_;
+	int popped_;
+	bool* strand_destroyed_; // Set while a strand batch runs, lets the executor be destroyed by one of its own tasks.
+	boost::mutex join_mutex_;
+	boost::condition_variable join_cond_;
+
 	template<typename Func>
 	auto create_task(Func&& func) -> boost::packaged_task<decltype(func())> // noexcept
 	{	
@@ -101,7 +239,7 @@ class executor : boost::noncopyable
 		{
 			try
 			{
-				if(boost::this_thread::get_id() == thread_.get_id())  // Avoids potential deadlock.
+				if(is_current())  // Avoids potential deadlock.
 					my_task();
 			}
 			catch(boost::task_already_started&){}
@@ -112,15 +250,33 @@ class executor : boost::noncopyable
 
 public:
 
-	explicit executor(const std::wstring& name) : name_(narrow(name)) // noexcept
+	explicit executor(const std::wstring& name, executor_mode mode = dedicated_thread) // noexcept
+		: name_(narrow(name))
+		, mode_(mode)
+		, popped_(0)
+		, strand_destroyed_(nullptr)
 	{
 		is_running_ = true;
-		thread_ = boost::thread(&executor::run, this);
+		pending_ = 0;
+		active_ = 0;
+		strand_.self = this;
+
+		if(mode_ == dedicated_thread)
+			thread_ = boost::thread(&executor::run, this);
 	}
 	
 	virtual ~executor() // noexcept
 	{
 		stop();
+
+		if(mode_ == shared_pool && is_current())
+		{
+			// Destroyed by one of its own tasks, the running strand stops touching this executor once the task returns.
+			CASPAR_LOG(warning) << name_.c_str() << L" destroyed from its own task. Remaining tasks are discarded.";
+			*strand_destroyed_ = true;
+			return;
+		}
+
 		join();
 	}
 
@@ -131,6 +287,9 @@ public:
 
 	void set_priority_class(thread_priority p)
 	{
+		if(mode_ != dedicated_thread) // Pool threads are shared.
+			return;
+
 		begin_invoke([=]
 		{
 			if(p == high_priority_class)
@@ -146,15 +305,27 @@ public:
 
 	void clear()
 	{
-		std::function<void()> func;
-		while(execution_queue_[normal_priority].try_pop(func));
-		while(execution_queue_[high_priority].try_pop(func));
+		int cleared = 0;
+
+		detail::task func;
+		while(execution_queue_[normal_priority].try_pop(func))
+			++cleared;
+		while(execution_queue_[high_priority].try_pop(func))
+			++cleared;
+
+		if(mode_ == shared_pool) // Leave empty tasks in place so that the strand's pending count matches the queues.
+		{
+			for(; cleared > 0; --cleared)
+				execution_queue_[high_priority].push(nullptr);
+		}
 	}
 
 	void stop() // noexcept
 	{
 		is_running_ = false;
-		execution_queue_[normal_priority].try_push([]{}); // Wake the execution thread.
+
+		if(mode_ == dedicated_thread)
+			execution_queue_[normal_priority].try_push(nullptr); // Wake the execution thread.
 	}
 
 	void wait() // noexcept
@@ -164,8 +335,17 @@ public:
 
 	void join()
 	{
-		if(boost::this_thread::get_id() != thread_.get_id())
+		if(is_current())
+			return;
+
+		if(mode_ == dedicated_thread)
 			thread_.join();
+		else
+		{
+			boost::unique_lock<boost::mutex> lock(join_mutex_);
+			while(pending_ > 0 || active_ > 0)
+				join_cond_.wait(lock);
+		}
 	}
 
 	template<typename Func>
@@ -179,7 +359,7 @@ public:
 
 		auto future = task_adaptor.value.get_future();
 
-		execution_queue_[priority].push([=]
+		push([=]
 		{
 			try
 			{
@@ -192,18 +372,25 @@ public:
 			{
 				CASPAR_LOG_CURRENT_EXCEPTION();
 			}
-		});
-
-		if(priority != normal_priority)
-			execution_queue_[normal_priority].push(nullptr);
+		}, priority);
 
 		return std::move(future);
 	}
 
+	// Fire and forget, no future is created. Exceptions are logged.
+	template<typename Func>
+	void post(Func&& func, task_priority priority = normal_priority)
+	{
+		if(!is_running_)
+			BOOST_THROW_EXCEPTION(invalid_operation() << msg_info("executor not running."));
+
+		push(std::forward<Func>(func), priority);
+	}
+
 	template<typename Func>
 	auto invoke(Func&& func, task_priority prioriy = normal_priority) -> decltype(func()) // noexcept
 	{
-		if(boost::this_thread::get_id() == thread_.get_id())  // Avoids potential deadlock.
+		if(is_current())  // Avoids potential deadlock.
 			return func();
 		
 		return begin_invoke(std::forward<Func>(func), prioriy).get();
@@ -211,42 +398,64 @@ public:
 	
 	void yield() // noexcept
 	{
-		if(boost::this_thread::get_id() != thread_.get_id())  // Only yield when calling from execution thread.
+		if(!is_current())  // Only yield when calling from execution thread.
 			return;
 
-		std::function<void()> func;
+		detail::task func;
 		while(execution_queue_[high_priority].try_pop(func))
 		{
-			if(func)
-				func();
+			if(mode_ == shared_pool)
+				++popped_;
+
+			func();
 		}
 	}
 
+	// True when called from a task running on this executor.
+	bool is_current() const /*noexcept*/
+	{
+		if(mode_ == shared_pool)
+			return detail::executor_pool::current() == &strand_;
+
+		return boost::this_thread::get_id() == thread_.get_id();
+	}
+
 	function_queue::size_type capacity() const /*noexcept*/ { return execution_queue_[normal_priority].capacity();	}
 	function_queue::size_type size() const /*noexcept*/ { return execution_queue_[normal_priority].size();	}
 	bool empty() const /*noexcept*/	{ return execution_queue_[normal_priority].empty();	}
 	bool is_running() const /*noexcept*/ { return is_running_; }	
 
 private:
+
+	void push(detail::task&& func, task_priority priority)
+	{
+		execution_queue_[priority].push(func);
+
+		if(mode_ == shared_pool)
+		{
+			if(++pending_ == 1)
+				detail::executor_pool::instance().schedule(&strand_);
+		}
+		else if(priority != normal_priority)
+			execution_queue_[normal_priority].push(nullptr);
+	}
 	
 	void execute() // noexcept
 	{
-		std::function<void()> func;
+		detail::task func;
 		execution_queue_[normal_priority].pop(func);	
 
 		yield();
 
-		if(func)
-			func();
+		func();
 	}
 
 	void execute_rest(task_priority priority) // noexcept
 	{
-		std::function<void()> func;
+		detail::task func;
 
 		while (execution_queue_[priority].try_pop(func))
-			if (func)
-				func();
+			func();
 	}
 
 	void run() // noexcept
@@ -273,6 +482,46 @@ private:
 			CASPAR_LOG_CURRENT_EXCEPTION();
 		}
 	}
+
+	// Runs a bounded batch on a pool thread and reschedules if more work is pending, so executors sharing the pool take turns.
+	void run_strand() // noexcept
+	{
+		++active_;
+		popped_ = 0;
+
+		bool destroyed = false;
+		strand_destroyed_ = &destroyed;
+
+		for(int n = 0; n < 32; ++n)
+		{
+			detail::task func;
+			if(!execution_queue_[high_priority].try_pop(func) && !execution_queue_[normal_priority].try_pop(func))
+				break;
+
+			++popped_;
+
+			try
+			{
+				func();
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+			}
+
+			if(destroyed)
+				return;
+		}
+
+		strand_destroyed_ = nullptr;
+
+		if((pending_ -= popped_) > 0)
+			detail::executor_pool::instance().schedule(&strand_);
+
+		boost::lock_guard<boost::mutex> lock(join_mutex_);
+		--active_;
+		join_cond_.notify_all();
+	}
 };
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,209 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../stdafx.h"
+
+#include "executor_pool.h"
+
+#include "../env.h"
+#include "../exception/win32_exception.h"
+#include "../log/log.h"
+
+#include <tbb/atomic.h>
+#include <tbb/concurrent_queue.h>
+
+#include <boost/thread.hpp>
+#include <boost/thread/once.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <algorithm>
+#include <vector>
+
+namespace caspar { namespace detail {
+
+namespace {
+
+struct worker_context
+{
+	size_t		index;
+	pool_job*	current;
+};
+
+void no_cleanup(worker_context*){}
+
+boost::thread_specific_ptr<worker_context> g_worker_context(no_cleanup);
+
+}
+
+struct executor_pool::implementation : boost::noncopyable
+{
+	typedef tbb::concurrent_queue<pool_job*> job_queue;
+
+	std::vector<std::shared_ptr<job_queue>>	queues_;
+	std::vector<std::shared_ptr<boost::thread>>	threads_;
+	std::vector<worker_context>				contexts_;
+	tbb::atomic<size_t>						next_;
+	tbb::atomic<size_t>						started_;
+	tbb::atomic<int>						sleeping_;
+
+	boost::mutex							mutex_;
+	boost::condition_variable				cond_;
+	boost::mutex							start_mutex_;
+
+	implementation(size_t thread_count)
+		: contexts_(thread_count)
+	{
+		next_		= 0;
+		started_	= 0;
+		sleeping_	= 0;
+
+		for(size_t n = 0; n < thread_count; ++n)
+		{
+			queues_.push_back(std::make_shared<job_queue>());
+			contexts_[n].index		= n;
+			contexts_[n].current	= nullptr;
+		}
+
+		CASPAR_LOG(info) << L"[executor_pool] Up to " << thread_count << L" worker threads, started on demand.";
+	}
+
+	void schedule(pool_job* job)
+	{
+		auto context = g_worker_context.get();
+
+		// Prefer the queue of the scheduling worker, the job will most likely touch the same data.
+		auto index = context ? context->index : next_.fetch_and_increment() % std::max<size_t>(1, started_);
+		queues_[index]->push(job);
+
+		if(sleeping_ > 0)
+		{
+			boost::lock_guard<boost::mutex> lock(mutex_);
+			cond_.notify_one();
+		}
+		else if(started_ < queues_.size())
+			start_worker();
+	}
+
+	// Workers are only started while every running one is busy, so the pool never holds more threads than the 
+	// executors on it have kept busy at the same time.
+	void start_worker()
+	{
+		boost::lock_guard<boost::mutex> lock(start_mutex_);
+
+		if(sleeping_ > 0 || started_ == queues_.size())
+			return;
+
+		const size_t n = started_;
+		threads_.push_back(std::make_shared<boost::thread>([=]{run(n);}));
+		++started_;
+	}
+
+	bool try_get(size_t index, pool_job*& job)
+	{
+		if(queues_[index]->try_pop(job))
+			return true;
+
+		for(size_t n = 1; n < queues_.size(); ++n)
+		{
+			if(queues_[(index + n) % queues_.size()]->try_pop(job))
+				return true;
+		}
+
+		return false;
+	}
+
+	void run(size_t index)
+	{
+		win32_exception::ensure_handler_installed_for_thread(("executor_pool " + boost::lexical_cast<std::string>(index)).c_str());
+
+		g_worker_context.reset(&contexts_[index]);
+
+		while(true)
+		{
+			pool_job* job = nullptr;
+
+			if(!try_get(index, job))
+			{
+				boost::unique_lock<boost::mutex> lock(mutex_);
+				++sleeping_;
+
+				if(!try_get(index, job))
+					cond_.timed_wait(lock, boost::posix_time::milliseconds(10)); // Timeout covers a notify racing with the increment above.
+
+				--sleeping_;
+
+				if(!job)
+					continue;
+			}
+
+			contexts_[index].current = job;
+
+			try
+			{
+				job->run();
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+			}
+
+			contexts_[index].current = nullptr;
+		}
+	}
+};
+
+namespace {
+
+executor_pool*	g_instance = nullptr;
+boost::once_flag g_instance_flag = BOOST_ONCE_INIT;
+
+}
+
+executor_pool::executor_pool(size_t thread_count) : impl_(new implementation(thread_count)){}
+
+executor_pool& executor_pool::instance()
+{
+	struct initializer
+	{
+		static void init()
+		{
+			int thread_count = env::properties().get(L"configuration.executor-pool-threads", 0);
+			if(thread_count < 1)
+				thread_count = std::max(2, static_cast<int>(boost::thread::hardware_concurrency()));
+
+			g_instance = new executor_pool(static_cast<size_t>(thread_count)); // Lives for the duration of the process.
+		}
+	};
+
+	boost::call_once(g_instance_flag, &initializer::init);
+	return *g_instance;
+}
+
+void executor_pool::schedule(pool_job* job)
+{
+	impl_->schedule(job);
+}
+
+pool_job* executor_pool::current()
+{
+	auto context = g_worker_context.get();
+	return context ? context->current : nullptr;
+}
+
+}}
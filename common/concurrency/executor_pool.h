@@ -0,0 +1,53 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "../memory/safe_ptr.h"
+
+#include <boost/noncopyable.hpp>
+
+namespace caspar { namespace detail {
+
+// Unit of work scheduled on the executor_pool. An executor running on the pool schedules itself whenever it has pending tasks.
+struct pool_job
+{
+	virtual ~pool_job(){}
+	virtual void run() = 0;
+};
+
+// Shared work-stealing thread pool. Every worker owns a queue, jobs scheduled from a worker are put on its own queue
+// and idle workers steal from the others.
+class executor_pool : boost::noncopyable
+{
+public:
+	static executor_pool& instance();
+
+	void schedule(pool_job* job);
+
+	// The pool_job currently running on the calling thread, nullptr if the calling thread is not a pool worker.
+	static pool_job* current();
+private:
+	explicit executor_pool(size_t thread_count);
+
+	struct implementation;
+	safe_ptr<implementation> impl_;
+};
+
+}}
@@ -156,7 +156,7 @@ public:
 
 	void send(const std::pair<safe_ptr<read_frame>, std::shared_ptr<void>>& packet)
 	{
-		executor_.begin_invoke([=]
+		executor_.post([=]
 		{
 			try
 			{
@@ -30,10 +30,14 @@
 #include "audio_util.h"
 
 #include <tbb/cache_aligned_allocator.h>
+#include <tbb/spin_mutex.h>
+
+#include <intrin.h>
 
 #include <boost/range/adaptors.hpp>
 #include <boost/range/distance.hpp>
 
+#include <cmath>
 #include <map>
 #include <stack>
 #include <vector>
@@ -58,14 +62,79 @@ struct audio_item
 	}
 };
 
-typedef std::vector<double, tbb::cache_aligned_allocator<double>> audio_buffer_ps;
+typedef std::vector<float, tbb::cache_aligned_allocator<float>> audio_buffer_ps;
 	
 struct audio_stream
 {
 	frame_transform prev_transform;
-	audio_buffer_ps audio_data;
+	audio_buffer_ps audio_data; // Keeps its capacity between ticks.
+	size_t			read_pos; // Samples of audio_data which have already been mixed.
+	uint64_t		last_tick;
+
+	audio_stream() : read_pos(0), last_tick(0)
+	{
+	}
+
+	size_t available() const
+	{
+		return audio_data.size() - read_pos;
+	}
+
+	// Drops the mixed samples before appending, which only moves what was left over from the previous tick.
+	void compact()
+	{
+		if(read_pos == 0)
+			return;
+
+		std::copy(audio_data.begin() + read_pos, audio_data.end(), audio_data.begin());
+		audio_data.resize(audio_data.size() - read_pos);
+		read_pos = 0;
+	}
 };
 
+// Mixed buffers handed back by the frames holding them.
+struct audio_buffer_pool
+{
+	static const size_t MAX_BUFFERS = 8;
+
+	tbb::spin_mutex				mutex;
+	std::vector<audio_buffer>	buffers;
+
+	audio_buffer_pool()
+	{
+		buffers.reserve(MAX_BUFFERS);
+	}
+
+	void take(audio_buffer& buffer)
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex);
+		if(buffers.empty())
+			return;
+
+		buffer.swap(buffers.back());
+		buffers.pop_back();
+	}
+
+	void give(audio_buffer& buffer)
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex);
+		if(buffers.size() >= MAX_BUFFERS)
+			return;
+
+		buffers.push_back(audio_buffer());
+		buffers.back().swap(buffer);
+	}
+};
+
+// Number of interleaved samples after which the channel of every 4 wide lane repeats.
+inline uint32_t lane_period(uint32_t num_channels)
+{
+	uint32_t period = num_channels;
+	while(period % 4 != 0)
+		period += num_channels;
+	return period;
+}
+
 struct audio_mixer::implementation
 {
 	safe_ptr<diagnostics::graph>		graph_;
@@ -78,6 +147,16 @@ struct audio_mixer::implementation
 	float								master_volume_;
 	float								previous_master_volume_;
 	monitor::subject					monitor_subject_;
+	uint64_t							tick_;
+	std::shared_ptr<audio_buffer_pool>	pool_;
+
+	// Scratch state for the mixing kernel, sized on layout changes so that mixing does not allocate.
+	audio_buffer_ps						lane_frames_; // Sample frame of every lane within one lane_period.
+	audio_buffer_ps						lane_peaks_;
+	std::vector<float>					peaks_;
+	std::vector<const float*>			sources_;
+	std::vector<std::string>			pfs_paths_;
+	std::vector<std::string>			dbfs_paths_;
 	
 public:
 	implementation(const safe_ptr<diagnostics::graph>& graph)
@@ -87,9 +166,12 @@ public:
 		, master_volume_(1.0f)
 		, previous_master_volume_(master_volume_)
 		, monitor_subject_("/audio")
+		, tick_(0)
+		, pool_(std::make_shared<audio_buffer_pool>())
 	{
 		graph_->set_color("volume", diagnostics::color(1.0f, 0.8f, 0.1f));
 		transform_stack_.push(core::frame_transform());
+		update_lanes();
 	}
 	
 	void begin(core::basic_frame& frame)
@@ -158,123 +240,219 @@ public:
 	}
 	
 	audio_buffer mix(const video_format_desc& format_desc, const channel_layout& layout)
-	{	
+	{
 		if(format_desc_ != format_desc)
 		{
 			audio_streams_.clear();
 			audio_cadence_ = format_desc.audio_cadence;
 			format_desc_ = format_desc;
 			channel_layout_ = layout;
+			update_lanes();
 		}
-		
-		std::map<const void*, audio_stream>	next_audio_streams;
+
+		++tick_;
 
 		BOOST_FOREACH(auto& item, items_)
-		{			
-			if (next_audio_streams.find(item.tag) != next_audio_streams.end())
+		{
+			auto it = audio_streams_.find(item.tag);
+			if(it != audio_streams_.end() && it->second.last_tick == tick_)
 				continue;
 
-			audio_buffer_ps next_audio;
-
 			auto next_transform = item.transform;
-			auto prev_transform = next_transform;
-
-			const auto it = audio_streams_.find(item.tag);
-			if(it != audio_streams_.end())
-			{	
-				prev_transform	= it->second.prev_transform;
-				next_audio		= std::move(it->second.audio_data);
-			}
+			auto prev_transform = it != audio_streams_.end() ? it->second.prev_transform : next_transform;
 
 			if(prev_transform.volume < 0.001 && next_transform.volume < 0.001)
 				continue;
-			
+
+			auto& stream = it != audio_streams_.end() ? it->second : audio_streams_[item.tag];
+
 			const double prev_volume = prev_transform.volume * previous_master_volume_;
 			const double next_volume = next_transform.volume * master_volume_;
-									
+
 			auto alpha = (next_volume-prev_volume)/(item.audio_data.size()/channel_layout_.num_channels);
-			
-			for(uint32_t n = 0; n < item.audio_data.size(); ++n)
-			{
-				auto sample_multiplier = (prev_volume + (n/channel_layout_.num_channels) * alpha);
-				next_audio.push_back(item.audio_data[n] * sample_multiplier);
-			}
-										
-			next_audio_streams[item.tag].prev_transform  = std::move(next_transform); // Store all active tags, inactive tags will be removed at the end.
-			next_audio_streams[item.tag].audio_data		 = std::move(next_audio);			
+
+			stream.compact();
+			append_ramped(stream.audio_data, item.audio_data, static_cast<float>(prev_volume), static_cast<float>(alpha));
+
+			stream.prev_transform	= std::move(next_transform);
+			stream.last_tick		= tick_;
 		}
 
 		previous_master_volume_ = master_volume_;
 		items_.clear();
 
-		audio_streams_ = std::move(next_audio_streams);
-		
-		if(audio_streams_.empty())		
-			audio_streams_[nullptr].audio_data = audio_buffer_ps(audio_size(audio_cadence_.front()), 0.0f);
-				
+		for(auto it = audio_streams_.begin(); it != audio_streams_.end();) // Tags which were not visited this tick are dropped.
+		{
+			if(it->second.last_tick != tick_)
+				it = audio_streams_.erase(it);
+			else
+				++it;
+		}
+
+		const auto size = audio_size(audio_cadence_.front());
+
 		{ // sanity check
 
 			auto nb_invalid_streams = boost::count_if(audio_streams_ | boost::adaptors::map_values, [&](const audio_stream& x)
 			{
-				return x.audio_data.size() < audio_size(audio_cadence_.front());
+				return x.available() < size;
 			});
 
-			if(nb_invalid_streams > 0)		
-				CASPAR_LOG(trace) << "[audio_mixer] Incorrect frame audio cadence detected.";			
+			if(nb_invalid_streams > 0)
+				CASPAR_LOG(trace) << "[audio_mixer] Incorrect frame audio cadence detected.";
 		}
 
-		audio_buffer_ps result_ps(audio_size(audio_cadence_.front()), 0.0f);
-
+		sources_.clear();
 		BOOST_FOREACH(auto& stream, audio_streams_ | boost::adaptors::map_values)
 		{
-			//CASPAR_LOG(debug) << stream.audio_data.size() << L" : " << result_ps.size();
-
-			if(stream.audio_data.size() < result_ps.size())
+			if(stream.available() < size)
 			{
-				stream.audio_data.resize(result_ps.size(), 0.0f);
+				stream.audio_data.resize(stream.read_pos + size, 0.0f);
 				CASPAR_LOG(trace) << L"[audio_mixer] Appended zero samples";
 			}
 
-			auto out = boost::range::transform(result_ps, stream.audio_data, std::begin(result_ps), std::plus<double>());
-			stream.audio_data.erase(std::begin(stream.audio_data), std::begin(stream.audio_data) + std::distance(std::begin(result_ps), out));
+			sources_.push_back(stream.audio_data.data() + stream.read_pos);
+			stream.read_pos += size;
 		}
-		
-		boost::range::rotate(audio_cadence_, std::begin(audio_cadence_)+1);
-		
 
 		audio_buffer result;
-		result.reserve(result_ps.size());
-		boost::range::transform(result_ps, std::back_inserter(result), [](double sample){return static_cast<int32_t>(sample);});		
-		
+		pool_->take(result);
+		result.resize(size);
+		mix_sources(result);
+
+		boost::range::rotate(audio_cadence_, std::begin(audio_cadence_)+1);
+
 		const int num_channels = channel_layout_.num_channels;
 		monitor_subject_ << monitor::message("/nb_channels") % num_channels;
 
-		auto max = std::vector<int32_t>(num_channels, std::numeric_limits<int32_t>::min());
-
-		for (uint32_t n = 0; n < result.size(); n += num_channels)
-			for (int ch = 0; ch < num_channels; ++ch)
-				max[ch] = std::max(max[ch], std::abs(result[n + ch]));
-		
 		// Makes the dBFS of silence => -dynamic range of 32bit LPCM => about -192 dBFS
 		// Otherwise it would be -infinity
 		static const auto MIN_PFS = 0.5f / static_cast<float>(std::numeric_limits<int32_t>::max());
 
 		for (int i = 0; i < num_channels; ++i)
 		{
-			const auto pFS  = max[i] / static_cast<float>(std::numeric_limits<int32_t>::max());
+			const auto pFS  = peaks_[i] / static_cast<float>(std::numeric_limits<int32_t>::max());
 			const auto dBFS = 20.0f * std::log10(std::max(MIN_PFS, pFS));
-			
-			auto chan_str = boost::lexical_cast<std::string>(i + 1);
 
-			monitor_subject_ << monitor::message("/" + chan_str + "/pFS") % pFS;
-			monitor_subject_ << monitor::message("/" + chan_str + "/dBFS") % dBFS;
+			monitor_subject_ << monitor::message(pfs_paths_[i]) % pFS;
+			monitor_subject_ << monitor::message(dbfs_paths_[i]) % dBFS;
 		}
 
-		graph_->set_value("volume", static_cast<double>(*boost::max_element(max)) / std::numeric_limits<int32_t>::max());
+		graph_->set_value("volume", static_cast<double>(*boost::max_element(peaks_)) / std::numeric_limits<int32_t>::max());
 
 		return result;
 	}
 
+	void update_lanes()
+	{
+		const auto num_channels = static_cast<uint32_t>(channel_layout_.num_channels);
+		const auto period		= lane_period(num_channels);
+
+		lane_frames_.resize(period);
+		for(uint32_t n = 0; n < period; ++n)
+			lane_frames_[n] = static_cast<float>(n / num_channels);
+
+		lane_peaks_.resize(period);
+		peaks_.resize(num_channels);
+		sources_.reserve(16);
+
+		pfs_paths_.clear();
+		dbfs_paths_.clear();
+		for(uint32_t n = 0; n < num_channels; ++n)
+		{
+			auto chan_str = boost::lexical_cast<std::string>(n + 1);
+			pfs_paths_.push_back("/" + chan_str + "/pFS");
+			dbfs_paths_.push_back("/" + chan_str + "/dBFS");
+		}
+	}
+
+	// Converts and appends src to dst while ramping the gain by alpha per sample frame.
+	void append_ramped(audio_buffer_ps& dst, const audio_buffer& src, float prev_volume, float alpha)
+	{
+		const auto num_channels = static_cast<uint32_t>(channel_layout_.num_channels);
+		const auto period		= static_cast<uint32_t>(lane_frames_.size());
+		const auto count		= static_cast<uint32_t>(src.size());
+		const auto offset		= dst.size();
+
+		dst.resize(offset + count);
+
+		auto out = dst.data() + offset;
+		auto in  = src.data();
+
+		const auto prev = _mm_set1_ps(prev_volume);
+		const auto step = _mm_set1_ps(alpha);
+
+		uint32_t n = 0;
+		for(float frame = 0.0f; n + period <= count; n += period, frame += static_cast<float>(period / num_channels))
+		{
+			const auto frame_base = _mm_set1_ps(frame);
+
+			for(uint32_t k = 0; k < period; k += 4)
+			{
+				auto gain	= _mm_add_ps(prev, _mm_mul_ps(_mm_add_ps(frame_base, _mm_load_ps(lane_frames_.data() + k)), step));
+				auto sample = _mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + n + k)));
+				_mm_storeu_ps(out + n + k, _mm_mul_ps(sample, gain));
+			}
+		}
+
+		for(; n < count; ++n)
+			out[n] = static_cast<float>(in[n]) * (prev_volume + static_cast<float>(n / num_channels) * alpha);
+	}
+
+	// Accumulates all sources, clamps, converts to int32 and tracks per channel peaks in a single pass.
+	void mix_sources(audio_buffer& result)
+	{
+		static const float max_sample = 2147483520.0f; // Largest float below 2^31.
+		static const float min_sample = -2147483648.0f;
+
+		const auto num_channels = static_cast<uint32_t>(channel_layout_.num_channels);
+		const auto period		= static_cast<uint32_t>(lane_peaks_.size());
+		const auto count		= static_cast<uint32_t>(result.size());
+		const auto sources		= sources_.data();
+		const auto nb_sources	= sources_.size();
+
+		const auto max_v	= _mm_set1_ps(max_sample);
+		const auto min_v	= _mm_set1_ps(min_sample);
+		const auto abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+
+		auto out	= result.data();
+		auto peaks	= lane_peaks_.data();
+
+		std::fill(lane_peaks_.begin(), lane_peaks_.end(), 0.0f);
+
+		uint32_t n = 0;
+		for(; n + period <= count; n += period)
+		{
+			for(uint32_t k = 0; k < period; k += 4)
+			{
+				auto sum = _mm_setzero_ps();
+				for(size_t s = 0; s < nb_sources; ++s)
+					sum = _mm_add_ps(sum, _mm_loadu_ps(sources[s] + n + k));
+
+				sum = _mm_min_ps(_mm_max_ps(sum, min_v), max_v);
+
+				_mm_store_si128(reinterpret_cast<__m128i*>(out + n + k), _mm_cvtps_epi32(sum));
+				_mm_store_ps(peaks + k, _mm_max_ps(_mm_load_ps(peaks + k), _mm_and_ps(sum, abs_mask)));
+			}
+		}
+
+		for(; n < count; ++n)
+		{
+			float sum = 0.0f;
+			for(size_t s = 0; s < nb_sources; ++s)
+				sum += sources[s][n];
+
+			sum = std::min(std::max(sum, min_sample), max_sample);
+
+			out[n] = _mm_cvtss_si32(_mm_set_ss(sum));
+			peaks[n % period] = std::max(peaks[n % period], std::abs(sum));
+		}
+
+		std::fill(peaks_.begin(), peaks_.end(), 0.0f);
+		for(uint32_t k = 0; k < period; ++k)
+			peaks_[k % num_channels] = std::max(peaks_[k % num_channels], peaks[k]);
+	}
+
 	uint32_t audio_size(uint32_t num_samples) const
 	{
 		return num_samples * channel_layout_.num_channels;
@@ -301,6 +479,11 @@ void audio_mixer::end(){impl_->end();}
 float audio_mixer::get_master_volume() const { return impl_->get_master_volume(); }
 void audio_mixer::set_master_volume(float volume) { impl_->set_master_volume(volume); }
 audio_buffer audio_mixer::operator()(const video_format_desc& format_desc, const channel_layout& layout){return impl_->mix(format_desc, layout);}
+audio_buffer_recycler audio_mixer::recycler() const
+{
+	auto pool = impl_->pool_;
+	return [=](audio_buffer& buffer){pool->give(buffer);};
+}
 monitor::subject& audio_mixer::monitor_output(){return impl_->monitor_subject_;}
 
 }}
\ No newline at end of file
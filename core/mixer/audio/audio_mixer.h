@@ -31,6 +31,7 @@
 
 #include <tbb/cache_aligned_allocator.h>
 
+#include <functional>
 #include <vector>
 
 namespace caspar {
@@ -48,6 +49,9 @@ struct channel_layout;
 	
 typedef std::vector<int32_t, tbb::cache_aligned_allocator<int32_t>> audio_buffer;
 
+// Takes back a mixed buffer once its frame is done with it, so that the next mix reuses the memory.
+typedef std::function<void(audio_buffer& buffer)> audio_buffer_recycler;
+
 class audio_mixer : public core::frame_visitor, boost::noncopyable
 {
 public:
@@ -61,6 +65,7 @@ public:
 	void set_master_volume(float volume);
 
 	audio_buffer operator()(const video_format_desc& format_desc, const channel_layout& layout);
+	audio_buffer_recycler recycler() const; // Safe to call after the audio_mixer has been destroyed.
 
 	monitor::subject& monitor_output();
 	
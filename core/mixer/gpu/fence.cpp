@@ -57,6 +57,18 @@ struct fence::implementation
 		return values[0] == GL_SIGNALED;
 	}
 
+	bool client_wait(int timeout_ms)
+	{
+		if(!sync_)
+			return true;
+
+		auto result = glClientWaitSync(sync_, GL_SYNC_FLUSH_COMMANDS_BIT, static_cast<GLuint64>(timeout_ms) * 1000000);
+		if(result == GL_WAIT_FAILED)
+			CASPAR_LOG(warning) << L"[fence] Failed to wait for host read-back.";
+
+		return result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED;
+	}
+
 	void wait(ogl_device& ogl)
 	{	
 		int delay = 0;
@@ -111,6 +123,11 @@ bool fence::ready() const
 	return impl_ ? impl_->ready() : true;
 }
 
+bool fence::client_wait(int timeout_ms)
+{
+	return impl_ ? impl_->client_wait(timeout_ms) : true;
+}
+
 void fence::wait(ogl_device& ogl)
 {
 	if(impl_)
@@ -37,6 +37,7 @@ public:
 	void set();
 	bool ready() const;
 	void wait(ogl_device& ogl);
+	bool client_wait(int timeout_ms); // Blocks until signalled or timed out. Must be called on the ogl_device thread.
 private:
 	struct implementation;
 	std::shared_ptr<implementation> impl_;
@@ -33,20 +33,24 @@
 #include <gl/glew.h>
 
 #include <tbb/atomic.h>
+#include <tbb/concurrent_queue.h>
+#include <tbb/concurrent_unordered_map.h>
+#include <tbb/scalable_allocator.h>
 
 namespace caspar { namespace core {
 
 static tbb::atomic<int> g_w_total_count;
 static tbb::atomic<int> g_r_total_count;
+static tbb::atomic<int> g_s_total_count;
 																																								
 struct host_buffer::implementation : boost::noncopyable
 {	
-	GLuint			pbo_;
-	const uint32_t	size_;
-	void*			data_;
-	GLenum			usage_;
-	GLenum			target_;
-	fence			fence_;
+	GLuint					pbo_;
+	const uint32_t			size_;
+	void*					data_;
+	GLenum					usage_;
+	GLenum					target_;
+	std::unique_ptr<fence>	fence_;
 
 public:
 	implementation(uint32_t size, usage_t usage) 
@@ -56,6 +60,20 @@ public:
 		, target_(usage == write_only ? GL_PIXEL_UNPACK_BUFFER : GL_PIXEL_PACK_BUFFER)
 		, usage_(usage == write_only ? GL_STREAM_DRAW : GL_STREAM_READ)
 	{
+		if(usage == system_only)
+		{
+			usage_ = 0;
+			data_ = scalable_aligned_malloc(size_, 64);
+
+			if(!data_)
+				BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("Failed to allocate buffer."));
+
+			CASPAR_LOG(trace) << "[host_buffer] [" << ++g_s_total_count << L"] allocated size:" << size_ << " usage: system_only";
+			return;
+		}
+
+		fence_.reset(new fence());
+
 		GL(glGenBuffers(1, &pbo_));
 		GL(glBindBuffer(target_, pbo_));
 		if(usage_ != write_only)	
@@ -72,6 +90,12 @@ public:
 	{
 		try
 		{
+			if(!pbo_)
+			{
+				scalable_aligned_free(data_);
+				return;
+			}
+
 			GL(glDeleteBuffers(1, &pbo_));
 			//CASPAR_LOG(trace) << "[host_buffer] [" << --(usage_ == write_only ? g_w_total_count : g_r_total_count) << L"] deallocated size:" << size_ << " usage: " << (usage_ == write_only ? "write_only" : "read_only");
 		}
@@ -98,12 +122,18 @@ public:
 
 	void wait(ogl_device& ogl)
 	{
-		fence_.wait(ogl);
+		if(fence_)
+			fence_->wait(ogl);
+	}
+
+	bool client_wait(int timeout_ms)
+	{
+		return fence_ ? fence_->client_wait(timeout_ms) : true;
 	}
 
 	void unmap()
 	{
-		if(!data_)
+		if(!data_ || !pbo_)
 			return;
 		
 		GL(glBindBuffer(target_, pbo_));
@@ -124,16 +154,19 @@ public:
 
 	void begin_read(uint32_t width, uint32_t height, unsigned int format)
 	{
+		if(!pbo_)
+			BOOST_THROW_EXCEPTION(invalid_operation() << msg_info("System memory buffer can not be used for read-back."));
+
 		unmap();
 		bind();
 		GL(glReadPixels(0, 0, static_cast<GLsizei>(width), static_cast<GLsizei>(height), static_cast<GLuint>(format), GL_UNSIGNED_BYTE, NULL));
 		unbind();
-		fence_.set();
+		fence_->set();
 	}
 
 	bool ready() const
 	{
-		return fence_.ready();
+		return fence_ ? fence_->ready() : true;
 	}
 };
 
@@ -148,5 +181,25 @@ void host_buffer::begin_read(uint32_t width, uint32_t height, unsigned int forma
 uint32_t host_buffer::size() const { return impl_->size_; }
 bool host_buffer::ready() const{return impl_->ready();}
 void host_buffer::wait(ogl_device& ogl){impl_->wait(ogl);}
+bool host_buffer::client_wait(int timeout_ms){return impl_->client_wait(timeout_ms);}
+
+safe_ptr<host_buffer> create_system_host_buffer(uint32_t size)
+{
+	typedef tbb::concurrent_bounded_queue<std::shared_ptr<host_buffer>> pool_t;
+
+	static tbb::concurrent_unordered_map<uint32_t, safe_ptr<pool_t>> pools;
+
+	CASPAR_VERIFY(size > 0);
+
+	auto pool = pools[size];
+	std::shared_ptr<host_buffer> buffer;
+	if(!pool->try_pop(buffer))
+		buffer.reset(new host_buffer(size, system_only));
+
+	return safe_ptr<host_buffer>(buffer.get(), [=](host_buffer*) mutable
+	{
+		pool->push(buffer);
+	});
+}
 
 }}
\ No newline at end of file
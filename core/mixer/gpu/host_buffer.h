@@ -32,7 +32,8 @@ class ogl_device;
 enum usage_t
 	{
 		write_only,
-		read_only
+		read_only,
+		system_only
 	};
 		
 class host_buffer : boost::noncopyable
@@ -52,12 +53,17 @@ public:
 	void begin_read(uint32_t width, uint32_t height, unsigned int format);
 	bool ready() const;
 	void wait(ogl_device& ogl);
+	bool client_wait(int timeout_ms); // Blocks the ogl_device thread until the read-back has completed or timed out.
 private:
 	friend class ogl_device;
+	friend safe_ptr<host_buffer> create_system_host_buffer(uint32_t size);
 	host_buffer(uint32_t size, usage_t usage);
 
 	struct implementation;
 	safe_ptr<implementation> impl_;
 };
 
+// Pooled, permanently mapped system memory buffer. Does not require an OpenGL context.
+safe_ptr<host_buffer> create_system_host_buffer(uint32_t size);
+
 }}
\ No newline at end of file
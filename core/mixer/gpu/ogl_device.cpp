@@ -218,7 +218,7 @@ safe_ptr<host_buffer> ogl_device::create_host_buffer(uint32_t size, usage_t usag
 	auto self = shared_from_this();
 	return safe_ptr<host_buffer>(buffer.get(), [=](host_buffer*) mutable
 	{
-		self->executor_.begin_invoke([=]() mutable
+		self->executor_.post([=]() mutable
 		{		
 			if(usage == write_only)
 				buffer->map();
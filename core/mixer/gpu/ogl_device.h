@@ -111,6 +111,12 @@ public:
 	{			
 		return executor_.begin_invoke(std::forward<Func>(func), priority);
 	}
+
+	template<typename Func>
+	void post(Func&& func, task_priority priority = normal_priority) // noexcept
+	{
+		executor_.post(std::forward<Func>(func), priority);
+	}
 	
 	template<typename Func>
 	auto invoke(Func&& func, task_priority priority = normal_priority) -> decltype(func())
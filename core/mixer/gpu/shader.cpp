@@ -33,8 +33,25 @@ namespace caspar { namespace core {
 
 struct shader::implementation : boost::noncopyable
 {
+	// Uniform values are part of the program object, remembering the last value lets redundant glUniform calls be skipped.
+	struct uniform
+	{
+		GLint	location;
+		int		count;
+		GLint	ivalue;
+		GLfloat	fvalue[4];
+
+		explicit uniform(GLint location) 
+			: location(location)
+			, count(-1)
+			, ivalue(0)
+		{
+			fvalue[0] = fvalue[1] = fvalue[2] = fvalue[3] = 0.0f;
+		}
+	};
+
 	GLuint program_;
-	std::unordered_map<std::string, GLint> locations_;
+	std::unordered_map<std::string, uniform> uniforms_;
 public:
 
 	implementation(const std::string& vertex_source_str, const std::string& fragment_source_str) : program_(0)
@@ -105,13 +122,35 @@ public:
 		glDeleteProgram(program_);
 	}
 
-	GLint get_location(const char* name)
+	uniform& get_uniform(const std::string& name)
 	{
-		auto it = locations_.find(name);
-		if(it == locations_.end())
-			it = locations_.insert(std::make_pair(name, glGetUniformLocation(program_, name))).first;
+		auto it = uniforms_.find(name);
+		if(it == uniforms_.end())
+			it = uniforms_.insert(std::make_pair(name, uniform(glGetUniformLocation(program_, name.c_str())))).first;
 		return it->second;
 	}
+
+	void set_floats(const std::string& name, int count, float value1, float value2 = 0.0f, float value3 = 0.0f, float value4 = 0.0f)
+	{
+		auto& u = get_uniform(name);
+
+		if(u.count == count && u.fvalue[0] == value1 && u.fvalue[1] == value2 && u.fvalue[2] == value3 && u.fvalue[3] == value4)
+			return;
+
+		u.count		= count;
+		u.fvalue[0] = value1;
+		u.fvalue[1] = value2;
+		u.fvalue[2] = value3;
+		u.fvalue[3] = value4;
+
+		switch(count)
+		{
+		case 1: GL(glUniform1f(u.location, value1)); break;
+		case 2: GL(glUniform2f(u.location, value1, value2)); break;
+		case 3: GL(glUniform3f(u.location, value1, value2, value3)); break;
+		case 4: GL(glUniform4f(u.location, value1, value2, value3, value4)); break;
+		}
+	}
 	
 	void set(const std::string& name, bool value)
 	{
@@ -120,37 +159,45 @@ public:
 
 	void set(const std::string& name, int value)
 	{
-		GL(glUniform1i(get_location(name.c_str()), value));
+		auto& u = get_uniform(name);
+
+		if(u.count == 0 && u.ivalue == value)
+			return;
+
+		u.count  = 0;
+		u.ivalue = value;
+
+		GL(glUniform1i(u.location, value));
 	}
 	
 	void set(const std::string& name, float value)
 	{
-		GL(glUniform1f(get_location(name.c_str()), value));
+		set_floats(name, 1, value);
 	}
 
     void set(const std::string& name, float value1, float value2)
     {
-        GL(glUniform2f(get_location(name.c_str()), value1, value2));
+		set_floats(name, 2, value1, value2);
     }
 
     void set(const std::string& name, float value1, float value2, float value3)
     {
-        GL(glUniform3f(get_location(name.c_str()), value1, value2, value3));
+		set_floats(name, 3, value1, value2, value3);
     }
 
     void set(const std::string& name, float value1, float value2, float value3, float value4)
     {
-        GL(glUniform4f(get_location(name.c_str()), value1, value2, value3, value4));
+		set_floats(name, 4, value1, value2, value3, value4);
     }
 
     void set(const std::string& name, double value)
 	{
-		GL(glUniform1f(get_location(name.c_str()), static_cast<float>(value)));
+		set_floats(name, 1, static_cast<float>(value));
 	}
 
     void set(const std::string& name, double value1, double value2)
     {
-        GL(glUniform2f(get_location(name.c_str()), static_cast<float>(value1), static_cast<float>(value2)));
+		set_floats(name, 2, static_cast<float>(value1), static_cast<float>(value2));
     }
 };
 
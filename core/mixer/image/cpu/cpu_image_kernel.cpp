@@ -0,0 +1,867 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../../../stdafx.h"
+
+#include "cpu_image_kernel.h"
+
+#include "../../gpu/host_buffer.h"
+
+#include <common/exception/exceptions.h>
+
+#include <core/video_format.h>
+#include <core/producer/frame/pixel_format.h>
+#include <core/producer/frame/frame_transform.h>
+
+#include <intrin.h>
+
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <tbb/blocked_range2d.h>
+
+#include <cmath>
+#include <cstring>
+
+namespace caspar { namespace core {
+
+struct cpu_buffer::implementation : boost::noncopyable
+{
+	safe_ptr<host_buffer>	memory_;
+	const uint32_t			width_;
+	const uint32_t			height_;
+	const uint32_t			stride_;
+
+	implementation(uint32_t width, uint32_t height, uint32_t stride)
+		: memory_(create_system_host_buffer(width*height*stride))
+		, width_(width)
+		, height_(height)
+		, stride_(stride)
+	{
+		auto data = static_cast<uint8_t*>(memory_->data());
+		auto line = width_*stride_;
+
+		tbb::parallel_for(tbb::blocked_range<uint32_t>(0, height_, 64), [&](const tbb::blocked_range<uint32_t>& r)
+		{
+			std::memset(data + r.begin()*line, 0, r.size()*line);
+		});
+	}
+};
+
+cpu_buffer::cpu_buffer(uint32_t width, uint32_t height, uint32_t stride) : impl_(new implementation(width, height, stride)){}
+uint32_t cpu_buffer::stride() const { return impl_->stride_; }
+uint32_t cpu_buffer::width() const { return impl_->width_; }
+uint32_t cpu_buffer::height() const { return impl_->height_; }
+uint8_t* cpu_buffer::data() { return static_cast<uint8_t*>(impl_->memory_->data()); }
+const uint8_t* cpu_buffer::data() const { return static_cast<const uint8_t*>(impl_->memory_->data()); }
+const safe_ptr<host_buffer>& cpu_buffer::memory() const { return impl_->memory_; }
+
+namespace {
+
+// Tiles of 16 rows by 128 pixels keep source, key and destination lines for a tile inside L1/L2.
+const int TILE_HEIGHT	= 16;
+const int TILE_WIDTH	= 128;
+
+const float EPSILON		= 0.0000001f;
+
+// Pixels are processed as one __m128 per pixel in destination memory order, i.e. lanes are [b, g, r, a].
+
+inline __m128 load_pixel(const uint8_t* ptr)
+{
+	__m128i v = _mm_cvtsi32_si128(*reinterpret_cast<const int*>(ptr));
+	v = _mm_unpacklo_epi8(v, _mm_setzero_si128());
+	v = _mm_unpacklo_epi16(v, _mm_setzero_si128());
+	return _mm_cvtepi32_ps(v);
+}
+
+inline void store_pixel(uint8_t* ptr, __m128 v)
+{
+	v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+	__m128i i = _mm_cvtps_epi32(_mm_mul_ps(v, _mm_set1_ps(255.0f)));
+	i = _mm_packs_epi32(i, i);
+	i = _mm_packus_epi16(i, i);
+	*reinterpret_cast<int*>(ptr) = _mm_cvtsi128_si32(i);
+}
+
+inline __m128 lerp(__m128 a, __m128 b, float t)
+{
+	return _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), _mm_set1_ps(t)));
+}
+
+inline __m128 select(__m128 mask, __m128 a, __m128 b)
+{
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+inline float lane(__m128 v, int n)
+{
+	return v.m128_f32[n];
+}
+
+struct axis_sample
+{
+	int		i0;
+	int		i1;
+	float	f;
+};
+
+// Maps destination pixel centers to GL_LINEAR / GL_CLAMP_TO_EDGE texel coordinates.
+inline axis_sample make_sample(double dest, double dest_size, double fill_pos, double fill_scale, int src_size)
+{
+	double u = ((dest + 0.5) / dest_size - fill_pos) / fill_scale;
+	double s = u * src_size - 0.5;
+	double i = std::floor(s);
+
+	axis_sample sample;
+	sample.f  = static_cast<float>(s - i);
+	sample.i0 = std::max(0, std::min(src_size-1, static_cast<int>(i)));
+	sample.i1 = std::max(0, std::min(src_size-1, static_cast<int>(i) + 1));
+
+	if(sample.f < 1.0f/512.0f)
+		sample.f = 0.0f;
+	else if(sample.f > 1.0f - 1.0f/512.0f)
+	{
+		sample.i0 = sample.i1;
+		sample.f = 0.0f;
+	}
+
+	return sample;
+}
+
+struct plane_view
+{
+	const uint8_t*				data;
+	int							width;
+	int							height;
+	int							channels;
+	int							linesize;
+	std::vector<axis_sample>	columns;
+};
+
+inline __m128 sample4(const plane_view& plane, const axis_sample& col, const uint8_t* row0, const uint8_t* row1, float fy)
+{
+	auto a = load_pixel(row0 + col.i0*4);
+	if(col.f != 0.0f)
+		a = lerp(a, load_pixel(row0 + col.i1*4), col.f);
+
+	if(fy == 0.0f)
+		return a;
+
+	auto b = load_pixel(row1 + col.i0*4);
+	if(col.f != 0.0f)
+		b = lerp(b, load_pixel(row1 + col.i1*4), col.f);
+
+	return lerp(a, b, fy);
+}
+
+inline float sample1(const plane_view& plane, const axis_sample& col, const uint8_t* row0, const uint8_t* row1, float fy)
+{
+	float a = row0[col.i0];
+	if(col.f != 0.0f)
+		a += (row0[col.i1] - a) * col.f;
+
+	if(fy == 0.0f)
+		return a;
+
+	float b = row1[col.i0];
+	if(col.f != 0.0f)
+		b += (row1[col.i1] - b) * col.f;
+
+	return a + (b - a) * fy;
+}
+
+inline float smoothstep(float edge0, float edge1, float x)
+{
+	float t = std::min(1.0f, std::max(0.0f, (x - edge0) / (edge1 - edge0 + EPSILON)));
+	return t * t * (3.0f - 2.0f * t);
+}
+
+// Hue, saturation, luminance. Operates on lanes [0, 1, 2] in the same order as the shader does.
+
+void rgb_to_hsl(const float* c, float* hsl)
+{
+	float fmin  = std::min(std::min(c[0], c[1]), c[2]);
+	float fmax  = std::max(std::max(c[0], c[1]), c[2]);
+	float delta = fmax - fmin;
+
+	hsl[2] = (fmax + fmin) / 2.0f;
+
+	if(delta == 0.0f)
+	{
+		hsl[0] = 0.0f;
+		hsl[1] = 0.0f;
+		return;
+	}
+
+	hsl[1] = hsl[2] < 0.5f ? delta / (fmax + fmin) : delta / (2.0f - fmax - fmin);
+
+	float delta_r = (((fmax - c[0]) / 6.0f) + (delta / 2.0f)) / delta;
+	float delta_g = (((fmax - c[1]) / 6.0f) + (delta / 2.0f)) / delta;
+	float delta_b = (((fmax - c[2]) / 6.0f) + (delta / 2.0f)) / delta;
+
+	if(c[0] == fmax)
+		hsl[0] = delta_b - delta_g;
+	else if(c[1] == fmax)
+		hsl[0] = (1.0f / 3.0f) + delta_r - delta_b;
+	else
+		hsl[0] = (2.0f / 3.0f) + delta_g - delta_r;
+
+	if(hsl[0] < 0.0f)
+		hsl[0] += 1.0f;
+	else if(hsl[0] > 1.0f)
+		hsl[0] -= 1.0f;
+}
+
+float hue_to_rgb(float f1, float f2, float hue)
+{
+	if(hue < 0.0f)
+		hue += 1.0f;
+	else if(hue > 1.0f)
+		hue -= 1.0f;
+
+	if((6.0f * hue) < 1.0f)
+		return f1 + (f2 - f1) * 6.0f * hue;
+	else if((2.0f * hue) < 1.0f)
+		return f2;
+	else if((3.0f * hue) < 2.0f)
+		return f1 + (f2 - f1) * ((2.0f / 3.0f) - hue) * 6.0f;
+
+	return f1;
+}
+
+void hsl_to_rgb(const float* hsl, float* c)
+{
+	if(hsl[1] == 0.0f)
+	{
+		c[0] = c[1] = c[2] = hsl[2];
+		return;
+	}
+
+	float f2 = hsl[2] < 0.5f ? hsl[2] * (1.0f + hsl[1]) : (hsl[2] + hsl[1]) - (hsl[1] * hsl[2]);
+	float f1 = 2.0f * hsl[2] - f2;
+
+	c[0] = hue_to_rgb(f1, f2, hsl[0] + (1.0f/3.0f));
+	c[1] = hue_to_rgb(f1, f2, hsl[0]);
+	c[2] = hue_to_rgb(f1, f2, hsl[0] - (1.0f/3.0f));
+}
+
+__m128 blend_hsl(__m128 back, __m128 fore, int take_fore_h, int take_fore_s, int take_fore_l)
+{
+	float b[4], f[4], bh[3], fh[3], h[3], c[4];
+	_mm_storeu_ps(b, back);
+	_mm_storeu_ps(f, fore);
+	rgb_to_hsl(b, bh);
+	rgb_to_hsl(f, fh);
+	h[0] = take_fore_h ? fh[0] : bh[0];
+	h[1] = take_fore_s ? fh[1] : bh[1];
+	h[2] = take_fore_l ? fh[2] : bh[2];
+	hsl_to_rgb(h, c);
+	c[3] = 0.0f;
+	return _mm_loadu_ps(c);
+}
+
+inline __m128 color_dodge(__m128 base, __m128 blend)
+{
+	auto one = _mm_set1_ps(1.0f);
+	return select(_mm_cmpeq_ps(blend, one), blend, _mm_min_ps(_mm_div_ps(base, _mm_max_ps(_mm_sub_ps(one, blend), _mm_set1_ps(EPSILON))), one));
+}
+
+inline __m128 color_burn(__m128 base, __m128 blend)
+{
+	auto one  = _mm_set1_ps(1.0f);
+	auto zero = _mm_setzero_ps();
+	return select(_mm_cmpeq_ps(blend, zero), blend, _mm_max_ps(_mm_sub_ps(one, _mm_div_ps(_mm_sub_ps(one, base), _mm_max_ps(blend, _mm_set1_ps(EPSILON)))), zero));
+}
+
+inline __m128 overlay(__m128 base, __m128 blend)
+{
+	auto one  = _mm_set1_ps(1.0f);
+	auto two  = _mm_set1_ps(2.0f);
+	return select(_mm_cmplt_ps(base, _mm_set1_ps(0.5f)),
+				  _mm_mul_ps(two, _mm_mul_ps(base, blend)),
+				  _mm_sub_ps(one, _mm_mul_ps(two, _mm_mul_ps(_mm_sub_ps(one, base), _mm_sub_ps(one, blend)))));
+}
+
+inline __m128 reflect(__m128 base, __m128 blend)
+{
+	auto one = _mm_set1_ps(1.0f);
+	return select(_mm_cmpeq_ps(blend, one), blend, _mm_min_ps(_mm_div_ps(_mm_mul_ps(base, base), _mm_max_ps(_mm_sub_ps(one, blend), _mm_set1_ps(EPSILON))), one));
+}
+
+inline __m128 vivid_light(__m128 base, __m128 blend)
+{
+	auto half = _mm_set1_ps(0.5f);
+	auto two  = _mm_set1_ps(2.0f);
+	return select(_mm_cmplt_ps(blend, half),
+				  color_burn(base, _mm_mul_ps(two, blend)),
+				  color_dodge(base, _mm_mul_ps(two, _mm_sub_ps(blend, half))));
+}
+
+// Mirrors get_blend_color in image_shader.cpp, including soft_light being disabled.
+__m128 blend_color(blend_mode::type mode, __m128 back, __m128 fore)
+{
+	auto zero = _mm_setzero_ps();
+	auto one  = _mm_set1_ps(1.0f);
+	auto half = _mm_set1_ps(0.5f);
+	auto two  = _mm_set1_ps(2.0f);
+
+	switch(mode)
+	{
+	case blend_mode::lighten:		return _mm_max_ps(fore, back);
+	case blend_mode::darken:		return _mm_min_ps(fore, back);
+	case blend_mode::multiply:		return _mm_mul_ps(back, fore);
+	case blend_mode::average:		return _mm_mul_ps(_mm_add_ps(back, fore), half);
+	case blend_mode::linear_dodge:
+	case blend_mode::add:			return _mm_min_ps(_mm_add_ps(back, fore), one);
+	case blend_mode::linear_burn:
+	case blend_mode::subtract:		return _mm_max_ps(_mm_sub_ps(_mm_add_ps(back, fore), one), zero);
+	case blend_mode::difference:	return _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_sub_ps(back, fore));
+	case blend_mode::negation:		return _mm_sub_ps(one, _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_sub_ps(_mm_sub_ps(one, back), fore)));
+	case blend_mode::exclusion:		return _mm_sub_ps(_mm_add_ps(back, fore), _mm_mul_ps(two, _mm_mul_ps(back, fore)));
+	case blend_mode::screen:		return _mm_sub_ps(one, _mm_mul_ps(_mm_sub_ps(one, back), _mm_sub_ps(one, fore)));
+	case blend_mode::overlay:		return overlay(back, fore);
+	case blend_mode::hard_light:	return overlay(fore, back);
+	case blend_mode::color_dodge:	return color_dodge(back, fore);
+	case blend_mode::color_burn:	return color_burn(back, fore);
+	case blend_mode::linear_light:
+		return select(_mm_cmplt_ps(fore, half),
+					  _mm_max_ps(_mm_sub_ps(_mm_add_ps(back, _mm_mul_ps(two, fore)), one), zero),
+					  _mm_min_ps(_mm_add_ps(back, _mm_mul_ps(two, _mm_sub_ps(fore, half))), one));
+	case blend_mode::vivid_light:	return vivid_light(back, fore);
+	case blend_mode::pin_light:
+		return select(_mm_cmplt_ps(fore, half),
+					  _mm_min_ps(back, _mm_mul_ps(two, fore)),
+					  _mm_max_ps(back, _mm_mul_ps(two, _mm_sub_ps(fore, half))));
+	case blend_mode::hard_mix:		return _mm_and_ps(_mm_cmpge_ps(vivid_light(back, fore), half), one);
+	case blend_mode::reflect:		return reflect(back, fore);
+	case blend_mode::glow:			return reflect(fore, back);
+	case blend_mode::phoenix:		return _mm_add_ps(_mm_sub_ps(_mm_min_ps(back, fore), _mm_max_ps(back, fore)), one);
+	case blend_mode::contrast:		return blend_hsl(back, fore, 1, 0, 0); // Hue
+	case blend_mode::saturation:	return blend_hsl(back, fore, 0, 1, 0);
+	case blend_mode::color:			return blend_hsl(back, fore, 1, 1, 0);
+	case blend_mode::luminosity:	return blend_hsl(back, fore, 0, 0, 1);
+	default:						return fore;
+	}
+}
+
+// dst = src*opacity + dst*(1-src.a*opacity) on 8-bit premultiplied BGRA, four pixels at a time.
+void over_row_sse2(uint8_t* dst, const uint8_t* src, int count, int opacity256, bool additive)
+{
+	const __m128i zero		= _mm_setzero_si128();
+	const __m128i opacity	= _mm_set1_epi16(static_cast<short>(opacity256));
+	const __m128i round		= _mm_set1_epi16(128);
+	const __m128i max		= _mm_set1_epi16(255);
+
+	int n = 0;
+	for(; n + 4 <= count; n += 4)
+	{
+		__m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + n*4));
+		__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + n*4));
+
+		__m128i s_lo = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), opacity), round), 8);
+		__m128i s_hi = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), opacity), round), 8);
+
+		__m128i result;
+
+		if(additive)
+			result = _mm_adds_epu8(_mm_packus_epi16(s_lo, s_hi), d);
+		else
+		{
+			__m128i a_lo = _mm_sub_epi16(max, _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3)));
+			__m128i a_hi = _mm_sub_epi16(max, _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3)));
+
+			__m128i d_lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), a_lo), round);
+			__m128i d_hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), a_hi), round);
+
+			d_lo = _mm_srli_epi16(_mm_add_epi16(d_lo, _mm_srli_epi16(d_lo, 8)), 8);
+			d_hi = _mm_srli_epi16(_mm_add_epi16(d_hi, _mm_srli_epi16(d_hi, 8)), 8);
+
+			result = _mm_packus_epi16(_mm_add_epi16(s_lo, d_lo), _mm_add_epi16(s_hi, d_hi));
+		}
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + n*4), result);
+	}
+
+	for(; n < count; ++n)
+	{
+		int a = (src[n*4+3] * opacity256 + 128) >> 8;
+		for(int c = 0; c < 4; ++c)
+		{
+			int s = (src[n*4+c] * opacity256 + 128) >> 8;
+			int d = dst[n*4+c];
+			if(additive)
+				dst[n*4+c] = static_cast<uint8_t>(std::min(255, s + d));
+			else
+			{
+				int t = d * (255 - a) + 128;
+				dst[n*4+c] = static_cast<uint8_t>(std::min(255, s + ((t + (t >> 8)) >> 8)));
+			}
+		}
+	}
+}
+
+}
+
+struct cpu_image_kernel::implementation : boost::noncopyable
+{
+	struct levels_params
+	{
+		bool	enabled;
+		__m128	min_input;
+		__m128	input_range;
+		float	inv_gamma;
+		__m128	min_output;
+		__m128	output_range;
+	};
+
+	struct csb_params
+	{
+		bool	enabled;
+		float	brt;
+		float	sat;
+		float	con;
+	};
+
+	void draw(cpu_draw_params&& params)
+	{
+		static const double epsilon = 0.001;
+
+		CASPAR_ASSERT(params.pix_desc.planes.size() == params.buffers.size());
+
+		if(params.buffers.empty() || !params.background)
+			return;
+
+		if(params.transform.opacity < epsilon)
+			return;
+
+		if(params.transform.is_key)
+			params.blend_mode = blend_mode::normal;
+
+		auto& background = *params.background;
+		const int width  = static_cast<int>(background.width());
+		const int height = static_cast<int>(background.height());
+
+		// Destination area covered by fill and clip (scissor).
+
+		auto f_p = params.transform.fill_translation;
+		auto f_s = params.transform.fill_scale;
+		auto m_p = params.transform.clip_translation;
+		auto m_s = params.transform.clip_scale;
+
+		if(f_s[0] < epsilon*epsilon || f_s[1] < epsilon*epsilon)
+			return;
+
+		int x_begin = static_cast<int>(std::ceil(f_p[0]*width - 0.5));
+		int x_end	= static_cast<int>(std::ceil((f_p[0]+f_s[0])*width - 0.5));
+		int y_begin = static_cast<int>(std::ceil(f_p[1]*height - 0.5));
+		int y_end	= static_cast<int>(std::ceil((f_p[1]+f_s[1])*height - 0.5));
+
+		int y_offset = (params.transform.is_paused && params.transform.field_mode == field_mode::upper) ? 1 : 0;
+
+		y_begin += y_offset;
+		y_end	+= y_offset;
+
+		x_begin = std::max(x_begin, static_cast<int>(m_p[0]*width));
+		x_end	= std::min(x_end,	static_cast<int>(m_p[0]*width) + static_cast<int>(m_s[0]*width));
+		y_begin = std::max(y_begin, static_cast<int>(m_p[1]*height));
+		y_end	= std::min(y_end,	static_cast<int>(m_p[1]*height) + static_cast<int>(m_s[1]*height));
+
+		x_begin = std::max(0, x_begin);
+		y_begin = std::max(0, y_begin);
+		x_end	= std::min(width, x_end);
+		y_end	= std::min(height, y_end);
+
+		if(x_begin >= x_end || y_begin >= y_end)
+			return;
+
+		// Source planes and horizontal sample tables.
+
+		std::vector<plane_view> planes;
+		for(size_t n = 0; n < params.buffers.size(); ++n)
+		{
+			auto& desc = params.pix_desc.planes[n];
+
+			if(!params.buffers[n] || !params.buffers[n]->data())
+				return;
+
+			plane_view plane;
+			plane.data		= static_cast<const uint8_t*>(params.buffers[n]->data());
+			plane.width		= static_cast<int>(desc.width);
+			plane.height	= static_cast<int>(desc.height);
+			plane.channels	= static_cast<int>(desc.channels);
+			plane.linesize	= static_cast<int>(desc.linesize);
+
+			plane.columns.reserve(x_end - x_begin);
+			for(int x = x_begin; x < x_end; ++x)
+				plane.columns.push_back(make_sample(x, width, f_p[0], f_s[0], plane.width));
+
+			planes.push_back(std::move(plane));
+		}
+
+		// Image adjustments, same thresholds as image_kernel.
+
+		levels_params levels;
+		levels.enabled = params.transform.levels.min_input  > epsilon		||
+						 params.transform.levels.max_input  < 1.0-epsilon	||
+						 params.transform.levels.min_output > epsilon		||
+						 params.transform.levels.max_output < 1.0-epsilon	||
+						 std::abs(params.transform.levels.gamma - 1.0) > epsilon;
+		levels.min_input	= _mm_set1_ps(static_cast<float>(params.transform.levels.min_input));
+		levels.input_range	= _mm_set1_ps(static_cast<float>(params.transform.levels.max_input - params.transform.levels.min_input));
+		levels.inv_gamma	= static_cast<float>(1.0 / params.transform.levels.gamma);
+		levels.min_output	= _mm_set1_ps(static_cast<float>(params.transform.levels.min_output));
+		levels.output_range	= _mm_set1_ps(static_cast<float>(params.transform.levels.max_output - params.transform.levels.min_output));
+
+		csb_params csb;
+		csb.enabled = std::abs(params.transform.brightness - 1.0) > epsilon ||
+					  std::abs(params.transform.saturation - 1.0) > epsilon ||
+					  std::abs(params.transform.contrast - 1.0)   > epsilon;
+		csb.brt = static_cast<float>(params.transform.brightness);
+		csb.sat = static_cast<float>(params.transform.saturation);
+		csb.con = static_cast<float>(params.transform.contrast);
+
+		const float opacity = static_cast<float>(params.transform.is_key ? 1.0 : params.transform.opacity);
+		const bool  is_hd	= params.pix_desc.planes.at(0).height > 700;
+
+		const bool direct = params.pix_desc.pix_fmt == pixel_format::bgra	&&
+							background.stride() == 4						&&
+							params.blend_mode.mode == blend_mode::normal	&&
+							params.blend_mode.chroma.key == chroma::none	&&
+							!params.local_key && !params.layer_key			&&
+							!levels.enabled && !csb.enabled					&&
+							is_identity(planes[0].columns);
+
+		auto draw_tile = [&](const tbb::blocked_range2d<int>& r)
+		{
+			for(int y = r.rows().begin(); y < r.rows().end(); ++y)
+			{
+				if(params.transform.field_mode == field_mode::upper && (y % 2) != 0)
+					continue;
+				if(params.transform.field_mode == field_mode::lower && (y % 2) != 1)
+					continue;
+
+				if(direct && draw_direct_row(params, planes[0], y - y_offset, y, r.cols().begin(), r.cols().end(), x_begin, height, opacity))
+					continue;
+
+				draw_row(params, planes, y - y_offset, y, r.cols().begin(), r.cols().end(), x_begin, height, opacity, is_hd, levels, csb);
+			}
+		};
+
+		tbb::parallel_for(tbb::blocked_range2d<int>(y_begin, y_end, TILE_HEIGHT, x_begin, x_end, TILE_WIDTH), draw_tile);
+	}
+
+	static bool is_identity(const std::vector<axis_sample>& columns)
+	{
+		for(size_t n = 0; n < columns.size(); ++n)
+		{
+			if(columns[n].f != 0.0f || columns[n].i0 != columns[0].i0 + static_cast<int>(n))
+				return false;
+		}
+		return true;
+	}
+
+	bool draw_direct_row(
+			cpu_draw_params& params,
+			const plane_view& plane,
+			int source_y,
+			int y,
+			int x0,
+			int x1,
+			int x_begin,
+			int height,
+			float opacity)
+	{
+		auto& transform = params.transform;
+		auto row = make_sample(source_y, height, transform.fill_translation[1], transform.fill_scale[1], plane.height);
+		if(row.f != 0.0f)
+			return false;
+
+		auto& background = *params.background;
+		auto dst = background.data() + (y*background.width() + x0)*4;
+		auto src = plane.data + row.i0*plane.linesize + plane.columns[x0 - x_begin].i0*4;
+
+		over_row_sse2(dst, src, x1 - x0, static_cast<int>(opacity*256.0f + 0.5f), params.keyer == keyer::additive);
+
+		return true;
+	}
+
+	void draw_row(
+			cpu_draw_params& params,
+			const std::vector<plane_view>& planes,
+			int source_y,
+			int y,
+			int x0,
+			int x1,
+			int x_begin,
+			int height,
+			float opacity,
+			bool is_hd,
+			const levels_params& levels,
+			const csb_params& csb)
+	{
+		auto& transform  = params.transform;
+		auto& background = *params.background;
+
+		const uint8_t* row0[4];
+		const uint8_t* row1[4];
+		float		   fy[4];
+
+		for(size_t n = 0; n < planes.size(); ++n)
+		{
+			auto row = make_sample(source_y, height, transform.fill_translation[1], transform.fill_scale[1], planes[n].height);
+			row0[n] = planes[n].data + row.i0*planes[n].linesize;
+			row1[n] = planes[n].data + row.i1*planes[n].linesize;
+			fy[n]	= row.f;
+		}
+
+		const uint8_t* local_key = params.local_key ? params.local_key->data() + y*params.local_key->width() : nullptr;
+		const uint8_t* layer_key = params.layer_key ? params.layer_key->data() + y*params.layer_key->width() : nullptr;
+
+		const __m128 scale = _mm_set1_ps(1.0f/255.0f);
+		const __m128 rgb_mask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+
+		for(int x = x0; x < x1; ++x)
+		{
+			const int c = x - x_begin;
+
+			__m128 color = get_color(params.pix_desc.pix_fmt, planes, c, row0, row1, fy, is_hd);
+
+			if(params.blend_mode.chroma.key == chroma::green || params.blend_mode.chroma.key == chroma::blue)
+				color = chroma_key(color, params.blend_mode.chroma);
+
+			if(levels.enabled)
+			{
+				auto v = _mm_min_ps(_mm_div_ps(_mm_max_ps(_mm_sub_ps(color, levels.min_input), _mm_setzero_ps()), levels.input_range), _mm_set1_ps(1.0f));
+				float g[4];
+				_mm_storeu_ps(g, v);
+				for(int n = 0; n < 3; ++n)
+					g[n] = std::pow(g[n], levels.inv_gamma);
+				v = _mm_add_ps(levels.min_output, _mm_mul_ps(levels.output_range, _mm_loadu_ps(g)));
+				color = select(rgb_mask, v, color);
+			}
+
+			if(csb.enabled)
+				color = select(rgb_mask, contrast_saturation_brightness(color, csb), color);
+
+			if(local_key)
+				color = _mm_mul_ps(color, _mm_set1_ps(local_key[x] / 255.0f));
+
+			if(layer_key)
+				color = _mm_mul_ps(color, _mm_set1_ps(layer_key[x] / 255.0f));
+
+			color = _mm_mul_ps(color, _mm_set1_ps(opacity));
+
+			if(background.stride() == 1)
+			{
+				auto& dst = background.data()[y*background.width() + x];
+				float fore = lane(color, 2);
+				float back = dst / 255.0f;
+				float result = params.keyer == keyer::additive ? fore + back : fore + (1.0f - lane(color, 3))*back;
+				dst = static_cast<uint8_t>(std::min(1.0f, std::max(0.0f, result)) * 255.0f + 0.5f);
+			}
+			else
+			{
+				auto dst  = background.data() + (y*background.width() + x)*4;
+				auto back = _mm_mul_ps(load_pixel(dst), scale);
+
+				if(params.blend_mode.mode != blend_mode::normal)
+				{
+					auto fore_a = _mm_shuffle_ps(color, color, _MM_SHUFFLE(3,3,3,3));
+					auto back_a = _mm_shuffle_ps(back, back, _MM_SHUFFLE(3,3,3,3));
+					auto blended = blend_color(params.blend_mode.mode,
+												_mm_div_ps(back, _mm_add_ps(back_a, _mm_set1_ps(EPSILON))),
+												_mm_div_ps(color, _mm_add_ps(fore_a, _mm_set1_ps(EPSILON))));
+					color = select(rgb_mask, _mm_mul_ps(blended, fore_a), color);
+				}
+
+				if(params.keyer == keyer::additive)
+					color = _mm_add_ps(color, back);
+				else
+					color = _mm_add_ps(color, _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(1.0f), _mm_shuffle_ps(color, color, _MM_SHUFFLE(3,3,3,3))), back));
+
+				store_pixel(dst, color);
+			}
+		}
+	}
+
+	static __m128 get_color(
+			pixel_format::type pix_fmt,
+			const std::vector<plane_view>& planes,
+			int c,
+			const uint8_t* const* row0,
+			const uint8_t* const* row1,
+			const float* fy,
+			bool is_hd)
+	{
+		const __m128 scale = _mm_set1_ps(1.0f/255.0f);
+
+		switch(pix_fmt)
+		{
+		case pixel_format::gray:
+			{
+				float v = sample1(planes[0], planes[0].columns[c], row0[0], row1[0], fy[0]) / 255.0f;
+				return _mm_set_ps(1.0f, v, v, v);
+			}
+		case pixel_format::bgra:
+			return _mm_mul_ps(sample4(planes[0], planes[0].columns[c], row0[0], row1[0], fy[0]), scale);
+		case pixel_format::rgba:
+			{
+				auto v = _mm_mul_ps(sample4(planes[0], planes[0].columns[c], row0[0], row1[0], fy[0]), scale);
+				return _mm_shuffle_ps(v, v, _MM_SHUFFLE(3,0,1,2));
+			}
+		case pixel_format::argb:
+			{
+				auto v = _mm_mul_ps(sample4(planes[0], planes[0].columns[c], row0[0], row1[0], fy[0]), scale);
+				return _mm_shuffle_ps(v, v, _MM_SHUFFLE(0,1,2,3));
+			}
+		case pixel_format::abgr:
+			{
+				auto v = _mm_mul_ps(sample4(planes[0], planes[0].columns[c], row0[0], row1[0], fy[0]), scale);
+				return _mm_shuffle_ps(v, v, _MM_SHUFFLE(0,3,2,1));
+			}
+		case pixel_format::ycbcr:
+		case pixel_format::ycbcra:
+			{
+				float y  = sample1(planes[0], planes[0].columns[c], row0[0], row1[0], fy[0]);
+				float cb = sample1(planes[1], planes[1].columns[c], row0[1], row1[1], fy[1]);
+				float cr = sample1(planes[2], planes[2].columns[c], row0[2], row1[2], fy[2]);
+				float a  = pix_fmt == pixel_format::ycbcra ? sample1(planes[3], planes[3].columns[c], row0[3], row1[3], fy[3]) / 255.0f : 1.0f;
+				return ycbcra_to_bgra(y, cb, cr, a, is_hd);
+			}
+		case pixel_format::luma:
+			{
+				float v = (sample1(planes[0], planes[0].columns[c], row0[0], row1[0], fy[0]) / 255.0f - 0.065f) / 0.859f;
+				return _mm_set_ps(1.0f, v, v, v);
+			}
+		}
+
+		return _mm_setzero_ps();
+	}
+
+	static __m128 ycbcra_to_bgra(float y, float cb, float cr, float a, bool is_hd)
+	{
+		y  = 1.164f*(y - 16.0f);
+		cb = cb - 128.0f;
+		cr = cr - 128.0f;
+
+		float r, g, b;
+		if(is_hd)
+		{
+			r = y + 1.793f*cr;
+			g = y - 0.534f*cr - 0.213f*cb;
+			b = y + 2.115f*cb;
+		}
+		else
+		{
+			r = y + 1.596f*cr;
+			g = y - 0.813f*cr - 0.391f*cb;
+			b = y + 2.018f*cb;
+		}
+
+		return _mm_set_ps(a, r/255.0f, g/255.0f, b/255.0f);
+	}
+
+	static __m128 chroma_key(__m128 color, const chroma& params)
+	{
+		float c[4];
+		_mm_storeu_ps(c, color);
+
+		float& b = c[0];
+		float& g = c[1];
+		float& r = c[2];
+
+		float d = params.key == chroma::green ? (2.0f*g - r - b)/2.0f : (2.0f*b - r - g)/2.0f;
+
+		float alpha = 1.0f - smoothstep(params.threshold, params.softness, d);
+		for(int n = 0; n < 4; ++n)
+			c[n] *= alpha;
+
+		float ds = smoothstep(params.spill, 1.0f, d/(params.softness + EPSILON));
+		float gl = 0.3f*r + 0.59f*g + 0.11f*b;
+
+		for(int n = 0; n < 3; ++n)
+			c[n] += (gl*gl - c[n])*ds;
+		c[3] += (gl - c[3])*ds;
+
+		return _mm_loadu_ps(c);
+	}
+
+	static __m128 contrast_saturation_brightness(__m128 color, const csb_params& csb)
+	{
+		const __m128 lum_coeff = _mm_set_ps(0.0f, 0.2125f, 0.7154f, 0.0721f);
+		const __m128 avg_lumin = _mm_set1_ps(0.5f);
+
+		bool demultiply_remultiply = csb.con < 1.0f;
+		auto alpha = _mm_add_ps(_mm_shuffle_ps(color, color, _MM_SHUFFLE(3,3,3,3)), _mm_set1_ps(EPSILON));
+
+		if(demultiply_remultiply)
+			color = _mm_div_ps(color, alpha);
+
+		auto brt_color = _mm_mul_ps(color, _mm_set1_ps(csb.brt));
+		auto weighted  = _mm_mul_ps(brt_color, lum_coeff);
+		auto intensity = _mm_set1_ps(lane(weighted, 0) + lane(weighted, 1) + lane(weighted, 2));
+		auto sat_color = _mm_add_ps(intensity, _mm_mul_ps(_mm_sub_ps(brt_color, intensity), _mm_set1_ps(csb.sat)));
+		auto con_color = _mm_add_ps(avg_lumin, _mm_mul_ps(_mm_sub_ps(sat_color, avg_lumin), _mm_set1_ps(csb.con)));
+
+		if(demultiply_remultiply)
+			con_color = _mm_mul_ps(con_color, alpha);
+
+		return con_color;
+	}
+
+	void post_process(
+			const safe_ptr<cpu_buffer>& background, bool straighten_alpha)
+	{
+		if(!straighten_alpha || background->stride() != 4)
+			return;
+
+		auto data	= background->data();
+		auto width	= static_cast<int>(background->width());
+
+		tbb::parallel_for(tbb::blocked_range<int>(0, static_cast<int>(background->height()), TILE_HEIGHT), [&](const tbb::blocked_range<int>& r)
+		{
+			for(int y = r.begin(); y < r.end(); ++y)
+			{
+				auto row = data + y*width*4;
+				for(int x = 0; x < width; ++x)
+				{
+					auto px = row + x*4;
+					int a = px[3];
+					if(a == 0 || a == 255)
+						continue;
+					for(int n = 0; n < 3; ++n)
+						px[n] = static_cast<uint8_t>(std::min(255, (px[n]*255 + a/2) / a));
+				}
+			}
+		});
+	}
+};
+
+cpu_image_kernel::cpu_image_kernel() : impl_(new implementation()){}
+void cpu_image_kernel::draw(cpu_draw_params&& params)
+{
+	impl_->draw(std::move(params));
+}
+
+void cpu_image_kernel::post_process(
+		const safe_ptr<cpu_buffer>& background, bool straighten_alpha)
+{
+	impl_->post_process(background, straighten_alpha);
+}
+
+}}
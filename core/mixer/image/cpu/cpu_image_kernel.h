@@ -0,0 +1,89 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "../blend_modes.h"
+#include "../image_kernel.h"
+
+#include <common/memory/safe_ptr.h>
+
+#include <core/producer/frame/pixel_format.h>
+#include <core/producer/frame/frame_transform.h>
+
+#include <boost/noncopyable.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace caspar { namespace core {
+
+class host_buffer;
+
+// Premultiplied BGRA (stride 4) or key (stride 1) surface in system memory.
+class cpu_buffer : boost::noncopyable
+{
+public:
+	cpu_buffer(uint32_t width, uint32_t height, uint32_t stride);
+
+	uint32_t stride() const;
+	uint32_t width() const;
+	uint32_t height() const;
+
+	uint8_t* data();
+	const uint8_t* data() const;
+
+	const safe_ptr<host_buffer>& memory() const;
+private:
+	struct implementation;
+	safe_ptr<implementation> impl_;
+};
+
+struct cpu_draw_params
+{
+	pixel_format_desc							pix_desc;
+	std::vector<std::shared_ptr<host_buffer>>	buffers;
+	frame_transform								transform;
+	blend_mode									blend_mode;
+	keyer::type									keyer;
+	std::shared_ptr<cpu_buffer>					background;
+	std::shared_ptr<cpu_buffer>					local_key;
+	std::shared_ptr<cpu_buffer>					layer_key;
+
+	cpu_draw_params()
+		: blend_mode(blend_mode::normal)
+		, keyer(keyer::linear)
+	{
+	}
+};
+
+// Software equivalent of image_kernel. Draws are split into cache sized tiles which are processed in parallel.
+class cpu_image_kernel : boost::noncopyable
+{
+public:
+	cpu_image_kernel();
+	void draw(cpu_draw_params&& params);
+	void post_process(
+			const safe_ptr<cpu_buffer>& background, bool straighten_alpha);
+private:
+	struct implementation;
+	safe_ptr<implementation> impl_;
+};
+
+}}
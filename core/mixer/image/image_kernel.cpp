@@ -71,7 +71,44 @@ struct image_kernel::implementation : boost::noncopyable
 			CASPAR_LOG(warning) << L"[image_mixer] TextureBarrierNV not supported. Post processing will not be available";
 	}
 
-	void draw(draw_params&& params)
+	void draw(std::vector<draw_params>&& draw_list)
+	{
+		if(draw_list.empty())
+			return;
+
+		bool ready = std::all_of(draw_list.begin(), draw_list.end(), [](const draw_params& params)
+		{
+			return std::all_of(params.textures.begin(), params.textures.end(), std::mem_fn(&device_buffer::ready));
+		});
+
+		if(!ready)
+		{
+			CASPAR_LOG(trace) << L"[image_mixer] Performance warning. Host to device transfer not complete, GPU will be stalled";
+			ogl_->yield(); // Try to give it some more time.
+		}
+
+		// State which is the same for every draw in the list.
+
+		ogl_->use(*shader_);
+
+		shader_->set("plane[0]",		texture_id::plane0);
+		shader_->set("plane[1]",		texture_id::plane1);
+		shader_->set("plane[2]",		texture_id::plane2);
+		shader_->set("plane[3]",		texture_id::plane3);
+		shader_->set("local_key",		texture_id::local_key);
+		shader_->set("layer_key",		texture_id::layer_key);
+		shader_->set("post_processing",	false);
+
+		if(blend_modes_)
+			shader_->set("background",	texture_id::background);
+
+		for(auto it = draw_list.begin(); it != draw_list.end(); ++it)
+			draw_one(std::move(*it));
+
+		draw_list.clear();
+	}
+
+	void draw_one(draw_params&& params)
 	{
 		static const double epsilon = 0.001;
 
@@ -83,12 +120,6 @@ struct image_kernel::implementation : boost::noncopyable
 		if(params.transform.opacity < epsilon)
 			return;
 		
-		if(!std::all_of(params.textures.begin(), params.textures.end(), std::mem_fn(&device_buffer::ready)))
-		{
-			CASPAR_LOG(trace) << L"[image_mixer] Performance warning. Host to device transfer not complete, GPU will be stalled";
-			ogl_->yield(); // Try to give it some more time.
-		}		
-		
 		// Bind textures
 
 		for(uint32_t n = 0; n < params.textures.size(); ++n)
@@ -101,21 +132,12 @@ struct image_kernel::implementation : boost::noncopyable
 			params.layer_key->bind(texture_id::layer_key);
 			
 		// Setup shader
-								
-		ogl_->use(*shader_);
 
-		shader_->set("plane[0]",		texture_id::plane0);
-		shader_->set("plane[1]",		texture_id::plane1);
-		shader_->set("plane[2]",		texture_id::plane2);
-		shader_->set("plane[3]",		texture_id::plane3);
-		shader_->set("local_key",		texture_id::local_key);
-		shader_->set("layer_key",		texture_id::layer_key);
 		shader_->set("is_hd",		 	params.pix_desc.planes.at(0).height > 700 ? 1 : 0);
 		shader_->set("has_local_key",	bool(params.local_key));
 		shader_->set("has_layer_key",	bool(params.layer_key));
 		shader_->set("pixel_format",	params.pix_desc.pix_fmt);	
 		shader_->set("opacity",			params.transform.is_key ? 1.0 : params.transform.opacity);	
-		shader_->set("post_processing",	false);
 
 		shader_->set("chroma_mode",    params.blend_mode.chroma.key == chroma::green ? 1 : (params.blend_mode.chroma.key == chroma::blue ? 2 : 0));
         shader_->set("chroma_blend",   params.blend_mode.chroma.threshold, params.blend_mode.chroma.softness);
@@ -140,7 +162,6 @@ struct image_kernel::implementation : boost::noncopyable
 		{
 			params.background->bind(texture_id::background);
 
-			shader_->set("background",	texture_id::background);
 			shader_->set("blend_mode",	params.blend_mode.mode);
 			shader_->set("keyer",		params.keyer);
 		}
@@ -300,7 +321,14 @@ struct image_kernel::implementation : boost::noncopyable
 image_kernel::image_kernel(const safe_ptr<ogl_device>& ogl) : impl_(new implementation(ogl)){}
 void image_kernel::draw(draw_params&& params)
 {
-	impl_->draw(std::move(params));
+	std::vector<draw_params> draw_list;
+	draw_list.push_back(std::move(params));
+	impl_->draw(std::move(draw_list));
+}
+
+void image_kernel::draw(std::vector<draw_params>&& draw_list)
+{
+	impl_->draw(std::move(draw_list));
 }
 
 void image_kernel::post_process(
@@ -67,6 +67,7 @@ class image_kernel : boost::noncopyable
 public:
 	image_kernel(const safe_ptr<ogl_device>& ogl);
 	void draw(draw_params&& params);
+	void draw(std::vector<draw_params>&& draw_list); // Submits a whole frame, state shared by all draws is only set once.
 	void post_process(
 			const safe_ptr<device_buffer>& background, bool straighten_alpha);
 private:
@@ -24,11 +24,14 @@
 #include "image_mixer.h"
 
 #include "image_kernel.h"
+#include "cpu/cpu_image_kernel.h"
 #include "../write_frame.h"
 #include "../gpu/ogl_device.h"
 #include "../gpu/host_buffer.h"
 #include "../gpu/device_buffer.h"
 
+#include <common/concurrency/executor.h>
+#include <common/env.h>
 #include <common/exception/exceptions.h>
 #include <common/gl/gl_check.h>
 #include <common/utility/move_on_copy.h>
@@ -39,7 +42,10 @@
 
 #include <gl/glew.h>
 
+#include <tbb/atomic.h>
+
 #include <boost/foreach.hpp>
+#include <boost/thread.hpp>
 #include <boost/range/algorithm_ext/erase.hpp>
 
 #include <algorithm>
@@ -53,21 +59,39 @@ struct item
 {
 	pixel_format_desc						pix_desc;
 	std::vector<safe_ptr<device_buffer>>	textures;
+	std::vector<std::shared_ptr<host_buffer>>	buffers;
 	frame_transform							transform;
 };
 
 typedef std::pair<blend_mode, std::vector<item>> layer;
 
+const int READBACK_TIMEOUT_MS = 1000;
+
 class image_renderer
 {
+	typedef boost::promise<safe_ptr<host_buffer>> promise_t;
+
+	struct readback
+	{
+		safe_ptr<host_buffer>			buffer;
+		std::shared_ptr<device_buffer>	source;
+		std::shared_ptr<promise_t>		promise;
+	};
+
 	safe_ptr<ogl_device>			ogl_;
 	image_kernel					kernel_;	
-	std::shared_ptr<device_buffer>	transferring_buffer_;
+	std::deque<readback>			readbacks_; // Only accessed on the ogl_device thread.
+	const size_t					readback_depth_;
+	tbb::atomic<int64_t>			stall_count_;
+	bool							poll_scheduled_; // Only accessed on the ogl_device thread.
 public:
 	image_renderer(const safe_ptr<ogl_device>& ogl)
 		: ogl_(ogl)
 		, kernel_(ogl_)
+		, readback_depth_(std::max(1, env::properties().get(L"configuration.mixer.readback-depth", 2)))
+		, poll_scheduled_(false)
 	{
+		stall_count_ = 0;
 	}
 	
 	boost::unique_future<safe_ptr<host_buffer>> operator()(
@@ -75,19 +99,40 @@ public:
 			const video_format_desc& format_desc,
 			bool straighten_alpha)
 	{		
+		auto promise = std::make_shared<promise_t>();
+		auto future	 = promise->get_future();
+
 		auto layers2 = make_move_on_copy(std::move(layers));
-		return ogl_->begin_invoke([=]
+		ogl_->post([=]
 		{
-			return do_render(
-					std::move(layers2.value), format_desc, straighten_alpha);
+			try
+			{
+				do_render(std::move(layers2.value), format_desc, straighten_alpha, promise);
+			}
+			catch(...)
+			{
+				promise->set_exception(boost::current_exception());
+			}
 		});
+
+		return std::move(future);
+	}
+
+	int64_t stall_count() const
+	{
+		return stall_count_;
 	}
 
 private:
-	safe_ptr<host_buffer> do_render(std::vector<layer>&& layers, const video_format_desc& format_desc, bool straighten_alpha)
+	void do_render(std::vector<layer>&& layers, const video_format_desc& format_desc, bool straighten_alpha, const std::shared_ptr<promise_t>& promise)
 	{
+		complete_readbacks(); // Hands on whatever the GPU finished since the previous frame.
+
 		auto draw_buffer = create_mixer_buffer(4, format_desc);
 
+		// The whole frame is recorded into a draw list before anything is submitted to the kernel.
+		std::vector<draw_params> draw_list;
+
 		if(format_desc.field_mode != field_mode::progressive)
 		{
 			auto upper = layers;
@@ -105,14 +150,15 @@ private:
 					item.transform.field_mode = static_cast<field_mode::type>(item.transform.field_mode & field_mode::lower);
 			}
 
-			draw(std::move(upper), draw_buffer, format_desc);
-			draw(std::move(lower), draw_buffer, format_desc);
+			draw(std::move(upper), draw_buffer, draw_list, format_desc);
+			draw(std::move(lower), draw_buffer, draw_list, format_desc);
 		}
 		else
 		{
-			draw(std::move(layers), draw_buffer, format_desc);
+			draw(std::move(layers), draw_buffer, draw_list, format_desc);
 		}
 
+		kernel_.draw(std::move(draw_list));
 		kernel_.post_process(draw_buffer, straighten_alpha);
 
 		auto host_buffer = ogl_->create_host_buffer(format_desc.size, read_only);
@@ -120,26 +166,88 @@ private:
 		ogl_->read_buffer(*draw_buffer);
 		host_buffer->begin_read(draw_buffer->width(), draw_buffer->height(), format(draw_buffer->stride()));
 		
-		transferring_buffer_ = std::move(draw_buffer);
-
 		ogl_->flush(); // NOTE: This is important, otherwise fences will deadlock.
-			
-		return host_buffer;
+
+		readback entry;
+		entry.buffer	= host_buffer;
+		entry.source	= draw_buffer;
+		entry.promise	= promise;
+		readbacks_.push_back(std::move(entry));
+
+		if(!complete_readbacks())
+			schedule_poll();
+	}
+
+	// Maps every finished read-back in order, polling the fences without blocking. The oldest one is only waited for 
+	// when more than readback_depth_ are in flight, which is counted as a stall.
+	bool complete_readbacks()
+	{
+		while(!readbacks_.empty())
+		{
+			auto& front = readbacks_.front();
+
+			try
+			{
+				if(!front.buffer->ready())
+				{
+					if(readbacks_.size() <= readback_depth_)
+						break;
+
+					++stall_count_;
+					if(!front.buffer->client_wait(READBACK_TIMEOUT_MS))
+						BOOST_THROW_EXCEPTION(timed_out() << msg_info("GPU did not complete host read-back."));
+				}
+
+				front.buffer->map();
+				front.promise->set_value(front.buffer);
+			}
+			catch(...)
+			{
+				front.promise->set_exception(boost::current_exception());
+			}
+
+			readbacks_.pop_front();
+		}
+
+		return readbacks_.empty();
+	}
+
+	// Completes pending read-backs when no further frames are rendered, e.g. with a single pipeline token.
+	// Re-queues itself behind any other work on the ogl_device thread until the fences have signalled.
+	void schedule_poll()
+	{
+		if(poll_scheduled_)
+			return;
+
+		poll_scheduled_ = true;
+
+		ogl_->post([=]
+		{
+			poll_scheduled_ = false;
+
+			if(!complete_readbacks())
+			{
+				boost::this_thread::yield(); // Gives the cpu away rather than spinning when nothing else is queued.
+				schedule_poll();
+			}
+		});
 	}
 
 	void draw(std::vector<layer>&&		layers, 
 			  safe_ptr<device_buffer>&	draw_buffer, 
+			  std::vector<draw_params>&	draw_list,
 			  const video_format_desc& format_desc)
 	{
 		std::shared_ptr<device_buffer> layer_key_buffer;
 
 		BOOST_FOREACH(auto& layer, layers)
-			draw_layer(std::move(layer), draw_buffer, layer_key_buffer, format_desc);
+			draw_layer(std::move(layer), draw_buffer, layer_key_buffer, draw_list, format_desc);
 	}
 
 	void draw_layer(layer&&							layer, 
 					safe_ptr<device_buffer>&		draw_buffer,
 					std::shared_ptr<device_buffer>& layer_key_buffer,
+					std::vector<draw_params>&		draw_list,
 					const video_format_desc&		format_desc)
 	{				
 		boost::remove_erase_if(layer.second, [](const item& item){return item.transform.field_mode == field_mode::empty;});
@@ -155,17 +263,17 @@ private:
 			auto layer_draw_buffer = create_mixer_buffer(4, format_desc);
 
 			BOOST_FOREACH(auto& item, layer.second)
-				draw_item(std::move(item), layer_draw_buffer, layer_key_buffer, local_key_buffer, local_mix_buffer, format_desc);	
+				draw_item(std::move(item), layer_draw_buffer, layer_key_buffer, local_key_buffer, local_mix_buffer, draw_list, format_desc);	
 		
-			draw_mixer_buffer(layer_draw_buffer, std::move(local_mix_buffer), blend_mode::normal);							
-			draw_mixer_buffer(draw_buffer, std::move(layer_draw_buffer), layer.first);
+			draw_mixer_buffer(layer_draw_buffer, std::move(local_mix_buffer), draw_list, blend_mode::normal);							
+			draw_mixer_buffer(draw_buffer, std::move(layer_draw_buffer), draw_list, layer.first);
 		}
 		else // fast path
 		{
 			BOOST_FOREACH(auto& item, layer.second)		
-				draw_item(std::move(item), draw_buffer, layer_key_buffer, local_key_buffer, local_mix_buffer, format_desc);		
+				draw_item(std::move(item), draw_buffer, layer_key_buffer, local_key_buffer, local_mix_buffer, draw_list, format_desc);		
 					
-			draw_mixer_buffer(draw_buffer, std::move(local_mix_buffer), layer.first);
+			draw_mixer_buffer(draw_buffer, std::move(local_mix_buffer), draw_list, layer.first);
 		}					
 
 		layer_key_buffer = std::move(local_key_buffer);
@@ -176,6 +284,7 @@ private:
 				   std::shared_ptr<device_buffer>&	layer_key_buffer, 
 				   std::shared_ptr<device_buffer>&	local_key_buffer, 
 				   std::shared_ptr<device_buffer>&	local_mix_buffer,
+				   std::vector<draw_params>&		draw_list,
 				   const video_format_desc&			format_desc)
 	{			
 		draw_params draw_params;
@@ -191,7 +300,7 @@ private:
 			draw_params.local_key			= nullptr;
 			draw_params.layer_key			= nullptr;
 
-			kernel_.draw(std::move(draw_params));
+			draw_list.push_back(std::move(draw_params));
 		}
 		else if(item.transform.is_mix)
 		{
@@ -203,22 +312,23 @@ private:
 
 			draw_params.keyer				= keyer::additive;
 
-			kernel_.draw(std::move(draw_params));
+			draw_list.push_back(std::move(draw_params));
 		}
 		else
 		{
-			draw_mixer_buffer(draw_buffer, std::move(local_mix_buffer), blend_mode::normal);
+			draw_mixer_buffer(draw_buffer, std::move(local_mix_buffer), draw_list, blend_mode::normal);
 			
 			draw_params.background			= draw_buffer;
 			draw_params.local_key			= std::move(local_key_buffer);
 			draw_params.layer_key			= layer_key_buffer;
 
-			kernel_.draw(std::move(draw_params));
+			draw_list.push_back(std::move(draw_params));
 		}	
 	}
 
 	void draw_mixer_buffer(safe_ptr<device_buffer>&			draw_buffer, 
 						   std::shared_ptr<device_buffer>&& source_buffer, 
+						   std::vector<draw_params>&		draw_list,
 						   blend_mode   			        blend_mode = blend_mode::normal)
 	{
 		if(!source_buffer)
@@ -232,7 +342,7 @@ private:
 		draw_params.blend_mode			= blend_mode;
 		draw_params.background			= draw_buffer;
 
-		kernel_.draw(std::move(draw_params));
+		draw_list.push_back(std::move(draw_params));
 	}
 			
 	safe_ptr<device_buffer> create_mixer_buffer(uint32_t stride, const video_format_desc& format_desc)
@@ -242,17 +352,196 @@ private:
 		return buffer;
 	}
 };
+
+class cpu_image_renderer
+{
+	cpu_image_kernel	kernel_;
+	executor			executor_;
+public:
+	cpu_image_renderer()
+		: executor_(L"cpu_image_renderer", shared_pool)
+	{
+	}
+	
+	boost::unique_future<safe_ptr<host_buffer>> operator()(
+			std::vector<layer>&& layers,
+			const video_format_desc& format_desc,
+			bool straighten_alpha)
+	{		
+		auto layers2 = make_move_on_copy(std::move(layers));
+		return executor_.begin_invoke([=]
+		{
+			return do_render(
+					std::move(layers2.value), format_desc, straighten_alpha);
+		});
+	}
+
+private:
+	safe_ptr<host_buffer> do_render(std::vector<layer>&& layers, const video_format_desc& format_desc, bool straighten_alpha)
+	{
+		auto draw_buffer = create_mixer_buffer(4, format_desc);
+
+		if(format_desc.field_mode != field_mode::progressive)
+		{
+			auto upper = layers;
+			auto lower = std::move(layers);
+
+			BOOST_FOREACH(auto& layer, upper)
+			{
+				BOOST_FOREACH(auto& item, layer.second)
+					item.transform.field_mode = static_cast<field_mode::type>(item.transform.field_mode & field_mode::upper);
+			}
+
+			BOOST_FOREACH(auto& layer, lower)
+			{
+				BOOST_FOREACH(auto& item, layer.second)
+					item.transform.field_mode = static_cast<field_mode::type>(item.transform.field_mode & field_mode::lower);
+			}
+
+			draw(std::move(upper), draw_buffer, format_desc);
+			draw(std::move(lower), draw_buffer, format_desc);
+		}
+		else
+		{
+			draw(std::move(layers), draw_buffer, format_desc);
+		}
+
+		kernel_.post_process(draw_buffer, straighten_alpha);
+
+		return draw_buffer->memory();
+	}
+
+	void draw(std::vector<layer>&&		layers, 
+			  safe_ptr<cpu_buffer>&		draw_buffer, 
+			  const video_format_desc&	format_desc)
+	{
+		std::shared_ptr<cpu_buffer> layer_key_buffer;
+
+		BOOST_FOREACH(auto& layer, layers)
+			draw_layer(std::move(layer), draw_buffer, layer_key_buffer, format_desc);
+	}
+
+	void draw_layer(layer&&							layer, 
+					safe_ptr<cpu_buffer>&			draw_buffer,
+					std::shared_ptr<cpu_buffer>&	layer_key_buffer,
+					const video_format_desc&		format_desc)
+	{				
+		boost::remove_erase_if(layer.second, [](const item& item){return item.transform.field_mode == field_mode::empty;});
+
+		if(layer.second.empty())
+			return;
+
+		std::shared_ptr<cpu_buffer> local_key_buffer;
+		std::shared_ptr<cpu_buffer> local_mix_buffer;
+				
+		if(layer.first.mode != blend_mode::normal || layer.first.chroma.key != chroma::none)
+		{
+			auto layer_draw_buffer = create_mixer_buffer(4, format_desc);
+
+			BOOST_FOREACH(auto& item, layer.second)
+				draw_item(std::move(item), layer_draw_buffer, layer_key_buffer, local_key_buffer, local_mix_buffer, format_desc);	
+		
+			draw_mixer_buffer(layer_draw_buffer, std::move(local_mix_buffer), blend_mode::normal);							
+			draw_mixer_buffer(draw_buffer, std::move(layer_draw_buffer), layer.first);
+		}
+		else // fast path
+		{
+			BOOST_FOREACH(auto& item, layer.second)		
+				draw_item(std::move(item), draw_buffer, layer_key_buffer, local_key_buffer, local_mix_buffer, format_desc);		
+					
+			draw_mixer_buffer(draw_buffer, std::move(local_mix_buffer), layer.first);
+		}					
+
+		layer_key_buffer = std::move(local_key_buffer);
+	}
+
+	void draw_item(item&&							item, 
+				   safe_ptr<cpu_buffer>&			draw_buffer, 
+				   std::shared_ptr<cpu_buffer>&		layer_key_buffer, 
+				   std::shared_ptr<cpu_buffer>&		local_key_buffer, 
+				   std::shared_ptr<cpu_buffer>&		local_mix_buffer,
+				   const video_format_desc&			format_desc)
+	{			
+		cpu_draw_params draw_params;
+		draw_params.pix_desc				= std::move(item.pix_desc);
+		draw_params.buffers					= std::move(item.buffers);
+		draw_params.transform				= std::move(item.transform);
+
+		if(item.transform.is_key)
+		{
+			local_key_buffer = local_key_buffer ? local_key_buffer : create_mixer_buffer(1, format_desc);
+
+			draw_params.background			= local_key_buffer;
+			draw_params.local_key			= nullptr;
+			draw_params.layer_key			= nullptr;
+
+			kernel_.draw(std::move(draw_params));
+		}
+		else if(item.transform.is_mix)
+		{
+			local_mix_buffer = local_mix_buffer ? local_mix_buffer : create_mixer_buffer(4, format_desc);
+
+			draw_params.background			= local_mix_buffer;
+			draw_params.local_key			= std::move(local_key_buffer);
+			draw_params.layer_key			= layer_key_buffer;
+
+			draw_params.keyer				= keyer::additive;
+
+			kernel_.draw(std::move(draw_params));
+		}
+		else
+		{
+			draw_mixer_buffer(draw_buffer, std::move(local_mix_buffer), blend_mode::normal);
+			
+			draw_params.background			= draw_buffer;
+			draw_params.local_key			= std::move(local_key_buffer);
+			draw_params.layer_key			= layer_key_buffer;
+
+			kernel_.draw(std::move(draw_params));
+		}	
+	}
+
+	void draw_mixer_buffer(safe_ptr<cpu_buffer>&			draw_buffer, 
+						   std::shared_ptr<cpu_buffer>&&	source_buffer, 
+						   blend_mode   			        blend_mode = blend_mode::normal)
+	{
+		if(!source_buffer)
+			return;
+
+		cpu_draw_params draw_params;
+		draw_params.pix_desc.pix_fmt	= pixel_format::bgra;
+		draw_params.pix_desc.planes		= list_of(pixel_format_desc::plane(source_buffer->width(), source_buffer->height(), 4));
+		draw_params.buffers				= list_of(std::shared_ptr<host_buffer>(source_buffer->memory()));
+		draw_params.transform			= frame_transform();
+		draw_params.blend_mode			= blend_mode;
+		draw_params.background			= draw_buffer;
+
+		kernel_.draw(std::move(draw_params));
+	}
+			
+	safe_ptr<cpu_buffer> create_mixer_buffer(uint32_t stride, const video_format_desc& format_desc)
+	{
+		return make_safe<cpu_buffer>(format_desc.width, format_desc.height, stride);
+	}
+};
 		
 struct image_mixer::implementation : boost::noncopyable
 {	
-	safe_ptr<ogl_device>			ogl_;
-	image_renderer					renderer_;
-	std::vector<frame_transform>	transform_stack_;
-	std::vector<layer>				layers_; // layer/stream/items
+	std::shared_ptr<ogl_device>			ogl_;
+	std::unique_ptr<image_renderer>		renderer_;
+	std::unique_ptr<cpu_image_renderer>	cpu_renderer_;
+	std::vector<frame_transform>		transform_stack_;
+	std::vector<layer>					layers_; // layer/stream/items
 public:
 	implementation(const safe_ptr<ogl_device>& ogl) 
 		: ogl_(ogl)
-		, renderer_(ogl)
+		, renderer_(new image_renderer(ogl))
+		, transform_stack_(1)	
+	{
+	}
+
+	implementation() 
+		: cpu_renderer_(new cpu_image_renderer())
 		, transform_stack_(1)	
 	{
 	}
@@ -272,6 +561,7 @@ public:
 		item item;
 		item.pix_desc	= frame.get_pixel_format_desc();
 		item.textures	= frame.get_textures();
+		item.buffers	= frame.get_buffers();
 		item.transform	= transform_stack_.back();
 
 		layers_.back().second.push_back(item);
@@ -286,18 +576,28 @@ public:
 	{		
 	}
 	
+	int64_t readback_stall_count() const
+	{
+		return renderer_ ? renderer_->stall_count() : 0;
+	}
+
 	boost::unique_future<safe_ptr<host_buffer>> render(const video_format_desc& format_desc, bool straighten_alpha)
 	{
-		return renderer_(std::move(layers_), format_desc, straighten_alpha);
+		if(cpu_renderer_)
+			return (*cpu_renderer_)(std::move(layers_), format_desc, straighten_alpha);
+
+		return (*renderer_)(std::move(layers_), format_desc, straighten_alpha);
 	}
 };
 
 image_mixer::image_mixer(const safe_ptr<ogl_device>& ogl) : impl_(new implementation(ogl)){}
+image_mixer::image_mixer() : impl_(new implementation()){}
 void image_mixer::begin(basic_frame& frame){impl_->begin(frame);}
 void image_mixer::visit(write_frame& frame){impl_->visit(frame);}
 void image_mixer::end(){impl_->end();}
 boost::unique_future<safe_ptr<host_buffer>> image_mixer::operator()(const video_format_desc& format_desc, bool straighten_alpha){return impl_->render(format_desc, straighten_alpha);}
 void image_mixer::begin_layer(blend_mode blend_mode){impl_->begin_layer(blend_mode);}
 void image_mixer::end_layer(){impl_->end_layer();}
+int64_t image_mixer::readback_stall_count() const{return impl_->readback_stall_count();}
 
 }}
\ No newline at end of file
@@ -31,6 +31,8 @@
 
 #include <boost/thread/future.hpp>
 
+#include <cstdint>
+
 namespace caspar { namespace core {
 
 class write_frame;
@@ -43,6 +45,7 @@ class image_mixer : public core::frame_visitor, boost::noncopyable
 {
 public:
 	image_mixer(const safe_ptr<ogl_device>& ogl);
+	image_mixer(); // Software compositing, see cpu_image_kernel.
 	
 	virtual void begin(core::basic_frame& frame);
 	virtual void visit(core::write_frame& frame);
@@ -52,7 +55,9 @@ public:
 	void end_layer();
 		
 	boost::unique_future<safe_ptr<host_buffer>> operator()(
-			const video_format_desc& format_desc, bool straighten_alpha);
+			const video_format_desc& format_desc, bool straighten_alpha); // The returned host_buffer is already mapped.
+
+	int64_t readback_stall_count() const;
 		
 private:
 	struct implementation;
@@ -31,6 +31,7 @@
 
 #include <common/env.h>
 #include <common/concurrency/executor.h>
+#include <common/utility/move_on_copy.h>
 #include <common/concurrency/future_util.h>
 #include <common/exception/exceptions.h>
 #include <common/gl/gl_check.h>
@@ -64,26 +65,28 @@ namespace caspar { namespace core {
 struct mixer::implementation : boost::noncopyable
 {		
 	safe_ptr<diagnostics::graph>	graph_;
-	boost::timer					mix_timer_;
 	tbb::atomic<int64_t>			current_mix_time_;
+	int64_t							readback_stalls_;
 
 	safe_ptr<mixer::target_t>		target_;
 	mutable tbb::spin_mutex			format_desc_mutex_;
 	video_format_desc				format_desc_;
-	safe_ptr<ogl_device>			ogl_;
+	std::shared_ptr<ogl_device>		ogl_;
 	channel_layout					audio_channel_layout_;
 	bool							straighten_alpha_;
 	
 	audio_mixer	audio_mixer_;
-	image_mixer image_mixer_;
+	const audio_buffer_recycler audio_recycler_;
+	safe_ptr<image_mixer> image_mixer_;
 	
 	std::unordered_map<int, blend_mode> blend_modes_;
 			
+	executor render_executor_; // Waits for rendered frames so that the next frame can be visited while the current one renders.
 	executor executor_;
 	safe_ptr<monitor::subject>		 monitor_subject_;
 
 public:
-	implementation(const safe_ptr<diagnostics::graph>& graph, const safe_ptr<mixer::target_t>& target, const video_format_desc& format_desc, const safe_ptr<ogl_device>& ogl, const channel_layout& audio_channel_layout, const int channel_index)
+	implementation(const safe_ptr<diagnostics::graph>& graph, const safe_ptr<mixer::target_t>& target, const video_format_desc& format_desc, const std::shared_ptr<ogl_device>& ogl, const channel_layout& audio_channel_layout, const int channel_index)
 		: graph_(graph)
 		, target_(target)
 		, format_desc_(format_desc)
@@ -91,23 +94,27 @@ public:
 		, audio_channel_layout_(audio_channel_layout)
 		, straighten_alpha_(false)
 		, audio_mixer_(graph_)
-		, image_mixer_(ogl)
+		, audio_recycler_(audio_mixer_.recycler())
+		, image_mixer_(ogl ? make_safe<image_mixer>(make_safe_ptr(ogl)) : make_safe<image_mixer>())
+		, render_executor_(L"mixer[" + std::to_wstring(static_cast<uint64_t>(channel_index)) + L"] render")
 		, executor_(L"mixer[" + std::to_wstring(static_cast<uint64_t>(channel_index)) + L"]")
 		, monitor_subject_(make_safe<monitor::subject>("/mixer"))
 	{			
 		graph_->set_color("mix-time", diagnostics::color(1.0f, 0.0f, 0.9f, 0.8));
+		graph_->set_color("readback-stall", diagnostics::color(0.9f, 0.6f, 0.1f));
 		current_mix_time_ = 0;
+		readback_stalls_ = 0;
 
 		audio_mixer_.monitor_output().attach_parent(monitor_subject_);
 	}
 	
 	void send(const std::pair<std::map<int, safe_ptr<core::basic_frame>>, std::shared_ptr<void>>& packet)
 	{			
-		executor_.begin_invoke([=]
+		executor_.post([=]
 		{		
 			try
 			{
-				mix_timer_.restart();
+				boost::timer mix_timer;
 
 				auto frames = packet.first;
 				int timecode = std::numeric_limits<int>().max();
@@ -115,24 +122,44 @@ public:
 				BOOST_FOREACH(auto& frame, frames)
 				{
 					auto blend_it = blend_modes_.find(frame.first);
-					image_mixer_.begin_layer(blend_it != blend_modes_.end() ? blend_it->second : blend_mode::normal);
+					image_mixer_->begin_layer(blend_it != blend_modes_.end() ? blend_it->second : blend_mode::normal);
 													
 					frame.second->accept(audio_mixer_);					
-					frame.second->accept(image_mixer_);
+					frame.second->accept(*image_mixer_);
 					
-					image_mixer_.end_layer();
+					image_mixer_->end_layer();
 					timecode = std::min(timecode, frame.second->get_timecode());
 				}
 
-				auto image = image_mixer_(format_desc_, straighten_alpha_);
-				auto audio = audio_mixer_(format_desc_, audio_channel_layout_);
-				image.wait();
-
-				auto mix_time = mix_timer_.elapsed();
-				graph_->set_value("mix-time", mix_time*format_desc_.fps*0.5);
-				current_mix_time_ = static_cast<int64_t>(mix_time * 1000.0);
+				auto image = make_move_on_copy((*image_mixer_)(format_desc_, straighten_alpha_));
+				auto audio = make_move_on_copy(audio_mixer_(format_desc_, audio_channel_layout_));
+				auto format_desc = format_desc_;
 
-				target_->send(std::make_pair(make_safe<read_frame>(ogl_, format_desc_.size, std::move(image.get()), std::move(audio), audio_channel_layout_, timecode), packet.second));
+				// Frames from successive pipeline tokens overlap, this one renders while the next one is visited.
+				render_executor_.post([=]() mutable
+				{
+					try
+					{
+						image.value.wait();
+
+						auto mix_time = mix_timer.elapsed();
+						graph_->set_value("mix-time", mix_time*format_desc.fps*0.5);
+						current_mix_time_ = static_cast<int64_t>(mix_time * 1000.0);
+
+						auto readback_stalls = image_mixer_->readback_stall_count();
+						if(readback_stalls != readback_stalls_)
+						{
+							readback_stalls_ = readback_stalls;
+							graph_->set_tag("readback-stall");
+						}
+
+						target_->send(std::make_pair(make_safe<read_frame>(ogl_, format_desc.size, std::move(image.value.get()), std::move(audio.value), audio_channel_layout_, timecode, audio_recycler_), packet.second));
+					}
+					catch(...)
+					{
+						CASPAR_LOG_CURRENT_EXCEPTION();
+					}
+				});
 			}
 			catch(...)
 			{
@@ -146,7 +173,10 @@ public:
 			const core::pixel_format_desc& desc,
 			const channel_layout& audio_channel_layout)
 	{		
-		return make_safe<write_frame>(ogl_, tag, desc, audio_channel_layout);
+		if(!ogl_)
+			return make_safe<write_frame>(tag, desc, audio_channel_layout);
+
+		return make_safe<write_frame>(make_safe_ptr(ogl_), tag, desc, audio_channel_layout);
 	}
 
 	blend_mode::type get_blend_mode(int index)
@@ -248,6 +278,7 @@ public:
 	{
 		boost::property_tree::wptree info;
 		info.add(L"mix-time", current_mix_time_);
+		info.add(L"readback-stalls", image_mixer_->readback_stall_count());
 
 		return wrap_as_future(std::move(info));
 	}
@@ -261,7 +292,7 @@ public:
 	}
 };
 	
-mixer::mixer(const safe_ptr<diagnostics::graph>& graph, const safe_ptr<target_t>& target, const video_format_desc& format_desc, const safe_ptr<ogl_device>& ogl, const channel_layout& audio_channel_layout, int channel_index) 
+mixer::mixer(const safe_ptr<diagnostics::graph>& graph, const safe_ptr<target_t>& target, const video_format_desc& format_desc, const std::shared_ptr<ogl_device>& ogl, const channel_layout& audio_channel_layout, int channel_index) 
 	: impl_(new implementation(graph, target, format_desc, ogl, audio_channel_layout, channel_index)){}
 void mixer::send(const std::pair<std::map<int, safe_ptr<core::basic_frame>>, std::shared_ptr<void>>& frames){ impl_->send(frames);}
 core::video_format_desc mixer::get_video_format_desc() const { return impl_->get_video_format_desc(); }
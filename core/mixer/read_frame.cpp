@@ -43,7 +43,7 @@ int64_t get_current_time_millis()
 																																							
 struct read_frame::implementation : boost::noncopyable
 {
-	safe_ptr<ogl_device>		ogl_;
+	std::shared_ptr<ogl_device>	ogl_;
 	uint32_t					size_;
 	safe_ptr<host_buffer>		image_data_;
 	tbb::mutex					mutex_;
@@ -51,15 +51,17 @@ struct read_frame::implementation : boost::noncopyable
 	const channel_layout		audio_channel_layout_;
 	int64_t						created_timestamp_;
 	const int					frame_timecode_;
+	const audio_buffer_recycler	audio_recycler_;
 
 public:
 	implementation(
-			const safe_ptr<ogl_device>& ogl,
+			const std::shared_ptr<ogl_device>& ogl,
 			uint32_t size,
 			safe_ptr<host_buffer>&& image_data,
 			audio_buffer&& audio_data,
 			const channel_layout& audio_channel_layout,
-			const unsigned int frame_timecode
+			const unsigned int frame_timecode,
+			const audio_buffer_recycler& audio_recycler
 	) 
 		: ogl_(ogl)
 		, size_(size)
@@ -68,15 +70,22 @@ public:
 		, audio_channel_layout_(audio_channel_layout)
 		, created_timestamp_(get_current_time_millis())
 		, frame_timecode_(frame_timecode)
+		, audio_recycler_(audio_recycler)
 	{
 	}	
+
+	~implementation()
+	{
+		if(audio_recycler_)
+			audio_recycler_(audio_data_);
+	}
 	
 	const boost::iterator_range<const uint8_t*> image_data()
 	{
 		{
 			tbb::mutex::scoped_lock lock(mutex_);
 
-			if(!image_data_->data())
+			if(!image_data_->data() && ogl_)
 			{
 				image_data_.get()->wait(*ogl_);
 				ogl_->invoke([=]{image_data_.get()->map();}, high_priority);
@@ -95,13 +104,14 @@ public:
 };
 
 read_frame::read_frame(
-		const safe_ptr<ogl_device>& ogl,
+		const std::shared_ptr<ogl_device>& ogl,
 		uint32_t size,
 		safe_ptr<host_buffer>&& image_data,
 		audio_buffer&& audio_data,
 		const channel_layout& audio_channel_layout,
-		int frame_timecode)
-	: impl_(new implementation(ogl, size, std::move(image_data), std::move(audio_data), audio_channel_layout, frame_timecode))
+		int frame_timecode,
+		const audio_buffer_recycler& audio_recycler)
+	: impl_(new implementation(ogl, size, std::move(image_data), std::move(audio_data), audio_channel_layout, frame_timecode, audio_recycler))
 {
 }
 
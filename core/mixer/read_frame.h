@@ -43,12 +43,13 @@ class read_frame : boost::noncopyable
 public:
 	read_frame();
 	read_frame(
-			const safe_ptr<ogl_device>& ogl,
+			const std::shared_ptr<ogl_device>& ogl, // nullptr for system memory image_data.
 			uint32_t size,
 			safe_ptr<host_buffer>&& image_data,
 			audio_buffer&& audio_data,
 			const channel_layout& audio_channel_layout,
-			int frame_timecode);
+			int frame_timecode,
+			const audio_buffer_recycler& audio_recycler = audio_buffer_recycler());
 
 	virtual const boost::iterator_range<const uint8_t*> image_data();
 	virtual const boost::iterator_range<const int32_t*> audio_data();
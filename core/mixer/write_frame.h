@@ -37,6 +37,7 @@
 namespace caspar { namespace core {
 
 class device_buffer;
+class host_buffer;
 struct frame_visitor;
 struct pixel_format_desc;
 class ogl_device;	
@@ -46,6 +47,7 @@ class write_frame : public core::basic_frame, boost::noncopyable
 public:	
 	explicit write_frame(const void* tag, const channel_layout& channel_layout);
 	explicit write_frame(const safe_ptr<ogl_device>& ogl, const void* tag, const core::pixel_format_desc& desc, const channel_layout& channel_layout);
+	explicit write_frame(const void* tag, const core::pixel_format_desc& desc, const channel_layout& channel_layout); // System memory only, used by the cpu image_mixer.
 
 	write_frame(const write_frame& other);
 	write_frame(write_frame&& other);
@@ -82,6 +84,7 @@ private:
 	friend class image_mixer;
 	
 	const std::vector<safe_ptr<device_buffer>>& get_textures() const;
+	const std::vector<std::shared_ptr<host_buffer>>& get_buffers() const;
 
 	struct implementation;
 	safe_ptr<implementation> impl_;
@@ -22,6 +22,14 @@
 
 #include "monitor.h"
 
+#include <tbb/atomic.h>
+
+#include <boost/thread/mutex.hpp>
+
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
+
 namespace caspar { namespace core { namespace monitor {
 
 /*class in_callers_thread_schedule_group : public Concurrency::ScheduleGroup
@@ -54,4 +62,156 @@ Concurrency::ScheduleGroup& get_in_callers_thread_schedule_group()
 	return group;
 }*/
 
+namespace {
+
+// Bumped whenever a subject is attached or detached, invalidates all resolved addresses.
+tbb::atomic<unsigned int> g_generation;
+
+struct address_registry
+{
+	boost::mutex								mutex;
+	std::unordered_map<std::string, address>	addresses;
+	std::deque<std::string>						paths;
+} g_registry;
+
+void topology_changed()
+{
+	++g_generation;
+}
+
+}
+
+address intern(const std::string& full_path)
+{
+	boost::lock_guard<boost::mutex> lock(g_registry.mutex);
+
+	auto it = g_registry.addresses.find(full_path);
+	if(it != g_registry.addresses.end())
+		return it->second;
+
+	auto addr = static_cast<address>(g_registry.paths.size());
+	g_registry.paths.push_back(full_path);
+	g_registry.addresses.insert(std::make_pair(full_path, addr));
+
+	return addr;
+}
+
+const std::string& address_path(address addr)
+{
+	boost::lock_guard<boost::mutex> lock(g_registry.mutex);
+
+	return g_registry.paths.at(addr);
+}
+
+subject::subject(std::string path)
+	: path_(std::move(path))
+	, generation_(static_cast<unsigned int>(-1))
+{
+	CASPAR_ASSERT(path_.empty() || path_[0] == '/');
+}
+
+void subject::attach_parent(const safe_ptr<sink>& parent)
+{
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+		parent_ = parent;
+	}
+
+	topology_changed();
+}
+
+void subject::detach_parent()
+{
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+		parent_.reset();
+	}
+
+	topology_changed();
+}
+
+void subject::propagate(address addr, const message& msg)
+{
+	std::shared_ptr<sink> parent;
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+		parent = parent_.lock();
+	}
+
+	if(parent)
+		parent->propagate(addr, msg);
+}
+
+std::shared_ptr<sink> subject::resolve(std::string& path, const std::shared_ptr<sink>& self)
+{
+	std::shared_ptr<sink> parent;
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+		parent = parent_.lock();
+	}
+
+	path.insert(0, path_);
+
+	return parent ? parent->resolve(path, parent) : nullptr;
+}
+
+void subject::send(const message& msg)
+{
+	std::shared_ptr<sink> target;
+	address addr = 0;
+
+	{
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+
+		if(generation_ != g_generation)
+		{
+			unsigned int generation = g_generation;
+
+			auto parent = parent_.lock();
+			lock.release(); // The parents lock their own mutex while resolving.
+
+			std::string prefix = path_;
+			auto new_target = parent ? parent->resolve(prefix, parent) : nullptr;
+
+			lock.acquire(mutex_);
+			generation_	= generation;
+			prefix_		= std::move(prefix);
+			target_		= new_target;
+			addresses_.clear();
+		}
+
+		target = target_.lock();
+		if(!target)
+			return;
+
+		auto is_path = [&](const cached_address& cached)
+		{
+			return cached.path == msg.path();
+		};
+
+		auto it = std::find_if(addresses_.begin(), addresses_.end(), is_path);
+		if(it != addresses_.end())
+			addr = it->addr;
+		else
+		{
+			auto generation = generation_;
+			auto full_path	= prefix_ + msg.path();
+			lock.release(); // intern locks the registry and allocates.
+
+			addr = intern(full_path);
+
+			lock.acquire(mutex_);
+			if(generation_ == generation && std::find_if(addresses_.begin(), addresses_.end(), is_path) == addresses_.end())
+			{
+				cached_address cached;
+				cached.path = msg.path();
+				cached.addr = addr;
+				addresses_.push_back(cached);
+			}
+		}
+	}
+
+	target->propagate(addr, msg);
+}
+
 }}}
@@ -25,7 +25,11 @@
 
 #include <boost/variant.hpp>
 #include <boost/chrono/duration.hpp>
+#include <boost/range/iterator_range.hpp>
 
+#include <tbb/spin_mutex.h>
+
+#include <array>
 #include <cstdint>
 #include <string>
 #include <vector>
@@ -41,22 +45,24 @@ typedef boost::variant<bool,
 					   std::wstring,
 					   std::vector<std::int8_t>> data_t;
 
+// Interned full path of a message. The same path always yields the same address for the lifetime of the process.
+typedef std::uint32_t address;
+
+address intern(const std::string& full_path);
+const std::string& address_path(address addr);
+
+// Message with its first MAX_DATA arguments stored inline, constructing and sending one does not allocate unless it carries 
+// long strings or more arguments.
 class message
 {
 public:
+	static const int MAX_DATA = 8;
 
-	message(std::string path, std::vector<data_t> data = std::vector<data_t>())
+	explicit message(std::string path)
 		: path_(std::move(path))
-		, data_ptr_(std::make_shared<std::vector<data_t>>(std::move(data)))
+		, size_(0)
 	{
-		CASPAR_ASSERT(path.empty() || path[0] == '/');
-	}
-	
-	message(std::string path, safe_ptr<std::vector<data_t>> data_ptr)
-		: path_(std::move(path))
-		, data_ptr_(std::move(data_ptr))
-	{
-		CASPAR_ASSERT(path.empty() || path[0] == '/');
+		CASPAR_ASSERT(path_.empty() || path_[0] == '/');
 	}
 
 	const std::string& path() const
@@ -64,71 +70,84 @@ public:
 		return path_;
 	}
 
-	const std::vector<data_t>& data() const
+	boost::iterator_range<const data_t*> data() const
 	{
-		return *data_ptr_;
-	}
-
-	message propagate(const std::string& path) const
-	{
-		return message(path + path_, data_ptr_);
+		auto begin = overflow_.empty() ? data_.data() : overflow_.data();
+		return boost::make_iterator_range(begin, begin + size_);
 	}
 
 	template<typename T>
 	message& operator%(T&& data)
 	{
-		data_ptr_->push_back(std::forward<T>(data));
+		if(size_ < MAX_DATA)
+			data_[size_] = std::forward<T>(data);
+		else
+		{
+			if(overflow_.empty()) // Moves all arguments to the heap so that data() stays contiguous.
+				overflow_.assign(data_.begin(), data_.end());
+			overflow_.push_back(std::forward<T>(data));
+		}
+
+		++size_;
 		return *this;
 	}
 
 private:
 	std::string						path_;
-	safe_ptr<std::vector<data_t>>	data_ptr_;
+	std::array<data_t, MAX_DATA>	data_;
+	std::vector<data_t>				overflow_;
+	int								size_;
 };
 
 struct sink
 {
 	virtual ~sink() { }
 
-	virtual void propagate(const message& msg) = 0;
-};
+	// Receives a message, addr is the interned full path of the message.
+	virtual void propagate(address addr, const message& msg) = 0;
 
-class subject : public sink
-{
-private:
-	std::weak_ptr<sink> parent_;
-	const std::string path_;
-public:
-	subject(std::string path = "")
-		: path_(std::move(path))
+	// Prepends the path of this sink to path and returns the sink which finally receives the messages, nullptr if there is none.
+	virtual std::shared_ptr<sink> resolve(std::string& path, const std::shared_ptr<sink>& self)
 	{
-		CASPAR_ASSERT(path.empty() || path[0] == '/');
+		return self;
 	}
+};
 
-	void attach_parent(const safe_ptr<sink>& parent)
+// Messages are sent directly to the sink at the end of the parent chain. The full path of every message path is resolved 
+// and interned once, and resolved again only after a subject anywhere has been attached or detached.
+class subject : public sink
+{
+	struct cached_address
 	{
-		parent_ = parent;
-	}
+		std::string	path;
+		address		addr;
+	};
+
+	const std::string				path_;
+
+	tbb::spin_mutex					mutex_;
+	std::weak_ptr<sink>				parent_;
+	unsigned int					generation_;
+	std::string						prefix_;
+	std::weak_ptr<sink>				target_;
+	std::vector<cached_address>		addresses_;
+public:
+	subject(std::string path = "");
 
-	void detach_parent()
-	{
-		parent_.reset();
-	}
+	void attach_parent(const safe_ptr<sink>& parent);
+	void detach_parent();
 
 	subject& operator<<(const message& msg)
 	{
-		propagate(msg);
+		send(msg);
 
 		return *this;
 	}
 
-	virtual void propagate(const message& msg) override
-	{
-		auto parent = parent_.lock();
-
-		if (parent)
-			parent->propagate(msg.propagate(path_));
-	}
+	virtual void propagate(address addr, const message& msg) override;
+	virtual std::shared_ptr<sink> resolve(std::string& path, const std::shared_ptr<sink>& self) override;
+private:
+	void send(const message& msg);
 };
 
 }}}
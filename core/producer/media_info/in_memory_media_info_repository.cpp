@@ -24,10 +24,13 @@
 #include "in_memory_media_info_repository.h"
 
 #include <map>
+#include <set>
 #include <vector>
 
 #include <boost/thread/mutex.hpp>
 #include <boost/foreach.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string/predicate.hpp>
 
 #include "media_info.h"
 #include "media_info_repository.h"
@@ -39,6 +42,7 @@ class in_memory_media_info_repository : public media_info_repository
 	boost::mutex mutex_;
 	std::map<std::wstring, media_info> info_by_file_;
 	std::vector<media_info_extractor> extractors_;
+	std::set<std::wstring> indexed_folders_;
 public:
 	virtual void register_extractor(media_info_extractor extractor) override
 	{
@@ -61,10 +65,20 @@ public:
 			{
 				if (extractor(file, info))
 				{
+					info.recognized = true;
 					break;
 				}
 			}
 
+			try
+			{
+				info.size = boost::filesystem::file_size(boost::filesystem::wpath(file));
+				info.write_time = boost::filesystem::last_write_time(boost::filesystem::wpath(file));
+			}
+			catch (...)
+			{
+			}
+
 			info_by_file_.insert(std::make_pair(file, info));
 
 			return info;
@@ -79,6 +93,55 @@ public:
 
 		info_by_file_.erase(file);
 	}
+
+	virtual void update_all(const std::wstring& folder, const std::vector<std::wstring>& files, const std::function<bool ()>& should_abort) override
+	{
+		std::set<std::wstring> known(files.begin(), files.end());
+
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+
+			for (auto iter = info_by_file_.begin(); iter != info_by_file_.end();)
+			{
+				if (boost::istarts_with(iter->first, folder) && known.find(iter->first) == known.end())
+					iter = info_by_file_.erase(iter);
+				else
+					++iter;
+			}
+		}
+
+		BOOST_FOREACH(auto& file, files)
+		{
+			if (should_abort())
+				return;
+
+			get(file);
+		}
+
+		boost::mutex::scoped_lock lock(mutex_);
+
+		indexed_folders_.insert(folder);
+	}
+
+	virtual bool is_indexed(const std::wstring& folder) override
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+
+		BOOST_FOREACH(auto& indexed_folder, indexed_folders_)
+		{
+			if (boost::istarts_with(folder, indexed_folder))
+				return true;
+		}
+
+		return false;
+	}
+
+	virtual std::vector<std::pair<std::wstring, media_info>> get_all() override
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+
+		return std::vector<std::pair<std::wstring, media_info>>(info_by_file_.begin(), info_by_file_.end());
+	}
 };
 
 safe_ptr<struct media_info_repository> create_in_memory_media_info_repository()
@@ -22,6 +22,7 @@
 #pragma once
 
 #include <cstdint>
+#include <ctime>
 
 #include <boost/rational.hpp>
 
@@ -31,9 +32,15 @@ struct media_info
 {
 	std::int64_t duration;
 	boost::rational<std::int64_t> time_base;
+	std::uint64_t size;
+	std::time_t write_time;
+	bool recognized; // An extractor accepted the file.
 
 	media_info()
 		: duration(0)
+		, size(0)
+		, write_time(0)
+		, recognized(false)
 	{
 	}
 };
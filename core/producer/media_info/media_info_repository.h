@@ -23,6 +23,8 @@
 
 #include <string>
 #include <functional>
+#include <utility>
+#include <vector>
 
 namespace caspar { namespace core {
 
@@ -35,6 +37,24 @@ struct media_info_repository
 	virtual void register_extractor(media_info_extractor extractor) = 0;
 	virtual media_info get(const std::wstring& file) = 0;
 	virtual void remove(const std::wstring& file) = 0;
+
+	/**
+	 * Brings the repository in line with the files found in folder. New or
+	 * modified files are extracted, other files in folder are forgotten.
+	 */
+	virtual void update_all(const std::wstring& folder, const std::vector<std::wstring>& files, const std::function<bool ()>& should_abort) = 0;
+
+	/**
+	 * @return whether an update_all() of folder, or of a folder containing
+	 *         it, has run to completion. Until then get_all() may be missing
+	 *         files in folder.
+	 */
+	virtual bool is_indexed(const std::wstring& folder) = 0;
+
+	/**
+	 * @return all known files and their information, ordered by file name.
+	 */
+	virtual std::vector<std::pair<std::wstring, media_info>> get_all() = 0;
 };
 
 }}
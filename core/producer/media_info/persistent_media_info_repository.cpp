@@ -0,0 +1,388 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../../StdAfx.h"
+
+#include "persistent_media_info_repository.h"
+
+#include "media_info.h"
+#include "media_info_repository.h"
+
+#include <common/concurrency/executor.h>
+#include <common/exception/exceptions.h>
+#include <common/log/log.h>
+#include <common/utility/string.h>
+
+#include <fstream>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/algorithm/string.hpp>
+
+#include <tbb/atomic.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
+namespace caspar { namespace core {
+
+namespace {
+
+const char* const INDEX_HEADER = "casparcg-media-index 2";
+
+void stat_file(const std::wstring& file, media_info& info)
+{
+	try
+	{
+		boost::filesystem::wpath path(file);
+		info.size = boost::filesystem::file_size(path);
+		info.write_time = boost::filesystem::last_write_time(path);
+	}
+	catch (...)
+	{
+	}
+}
+
+// File names may contain the field and line separators of the index.
+std::string escape(const std::string& field)
+{
+	std::string result;
+
+	BOOST_FOREACH(auto c, field)
+	{
+		switch (c)
+		{
+		case '\\':	result += "\\\\";	break;
+		case '\t':	result += "\\t";	break;
+		case '\n':	result += "\\n";	break;
+		case '\r':	result += "\\r";	break;
+		default:	result += c;		break;
+		}
+	}
+
+	return result;
+}
+
+std::string unescape(const std::string& field)
+{
+	std::string result;
+
+	for (auto iter = field.begin(); iter != field.end(); ++iter)
+	{
+		if (*iter != '\\' || iter + 1 == field.end())
+		{
+			result += *iter;
+			continue;
+		}
+
+		switch (*++iter)
+		{
+		case 't':	result += '\t';		break;
+		case 'n':	result += '\n';		break;
+		case 'r':	result += '\r';		break;
+		default:	result += *iter;	break;
+		}
+	}
+
+	return result;
+}
+
+}
+
+class persistent_media_info_repository : public media_info_repository
+{
+	const std::wstring index_file_;
+	boost::shared_mutex mutex_;
+	std::map<std::wstring, media_info> info_by_file_;
+	std::vector<media_info_extractor> extractors_;
+	std::set<std::wstring> indexed_folders_;
+	tbb::atomic<bool> save_scheduled_;
+	executor executor_; // Writes the index. Destroyed first so that a pending write completes.
+public:
+	persistent_media_info_repository(const std::wstring& index_file)
+		: index_file_(index_file)
+		, executor_(L"persistent_media_info_repository")
+	{
+		save_scheduled_ = false;
+		load();
+	}
+
+	virtual void register_extractor(media_info_extractor extractor) override
+	{
+		boost::unique_lock<boost::shared_mutex> lock(mutex_);
+
+		extractors_.push_back(extractor);
+	}
+
+	virtual media_info get(const std::wstring& file) override
+	{
+		media_info current;
+		stat_file(file, current);
+
+		{
+			boost::shared_lock<boost::shared_mutex> lock(mutex_);
+
+			auto iter = info_by_file_.find(file);
+
+			if (iter != info_by_file_.end() && is_up_to_date(iter->second, current))
+				return iter->second;
+		}
+
+		auto info = extract(file, current);
+
+		{
+			boost::unique_lock<boost::shared_mutex> lock(mutex_);
+
+			info_by_file_[file] = info;
+		}
+
+		schedule_save();
+
+		return info;
+	}
+
+	virtual void remove(const std::wstring& file) override
+	{
+		{
+			boost::unique_lock<boost::shared_mutex> lock(mutex_);
+
+			if (info_by_file_.erase(file) == 0)
+				return;
+		}
+
+		schedule_save();
+	}
+
+	virtual void update_all(const std::wstring& folder, const std::vector<std::wstring>& files, const std::function<bool ()>& should_abort) override
+	{
+		std::set<std::wstring> known(files.begin(), files.end());
+		std::vector<std::pair<std::wstring, media_info>> current;
+		std::vector<std::pair<std::wstring, media_info>> stale;
+
+		BOOST_FOREACH(auto& file, files)
+		{
+			current.push_back(std::make_pair(file, media_info()));
+			stat_file(file, current.back().second);
+		}
+
+		{
+			boost::unique_lock<boost::shared_mutex> lock(mutex_);
+
+			for (auto iter = info_by_file_.begin(); iter != info_by_file_.end();)
+			{
+				if (boost::istarts_with(iter->first, folder) && known.find(iter->first) == known.end())
+					iter = info_by_file_.erase(iter);
+				else
+					++iter;
+			}
+
+			BOOST_FOREACH(auto& file, current)
+			{
+				auto iter = info_by_file_.find(file.first);
+
+				if (iter == info_by_file_.end() || !is_up_to_date(iter->second, file.second))
+					stale.push_back(file);
+			}
+		}
+
+		// Extraction is I/O bound and independent per file.
+		tbb::parallel_for(tbb::blocked_range<size_t>(0, stale.size(), 1), [&](const tbb::blocked_range<size_t>& range)
+		{
+			for (auto n = range.begin(); n != range.end(); ++n)
+			{
+				if (should_abort())
+					return;
+
+				auto info = extract(stale[n].first, stale[n].second);
+
+				boost::unique_lock<boost::shared_mutex> lock(mutex_);
+
+				info_by_file_[stale[n].first] = info;
+			}
+		});
+
+		schedule_save();
+
+		if (should_abort())
+			return;
+
+		{
+			boost::unique_lock<boost::shared_mutex> lock(mutex_);
+
+			indexed_folders_.insert(folder);
+		}
+
+		CASPAR_LOG(info) << L"[media_info] " << folder << L": " << files.size() << L" files, " << stale.size() << L" new or modified.";
+	}
+
+	virtual bool is_indexed(const std::wstring& folder) override
+	{
+		boost::shared_lock<boost::shared_mutex> lock(mutex_);
+
+		BOOST_FOREACH(auto& indexed_folder, indexed_folders_)
+		{
+			if (boost::istarts_with(folder, indexed_folder))
+				return true;
+		}
+
+		return false;
+	}
+
+	virtual std::vector<std::pair<std::wstring, media_info>> get_all() override
+	{
+		boost::shared_lock<boost::shared_mutex> lock(mutex_);
+
+		return std::vector<std::pair<std::wstring, media_info>>(info_by_file_.begin(), info_by_file_.end());
+	}
+private:
+	static bool is_up_to_date(const media_info& indexed, const media_info& current)
+	{
+		return indexed.size == current.size && indexed.write_time == current.write_time;
+	}
+
+	media_info extract(const std::wstring& file, const media_info& current)
+	{
+		std::vector<media_info_extractor> extractors;
+
+		{
+			boost::shared_lock<boost::shared_mutex> lock(mutex_);
+
+			extractors = extractors_;
+		}
+
+		media_info info;
+		info.size = current.size;
+		info.write_time = current.write_time;
+
+		BOOST_FOREACH(auto& extractor, extractors)
+		{
+			if (extractor(file, info))
+			{
+				info.recognized = true;
+				break;
+			}
+		}
+
+		return info;
+	}
+
+	void schedule_save()
+	{
+		if (save_scheduled_.fetch_and_store(true) || !executor_.is_running())
+			return;
+
+		executor_.post([=]
+		{
+			if (executor_.is_running())
+				boost::this_thread::sleep(boost::posix_time::seconds(1)); // Coalesces bursts of changes into one write.
+
+			save_scheduled_ = false;
+			save();
+		});
+	}
+
+	void load()
+	{
+		std::ifstream stream(index_file_.c_str());
+
+		if (!stream)
+			return;
+
+		std::string line;
+
+		if (!std::getline(stream, line) || line != INDEX_HEADER)
+		{
+			CASPAR_LOG(warning) << L"[media_info] Ignoring " << index_file_ << L", unknown format.";
+			return;
+		}
+
+		while (std::getline(stream, line))
+		{
+			std::vector<std::string> fields;
+			boost::split(fields, line, boost::is_any_of("\t"));
+
+			if (fields.size() != 7)
+				continue;
+
+			try
+			{
+				media_info info;
+				info.size = boost::lexical_cast<std::uint64_t>(fields[1]);
+				info.write_time = boost::lexical_cast<std::time_t>(fields[2]);
+				info.recognized = fields[3] == "1";
+				info.duration = boost::lexical_cast<std::int64_t>(fields[4]);
+				info.time_base = boost::rational<std::int64_t>(boost::lexical_cast<std::int64_t>(fields[5]), boost::lexical_cast<std::int64_t>(fields[6]));
+
+				info_by_file_[widen(unescape(fields[0]))] = info;
+			}
+			catch (...)
+			{
+			}
+		}
+
+		CASPAR_LOG(info) << L"[media_info] Loaded " << info_by_file_.size() << L" entries from " << index_file_ << L".";
+	}
+
+	void save()
+	{
+		auto entries = get_all();
+		auto temp_file = index_file_ + L".tmp";
+
+		{
+			std::ofstream stream(temp_file.c_str(), std::ios::out | std::ios::trunc);
+
+			stream << INDEX_HEADER << "\n";
+
+			BOOST_FOREACH(auto& entry, entries)
+			{
+				auto& info = entry.second;
+
+				if (!info.recognized) // Not persisted, so that the extractors get another chance after a restart.
+					continue;
+
+				stream	<< escape(narrow(entry.first))
+						<< "\t" << info.size
+						<< "\t" << info.write_time
+						<< "\t" << (info.recognized ? 1 : 0)
+						<< "\t" << info.duration
+						<< "\t" << info.time_base.numerator()
+						<< "\t" << info.time_base.denominator()
+						<< "\n";
+			}
+
+			if (!stream)
+				BOOST_THROW_EXCEPTION(io_error() << msg_info("Failed to write " + narrow(temp_file)));
+		}
+
+		boost::filesystem::remove(boost::filesystem::wpath(index_file_));
+		boost::filesystem::rename(boost::filesystem::wpath(temp_file), boost::filesystem::wpath(index_file_));
+	}
+};
+
+safe_ptr<struct media_info_repository> create_persistent_media_info_repository(const std::wstring& index_file)
+{
+	return make_safe<persistent_media_info_repository>(index_file);
+}
+
+}}
@@ -15,18 +15,20 @@
 *
 * You should have received a copy of the GNU General Public License
 * along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
-*
-* Author: Robert Nagy, ronag89@gmail.com
 */
 
 #pragma once
 
-struct AVCodecContext;
-struct AVCodec;
-struct AVDictionary;
+#include <string>
+
+#include <common/memory/safe_ptr.h>
+
+namespace caspar { namespace core {
 
-namespace caspar {
-	
-int tbb_avcodec_open(AVCodecContext *avctx, const AVCodec *codec, AVDictionary ** options);
+/**
+ * Creates a repository which keeps its information in index_file between runs.
+ * A file is only extracted again when its size or modification time changes.
+ */
+safe_ptr<struct media_info_repository> create_persistent_media_info_repository(const std::wstring& index_file);
 
-}
\ No newline at end of file
+}}
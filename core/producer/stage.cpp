@@ -122,7 +122,7 @@ public:
 	void spawn_token()
 	{
 		std::weak_ptr<implementation> self = shared_from_this();
-		executor_.begin_invoke([=]{tick(self);});
+		executor_.post([=]{tick(self);});
 	}
 	
 	void add_layer_consumer(void* token, int layer, const std::shared_ptr<write_frame_consumer>& layer_consumer)
@@ -206,7 +206,7 @@ public:
 			{
 				auto self2 = self.lock();
 				if(self2)				
-					self2->executor_.begin_invoke([=]{tick(self);});				
+					self2->executor_.post([=]{tick(self);});				
 			});
 
 			target_->send(std::make_pair(frames, ticket));
@@ -46,7 +46,7 @@ struct video_channel::implementation : boost::noncopyable
 	const int								index_;
 	video_format_desc						format_desc_;
 	channel_layout							audio_channel_layout_;
-	const safe_ptr<ogl_device>				ogl_;
+	const std::shared_ptr<ogl_device>		ogl_;
 	const safe_ptr<diagnostics::graph>		graph_;
 
 	const safe_ptr<caspar::core::output>	output_;
@@ -56,7 +56,7 @@ struct video_channel::implementation : boost::noncopyable
 	safe_ptr<monitor::subject>				monitor_subject_;
 	
 public:
-	implementation(video_channel& self, int index, const video_format_desc& format_desc, const safe_ptr<ogl_device>& ogl, const channel_layout& audio_channel_layout)  
+	implementation(video_channel& self, int index, const video_format_desc& format_desc, const std::shared_ptr<ogl_device>& ogl, const channel_layout& audio_channel_layout)  
 		: self_(self)
 		, index_(index)
 		, format_desc_(format_desc)
@@ -140,7 +140,7 @@ public:
 	}
 };
 
-video_channel::video_channel(int index, const video_format_desc& format_desc, const safe_ptr<ogl_device>& ogl, const channel_layout& audio_channel_layout) 
+video_channel::video_channel(int index, const video_format_desc& format_desc, const std::shared_ptr<ogl_device>& ogl, const channel_layout& audio_channel_layout) 
 	: impl_(new implementation(*this, index, format_desc, ogl, audio_channel_layout)){}
 safe_ptr<stage> video_channel::stage() { return impl_->stage_;} 
 safe_ptr<mixer> video_channel::mixer() { return impl_->mixer_;} 
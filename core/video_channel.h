@@ -47,7 +47,7 @@ public:
 
 	// Constructors
 
-	explicit video_channel(int index, const video_format_desc& format_desc, const safe_ptr<ogl_device>& ogl, const channel_layout& audio_channel_layout);
+	explicit video_channel(int index, const video_format_desc& format_desc, const std::shared_ptr<ogl_device>& ogl, const channel_layout& audio_channel_layout); // ogl == nullptr for software compositing.
 
 	// Methods
 
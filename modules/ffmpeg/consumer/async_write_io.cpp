@@ -0,0 +1,443 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../StdAfx.h"
+
+#include "async_write_io.h"
+
+#include <common/env.h>
+#include <common/concurrency/executor.h>
+#include <common/exception/exceptions.h>
+#include <common/log/log.h>
+#include <common/utility/string.h>
+
+#include <tbb/atomic.h>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(_MSC_VER)
+#pragma warning (push)
+#pragma warning (disable : 4244)
+#endif
+extern "C" 
+{
+	#include <libavformat/avio.h>
+	#include <libavutil/error.h>
+	#include <libavutil/mem.h>
+}
+#if defined(_MSC_VER)
+#pragma warning (pop)
+#endif
+
+namespace caspar { namespace ffmpeg {
+
+namespace {
+
+const int AVIO_BUFFER_SIZE	= 64 * 1024;
+const int CHUNK_SIZE		= 1024 * 1024;
+const int DIRECT_ALIGNMENT	= 4096; // Offset, size and memory alignment required for writes bypassing the os cache.
+const int LATENCY_WINDOW	= 16; // Writes weighted into the recent latency.
+
+uint8_t* allocate_aligned(size_t size)
+{
+#if defined(_WIN32)
+	auto p = _aligned_malloc(size, DIRECT_ALIGNMENT);
+#else
+	void* p = nullptr;
+	if (posix_memalign(&p, DIRECT_ALIGNMENT, size) != 0)
+		p = nullptr;
+#endif
+	if (!p)
+		throw std::bad_alloc();
+	return static_cast<uint8_t*>(p);
+}
+
+void free_aligned(uint8_t* p)
+{
+#if defined(_WIN32)
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+// Positional writes, so that the writes following a muxer seeking back to patch a header need no file pointer. 
+// Aligned chunks go through a second unbuffered handle (O_DIRECT on linux, FILE_FLAG_NO_BUFFERING on windows), the 
+// rest through the os cache.
+class output_file : boost::noncopyable
+{
+#if defined(_WIN32)
+	HANDLE	handle_;
+	HANDLE	direct_handle_;
+#else
+	int		fd_;
+	int		direct_fd_;
+#endif
+	int64_t	preallocation_;
+	int64_t	allocated_;
+public:
+	output_file(const std::string& filename, int64_t preallocation)
+		: preallocation_(preallocation)
+		, allocated_(0)
+	{
+#if defined(_WIN32)
+		handle_ = CreateFileW(widen(filename).c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (handle_ == INVALID_HANDLE_VALUE)
+			BOOST_THROW_EXCEPTION(io_error() << msg_info("Could not create file.") << boost::errinfo_file_name(filename));
+		direct_handle_ = CreateFileW(widen(filename).c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH, nullptr);
+#else
+		fd_ = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fd_ < 0)
+			BOOST_THROW_EXCEPTION(io_error() << msg_info("Could not create file.") << boost::errinfo_file_name(filename));
+#if defined(O_DIRECT)
+		direct_fd_ = ::open(filename.c_str(), O_WRONLY | O_DIRECT);
+#else
+		direct_fd_ = -1;
+#endif
+#endif
+	}
+
+	~output_file()
+	{
+#if defined(_WIN32)
+		if (direct_handle_ != INVALID_HANDLE_VALUE)
+			CloseHandle(direct_handle_);
+		CloseHandle(handle_);
+#else
+		if (direct_fd_ >= 0)
+			::close(direct_fd_);
+		::close(fd_);
+#endif
+	}
+
+	// Allocates preallocation bytes past end whenever the writes get close to the allocated space, without changing
+	// the file size, so that a long recording is laid out contiguously.
+	void reserve(int64_t end)
+	{
+		if (preallocation_ <= 0 || end <= allocated_)
+			return;
+
+		const auto allocated = end + preallocation_;
+#if defined(_WIN32)
+		FILE_ALLOCATION_INFO info;
+		info.AllocationSize.QuadPart = allocated;
+		if (!SetFileInformationByHandle(handle_, FileAllocationInfo, &info, sizeof(info)))
+			preallocation_ = 0;
+#elif defined(FALLOC_FL_KEEP_SIZE)
+		if (::fallocate(fd_, FALLOC_FL_KEEP_SIZE, allocated_, allocated - allocated_) != 0)
+			preallocation_ = 0; // Not supported by the file system.
+#else
+		preallocation_ = 0;
+#endif
+		allocated_ = allocated;
+	}
+
+	bool write(int64_t offset, const uint8_t* data, int size)
+	{
+		int total = 0;
+		while (total < size)
+		{
+#if defined(_WIN32)
+			const bool direct = direct_handle_ != INVALID_HANDLE_VALUE && total == 0 && offset % DIRECT_ALIGNMENT == 0 && size % DIRECT_ALIGNMENT == 0;
+			OVERLAPPED overlapped = {0};
+			overlapped.Offset		= static_cast<DWORD>(offset + total);
+			overlapped.OffsetHigh	= static_cast<DWORD>((offset + total) >> 32);
+			DWORD n = 0;
+			if (!WriteFile(direct ? direct_handle_ : handle_, data + total, static_cast<DWORD>(size - total), &n, &overlapped))
+			{
+				if (direct && GetLastError() == ERROR_INVALID_PARAMETER)
+				{
+					CloseHandle(direct_handle_); // Sector size larger than the alignment.
+					direct_handle_ = INVALID_HANDLE_VALUE;
+					continue;
+				}
+				return false;
+			}
+#else
+			const bool direct = direct_fd_ >= 0 && total == 0 && offset % DIRECT_ALIGNMENT == 0 && size % DIRECT_ALIGNMENT == 0;
+			auto n = ::pwrite(direct ? direct_fd_ : fd_, data + total, size - total, offset + total);
+			if (n < 0 && direct && errno == EINVAL)
+			{
+				::close(direct_fd_); // Not supported by the file system.
+				direct_fd_ = -1;
+				continue;
+			}
+			if (n < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return false;
+			}
+#endif
+			if (n == 0)
+				return false;
+			total += static_cast<int>(n);
+		}
+		return true;
+	}
+
+	// Releases the preallocated space past the end of the file.
+	void close(int64_t size)
+	{
+		if (allocated_ <= size)
+			return;
+#if defined(_WIN32)
+		FILE_ALLOCATION_INFO info;
+		info.AllocationSize.QuadPart = size;
+		SetFileInformationByHandle(handle_, FileAllocationInfo, &info, sizeof(info));
+#else
+		if (::ftruncate(fd_, size) != 0)
+			CASPAR_LOG(warning) << L"[async_write_io] Could not release preallocated space.";
+#endif
+	}
+};
+
+struct chunk
+{
+	uint8_t*	data;
+	int64_t		offset;
+	int			size;
+	int			capacity;
+};
+
+}
+
+struct async_write_io::implementation : boost::noncopyable
+{
+	const std::string				filename_;
+	output_file						file_;
+	std::vector<chunk>				chunks_;
+	std::vector<chunk*>				free_chunks_;
+	boost::mutex					mutex_;
+	boost::condition_variable		chunk_free_;
+
+	chunk*							current_;
+	int64_t							pos_;
+	int64_t							end_;
+	AVIOContext*					context_;
+
+	tbb::atomic<int>				chunks_in_flight_;
+	tbb::atomic<int64_t>			bytes_written_;
+	tbb::atomic<int64_t>			max_latency_us_;
+	tbb::atomic<int64_t>			average_latency_us_;
+	tbb::atomic<int64_t>			stall_us_;
+	tbb::atomic<bool>				failed_;
+
+	executor						writer_;
+
+	implementation(const std::string& filename, int chunk_count, int64_t preallocation)
+		: filename_(filename)
+		, file_(filename, preallocation)
+		, chunks_(chunk_count)
+		, current_(nullptr)
+		, pos_(0)
+		, end_(0)
+		, context_(nullptr)
+		, writer_(L"async_write_io " + widen(filename))
+	{
+		chunks_in_flight_	= 0;
+		bytes_written_		= 0;
+		max_latency_us_		= 0;
+		average_latency_us_	= 0;
+		stall_us_			= 0;
+		failed_				= false;
+
+		BOOST_FOREACH(auto& c, chunks_)
+		{
+			c.data = allocate_aligned(CHUNK_SIZE);
+			free_chunks_.push_back(&c);
+		}
+
+		auto buffer = static_cast<unsigned char*>(av_malloc(AVIO_BUFFER_SIZE));
+		if (!buffer)
+			throw std::bad_alloc();
+
+		context_ = avio_alloc_context(buffer, AVIO_BUFFER_SIZE, 1, this, nullptr, &implementation::write_packet, &implementation::seek);
+		if (!context_)
+		{
+			av_free(buffer);
+			throw std::bad_alloc();
+		}
+	}
+
+	~implementation()
+	{
+		avio_flush(context_);
+		if (current_)
+			submit();
+
+		writer_.invoke([]{});
+		file_.close(end_);
+
+		av_freep(&context_->buffer);
+		avio_context_free(&context_);
+
+		BOOST_FOREACH(auto& c, chunks_)
+			free_aligned(c.data);
+	}
+
+	chunk* acquire()
+	{
+		boost::unique_lock<boost::mutex> lock(mutex_);
+
+		if (free_chunks_.empty())
+		{
+			auto stall_start = boost::posix_time::microsec_clock::universal_time();
+			while (free_chunks_.empty())
+				chunk_free_.wait(lock);
+			stall_us_ += (boost::posix_time::microsec_clock::universal_time() - stall_start).total_microseconds();
+		}
+
+		auto c = free_chunks_.back();
+		free_chunks_.pop_back();
+		return c;
+	}
+
+	void submit()
+	{
+		auto c = current_;
+		current_ = nullptr;
+
+		++chunks_in_flight_;
+		writer_.post([=]
+		{
+			write_chunk(c);
+		});
+	}
+
+	void write_chunk(chunk* c)
+	{
+		if (!failed_)
+		{
+			auto start = boost::posix_time::microsec_clock::universal_time();
+
+			file_.reserve(c->offset + c->size);
+			if (file_.write(c->offset, c->data, c->size))
+				bytes_written_ += c->size;
+			else
+			{
+				failed_ = true;
+				CASPAR_LOG(error) << L"[async_write_io] Could not write to " << widen(filename_) << L".";
+			}
+
+			const auto latency = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds();
+			if (latency > max_latency_us_)
+				max_latency_us_ = latency;
+			average_latency_us_ = average_latency_us_ + (latency - average_latency_us_) / LATENCY_WINDOW; // Only written here.
+		}
+
+		boost::lock_guard<boost::mutex> lock(mutex_);
+		free_chunks_.push_back(c);
+		--chunks_in_flight_;
+		chunk_free_.notify_one();
+	}
+
+	int write(const uint8_t* buf, int size)
+	{
+		if (failed_)
+			return AVERROR(EIO);
+
+		const auto result = size;
+		while (size > 0)
+		{
+			if (current_ && (current_->offset + current_->size != pos_ || current_->size == current_->capacity))
+				submit();
+
+			if (!current_)
+			{
+				current_			= acquire();
+				current_->offset	= pos_;
+				current_->size		= 0;
+				current_->capacity	= CHUNK_SIZE - static_cast<int>(pos_ % CHUNK_SIZE); // Chunks end on aligned offsets, also after a seek.
+			}
+
+			const auto count = std::min(size, current_->capacity - current_->size);
+			std::memcpy(current_->data + current_->size, buf, count);
+			current_->size	+= count;
+			buf				+= count;
+			size			-= count;
+			pos_			+= count;
+			end_			= std::max(end_, pos_);
+		}
+		return result;
+	}
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+	static int write_packet(void* opaque, const uint8_t* buf, int size)
+#else
+	static int write_packet(void* opaque, uint8_t* buf, int size)
+#endif
+	{
+		return static_cast<implementation*>(opaque)->write(buf, size);
+	}
+
+	static int64_t seek(void* opaque, int64_t offset, int whence)
+	{
+		auto self = static_cast<implementation*>(opaque);
+
+		switch (whence & ~AVSEEK_FORCE)
+		{
+		case AVSEEK_SIZE:	return self->end_;
+		case SEEK_SET:		self->pos_ = offset;				break;
+		case SEEK_CUR:		self->pos_ += offset;				break;
+		case SEEK_END:		self->pos_ = self->end_ + offset;	break;
+		default:			return AVERROR(EINVAL);
+		}
+
+		return self->pos_;
+	}
+};
+
+async_write_io::async_write_io(const std::string& filename, int chunk_count, int64_t preallocation) : impl_(new implementation(filename, chunk_count, preallocation)){}
+async_write_io::~async_write_io(){}
+AVIOContext* async_write_io::context(){return impl_->context_;}
+int64_t async_write_io::bytes_written() const{return impl_->bytes_written_;}
+double async_write_io::write_latency() const{return static_cast<double>(impl_->average_latency_us_) / 1000000.0;}
+double async_write_io::max_write_latency() const{return static_cast<double>(impl_->max_latency_us_) / 1000000.0;}
+double async_write_io::buffer_occupancy() const{return static_cast<double>(impl_->chunks_in_flight_) / static_cast<double>(impl_->chunks_.size());}
+double async_write_io::stall_time() const{return static_cast<double>(impl_->stall_us_) / 1000000.0;}
+
+std::shared_ptr<async_write_io> async_write_io::open(const std::string& filename)
+{
+	const int		buffer_size		= env::properties().get(L"configuration.ffmpeg.write-buffer-size", 64);
+	const int64_t	preallocation	= static_cast<int64_t>(env::properties().get(L"configuration.ffmpeg.write-preallocation", 256)) * 1024 * 1024;
+
+	if (buffer_size < 1 || filename.find("://") != std::string::npos)
+		return nullptr;
+
+	const int chunk_count = std::max(2, buffer_size * 1024 * 1024 / CHUNK_SIZE);
+	return std::shared_ptr<async_write_io>(new async_write_io(filename, chunk_count, preallocation));
+}
+
+}}
@@ -0,0 +1,60 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <common/memory/safe_ptr.h>
+
+#include <boost/noncopyable.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+struct AVIOContext;
+
+namespace caspar { namespace ffmpeg {
+
+// Output AVIOContext for recordings. Muxed data is collected in an in-memory ring of large chunks 
+// (configuration.ffmpeg.write-buffer-size) which a dedicated thread writes to disk, so that a slow flush or a storage 
+// hiccup does not stall the encoders. Space is preallocated ahead of the end of the file and aligned chunks bypass 
+// the os cache where the platform supports it.
+class async_write_io : boost::noncopyable
+{
+public:
+	// Returns nullptr for urls and when the write buffer is disabled.
+	static std::shared_ptr<async_write_io> open(const std::string& filename);
+
+	~async_write_io(); // Waits for the buffered data to be written.
+
+	AVIOContext* context();
+
+	int64_t bytes_written() const;
+	double write_latency() const; // Seconds, moving average over the recent writes to disk.
+	double max_write_latency() const; // Seconds, the slowest write to disk so far.
+	double buffer_occupancy() const; // Share of the buffer waiting to be written.
+	double stall_time() const; // Seconds the muxer spent waiting for buffer space.
+private:
+	async_write_io(const std::string& filename, int chunk_count, int64_t preallocation);
+
+	struct implementation;
+	safe_ptr<implementation> impl_;
+};
+
+}}
@@ -0,0 +1,271 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../StdAfx.h"
+
+#include "bgra_to_yuv.h"
+
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+#include <emmintrin.h>
+
+#include <algorithm>
+
+#if defined(_MSC_VER)
+#pragma warning (push)
+#pragma warning (disable : 4244)
+#endif
+extern "C" 
+{
+	#include <libavutil/pixfmt.h>
+}
+#if defined(_MSC_VER)
+#pragma warning (pop)
+#endif
+
+namespace caspar { namespace ffmpeg {
+
+namespace {
+
+// Coefficients scaled by 256.
+const int Y_R =  66, Y_G = 129, Y_B =  25;
+const int U_R = -38, U_G = -74, U_B = 112;
+const int V_R = 112, V_G = -94, V_B = -18;
+
+struct target
+{
+	int		depth;
+	bool	packed;
+	bool	alpha;
+};
+
+bool get_target(int pix_fmt, target& result)
+{
+	switch (pix_fmt)
+	{
+	case AV_PIX_FMT_YUV422P:		result.depth = 8;	result.packed = false;	result.alpha = false;	return true;
+	case AV_PIX_FMT_YUVA422P:		result.depth = 8;	result.packed = false;	result.alpha = true;	return true;
+	case AV_PIX_FMT_YUV422P10LE:	result.depth = 10;	result.packed = false;	result.alpha = false;	return true;
+	case AV_PIX_FMT_YUVA422P10LE:	result.depth = 10;	result.packed = false;	result.alpha = true;	return true;
+	case AV_PIX_FMT_UYVY422:		result.depth = 8;	result.packed = true;	result.alpha = false;	return true;
+	default:						return false;
+	}
+}
+
+// Sums the neighbouring 32-bit lanes of a and b, {a0+a1, a2+a3, b0+b1, b2+b3}.
+__m128i add_pairs_epi32(__m128i a, __m128i b)
+{
+	auto even = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(2, 0, 2, 0)));
+	auto odd  = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(3, 1, 3, 1)));
+	return _mm_add_epi32(even, odd);
+}
+
+struct row_converter
+{
+	const target	target_;
+	const bool		key_;
+	const int		shift_;
+	const int		luma_offset_;
+	const int		chroma_offset_;
+
+	row_converter(const target& t, bool key)
+		: target_(t)
+		, key_(key)
+		, shift_(t.depth == 8 ? 8 : 6)
+		, luma_offset_(16 << (t.depth - 8))
+		, chroma_offset_(128 << (t.depth - 8))
+	{
+	}
+
+	// y, u and v hold 8, 4 and 4 samples, a holds 8.
+	void store(uint8_t* y_row, uint8_t* u_row, uint8_t* v_row, uint8_t* a_row, int x, __m128i y, __m128i uv, __m128i a) const
+	{
+		if (target_.depth == 8)
+		{
+			auto y8	 = _mm_packus_epi16(y, y);
+			auto uv8 = _mm_packus_epi16(uv, uv);
+			if (target_.packed)
+			{
+				auto cbcr = _mm_unpacklo_epi8(uv8, _mm_srli_si128(uv8, 4));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(y_row + x * 2), _mm_unpacklo_epi8(cbcr, y8));
+				return;
+			}
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(y_row + x), y8);
+			*reinterpret_cast<int*>(u_row + x / 2) = _mm_cvtsi128_si32(uv8);
+			*reinterpret_cast<int*>(v_row + x / 2) = _mm_cvtsi128_si32(_mm_srli_si128(uv8, 4));
+			if (a_row)
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(a_row + x), _mm_packus_epi16(a, a));
+		}
+		else
+		{
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(y_row + x * 2), y);
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(u_row + x), uv);
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(v_row + x), _mm_srli_si128(uv, 8));
+			if (a_row)
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(a_row + x * 2), _mm_or_si128(_mm_slli_epi16(a, 2), _mm_srli_epi16(a, 6)));
+		}
+	}
+
+	void store(uint8_t* y_row, uint8_t* u_row, uint8_t* v_row, uint8_t* a_row, int x, int y0, int y1, int u, int v, int a0, int a1) const
+	{
+		if (target_.depth == 8)
+		{
+			if (target_.packed)
+			{
+				auto dest = y_row + x * 2;
+				dest[0] = static_cast<uint8_t>(u);
+				dest[1] = static_cast<uint8_t>(y0);
+				dest[2] = static_cast<uint8_t>(v);
+				dest[3] = static_cast<uint8_t>(y1);
+				return;
+			}
+			y_row[x]	 = static_cast<uint8_t>(y0);
+			y_row[x + 1] = static_cast<uint8_t>(y1);
+			u_row[x / 2] = static_cast<uint8_t>(u);
+			v_row[x / 2] = static_cast<uint8_t>(v);
+			if (a_row)
+			{
+				a_row[x]	 = static_cast<uint8_t>(a0);
+				a_row[x + 1] = static_cast<uint8_t>(a1);
+			}
+		}
+		else
+		{
+			auto y16 = reinterpret_cast<uint16_t*>(y_row);
+			y16[x]	   = static_cast<uint16_t>(y0);
+			y16[x + 1] = static_cast<uint16_t>(y1);
+			reinterpret_cast<uint16_t*>(u_row)[x / 2] = static_cast<uint16_t>(u);
+			reinterpret_cast<uint16_t*>(v_row)[x / 2] = static_cast<uint16_t>(v);
+			if (a_row)
+			{
+				reinterpret_cast<uint16_t*>(a_row)[x]	  = static_cast<uint16_t>((a0 << 2) | (a0 >> 6));
+				reinterpret_cast<uint16_t*>(a_row)[x + 1] = static_cast<uint16_t>((a1 << 2) | (a1 >> 6));
+			}
+		}
+	}
+
+	// 8 pixels per iteration, pixel pairs share their averaged chroma like the swscale rgb input does.
+	void operator()(const uint8_t* source, uint8_t* y_row, uint8_t* u_row, uint8_t* v_row, uint8_t* a_row, int width) const
+	{
+		const auto zero			 = _mm_setzero_si128();
+		const auto y_coeffs		 = _mm_setr_epi16(Y_B, Y_G, Y_R, 0, Y_B, Y_G, Y_R, 0);
+		const auto u_coeffs		 = _mm_setr_epi16(U_B, U_G, U_R, 0, U_B, U_G, U_R, 0);
+		const auto v_coeffs		 = _mm_setr_epi16(V_B, V_G, V_R, 0, V_B, V_G, V_R, 0);
+		const auto luma_round	 = _mm_set1_epi32(1 << (shift_ - 1));
+		const auto chroma_round	 = _mm_set1_epi32(1 << shift_);
+		const auto luma_offset	 = _mm_set1_epi16(static_cast<short>(luma_offset_));
+		const auto chroma_offset = _mm_set1_epi16(static_cast<short>(chroma_offset_));
+		const auto luma_shift	 = _mm_cvtsi32_si128(shift_);
+		const auto chroma_shift	 = _mm_cvtsi32_si128(shift_ + 1);
+
+		int x = 0;
+		for (; x + 8 <= width; x += 8)
+		{
+			const auto p0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + x * 4));
+			const auto p1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + x * 4 + 16));
+
+			// Two pixels per register as 16-bit {b, g, r, a}.
+			__m128i px[4] = 
+			{
+				_mm_unpacklo_epi8(p0, zero), _mm_unpackhi_epi8(p0, zero),
+				_mm_unpacklo_epi8(p1, zero), _mm_unpackhi_epi8(p1, zero)
+			};
+
+			if (key_)
+			{
+				for (int n = 0; n < 4; ++n)
+					px[n] = _mm_shufflehi_epi16(_mm_shufflelo_epi16(px[n], _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+			}
+
+			auto y_lo = add_pairs_epi32(_mm_madd_epi16(px[0], y_coeffs), _mm_madd_epi16(px[1], y_coeffs));
+			auto y_hi = add_pairs_epi32(_mm_madd_epi16(px[2], y_coeffs), _mm_madd_epi16(px[3], y_coeffs));
+			y_lo = _mm_sra_epi32(_mm_add_epi32(y_lo, luma_round), luma_shift);
+			y_hi = _mm_sra_epi32(_mm_add_epi32(y_hi, luma_round), luma_shift);
+			auto y = _mm_add_epi16(_mm_packs_epi32(y_lo, y_hi), luma_offset);
+
+			// Pixel pair sums, {b, g, r, a} of two pairs per register.
+			auto pairs01 = _mm_unpacklo_epi64(_mm_add_epi16(px[0], _mm_srli_si128(px[0], 8)), _mm_add_epi16(px[1], _mm_srli_si128(px[1], 8)));
+			auto pairs23 = _mm_unpacklo_epi64(_mm_add_epi16(px[2], _mm_srli_si128(px[2], 8)), _mm_add_epi16(px[3], _mm_srli_si128(px[3], 8)));
+			auto u = add_pairs_epi32(_mm_madd_epi16(pairs01, u_coeffs), _mm_madd_epi16(pairs23, u_coeffs));
+			auto v = add_pairs_epi32(_mm_madd_epi16(pairs01, v_coeffs), _mm_madd_epi16(pairs23, v_coeffs));
+			u = _mm_sra_epi32(_mm_add_epi32(u, chroma_round), chroma_shift);
+			v = _mm_sra_epi32(_mm_add_epi32(v, chroma_round), chroma_shift);
+			auto uv = _mm_add_epi16(_mm_packs_epi32(u, v), chroma_offset);
+
+			auto a = _mm_packs_epi32(_mm_srli_epi32(p0, 24), _mm_srli_epi32(p1, 24));
+
+			store(y_row, u_row, v_row, a_row, x, y, uv, a);
+		}
+
+		for (; x < width; x += 2)
+		{
+			const auto s0 = source + x * 4;
+			const auto s1 = x + 1 < width ? s0 + 4 : s0;
+
+			int b0 = s0[0], g0 = s0[1], r0 = s0[2];
+			int b1 = s1[0], g1 = s1[1], r1 = s1[2];
+			if (key_)
+			{
+				b0 = g0 = r0 = s0[3];
+				b1 = g1 = r1 = s1[3];
+			}
+
+			const int y0 = ((Y_R * r0 + Y_G * g0 + Y_B * b0 + (1 << (shift_ - 1))) >> shift_) + luma_offset_;
+			const int y1 = ((Y_R * r1 + Y_G * g1 + Y_B * b1 + (1 << (shift_ - 1))) >> shift_) + luma_offset_;
+			const int u  = ((U_R * (r0 + r1) + U_G * (g0 + g1) + U_B * (b0 + b1) + (1 << shift_)) >> (shift_ + 1)) + chroma_offset_;
+			const int v  = ((V_R * (r0 + r1) + V_G * (g0 + g1) + V_B * (b0 + b1) + (1 << shift_)) >> (shift_ + 1)) + chroma_offset_;
+
+			store(y_row, u_row, v_row, a_row, x, y0, y1, u, v, s0[3], s1[3]);
+		}
+	}
+};
+
+}
+
+bool is_bgra_to_yuv_supported(int pix_fmt)
+{
+	target t;
+	return get_target(pix_fmt, t);
+}
+
+void bgra_to_yuv(const uint8_t* source, int source_stride, uint8_t* const dest[4], const int dest_linesize[4], int pix_fmt, int width, int height, bool key)
+{
+	target t;
+	if (!get_target(pix_fmt, t))
+		return;
+
+	const row_converter convert(t, key);
+
+	tbb::parallel_for(tbb::blocked_range<int>(0, height, 16), [&](const tbb::blocked_range<int>& r)
+	{
+		for (auto y = r.begin(); y != r.end(); ++y)
+		{
+			convert(
+				source + y * source_stride,
+				dest[0] + y * dest_linesize[0],
+				t.packed ? nullptr : dest[1] + y * dest_linesize[1],
+				t.packed ? nullptr : dest[2] + y * dest_linesize[2],
+				t.alpha ? dest[3] + y * dest_linesize[3] : nullptr,
+				width);
+		}
+	});
+}
+
+}}
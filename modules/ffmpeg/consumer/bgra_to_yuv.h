@@ -0,0 +1,34 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstdint>
+
+namespace caspar { namespace ffmpeg {
+
+// Whether bgra_to_yuv can write pix_fmt (yuv422p, yuv422p10, yuva422p, yuva422p10 and uyvy422).
+bool is_bgra_to_yuv_supported(int pix_fmt);
+
+// Converts premultiplied BGRA straight into the planes of an encoder picture with the studio range BT.601 matrix 
+// swscale uses by default, reading the source once. key writes the alpha channel as luma over neutral chroma, 
+// formats with an alpha plane get the alpha next to the fill.
+void bgra_to_yuv(const uint8_t* source, int source_stride, uint8_t* const dest[4], const int dest_linesize[4], int pix_fmt, int width, int height, bool key);
+
+}}
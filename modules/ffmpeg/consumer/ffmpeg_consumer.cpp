@@ -25,8 +25,11 @@
 #include "../ffmpeg.h"
 #include "../producer/filter/filter.h"
 #include "../producer/util/util.h"
+#include "../producer/util/av_pool.h"
 
 #include "ffmpeg_consumer.h"
+#include "async_write_io.h"
+#include "bgra_to_yuv.h"
 
 #include <core/parameters/parameters.h>
 #include <core/mixer/read_frame.h>
@@ -43,6 +46,7 @@
 
 #include <boost/algorithm/string.hpp>
 #include <boost/timer.hpp>
+#include <boost/optional.hpp>
 #include <boost/property_tree/ptree.hpp>
 #pragma warning(push)
 #pragma warning(disable: 4244)
@@ -54,9 +58,10 @@
 #include <tbb/cache_aligned_allocator.h>
 #include <tbb/parallel_invoke.h>
 
-#include <boost/range/algorithm_ext.hpp>
 #include <boost/lexical_cast.hpp>
 
+#include <algorithm>
+#include <map>
 #include <string>
 
 #define MAX_CHANNELS 63
@@ -227,6 +232,11 @@ namespace caspar {
 		typedef std::unique_ptr<SwrContext, std::function<void(SwrContext *)>> SwrContextPtr;
 		typedef std::unique_ptr<AVFormatContext, std::function<void(AVFormatContext *)>> AVFormatContextPtr;
 		typedef std::unique_ptr<AVCodecContext, std::function<void(AVCodecContext *)>> AVCodecContextPtr;
+		typedef std::vector<safe_ptr<AVPacket>> packet_list;
+		typedef std::vector<std::shared_ptr<AVFrame>> frame_list;
+
+		// Frames in flight between send and the muxer, and the queue capacity of every pipeline stage.
+		static const int					PIPELINE_DEPTH = 16;
 		
 		struct ffmpeg_consumer : boost::noncopyable
 		{
@@ -240,10 +250,12 @@ namespace caspar {
 			const safe_ptr<diagnostics::graph>		graph_;
 
 			AVFormatContextPtr						format_context_;
+			std::shared_ptr<async_write_io>			write_io_; // nullptr when writing through the default ffmpeg io.
 			AVStream *								audio_stream_;
 			AVStream *								video_stream_;
 			AVCodecContextPtr						audio_codec_ctx_;
 			AVCodecContextPtr						video_codec_ctx_;
+			std::vector<AVCodecContextPtr>			intra_codec_ctxs_; // Parallel contexts next to video_codec_ctx_ for intra-only codecs.
 			std::shared_ptr<filter>					video_filter_;
 
 			SwrContextPtr							swr_;
@@ -253,9 +265,12 @@ namespace caspar {
 			
 			std::vector<SwsContextPtr>				sws_;
 
-			byte_vector								audio_bufers_[AV_NUM_DATA_POINTERS];
+			std::shared_ptr<AVBufferPool>			audio_pool_; // Buffers for audio_frame_capacity_ samples of every channel.
+			std::shared_ptr<AVFrame>				audio_frame_; // Being filled by swr.
+			int										audio_frame_capacity_;
+			std::vector<uint8_t*>					audio_out_;
 			byte_vector								key_picture_buf_;
-			byte_vector								picture_buf_;
+			std::shared_ptr<AVBufferPool>			picture_pool_; // Zeroed once, the imx50 padding lines are never written.
 
 			tbb::atomic<int64_t>					out_frame_number_;
 			int64_t									out_audio_sample_number_;
@@ -263,11 +278,41 @@ namespace caspar {
 			const bool								key_only_;
 			bool									audio_is_planar_;
 			const bool								is_imx50_pal_;
+			bool									direct_convert_; // bgra_to_yuv writes the encoder picture, no swscale.
 			tbb::atomic<int64_t>					current_encoding_delay_;
 			boost::timer							frame_timer_;
-			boost::timer							video_timer_;
+			boost::timer							convert_timer_;
 			boost::timer							audio_timer_;
-			executor								encode_executor_;
+
+			// Mux stage state, frames are written in the order they were sent once both of their halves are encoded.
+			struct pending_frame
+			{
+				std::shared_ptr<packet_list>		video;
+				std::shared_ptr<packet_list>		audio;
+				int64_t								age_millis;
+
+				pending_frame() : age_millis(0) {}
+			};
+			std::map<int64_t, pending_frame>		pending_frames_;
+			int64_t									next_mux_frame_;
+			int64_t									next_send_frame_;
+			tbb::atomic<int>						frames_in_flight_;
+
+			executor								convert_executor_; // Colour conversion and the filter, on the executor_pool.
+			executor								video_executor_; // Video encoding.
+			executor								audio_executor_; // Audio resampling and encoding, on the executor_pool.
+			executor								mux_executor_; // Reassembly and writing.
+			std::vector<std::shared_ptr<executor>>	intra_executors_; // Encode on intra_codec_ctxs_, video_executor_ encodes on video_codec_ctx_.
+
+			struct video_encoder
+			{
+				AVCodecContext*						ctx;
+				executor*							exec;
+
+				video_encoder(AVCodecContext* ctx, executor* exec) : ctx(ctx), exec(exec) {}
+			};
+			std::vector<video_encoder>				video_encoders_; // Frames are dealt round-robin, the muxer restores their order.
+			size_t									next_video_encoder_;
 
 		public:
 			ffmpeg_consumer
@@ -277,8 +322,15 @@ namespace caspar {
 				const output_params& params,
 				bool key_only
 			)
-				: encode_executor_(print())
+				: convert_executor_(print() + L" convert", shared_pool)
+				, video_executor_(print() + L" video")
+				, audio_executor_(print() + L" audio", shared_pool)
+				, mux_executor_(print() + L" mux")
+				, next_mux_frame_(0)
+				, next_send_frame_(0)
+				, next_video_encoder_(0)
 				, out_audio_sample_number_(0)
+				, audio_frame_capacity_(0)
 				, output_params_(std::move(params))
 				, channel_format_desc_(channel_format_desc)
 				, audio_channel_layout_(audio_channel_layout)
@@ -287,6 +339,7 @@ namespace caspar {
 				, audio_stream_(nullptr)
 				, video_stream_(nullptr)
 				, is_imx50_pal_(output_params_.is_mxf_ && channel_format_desc.format == core::video_format::pal)
+				, direct_convert_(false)
 				, scale_slices_(get_scale_slice_count(channel_format_desc_))
 				, height_(channel_format_desc.format == core::video_format::ntsc ? 480 : channel_format_desc.height)
 				, scale_slice_height_(height_ / scale_slices_)
@@ -295,6 +348,7 @@ namespace caspar {
 
 				current_encoding_delay_ = 0;
 				out_frame_number_ = 0;
+				frames_in_flight_ = 0;
 
 				if (boost::filesystem::exists(output_params_.file_name_))
 					BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("File already exists: " + params.file_name_));
@@ -312,7 +366,11 @@ namespace caspar {
 				if (params.filter_.empty())
 				{
 					create_output(video_codec, audio_codec, channel_format_desc.width, channel_format_desc.height, requested_pxel_format, av_make_q(channel_format_desc.time_scale, channel_format_desc.duration), av_make_q(channel_format_desc.duration, channel_format_desc.time_scale), channel_sample_aspect_ratio_);
-					create_sws();
+					direct_convert_ = is_bgra_to_yuv_supported(video_codec_ctx_->pix_fmt)
+						&& video_codec_ctx_->width == channel_format_desc_.width && channel_format_desc_.width % 2 == 0
+						&& video_codec_ctx_->height == height_ + (is_imx50_pal_ ? 32 : 0);
+					if (!direct_convert_)
+						create_sws();
 				}
 				else
 				{
@@ -336,23 +394,39 @@ namespace caspar {
 				graph_->set_color("video-encode", diagnostics::color(0.4f, 1.0f, 0.0f));
 				graph_->set_color("audio", diagnostics::color(0.7f, 0.7f, 0.0f));
 				graph_->set_color("video-filter", diagnostics::color(0.2f, 0.8f, 1.0f));
+				graph_->set_color("convert-queue", diagnostics::color(0.3f, 0.6f, 0.9f));
+				graph_->set_color("video-queue", diagnostics::color(0.3f, 0.9f, 0.3f));
+				graph_->set_color("audio-queue", diagnostics::color(0.9f, 0.9f, 0.3f));
+				graph_->set_color("mux-queue", diagnostics::color(0.9f, 0.5f, 0.2f));
+				graph_->set_color("write-buffer", diagnostics::color(0.6f, 0.3f, 0.9f));
 				graph_->set_text(print());
 				diagnostics::register_graph(graph_);
 
-				encode_executor_.set_capacity(16);
+				convert_executor_.set_capacity(PIPELINE_DEPTH);
+				video_executor_.set_capacity(PIPELINE_DEPTH);
+				audio_executor_.set_capacity(PIPELINE_DEPTH);
+				mux_executor_.set_capacity(PIPELINE_DEPTH * 2); // Receives the video and the audio half of every frame.
 			
 				CASPAR_LOG(info) << print() << L" Successfully Initialized.";
 			}
 
 			~ffmpeg_consumer()
 			{
-				encode_executor_.begin_invoke([this] {
+				// Drains the stages front to back, every stage has handed its last frame on once its queue is empty.
+				convert_executor_.invoke([]{});
+				BOOST_FOREACH(auto& encoder, video_encoders_)
+					encoder.exec->invoke([]{});
+				audio_executor_.invoke([]{});
+				mux_executor_.invoke([this] 
+				{
+					packet_list packets;
 					if (video_filter_)
 					{
 						auto frames = video_filter_->poll_all();
 						for (auto frame = frames.begin(); frame != frames.end(); frame++)
-							encode_video((*frame).get());
+							encode_video(video_codec_ctx_.get(), (*frame).get(), packets);
 					}
+					write_packets(packets, true);
 					if ((video_codec_ctx_ && (video_codec_ctx_->codec->capabilities & AV_CODEC_CAP_DELAY))
 						|| (audio_codec_ctx_ && (audio_codec_ctx_->codec->capabilities & AV_CODEC_CAP_DELAY)))
 						flush_encoders();
@@ -369,6 +443,20 @@ namespace caspar {
 				return L"ffmpeg_consumer URL:" + widen(output_params_.file_name_) + L" Frame:" + boost::lexical_cast<std::wstring>(out_frame_number_);
 			}
 
+			boost::optional<boost::property_tree::wptree> write_info() const
+			{
+				if (!write_io_)
+					return boost::none;
+
+				boost::property_tree::wptree info;
+				info.add(L"bytes", write_io_->bytes_written());
+				info.add(L"latency", write_io_->write_latency());
+				info.add(L"max-latency", write_io_->max_write_latency());
+				info.add(L"buffer", write_io_->buffer_occupancy());
+				info.add(L"stall-time", write_io_->stall_time());
+				return info;
+			}
+
 			void create_output(const AVCodec* video_codec, const AVCodec * audio_codec, const int width, const int height, const AVPixelFormat pix_fmt, const AVRational frame_rate, const AVRational time_base, const AVRational sample_aspect_ratio)
 			{
 				try
@@ -388,9 +476,18 @@ namespace caspar {
 					if (!format)
 						BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("Could not guess output format."));
 
-					format_context_ = AVFormatContextPtr(alloc_output_params_context(output_params_.file_name_, format), [this](AVFormatContext * ctx)
+					// The faststart pass of the mov muxer reads the file back while writing the trailer.
+					auto movflags = av_dict_get(options_, "movflags", NULL, 0);
+					const bool faststart = movflags && std::string(movflags->value).find("faststart") != std::string::npos;
+					if (!(format->flags & AVFMT_NOFILE) && !output_params_.is_stream_ && !faststart)
+						write_io_ = async_write_io::open(output_params_.file_name_);
+
+					auto write_io = write_io_;
+					format_context_ = AVFormatContextPtr(alloc_output_params_context(output_params_.file_name_, format), [this, write_io](AVFormatContext * ctx)
 					{
-						if (!(ctx->oformat->flags & AVFMT_NOFILE))
+						if (write_io)
+							avio_flush(ctx->pb);
+						else if (!(ctx->oformat->flags & AVFMT_NOFILE))
 							LOG_ON_ERROR2(avio_close(ctx->pb), print());
 						avformat_free_context(ctx);
 					});
@@ -409,7 +506,12 @@ namespace caspar {
 
 					av_dump_format(format_context_.get(), 0, output_params_.file_name_.c_str(), 1);
 
-					if (!(format_context_->oformat->flags & AVFMT_NOFILE))
+					if (write_io_)
+					{
+						format_context_->pb = write_io_->context();
+						format_context_->flags |= AVFMT_FLAG_CUSTOM_IO;
+					}
+					else if (!(format_context_->oformat->flags & AVFMT_NOFILE))
 						THROW_ON_ERROR2(avio_open2(&format_context_->pb, output_params_.file_name_.c_str(), AVIO_FLAG_WRITE, NULL, &options_), print());
 
 					THROW_ON_ERROR2(avformat_write_header(format_context_.get(), &options_), print());
@@ -428,6 +530,7 @@ namespace caspar {
 				catch (...)
 				{
 					format_context_.reset();
+					write_io_.reset();
 					boost::filesystem2::remove(output_params_.file_name_); // Delete the file if exists and consumer not fully initialized
 					throw;
 				}
@@ -454,106 +557,177 @@ namespace caspar {
 					BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("Cannot initialize the conversion context"));
 			}
 
-			void add_video_stream(const AVCodec * encoder, const AVOutputFormat * format, const int width, const int height, const AVPixelFormat pix_fmt, const AVRational frame_rate, const AVRational time_base, const AVRational sample_aspect_ratio)
+			// Frames of codecs which keep no state between them can be spread over independent contexts 
+			// (configuration.ffmpeg.intra-encoder-contexts, 0 for one per core up to 8, 1 disables). I-frame only MPEG-2 (IMX) 
+			// is not one of them, its rate control and GOP counters live in the context.
+			int get_intra_encoder_count(const AVCodecContext* ctx) const
 			{
-				if (!encoder)
-					BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("Codec not found."));
+				switch (ctx->codec_id)
+				{
+				case AV_CODEC_ID_PRORES:
+				case AV_CODEC_ID_DNXHD:
+				case AV_CODEC_ID_DVVIDEO:
+				case AV_CODEC_ID_MJPEG:
+					break;
+				default:
+					return 1;
+				}
 
-				video_codec_ctx_ = AVCodecContextPtr(avcodec_alloc_context3(encoder), [](AVCodecContext * ctx) { avcodec_free_context(&ctx); });
+				if (ctx->codec->capabilities & AV_CODEC_CAP_DELAY)
+					return 1;
 
-				video_codec_ctx_->opaque = format_context_->url;
-				video_codec_ctx_->codec_id = encoder->id;
-				video_codec_ctx_->codec_type = AVMEDIA_TYPE_VIDEO;
-				video_codec_ctx_->width = width;
-				video_codec_ctx_->height = height;
-				video_codec_ctx_->time_base = time_base;
-				video_codec_ctx_->framerate = frame_rate;
-				video_codec_ctx_->flags = 0;
-				video_codec_ctx_->thread_count = std::min(tbb::tbb_thread::hardware_concurrency(), 8u); // limits memory usage in 32-bit process
+				int count = env::properties().get(L"configuration.ffmpeg.intra-encoder-contexts", 0);
+				if (count < 1)
+					count = std::min(tbb::tbb_thread::hardware_concurrency(), 8u);
+				return std::max(1, count);
+			}
+
+			void configure_video_codec(AVCodecContext* ctx, const AVCodec * encoder, const AVOutputFormat * format, const int width, const int height, const AVPixelFormat pix_fmt, const AVRational frame_rate, const AVRational time_base, const AVRational sample_aspect_ratio)
+			{
+				ctx->opaque = format_context_->url;
+				ctx->codec_id = encoder->id;
+				ctx->codec_type = AVMEDIA_TYPE_VIDEO;
+				ctx->width = width;
+				ctx->height = height;
+				ctx->time_base = time_base;
+				ctx->framerate = frame_rate;
+				ctx->flags = 0;
+				ctx->thread_count = std::min(tbb::tbb_thread::hardware_concurrency(), 8u); // limits memory usage in 32-bit process
 
 				if (channel_format_desc_.format == core::video_format::ntsc && height == 486)
-					video_codec_ctx_->height = 480;
+					ctx->height = 480;
 
 				if (!video_filter_ && channel_format_desc_.field_mode != core::field_mode::progressive)
-					video_codec_ctx_->flags |= (AV_CODEC_FLAG_INTERLACED_ME | AV_CODEC_FLAG_INTERLACED_DCT);
+					ctx->flags |= (AV_CODEC_FLAG_INTERLACED_ME | AV_CODEC_FLAG_INTERLACED_DCT);
 
-				if (video_codec_ctx_->codec_id == AV_CODEC_ID_PRORES)
+				if (ctx->codec_id == AV_CODEC_ID_PRORES)
 				{
-					video_codec_ctx_->bit_rate = video_codec_ctx_->width < 1280 ? 63 * 1000000 : 220 * 1000000;
-					video_codec_ctx_->pix_fmt = AV_PIX_FMT_YUV422P10;
+					ctx->bit_rate = ctx->width < 1280 ? 63 * 1000000 : 220 * 1000000;
+					ctx->pix_fmt = AV_PIX_FMT_YUV422P10;
 				}
-				else if (video_codec_ctx_->codec_id == AV_CODEC_ID_DNXHD)
+				else if (ctx->codec_id == AV_CODEC_ID_DNXHD)
 				{
-					if (video_codec_ctx_->width < 1280 || video_codec_ctx_->height < 720)
+					if (ctx->width < 1280 || ctx->height < 720)
 						BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("Unsupported video dimensions."));
-					video_codec_ctx_->bit_rate = 220 * 1000000;
-					video_codec_ctx_->pix_fmt = AV_PIX_FMT_YUV422P;
+					ctx->bit_rate = 220 * 1000000;
+					ctx->pix_fmt = AV_PIX_FMT_YUV422P;
 				}
-				else if (video_codec_ctx_->codec_id == AV_CODEC_ID_DVVIDEO)
+				else if (ctx->codec_id == AV_CODEC_ID_DVVIDEO)
 				{
-					video_codec_ctx_->width = video_codec_ctx_->height == 1280 ? 960 : video_codec_ctx_->width;
+					ctx->width = ctx->height == 1280 ? 960 : ctx->width;
 					if (!video_filter_ && pix_fmt == AV_PIX_FMT_NONE)
 					{
 						if (channel_format_desc_.format == core::video_format::ntsc)
-							video_codec_ctx_->pix_fmt = AV_PIX_FMT_YUV411P;
+							ctx->pix_fmt = AV_PIX_FMT_YUV411P;
 						else if (channel_format_desc_.format == core::video_format::pal)
-							video_codec_ctx_->pix_fmt = AV_PIX_FMT_YUV420P;
+							ctx->pix_fmt = AV_PIX_FMT_YUV420P;
 						else // dv50
-							video_codec_ctx_->pix_fmt = AV_PIX_FMT_YUV422P;
+							ctx->pix_fmt = AV_PIX_FMT_YUV422P;
 					}
 					if (channel_format_desc_.duration == 1001)
-						video_codec_ctx_->width = video_codec_ctx_->height == 1080 ? 1280 : video_codec_ctx_->width;
+						ctx->width = ctx->height == 1080 ? 1280 : ctx->width;
 					else
-						video_codec_ctx_->width = video_codec_ctx_->height == 1080 ? 1440 : video_codec_ctx_->width;
+						ctx->width = ctx->height == 1080 ? 1440 : ctx->width;
 				}
-				else if (video_codec_ctx_->codec_id == AV_CODEC_ID_H264)
+				else if (ctx->codec_id == AV_CODEC_ID_H264)
 				{
-					video_codec_ctx_->bit_rate = (video_filter_ ? video_filter_->out_height() : height_) * 14 * 1000; // about 8Mbps for SD, 14 for HD
-					video_codec_ctx_->gop_size = 30;
-					video_codec_ctx_->max_b_frames = 2;
-					if (strcmp(video_codec_ctx_->codec->name, "libx264") == 0)
+					ctx->bit_rate = (video_filter_ ? video_filter_->out_height() : height_) * 14 * 1000; // about 8Mbps for SD, 14 for HD
+					ctx->gop_size = 30;
+					ctx->max_b_frames = 2;
+					if (strcmp(ctx->codec->name, "libx264") == 0)
 					{
 						LOG_ON_ERROR2(av_dict_set(&options_, "preset", "veryfast", AV_DICT_DONT_OVERWRITE), print());
 					}
 				}
-				else if (video_codec_ctx_->codec_id == AV_CODEC_ID_QTRLE)
+				else if (ctx->codec_id == AV_CODEC_ID_QTRLE)
 				{
-					video_codec_ctx_->pix_fmt = AV_PIX_FMT_ARGB;
+					ctx->pix_fmt = AV_PIX_FMT_ARGB;
 				}
-				else if (video_codec_ctx_->codec_id == AV_CODEC_ID_MPEG2VIDEO)
+				else if (ctx->codec_id == AV_CODEC_ID_MPEG2VIDEO)
 				{
 					if (output_params_.is_mxf_)
 					{
-						video_codec_ctx_->pix_fmt = AV_PIX_FMT_YUV422P;
-						video_codec_ctx_->bit_rate = 50 * 1000000;
+						ctx->pix_fmt = AV_PIX_FMT_YUV422P;
+						ctx->bit_rate = 50 * 1000000;
 						if (!video_filter_ && channel_format_desc_.format == core::video_format::pal)
 						{
 							// IMX50 encoding parameters
-							video_codec_ctx_->bit_rate = 50 * 1000000;
-							video_codec_ctx_->height = 608;
-							video_codec_ctx_->codec_tag = strtol("mx5p", NULL, 0);
-							video_codec_ctx_->rc_min_rate = video_codec_ctx_->bit_rate;
-							video_codec_ctx_->rc_max_rate = video_codec_ctx_->bit_rate;
-							video_codec_ctx_->rc_buffer_size = 2000000;
-							video_codec_ctx_->rc_initial_buffer_occupancy = 2000000;
-							video_codec_ctx_->gop_size = 1;
-							video_codec_ctx_->field_order = AV_FIELD_TT;
-							video_codec_ctx_->qmin = 1;
-							video_codec_ctx_->qmax = 3;
-							video_codec_ctx_->flags |= (AV_CODEC_FLAG_INTERLACED_DCT | AV_CODEC_FLAG_LOW_DELAY);
+							ctx->bit_rate = 50 * 1000000;
+							ctx->height = 608;
+							ctx->codec_tag = strtol("mx5p", NULL, 0);
+							ctx->rc_min_rate = ctx->bit_rate;
+							ctx->rc_max_rate = ctx->bit_rate;
+							ctx->rc_buffer_size = 2000000;
+							ctx->rc_initial_buffer_occupancy = 2000000;
+							ctx->gop_size = 1;
+							ctx->field_order = AV_FIELD_TT;
+							ctx->qmin = 1;
+							ctx->qmax = 3;
+							ctx->flags |= (AV_CODEC_FLAG_INTERLACED_DCT | AV_CODEC_FLAG_LOW_DELAY);
 						}
 					}
 				}
 
 				if (output_params_.video_bitrate_)
-					video_codec_ctx_->bit_rate = output_params_.video_bitrate_ * 1000;
+					ctx->bit_rate = output_params_.video_bitrate_ * 1000;
 
 				if (format->flags & AVFMT_GLOBALHEADER)
-					video_codec_ctx_->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-				video_codec_ctx_->sample_aspect_ratio = sample_aspect_ratio;
-				if (video_codec_ctx_->pix_fmt == AV_PIX_FMT_NONE)
-					video_codec_ctx_->pix_fmt = pix_fmt == AV_PIX_FMT_NONE ? AV_PIX_FMT_YUV420P : pix_fmt;
+					ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+				ctx->sample_aspect_ratio = sample_aspect_ratio;
+				if (ctx->pix_fmt == AV_PIX_FMT_NONE)
+					ctx->pix_fmt = pix_fmt == AV_PIX_FMT_NONE ? AV_PIX_FMT_YUV420P : pix_fmt;
+			}
+
+			void add_video_stream(const AVCodec * encoder, const AVOutputFormat * format, const int width, const int height, const AVPixelFormat pix_fmt, const AVRational frame_rate, const AVRational time_base, const AVRational sample_aspect_ratio)
+			{
+				if (!encoder)
+					BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("Codec not found."));
+
+				video_codec_ctx_ = AVCodecContextPtr(avcodec_alloc_context3(encoder), [](AVCodecContext * ctx) { avcodec_free_context(&ctx); });
+
+				configure_video_codec(video_codec_ctx_.get(), encoder, format, width, height, pix_fmt, frame_rate, time_base, sample_aspect_ratio);
+
+				const int encoder_count = get_intra_encoder_count(video_codec_ctx_.get());
+				AVDictionary* intra_options = nullptr;
+				if (encoder_count > 1)
+				{
+					video_codec_ctx_->thread_count = 1; // The contexts run in parallel instead.
+					av_dict_copy(&intra_options, options_, 0);
+				}
+
 				THROW_ON_ERROR2(avcodec_open2(video_codec_ctx_.get(), encoder, &options_), print()); // we use as many threads as defined in options - default is 4
+
+				video_encoders_.push_back(video_encoder(video_codec_ctx_.get(), &video_executor_));
+				for (int n = 1; n < encoder_count; ++n)
+				{
+					try
+					{
+						AVCodecContextPtr ctx(avcodec_alloc_context3(encoder), [](AVCodecContext * ctx) { avcodec_free_context(&ctx); });
+						configure_video_codec(ctx.get(), encoder, format, width, height, pix_fmt, frame_rate, time_base, sample_aspect_ratio);
+						ctx->thread_count = 1;
+						AVDictionary* options = nullptr;
+						av_dict_copy(&options, intra_options, 0);
+						int ret = avcodec_open2(ctx.get(), encoder, &options);
+						av_dict_free(&options);
+						THROW_ON_ERROR2(ret, print());
+
+						auto exec = std::make_shared<executor>(print() + L" video " + boost::lexical_cast<std::wstring>(n));
+						exec->set_capacity(PIPELINE_DEPTH);
+						video_encoders_.push_back(video_encoder(ctx.get(), exec.get()));
+						intra_codec_ctxs_.push_back(std::move(ctx));
+						intra_executors_.push_back(exec);
+					}
+					catch (...)
+					{
+						CASPAR_LOG_CURRENT_EXCEPTION();
+						CASPAR_LOG(warning) << print() << L" Could not open more than " << video_encoders_.size() << L" parallel video encoders.";
+						break;
+					}
+				}
+				av_dict_free(&intra_options);
+
+				if (video_encoders_.size() > 1)
+					CASPAR_LOG(info) << print() << L" Encoding intra-only video on " << video_encoders_.size() << L" parallel codec contexts.";
 				video_stream_ = avformat_new_stream(format_context_.get(), NULL);
 				if (!video_stream_)
 					BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("Could not allocate video-stream.") << boost::errinfo_api_function("avformat_new_stream"));
@@ -566,7 +740,7 @@ namespace caspar {
 				video_stream_->time_base = time_base;
 				video_stream_->avg_frame_rate = frame_rate;
 				int size = av_image_get_buffer_size(video_codec_ctx_->pix_fmt, video_codec_ctx_->width, video_codec_ctx_->height, 1);
-				picture_buf_.resize(size);
+				picture_pool_.reset(av_buffer_pool_init(size, av_buffer_allocz), [](AVBufferPool* pool) { av_buffer_pool_uninit(&pool); });
 			}
 
 			void add_audio_stream(const AVCodec *encoder, const AVOutputFormat *format)
@@ -631,6 +805,34 @@ namespace caspar {
 			}
 
 			std::shared_ptr<AVFrame> fast_convert_video(const safe_ptr<core::read_frame>& frame)
+			{
+				auto out_frame = create_frame();
+				out_frame->buf[0] = av_buffer_pool_get(picture_pool_.get());
+				if (!out_frame->buf[0])
+					throw std::bad_alloc();
+
+				THROW_ON_ERROR2(av_image_fill_arrays(out_frame->data, out_frame->linesize, out_frame->buf[0]->data, video_codec_ctx_->pix_fmt, video_codec_ctx_->width, video_codec_ctx_->height, 1), print());
+
+				if (direct_convert_)
+				{
+					const int offset = is_imx50_pal_ ? 32 : 0;
+					uint8_t* out_data[4];
+					for (int i = 0; i < 4; i++)
+						out_data[i] = out_frame->data[i] == NULL ? NULL : out_frame->data[i] + offset * out_frame->linesize[i];
+					bgra_to_yuv(frame->image_data().begin(), channel_format_desc_.width * 4, out_data, out_frame->linesize, video_codec_ctx_->pix_fmt, channel_format_desc_.width, height_, key_only_);
+				}
+				else
+					sws_convert_video(frame, out_frame.get());
+
+				out_frame->height = video_codec_ctx_->height;
+				out_frame->width = video_codec_ctx_->width;
+				out_frame->format = video_codec_ctx_->pix_fmt;
+				out_frame->flags = field_mode2_avframe_flags(channel_format_desc_.field_mode);
+				out_frame->pts = out_frame_number_++;
+				return out_frame;
+			}
+
+			void sws_convert_video(const safe_ptr<core::read_frame>& frame, AVFrame* out_frame)
 			{
 				AVFrame in_frame = { 0 };
 				if (key_only_)
@@ -645,10 +847,6 @@ namespace caspar {
 					THROW_ON_ERROR2(av_image_fill_arrays(in_frame.data, in_frame.linesize, const_cast<uint8_t*>(frame->image_data().begin()), AV_PIX_FMT_BGRA, channel_format_desc_.width, channel_format_desc_.height, 1), print());
 				}
 
-				std::shared_ptr<AVFrame> out_frame(av_frame_alloc(), [](AVFrame* frame) { av_frame_free(&frame); });
-
-				THROW_ON_ERROR2(av_image_fill_arrays(out_frame->data, out_frame->linesize, picture_buf_.data(), video_codec_ctx_->pix_fmt, video_codec_ctx_->width, video_codec_ctx_->height, 1), print());
-
 				tbb::parallel_for(0u, scale_slices_, [&](const size_t& sws_index) 
 				{
 					if (channel_format_desc_.field_mode == caspar::core::field_mode::progressive)
@@ -691,17 +889,11 @@ namespace caspar {
 						sws_scale(sws_.at(sws_index).get(), in_data_lower, in_stride, 0, scale_slice_height_  / 2, out_data_lower, out_stride);
 					}
 				});
-				out_frame->height = video_codec_ctx_->height;
-				out_frame->width = video_codec_ctx_->width;
-				out_frame->format = video_codec_ctx_->pix_fmt;
-				out_frame->flags = field_mode2_avframe_flags(channel_format_desc_.field_mode);
-				out_frame->pts = out_frame_number_++;
-				return out_frame;
 			}
 
 			void send_frame_to_filter(const safe_ptr<core::read_frame>& read_frame)
 			{
-				std::shared_ptr<AVFrame> av_frame(av_frame_alloc(), [](AVFrame* frame) { av_frame_free(&frame); });
+				auto av_frame = create_frame();
 				av_frame->width = channel_format_desc_.width;
 				av_frame->height = height_;
 				av_frame->format = AV_PIX_FMT_BGRA;
@@ -722,42 +914,49 @@ namespace caspar {
 				video_filter_->push(av_frame);
 			}
 
-			void encode_video(AVFrame* frame)
+			void encode_video(AVCodecContext* ctx, AVFrame* frame, packet_list& packets)
 			{
-				video_timer_.restart();
-				THROW_ON_ERROR2(avcodec_send_frame(video_codec_ctx_.get(), frame), print());
-				AVPacket pkt = { 0 };
-				while (avcodec_receive_packet(video_codec_ctx_.get(), &pkt) == 0)
+				THROW_ON_ERROR2(avcodec_send_frame(ctx, frame), print());
+				while (true)
 				{
-					av_packet_rescale_ts(&pkt, video_codec_ctx_->time_base, video_stream_->time_base);
-					pkt.stream_index = video_stream_->index;
-					THROW_ON_ERROR2(av_packet_make_refcounted(&pkt), print());
-					THROW_ON_ERROR2(av_interleaved_write_frame(format_context_.get(), &pkt), print());
+					auto pkt = create_packet();
+					if (avcodec_receive_packet(ctx, pkt.get()) != 0)
+						break;
+					av_packet_rescale_ts(pkt.get(), ctx->time_base, video_stream_->time_base);
+					pkt->stream_index = video_stream_->index;
+					THROW_ON_ERROR2(av_packet_make_refcounted(pkt.get()), print());
+					packets.push_back(pkt);
 				}
-				graph_->set_value("video-encode", video_timer_.elapsed() * channel_format_desc_.fps);
 			}
 
-			void process_video_frame(const safe_ptr<core::read_frame>& frame)
+			// Convert stage.
+			frame_list convert_video(const safe_ptr<core::read_frame>& frame)
 			{
-				video_timer_.restart();
+				frame_list frames;
+				convert_timer_.restart();
 				if (video_filter_) //filtered path (slow one)
 				{
-
 					send_frame_to_filter(frame);
-					std::shared_ptr<AVFrame> converted = video_filter_->poll();
-					graph_->set_value("video-filter", video_timer_.elapsed() * channel_format_desc_.fps);
-					while (converted)
-					{
-						encode_video(converted.get());
-						converted = video_filter_->poll();
-					};
+					for (auto converted = video_filter_->poll(); converted; converted = video_filter_->poll())
+						frames.push_back(converted);
 				}
 				else // fast, multithreaded conversion
 				{
-					auto av_frame = fast_convert_video(frame);
-					graph_->set_value("video-filter", video_timer_.elapsed() * channel_format_desc_.fps);
-					encode_video(av_frame.get());
+					frames.push_back(fast_convert_video(frame));
 				}
+				graph_->set_value("video-filter", convert_timer_.elapsed() * channel_format_desc_.fps);
+				return frames;
+			}
+
+			// Video stage.
+			std::shared_ptr<packet_list> encode_video_frames(AVCodecContext* ctx, const frame_list& frames)
+			{
+				auto packets = std::make_shared<packet_list>();
+				boost::timer timer;
+				BOOST_FOREACH(auto& frame, frames)
+					encode_video(ctx, frame.get(), *packets);
+				graph_->set_value("video-encode", timer.elapsed() * channel_format_desc_.fps / video_encoders_.size());
+				return packets;
 			}
 
 			void create_swr()
@@ -775,111 +974,283 @@ namespace caspar {
 				if (output_params_.channel_map_.size() > 0 && output_params_.channel_map_.size() <= MAX_CHANNELS)
 					THROW_ON_ERROR2(swr_set_channel_mapping(swr_.get(), output_params_.channel_map_.data()), print());
 				THROW_ON_ERROR2(swr_init(swr_.get()), print());
+
+				// Codecs without a fixed frame size get the audio of a video frame in one frame.
+				const auto max_cadence = *std::max_element(channel_format_desc_.audio_cadence.begin(), channel_format_desc_.audio_cadence.end());
+				audio_frame_capacity_ = audio_codec_ctx_->frame_size > 0
+					? audio_codec_ctx_->frame_size
+					: static_cast<int>(av_rescale_rnd(max_cadence, audio_codec_ctx_->sample_rate, channel_format_desc_.audio_sample_rate, AV_ROUND_UP));
+				const int size = av_samples_get_buffer_size(NULL, audio_codec_ctx_->ch_layout.nb_channels, audio_frame_capacity_, audio_codec_ctx_->sample_fmt, 0);
+				THROW_ON_ERROR2(size, print());
+				audio_pool_.reset(av_buffer_pool_init(size, nullptr), [](AVBufferPool* pool) { av_buffer_pool_uninit(&pool); });
+				audio_out_.resize(audio_is_planar_ ? audio_codec_ctx_->ch_layout.nb_channels : 1);
+			}
+
+			std::shared_ptr<AVFrame> create_audio_frame()
+			{
+				const int channels = audio_codec_ctx_->ch_layout.nb_channels;
+
+				auto frame = create_frame();
+				frame->buf[0] = av_buffer_pool_get(audio_pool_.get());
+				if (!frame->buf[0])
+					throw std::bad_alloc();
+
+				if (audio_is_planar_ && channels > AV_NUM_DATA_POINTERS)
+				{
+					frame->extended_data = static_cast<uint8_t**>(av_calloc(channels, sizeof(uint8_t*))); // Freed by av_frame_unref.
+					if (!frame->extended_data)
+						throw std::bad_alloc();
+				}
+
+				THROW_ON_ERROR2(av_samples_fill_arrays(frame->extended_data, frame->linesize, frame->buf[0]->data, channels, audio_frame_capacity_, audio_codec_ctx_->sample_fmt, 0), print());
+				if (frame->extended_data != frame->data)
+					std::copy(frame->extended_data, frame->extended_data + AV_NUM_DATA_POINTERS, frame->data);
+
+				frame->format		= audio_codec_ctx_->sample_fmt;
+				frame->sample_rate	= audio_codec_ctx_->sample_rate;
+				frame->nb_samples	= 0;
+				THROW_ON_ERROR2(av_channel_layout_copy(&frame->ch_layout, &audio_codec_ctx_->ch_layout), print());
+				return frame;
 			}
 
-			void resample_audio(const safe_ptr<core::read_frame>& frame)
+			// swr converts straight into the pooled frame being filled, and keeps what does not fit until the next call. 
+			// Full frames are appended to frames.
+			void resample_audio(const safe_ptr<core::read_frame>& frame, frame_list& frames)
 			{
 				if (frame->num_channels() != audio_channel_layout_.num_channels)
 					BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("Frame with invalid number of channels received"));
-				byte_vector out_buffers[AV_NUM_DATA_POINTERS];
-				const int in_samples_count = frame->audio_data().size() / frame->num_channels();
-				const int out_samples_count = static_cast<int>(av_rescale_rnd(in_samples_count, audio_codec_ctx_->sample_rate, channel_format_desc_.audio_sample_rate, AV_ROUND_UP));
-				if (audio_is_planar_)
-					for (char i = 0; i < audio_codec_ctx_->ch_layout.nb_channels; i++)
-						out_buffers[i].resize(out_samples_count * av_get_bytes_per_sample(audio_codec_ctx_->sample_fmt));
-				else
-					out_buffers[0].resize(out_samples_count * av_get_bytes_per_sample(audio_codec_ctx_->sample_fmt) *audio_codec_ctx_->ch_layout.nb_channels);
 
+				const int bytes_per_sample = av_get_bytes_per_sample(audio_codec_ctx_->sample_fmt) * (audio_is_planar_ ? 1 : audio_codec_ctx_->ch_layout.nb_channels);
 				const uint8_t* in[] = { reinterpret_cast<const uint8_t*>(frame->audio_data().begin()) };
-				uint8_t*       out[AV_NUM_DATA_POINTERS];
-				for (char i = 0; i < AV_NUM_DATA_POINTERS; i++)
-					out[i] = out_buffers[i].data();
-
-				int converted_sample_count = swr_convert(swr_.get(),
-					out, out_samples_count,
-					in, in_samples_count);
-				if (audio_is_planar_)
-					for (char i = 0; i < audio_codec_ctx_->ch_layout.nb_channels; i++)
-					{
-						out_buffers[i].resize(converted_sample_count * av_get_bytes_per_sample(audio_codec_ctx_->sample_fmt));
-						boost::range::push_back(audio_bufers_[i], out_buffers[i]);
-					}
-				else
+				int in_samples_count = frame->audio_data().size() / frame->num_channels();
+
+				while (true)
+				{
+					if (!audio_frame_)
+						audio_frame_ = create_audio_frame();
+
+					const int filled = audio_frame_->nb_samples;
+					for (size_t i = 0; i < audio_out_.size(); i++)
+						audio_out_[i] = audio_frame_->extended_data[i] + filled * bytes_per_sample;
+
+					// A zero count with a non-null input drains the swr buffer without flushing it.
+					const int converted = swr_convert(swr_.get(), audio_out_.data(), audio_frame_capacity_ - filled, in, in_samples_count);
+					THROW_ON_ERROR2(converted, print());
+					in_samples_count = 0;
+
+					audio_frame_->nb_samples += converted;
+					if (audio_frame_->nb_samples < audio_frame_capacity_)
+						break;
+
+					frames.push_back(audio_frame_);
+					audio_frame_.reset();
+				}
+
+				if (audio_codec_ctx_->frame_size == 0 && audio_frame_->nb_samples > 0)
 				{
-					out_buffers[0].resize(converted_sample_count * av_get_bytes_per_sample(audio_codec_ctx_->sample_fmt) * audio_codec_ctx_->ch_layout.nb_channels);
-					boost::range::push_back(audio_bufers_[0], out_buffers[0]);
+					frames.push_back(audio_frame_);
+					audio_frame_.reset();
 				}
 			}
 
-			void encode_audio_buffer(bool is_last_frame)
+			// Pads the partially filled frame with silence unless the codec takes a short last frame.
+			void flush_audio_frame(frame_list& frames)
 			{
-				AVChannelLayout& channel_layout = audio_codec_ctx_->ch_layout;
-				int bytes_per_sample = av_get_bytes_per_sample(audio_codec_ctx_->sample_fmt);
-				size_t input_audio_size = audio_codec_ctx_->frame_size == 0 || is_last_frame ?
-					audio_bufers_[0].size() :
-					audio_codec_ctx_->frame_size * bytes_per_sample * channel_layout.nb_channels;
-				if (input_audio_size == 0)
+				if (!audio_frame_ || audio_frame_->nb_samples == 0)
 					return;
-				int frame_size = input_audio_size / (bytes_per_sample * channel_layout.nb_channels);
-				while (audio_bufers_[0].size() >= input_audio_size)
+
+				const auto capabilities = audio_codec_ctx_->codec->capabilities;
+				if (audio_codec_ctx_->frame_size > 0 && !(capabilities & (AV_CODEC_CAP_SMALL_LAST_FRAME | AV_CODEC_CAP_VARIABLE_FRAME_SIZE)))
 				{
-					AVPacket pkt = { 0 };
-					AVFrame in_frame = { 0 };
-					in_frame.nb_samples = frame_size;
-					in_frame.pts = out_audio_sample_number_;
-					in_frame.sample_rate = audio_codec_ctx_->sample_rate;
-					in_frame.format = audio_codec_ctx_->sample_fmt;
-					av_channel_layout_copy(&in_frame.ch_layout, &channel_layout);
-					out_audio_sample_number_ += frame_size;
-					uint8_t* out_buffers[AV_NUM_DATA_POINTERS];
-					for (char i = 0; i < AV_NUM_DATA_POINTERS; i++)
-						out_buffers[i] = audio_bufers_[i].data();
-					THROW_ON_ERROR2(avcodec_fill_audio_frame(&in_frame, channel_layout.nb_channels, audio_codec_ctx_->sample_fmt, (const uint8_t *)out_buffers[0], input_audio_size, 1), print());
-					if (audio_is_planar_)
-						for (char i = 0; i < channel_layout.nb_channels; i++)
-							in_frame.data[i] = audio_bufers_[i].data();
-					THROW_ON_ERROR2(avcodec_send_frame(audio_codec_ctx_.get(), &in_frame), print());
-					if (audio_is_planar_)
-						for (char i = 0; i < channel_layout.nb_channels; i++)
-							audio_bufers_[i].erase(audio_bufers_[i].begin(), audio_bufers_[i].begin() + (audio_codec_ctx_->frame_size * bytes_per_sample));
-					else
-						audio_bufers_[0].erase(audio_bufers_[0].begin(), audio_bufers_[0].begin() + input_audio_size);
-					while (avcodec_receive_packet(audio_codec_ctx_.get(), &pkt) == 0)
+					av_samples_set_silence(audio_frame_->extended_data, audio_frame_->nb_samples, audio_frame_capacity_ - audio_frame_->nb_samples, audio_codec_ctx_->ch_layout.nb_channels, audio_codec_ctx_->sample_fmt);
+					audio_frame_->nb_samples = audio_frame_capacity_;
+				}
+
+				frames.push_back(audio_frame_);
+				audio_frame_.reset();
+			}
+
+			void encode_audio_frames(const frame_list& frames, packet_list& packets)
+			{
+				BOOST_FOREACH(auto& frame, frames)
+				{
+					frame->pts = out_audio_sample_number_;
+					out_audio_sample_number_ += frame->nb_samples;
+					THROW_ON_ERROR2(avcodec_send_frame(audio_codec_ctx_.get(), frame.get()), print());
+					while (true)
 					{
-						pkt.stream_index = audio_stream_->index;
-						av_packet_rescale_ts(&pkt, audio_codec_ctx_->time_base, audio_stream_->time_base);
-						LOG_ON_ERROR2(av_interleaved_write_frame(format_context_.get(), &pkt), print());
+						auto pkt = create_packet();
+						if (avcodec_receive_packet(audio_codec_ctx_.get(), pkt.get()) != 0)
+							break;
+						pkt->stream_index = audio_stream_->index;
+						av_packet_rescale_ts(pkt.get(), audio_codec_ctx_->time_base, audio_stream_->time_base);
+						packets.push_back(pkt);
 					}
 				}
 			}
 
-			void process_audio_frame(const safe_ptr<core::read_frame>& frame)
+			// Audio stage.
+			std::shared_ptr<packet_list> process_audio_frame(const safe_ptr<core::read_frame>& frame)
 			{
+				auto packets = std::make_shared<packet_list>();
 				audio_timer_.restart();
-				resample_audio(frame);
-				encode_audio_buffer(false);
+				frame_list frames;
+				resample_audio(frame, frames);
+				encode_audio_frames(frames, *packets);
 				graph_->set_value("audio", audio_timer_.elapsed() * channel_format_desc_.fps);
+				return packets;
 			}
 
+			// Each frame passes the convert and video stages in turn while the audio stage works on it in parallel. 
+			// A stage which fails still hands an empty half on, so that the muxer does not wait for it.
 			void send(const safe_ptr<core::read_frame>& frame)
 			{
-				encode_executor_.begin_invoke([=] {
-					frame_timer_.restart();
+				const auto number = next_send_frame_++;
+				++frames_in_flight_;
 
-					process_video_frame(frame);
+				convert_executor_.post([=]
+				{
+					convert_stage(number, frame);
+				});
 
-					if (!key_only_)
-						process_audio_frame(frame);
+				if (!key_only_)
+				{
+					audio_executor_.post([=]
+					{
+						audio_stage(number, frame);
+					});
+				}
+
+				update_queue_graph();
+			}
+
+			void convert_stage(int64_t number, const safe_ptr<core::read_frame>& frame)
+			{
+				auto frames = std::make_shared<frame_list>();
+				try
+				{
+					*frames = convert_video(frame);
+				}
+				catch (...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+				}
+
+				auto ctx = video_encoders_[next_video_encoder_].ctx;
+				video_encoders_[next_video_encoder_].exec->post([=]
+				{
+					video_stage(number, frame, ctx, frames);
+				});
+				next_video_encoder_ = (next_video_encoder_ + 1) % video_encoders_.size();
+			}
+
+			void video_stage(int64_t number, const safe_ptr<core::read_frame>& frame, AVCodecContext* ctx, const std::shared_ptr<frame_list>& frames)
+			{
+				auto packets = std::make_shared<packet_list>();
+				try
+				{
+					packets = encode_video_frames(ctx, *frames);
+				}
+				catch (...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+				}
+
+				const auto age_millis = frame->get_age_millis();
+				mux_executor_.post([=]
+				{
+					mux(number, packets, nullptr, age_millis);
+				});
+			}
+
+			void audio_stage(int64_t number, const safe_ptr<core::read_frame>& frame)
+			{
+				auto packets = std::make_shared<packet_list>();
+				try
+				{
+					packets = process_audio_frame(frame);
+				}
+				catch (...)
+				{
+					CASPAR_LOG_CURRENT_EXCEPTION();
+				}
+
+				mux_executor_.post([=]
+				{
+					mux(number, nullptr, packets, 0);
+				});
+			}
+
+			// Mux stage.
+			void mux(int64_t number, const std::shared_ptr<packet_list>& video, const std::shared_ptr<packet_list>& audio, int64_t age_millis)
+			{
+				auto& pending = pending_frames_[number];
+				if (video)
+				{
+					pending.video		= video;
+					pending.age_millis	= age_millis;
+				}
+				if (audio)
+					pending.audio = audio;
+
+				while (!pending_frames_.empty() && pending_frames_.begin()->first == next_mux_frame_)
+				{
+					auto& next = pending_frames_.begin()->second;
+					if (!next.video || (!key_only_ && !next.audio))
+						break;
+
+					try
+					{
+						write_packets(*next.video, true);
+						if (next.audio)
+							write_packets(*next.audio, false);
+					}
+					catch (...)
+					{
+						CASPAR_LOG_CURRENT_EXCEPTION();
+					}
+
+					current_encoding_delay_ = next.age_millis;
+					pending_frames_.erase(pending_frames_.begin());
+					++next_mux_frame_;
+					--frames_in_flight_;
 
 					graph_->set_value("frame-time", frame_timer_.elapsed() * channel_format_desc_.fps);
+					frame_timer_.restart();
 					graph_->set_text(print());
-					current_encoding_delay_ = frame->get_age_millis();
-				});
+				}
+
+				update_queue_graph();
+			}
+
+			void write_packets(packet_list& packets, bool video)
+			{
+				BOOST_FOREACH(auto& pkt, packets)
+				{
+					if (video)
+						THROW_ON_ERROR2(av_interleaved_write_frame(format_context_.get(), pkt.get()), print());
+					else
+						LOG_ON_ERROR2(av_interleaved_write_frame(format_context_.get(), pkt.get()), print());
+				}
+				packets.clear();
+			}
+
+			void update_queue_graph()
+			{
+				graph_->set_value("convert-queue", static_cast<double>(convert_executor_.size()) / convert_executor_.capacity());
+				double video_queue = 0.0;
+				BOOST_FOREACH(auto& encoder, video_encoders_)
+					video_queue = std::max(video_queue, static_cast<double>(encoder.exec->size()) / encoder.exec->capacity());
+				graph_->set_value("video-queue", video_queue);
+				graph_->set_value("audio-queue", static_cast<double>(audio_executor_.size()) / audio_executor_.capacity());
+				graph_->set_value("mux-queue", static_cast<double>(mux_executor_.size()) / mux_executor_.capacity());
+				if (write_io_)
+					graph_->set_value("write-buffer", write_io_->buffer_occupancy());
 			}
 
 			bool ready_for_frame()
 			{
-				return encode_executor_.size() < encode_executor_.capacity();
+				return frames_in_flight_ < PIPELINE_DEPTH;
 			}
 
 			void mark_dropped()
@@ -894,7 +1265,11 @@ namespace caspar {
 			{
 				if (audio_codec_ctx_)
 				{
-					encode_audio_buffer(true); // encode remaining buffer data
+					packet_list packets;
+					frame_list frames;
+					flush_audio_frame(frames); // encode remaining buffer data
+					encode_audio_frames(frames, packets);
+					write_packets(packets, false);
 					if (audio_codec_ctx_->codec->capabilities & AV_CODEC_CAP_DELAY)
 						flush_stream(false);
 				}
@@ -1042,6 +1417,12 @@ namespace caspar {
 				info.add(L"type", L"ffmpeg_consumer");
 				info.add(L"filename", widen(output_params_.file_name_));
 				info.add(L"separate_key", separate_key_);
+				info.add_child(L"pools", pool_info());
+				boost::optional<boost::property_tree::wptree> write_info;
+				if (consumer_ && (write_info = consumer_->write_info()))
+					info.add_child(L"write", *write_info);
+				if (key_only_consumer_ && (write_info = key_only_consumer_->write_info()))
+					info.add_child(L"key-write", *write_info);
 				return info;
 			}
 
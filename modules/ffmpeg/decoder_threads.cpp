@@ -0,0 +1,208 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "StdAfx.h"
+
+#include "decoder_threads.h"
+
+#include <common/log/log.h>
+#include <common/env.h>
+
+#include <tbb/mutex.h>
+#include <tbb/task_scheduler_init.h>
+
+#include <boost/thread/once.hpp>
+
+#include <algorithm>
+#include <map>
+
+#if defined(_MSC_VER)
+#pragma warning (push)
+#pragma warning (disable : 4244)
+#endif
+extern "C" 
+{
+	#define __STDC_CONSTANT_MACROS
+	#define __STDC_LIMIT_MACROS
+	#include <libavcodec/avcodec.h>
+}
+#if defined(_MSC_VER)
+#pragma warning (pop)
+#endif
+
+namespace caspar {
+
+namespace {
+
+// Decoder threads are plain OS threads owned by libavcodec, they compete with the TBB arena and the executor pool 
+// for the same cores. The budget bounds their sum, so twenty open clips share the cores instead of each starting 
+// a full set of frame threads.
+class thread_budget
+{
+	tbb::mutex							mutex_;
+	int									budget_;
+	int									share_;
+	int									in_use_;
+	std::map<const void*, int>			leases_; // Decoder contexts and filter graphs holding threads.
+public:
+	thread_budget()
+		: in_use_(0)
+	{
+		// The TBB arena has a worker per core for the mixer and the producers' parallel work, by default half of it 
+		// is left to them.
+		budget_ = env::properties().get(L"configuration.ffmpeg.decoder-threads", 0);
+		if(budget_ < 1)
+			budget_ = (tbb::task_scheduler_init::default_num_threads() + 1) / 2;
+		budget_ = std::max(1, budget_);
+
+		// Every lease is capped at the share of one of the decoders expected to run at the same time, so the first 
+		// clip opened does not take the threads of the ones opened after it.
+		const int concurrency = std::max(1, env::properties().get(L"configuration.ffmpeg.decoder-concurrency", 4));
+		share_ = std::max(1, budget_ / concurrency);
+	}
+
+	// The thread count of a codec or filter graph is fixed once it is opened, so released threads are rebalanced by 
+	// the grants to the contexts opened after the release. Filter graphs are rebuilt on every seek and clear.
+	int reserve(const void* owner, int wanted)
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		release(owner, lock);
+
+		int threads = std::max(1, std::min(std::min(wanted, share_), budget_ - in_use_));
+		in_use_			+= threads;
+		leases_[owner]	= threads;
+		return threads;
+	}
+
+	void release(const void* owner)
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+		release(owner, lock);
+	}
+
+	int budget() const
+	{
+		return budget_;
+	}
+
+	int in_use()
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+		return in_use_;
+	}
+private:
+	void release(const void* owner, tbb::mutex::scoped_lock&)
+	{
+		auto it = leases_.find(owner);
+		if(it == leases_.end())
+			return;
+
+		in_use_ -= it->second;
+		leases_.erase(it);
+	}
+};
+
+thread_budget*		g_budget = nullptr;
+boost::once_flag	g_budget_flag = BOOST_ONCE_INIT;
+
+void init_budget()
+{
+	g_budget = new thread_budget(); // Lives for the duration of the process.
+}
+
+thread_budget& budget()
+{
+	boost::call_once(g_budget_flag, &init_budget);
+	return *g_budget;
+}
+
+// Intra-only codecs (ProRes, DNxHD, MJPEG...) decode every frame on its own, slice threading gives them the same 
+// throughput as frame threading without the extra frames of latency and memory. Long-GOP codecs scale with frames.
+int get_thread_type(const AVCodec* codec)
+{
+	const auto descriptor	= avcodec_descriptor_get(codec->id);
+	const bool intra_only	= descriptor && (descriptor->props & AV_CODEC_PROP_INTRA_ONLY);
+	const bool has_frame	= (codec->capabilities & AV_CODEC_CAP_FRAME_THREADS) != 0;
+	const bool has_slice	= (codec->capabilities & AV_CODEC_CAP_SLICE_THREADS) != 0;
+
+	if(has_slice && (intra_only || !has_frame))
+		return FF_THREAD_SLICE;
+	if(has_frame)
+		return FF_THREAD_FRAME;
+	return 0;
+}
+
+}
+
+int open_decoder(AVCodecContext* avctx, const AVCodec* codec, AVDictionary** options)
+{
+	auto& threads	= budget();
+	int thread_type = get_thread_type(codec);
+
+	if(thread_type == 0)
+		return avcodec_open2(avctx, codec, options);
+
+	// Frame threads are bounded by the frames libavcodec can keep in flight, every one of them holds a frame.
+	int wanted = thread_type == FF_THREAD_FRAME ? std::min(16, threads.budget()) : threads.budget();
+	int thread_count = threads.reserve(avctx, wanted);
+
+	avctx->thread_type	= thread_type;
+	avctx->thread_count = thread_count;
+
+	int result = avcodec_open2(avctx, codec, options);
+	if(result < 0 && thread_count > 1)
+	{
+		CASPAR_LOG(debug) << L"[decoder_threads] Threaded avcodec_open2 failed for " << codec->name << L", retrying single threaded.";
+		thread_count		= threads.reserve(avctx, 1);
+		avctx->thread_type	= 0;
+		avctx->thread_count = 1;
+		result = avcodec_open2(avctx, codec, options);
+	}
+
+	if(result < 0)
+	{
+		threads.release(avctx);
+		return result;
+	}
+
+	CASPAR_LOG(debug) << L"[decoder_threads] " << codec->name << L" opened with " << thread_count 
+					  << (thread_type == FF_THREAD_FRAME ? L" frame" : L" slice") << L" threads, " 
+					  << threads.in_use() << L"/" << threads.budget() << L" in use.";
+
+	return result;
+}
+
+void close_decoder(AVCodecContext* avctx)
+{
+	budget().release(avctx);
+	avcodec_free_context(&avctx);
+}
+
+int reserve_threads(const void* owner, int wanted)
+{
+	return budget().reserve(owner, wanted);
+}
+
+void release_threads(const void* owner)
+{
+	budget().release(owner);
+}
+
+}
@@ -0,0 +1,42 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+struct AVCodecContext;
+struct AVCodec;
+struct AVDictionary;
+
+namespace caspar {
+
+// Opens a video decoder with frame or slice threading, whichever suits the codec, and a thread count taken from 
+// a budget shared by all open decoders and filter graphs (configuration.ffmpeg.decoder-threads). Every lease is capped 
+// at the budget divided by configuration.ffmpeg.decoder-concurrency. Returns the avcodec_open2 result.
+int open_decoder(AVCodecContext* avctx, const AVCodec* codec, AVDictionary** options);
+
+// Returns the threads of a context opened by open_decoder to the budget and frees the context.
+void close_decoder(AVCodecContext* avctx);
+
+// Takes threads for other threaded ffmpeg work, e.g. filter graphs, from the same budget. Grants at least one.
+int reserve_threads(const void* owner, int wanted);
+
+// Returns the threads owner took by reserve_threads to the budget. Does nothing if it holds none.
+void release_threads(const void* owner);
+
+}
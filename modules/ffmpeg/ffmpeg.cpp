@@ -24,6 +24,8 @@
 #include "consumer/ffmpeg_consumer.h"
 #include "producer/ffmpeg_producer.h"
 #include "producer/util/util.h"
+#include "producer/filter/filter.h"
+#include "producer/input/keyframe_index.h"
 
 #include <common/log/log.h>
 #include <common/exception/win32_exception.h>
@@ -182,6 +184,8 @@ void init(const safe_ptr<core::media_info_repository>& media_info_repo)
 
 void uninit()
 {
+	keyframe_index::uninit();
+	filter::uninit();
 	avformat_network_deinit();
 }
 
@@ -22,6 +22,7 @@
 #include "../../stdafx.h"
 
 #include "audio_decoder.h"
+#include "audio_ring.h"
 
 //#include "audio_resampler.h"
 
@@ -31,9 +32,6 @@
 #include <core/video_format.h>
 #include <core/mixer/audio/audio_util.h>
 
-#include <tbb/cache_aligned_allocator.h>
-
-#include <queue>
 
 #if defined(_MSC_VER)
 #pragma warning (push)
@@ -53,7 +51,6 @@ namespace caspar { namespace ffmpeg {
 	
 struct audio_decoder::implementation : boost::noncopyable
 {	
-	static const int BUFFER_SIZE = 480000 * 2;
 	input 														input_;
 	const safe_ptr<AVCodecContext>								codec_context_;
 	AVStream*													stream_;
@@ -65,7 +62,8 @@ struct audio_decoder::implementation : boost::noncopyable
 	tbb::atomic<int64_t>										time_;
 	tbb::atomic<int64_t>										seek_pts_;
 	tbb::atomic<bool>											eof_;
-	std::vector<int32_t,  tbb::cache_aligned_allocator<int32_t>> buffer_;
+	const std::shared_ptr<AVFrame>								frame_; // Reused for every packet.
+	bool														pending_; // frame_ holds samples which did not fit in the ring yet.
 
 public:
 	explicit implementation(input &input, const caspar::core::video_format_desc &format, const std::wstring& custom_channel_order)
@@ -75,8 +73,9 @@ public:
 		, channel_layout_(get_audio_channel_layout(*codec_context_, custom_channel_order))
 		, swr_(alloc_resampler())
 		, stream_start_pts_(stream_->start_time == AV_NOPTS_VALUE ? 0 : stream_->start_time)
-		, buffer_(BUFFER_SIZE)
 		, duration_(calc_duration(stream_))
+		, frame_(create_frame())
+		, pending_(false)
 	{
 		seek_pts_ = 0;
 		time_ = AV_NOPTS_VALUE;
@@ -114,8 +113,12 @@ public:
 		return resampler;
 	}
 
-	std::shared_ptr<core::audio_buffer> poll()
+	// Decodes the next frame into frame_ without resampling it, a pending frame is kept.
+	bool decode()
 	{
+		if (pending_)
+			return true;
+
 		try
 		{
 			while (!eof_)
@@ -123,31 +126,23 @@ public:
 				std::shared_ptr<AVPacket> packet;
 				input_.try_pop_audio(packet);
 				avcodec_send_packet(codec_context_.get(), packet.get());
-				auto frame = create_frame();
-				int ret = avcodec_receive_frame(codec_context_.get(), frame.get());
+				av_frame_unref(frame_.get());
+				int ret = avcodec_receive_frame(codec_context_.get(), frame_.get());
 				switch (ret)
 				{
 				case 0:
-					if (frame->pts == AV_NOPTS_VALUE)
-						frame->pts = frame->best_effort_timestamp;
-					if (frame->pts != AV_NOPTS_VALUE)
-						frame->pts -= stream_start_pts_;
-					if (frame->pts < seek_pts_ || frame->nb_samples == 0)
+					if (frame_->pts == AV_NOPTS_VALUE)
+						frame_->pts = frame_->best_effort_timestamp;
+					if (frame_->pts != AV_NOPTS_VALUE)
+						frame_->pts -= stream_start_pts_;
+					if (frame_->pts < seek_pts_ || frame_->nb_samples == 0)
 						continue;
-					time_ = av_rescale(frame->pts * AV_TIME_BASE, stream_->time_base.num, stream_->time_base.den);
-					{
-						const uint8_t** in = const_cast<const uint8_t**>(frame->extended_data);
-						uint8_t* out[] = { reinterpret_cast<uint8_t*>(buffer_.data()) };
-						int n_samples = swr_convert(swr_.get(), out, buffer_.size() / frame->ch_layout.nb_channels, in, frame->nb_samples);
-						if (n_samples <= 0)
-							continue;
-						const auto samples = reinterpret_cast<uint32_t*>(*out);
-						return std::make_shared<core::audio_buffer>(samples, samples + n_samples * codec_context_->ch_layout.nb_channels);
-					}
-					break;
+					time_ = av_rescale(frame_->pts * AV_TIME_BASE, stream_->time_base.num, stream_->time_base.den);
+					pending_ = true;
+					return true;
 				case AVERROR_EOF:
 					eof_ = true;
-					return nullptr;
+					return false;
 				}
 			}
 		}
@@ -155,23 +150,59 @@ public:
 		{
 			CASPAR_LOG_CURRENT_EXCEPTION();
 		}
-		return nullptr;
+		return false;
 	}
 
-	void flush_resampler()
+	// Resamples the pending frame straight into the ring, in two parts when the free space wraps around.
+	bool poll(audio_ring& ring)
 	{
-		uint8_t* out[] =  { reinterpret_cast<uint8_t*>(buffer_.data()) };
-		while (swr_convert(swr_.get(),
-				out,
-				BUFFER_SIZE / codec_context_->ch_layout.nb_channels,
-				NULL,
-				0)>0) {};
+		if (!decode())
+			return false;
+
+		const int channels = codec_context_->ch_layout.nb_channels;
+		const size_t needed = static_cast<size_t>(swr_get_out_samples(swr_.get(), frame_->nb_samples)) * channels;
+		if (needed > ring.capacity())
+			BOOST_THROW_EXCEPTION(invalid_operation() << source_info(narrow(print())) << msg_info("Audio frame does not fit in the audio ring."));
+		if (ring.size() + needed > ring.limit())
+			BOOST_THROW_EXCEPTION(invalid_operation() << source_info(narrow(print())) << msg_info("audio-stream overflow. This can be caused by incorrect frame-rate. Check clip meta-data."));
+		if (needed > ring.space())
+			return false;
+
+		const uint8_t** in = const_cast<const uint8_t**>(frame_->extended_data);
+		int in_samples = frame_->nb_samples;
+		int written = 0;
+		
+		for (int part = 0; part < 2; ++part)
+		{
+			size_t region = 0;
+			uint8_t* out[] = { reinterpret_cast<uint8_t*>(ring.write_region(region)) };
+			const int out_samples = static_cast<int>(region / channels);
+			if (out_samples == 0)
+				break;
+
+			const int n_samples = swr_convert(swr_.get(), out, out_samples, in, in_samples);
+			if (n_samples <= 0)
+				break;
+
+			ring.commit(n_samples * channels);
+			written += n_samples;
+			in_samples = 0; // Drains what swr buffered without flushing its filter, which a NULL input would do.
+
+			if (n_samples < out_samples)
+				break;
+		}
+
+		av_frame_unref(frame_.get());
+		pending_ = false;
+		return written > 0;
 	}
-	
+
 	void seek(uint64_t time)
 	{
 		avcodec_flush_buffers(codec_context_.get());
-		flush_resampler();
+		av_frame_unref(frame_.get());
+		pending_ = false;
+		THROW_ON_ERROR2(swr_init(swr_.get()), print()); // Drops the samples buffered in the resampler.
 		eof_ = false;
 		time_ = AV_NOPTS_VALUE;
 		seek_pts_ = stream_start_pts_ == AV_NOPTS_VALUE ? 0 : stream_start_pts_ + (time * stream_->time_base.den / (AV_TIME_BASE * stream_->time_base.num));
@@ -184,7 +215,8 @@ public:
 };
 
 audio_decoder::audio_decoder(input &input, const caspar::core::video_format_desc &format, const std::wstring& custom_channel_order) : impl_(new implementation(input, format, custom_channel_order)){}
-std::shared_ptr<core::audio_buffer> audio_decoder::poll(){return impl_->poll();}
+bool audio_decoder::decode(){return impl_->decode();}
+bool audio_decoder::poll(audio_ring& ring){return impl_->poll(ring);}
 const core::channel_layout& audio_decoder::channel_layout() const { return impl_->channel_layout_; }
 std::wstring audio_decoder::print() const{return impl_->print();}
 void audio_decoder::seek(uint64_t time) {impl_->seek(time);}
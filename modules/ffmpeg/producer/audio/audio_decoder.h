@@ -42,12 +42,17 @@ struct channel_layout;
 }
 
 namespace ffmpeg {
+
+class audio_ring;
 	
 class audio_decoder : boost::noncopyable
 {
 public:
 	explicit audio_decoder(input &input, const caspar::core::video_format_desc &format,  const std::wstring& custom_channel_order);
-	std::shared_ptr<core::audio_buffer> poll();
+	// Decodes ahead without resampling, the frame is kept until the next poll.
+	bool decode();
+	// Resamples the next frame into ring, false when nothing was written or the ring is too full.
+	bool poll(audio_ring& ring);
 	const core::channel_layout& channel_layout() const;
 	std::wstring print() const;
 	void seek(uint64_t time);
@@ -0,0 +1,148 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../../stdafx.h"
+
+#include "audio_ring.h"
+
+#include <common/utility/assert.h>
+
+#include <tbb/atomic.h>
+#include <tbb/cache_aligned_allocator.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace caspar { namespace ffmpeg {
+
+struct audio_ring::implementation : boost::noncopyable
+{
+	const size_t											capacity_;
+	const size_t											max_span_;
+	std::vector<int32_t, tbb::cache_aligned_allocator<int32_t>>	samples_; // capacity_ samples followed by max_span_ of mirror.
+	tbb::atomic<uint64_t>									written_;
+	tbb::atomic<uint64_t>									read_;
+	tbb::atomic<size_t>										limit_;
+
+	implementation(size_t capacity, size_t max_span)
+		: capacity_(capacity)
+		, max_span_(max_span)
+		, samples_(capacity + max_span, 0)
+	{
+		CASPAR_VERIFY(capacity > 0 && max_span <= capacity);
+		written_	= 0;
+		read_		= 0;
+		limit_		= capacity;
+	}
+
+	size_t size() const
+	{
+		return static_cast<size_t>(written_ - read_);
+	}
+
+	size_t space() const
+	{
+		return capacity_ - size();
+	}
+
+	int32_t* write_region(size_t& count)
+	{
+		const auto offset = static_cast<size_t>(written_ % capacity_);
+		count = std::min(space(), capacity_ - offset);
+		return samples_.data() + offset;
+	}
+
+	void commit(size_t count)
+	{
+		CASPAR_VERIFY(count <= space());
+		written_ += count;
+	}
+
+	template<typename F>
+	void fill(size_t count, const F& func)
+	{
+		CASPAR_VERIFY(count <= space());
+		while (count > 0)
+		{
+			size_t region = 0;
+			auto dest = write_region(region);
+			region = std::min(region, count);
+			func(dest, region);
+			commit(region);
+			count -= region;
+		}
+	}
+
+	void write(const int32_t* samples, size_t count)
+	{
+		fill(count, [&](int32_t* dest, size_t region)
+		{
+			std::copy(samples, samples + region, dest);
+			samples += region;
+		});
+	}
+
+	void write_silence(size_t count)
+	{
+		fill(count, [](int32_t* dest, size_t region)
+		{
+			std::fill(dest, dest + region, 0);
+		});
+	}
+
+	const int32_t* peek(size_t count)
+	{
+		CASPAR_VERIFY(count <= size() && count <= max_span_);
+
+		const auto offset	= static_cast<size_t>(read_ % capacity_);
+		const auto tail		= capacity_ - offset;
+		if (count > tail) // The head of the span has not been released to the producer, so it can be mirrored safely.
+			std::copy(samples_.data(), samples_.data() + (count - tail), samples_.data() + capacity_);
+
+		return samples_.data() + offset;
+	}
+
+	void consume(size_t count)
+	{
+		CASPAR_VERIFY(count <= size());
+		read_ += count;
+	}
+
+	void clear()
+	{
+		written_	= 0;
+		read_		= 0;
+	}
+};
+
+audio_ring::audio_ring(size_t capacity, size_t max_span) : impl_(new implementation(capacity, max_span)){}
+size_t audio_ring::size() const{return impl_->size();}
+size_t audio_ring::space() const{return impl_->space();}
+size_t audio_ring::capacity() const{return impl_->capacity_;}
+size_t audio_ring::limit() const{return impl_->limit_;}
+void audio_ring::set_limit(size_t limit){impl_->limit_ = limit;}
+int32_t* audio_ring::write_region(size_t& count){return impl_->write_region(count);}
+void audio_ring::commit(size_t count){impl_->commit(count);}
+void audio_ring::write(const int32_t* samples, size_t count){impl_->write(samples, count);}
+void audio_ring::write_silence(size_t count){impl_->write_silence(count);}
+const int32_t* audio_ring::peek(size_t count){return impl_->peek(count);}
+void audio_ring::consume(size_t count){impl_->consume(count);}
+void audio_ring::clear(){impl_->clear();}
+
+}}
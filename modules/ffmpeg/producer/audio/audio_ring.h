@@ -0,0 +1,64 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <common/memory/safe_ptr.h>
+
+#include <boost/noncopyable.hpp>
+
+#include <cstdint>
+
+namespace caspar { namespace ffmpeg {
+
+// Lock-free single producer, single consumer ring of interleaved 32-bit samples. The producer resamples straight 
+// into the free space and the consumer reads cadence sized spans in place, spans which wrap around are made 
+// contiguous in a mirror area behind the ring. Nothing is allocated after construction.
+class audio_ring : boost::noncopyable
+{
+public:
+	// capacity and max_span are in samples and must be multiples of the channel count.
+	audio_ring(size_t capacity, size_t max_span);
+
+	size_t size() const;
+	size_t space() const;
+	size_t capacity() const;
+
+	// Bound on size() which producers check before writing, the capacity unless set by the consumer.
+	size_t limit() const;
+	void set_limit(size_t limit);
+
+	// Producer side. Returns the contiguous free region and its size in samples, commit publishes what was written.
+	int32_t* write_region(size_t& count);
+	void commit(size_t count);
+	void write(const int32_t* samples, size_t count);
+	void write_silence(size_t count);
+
+	// Consumer side. peek returns count contiguous samples which stay valid until consume.
+	const int32_t* peek(size_t count);
+	void consume(size_t count);
+
+	// Only while the producer is idle.
+	void clear();
+private:
+	struct implementation;
+	safe_ptr<implementation> impl_;
+};
+
+}}
@@ -29,10 +29,13 @@
 #include "muxer/frame_muxer.h"
 #include "input/input.h"
 #include "util/util.h"
+#include "util/av_pool.h"
 #include "audio/audio_decoder.h"
+#include "audio/audio_ring.h"
 #include "video/video_decoder.h"
 
 #include <common/env.h>
+#include <common/concurrency/executor.h>
 #include <common/utility/assert.h>
 #include <common/diagnostics/graph.h>
 #include <common/utility/string.h>
@@ -55,11 +58,16 @@
 #include <boost/regex.hpp>
 #include <boost/locale.hpp>
 
+#include <tbb/atomic.h>
+#include <tbb/concurrent_queue.h>
 #include <tbb/parallel_invoke.h>
+#include <tbb/spin_mutex.h>
 
 #include <limits>
+#include <deque>
 #include <memory>
 #include <queue>
+#include <vector>
 
 namespace caspar { namespace ffmpeg {
 
@@ -88,12 +96,181 @@ std::wstring get_relative_or_original(
 	return result;
 }
 
+const std::vector<std::wstring> g_invalid_exts = boost::assign::list_of(L".png")(L".tga")(L".bmp")(L".jpg")(L".jpeg")(L".gif")(L".tiff")(L".tif")(L".jp2")(L".jpx")(L".j2k")(L".j2c")(L".swf")(L".ct");
+
+// Resolves a clip name against the media folder, returns an empty string if no playable file matches.
+std::wstring resolve_filename(const std::wstring& name)
+{
+	auto filename = name;
+	if (!is_valid_file(filename, g_invalid_exts))
+		filename = env::media_folder() + L"\\" + name;
+	if (!boost::filesystem::exists(filename))
+		filename = probe_stem(filename, g_invalid_exts);
+	return filename;
+}
+
+// An opened file with its decoders. The producer plays from one source and keeps the next one pre-rolled in gapless mode.
+class decode_source : boost::noncopyable
+{
+	const std::wstring						filename_;
+	const std::wstring						path_relative_to_media_;
+	const int64_t							start_time_;
+	const int64_t							length_;
+
+	input									input_;
+	std::unique_ptr<video_decoder>			video_decoder_;
+	std::unique_ptr<audio_decoder>			audio_decoder_;
+
+	std::shared_ptr<AVFrame>				preroll_video_;
+public:
+	decode_source(const safe_ptr<diagnostics::graph>& graph, const std::wstring& filename, int64_t start_time, int64_t length, const core::video_format_desc& format_desc, const std::wstring& custom_channel_order, bool field_order_inverted)
+		: filename_(filename)
+		, path_relative_to_media_(get_relative_or_original(filename, env::media_folder()))
+		, start_time_(start_time)
+		, length_(length)
+		, input_(graph, filename)
+	{
+		try
+		{
+			video_decoder_.reset(new video_decoder(input_, field_order_inverted));
+		}
+		catch(averror_stream_not_found&)
+		{
+			CASPAR_LOG(warning) << print() << " No video-stream found. Running without video.";	
+		}
+		catch(...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+			CASPAR_LOG(warning) << print() << "Failed to open video-stream. Running without video.";	
+		}
+
+		try
+		{
+			audio_decoder_.reset(new audio_decoder(input_, format_desc, custom_channel_order));
+		}
+		catch(averror_stream_not_found&)
+		{
+			CASPAR_LOG(warning) << print() << " No audio-stream found. Running without audio.";	
+		}
+		catch(...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+			CASPAR_LOG(warning) << print() << " Failed to open audio-stream. Running without audio.";		
+		}
+
+		if(!video_decoder_ && !audio_decoder_)
+			BOOST_THROW_EXCEPTION(averror_stream_not_found() << msg_info("No streams found"));
+	}
+
+	const std::wstring& filename() const				{return filename_;}
+	const std::wstring& path_relative_to_media() const	{return path_relative_to_media_;}
+	int64_t start_time() const							{return start_time_;}
+	int64_t length() const								{return length_;}
+	input& get_input()									{return input_;}
+	video_decoder* video() const						{return video_decoder_.get();}
+	audio_decoder* audio() const						{return audio_decoder_.get();}
+
+	bool seek(int64_t time)
+	{
+		if (!input_.seek(time))
+			return false;
+		if (video_decoder_)
+			video_decoder_->seek(time);
+		if (audio_decoder_)
+			audio_decoder_->seek(time);
+		preroll_video_.reset();
+		return true;
+	}
+
+	// Seeks to start_time and decodes the first video frame and audio samples, so that switching to this source 
+	// does not wait for the decoders to get through the GOP before start_time.
+	void preroll()
+	{
+		if (!seek(start_time_))
+			CASPAR_LOG(warning) << print() << " Pre-roll seek failed.";
+
+		tbb::parallel_invoke(
+			[&]
+		{
+			if (video_decoder_)
+				preroll_video_ = video_decoder_->poll();
+		},
+			[&]
+		{
+			if (audio_decoder_)
+				audio_decoder_->decode(); // Resampled into the muxer's ring once this source plays.
+		});
+	}
+
+	std::shared_ptr<AVFrame> poll_video()
+	{
+		if (!preroll_video_)
+			return video_decoder_->poll();
+
+		auto frame = std::move(preroll_video_);
+		preroll_video_.reset();
+		return frame;
+	}
+
+	bool poll_audio(audio_ring& ring)
+	{
+		return audio_decoder_->poll(ring);
+	}
+
+	int64_t duration() const
+	{
+		if (video_decoder_)
+			return video_decoder_->duration();
+		else
+			if (audio_decoder_)
+				return audio_decoder_->duration();
+		return AV_NOPTS_VALUE;
+	}
+
+	int64_t decoded_time() const
+	{
+		if (video_decoder_)
+			return video_decoder_->time();
+		else
+			if (audio_decoder_)
+				return audio_decoder_->time();
+		return AV_NOPTS_VALUE;
+	}
+
+	bool eof() const
+	{
+		return video_decoder_ ? video_decoder_->eof() : audio_decoder_->eof();
+	}
+
+	bool is_compatible(const decode_source& other) const
+	{
+		if (!video_decoder_ != !other.video_decoder_ || !audio_decoder_ != !other.audio_decoder_)
+			return false;
+		if (video_decoder_ && video_decoder_->frame_rate() != other.video_decoder_->frame_rate())
+			return false;
+		if (audio_decoder_ && audio_decoder_->channel_layout().num_channels != other.audio_decoder_->channel_layout().num_channels)
+			return false;
+		return true;
+	}
+
+	std::wstring print() const
+	{
+		return L"ffmpeg[" + boost::filesystem::wpath(filename_).filename() + L"]";
+	}
+};
+
+struct playlist_item
+{
+	std::wstring	filename;
+	int64_t			start_time;
+	int64_t			length;
+};
+
 struct ffmpeg_producer : public core::frame_producer
 {
 	//const int MAX_GOP_SIZE = 256;
 	core::monitor::subject										monitor_subject_;
 	const std::wstring											filename_;
-	const std::wstring											path_relative_to_media_;
 
 	const safe_ptr<diagnostics::graph>							graph_;
 	boost::timer												frame_timer_;
@@ -101,9 +278,8 @@ struct ffmpeg_producer : public core::frame_producer
 	const safe_ptr<core::frame_factory>							frame_factory_;
 	const core::video_format_desc								format_desc_;
 
-	input														input_;	
-	std::unique_ptr<video_decoder>								video_decoder_;
-	std::unique_ptr<audio_decoder>								audio_decoder_;	
+	mutable tbb::spin_mutex										source_mutex_;
+	std::shared_ptr<decode_source>								source_; // Written on executor_ only, read elsewhere through current_source().
 	std::unique_ptr<frame_muxer>								muxer_;
 	core::channel_layout										audio_channel_layout_;
 	const std::wstring											custom_channel_order_;	
@@ -113,75 +289,82 @@ struct ffmpeg_producer : public core::frame_producer
 	const int64_t												length_;
 	const bool													alpha_mode_;
 	const std::string											filter_str_;
-	bool														loop_;
+	tbb::atomic<bool>											loop_;
+	tbb::atomic<bool>											gapless_;
+	tbb::atomic<bool>											field_order_inverted_;
 	tbb::atomic<bool>											is_eof_;
 	safe_ptr<core::basic_frame>									last_frame_;
+	tbb::atomic<int>											last_frame_number_; // Timecode of last_frame_, read from other threads by info() and print().
 	
-	std::queue<safe_ptr<core::basic_frame>>						frame_buffer_;
-
+	const size_t												prefetch_depth_;
+	tbb::concurrent_bounded_queue<safe_ptr<core::basic_frame>>	frame_buffer_;
+	tbb::atomic<int>											hints_;
+	tbb::atomic<bool>											decode_scheduled_;
+
+	std::vector<safe_ptr<core::basic_frame>>					loop_frames_; // First frames at start_time_, replayed on loop while the decoders pre-roll past them.
+	bool														capture_loop_frames_;
+
+	mutable tbb::spin_mutex										playlist_mutex_;
+	std::deque<playlist_item>									playlist_;
+	boost::unique_future<std::shared_ptr<decode_source>>		next_source_;
+	bool														next_source_pending_;
+	bool														next_source_is_loop_;
+	std::shared_ptr<decode_source>								loop_source_; // Played before the last loop splice, pre-rolled again for the next wrap instead of reopening the file.
+
+	std::unique_ptr<executor>									preroll_executor_; // Opens and pre-rolls the next source. File io blocks, so it has its own thread once gapless or a queue is used.
+	executor													executor_; // Decodes ahead of playout, owns source_ and muxer_ once constructed.
 		
 public:
-	explicit ffmpeg_producer(const safe_ptr<core::frame_factory>& frame_factory, const std::wstring& filename, const std::wstring& filter, bool loop, uint32_t start, uint32_t length, bool alpha_mode, const std::wstring& custom_channel_order, bool field_order_inverted, bool is_stream)
+	explicit ffmpeg_producer(const safe_ptr<core::frame_factory>& frame_factory, const std::wstring& filename, const std::wstring& filter, bool loop, bool gapless, uint32_t start, uint32_t length, bool alpha_mode, const std::wstring& custom_channel_order, bool field_order_inverted, bool is_stream)
 		: filename_(filename)
-		, path_relative_to_media_(get_relative_or_original(filename, env::media_folder()))
 		, frame_factory_(frame_factory)
 		, format_desc_(frame_factory->get_video_format_desc())
-		, input_(graph_, filename_)
 		, out_fps_(boost::rational<int>(format_desc_.time_scale, format_desc_.duration))
 		, length_(frame_to_time(length))
 		, alpha_mode_(alpha_mode)
 		, last_frame_(core::basic_frame::empty())
 		, filter_str_(narrow(filter))
 		, custom_channel_order_(custom_channel_order)
-		, loop_(loop)
 		, start_time_(frame_to_time(start))
+		, prefetch_depth_(std::max(2, env::properties().get(L"configuration.ffmpeg.prefetch-depth", 4)))
+		, next_source_pending_(false)
+		, next_source_is_loop_(false)
+		, executor_(L"ffmpeg_producer " + filename)
 	{
+		loop_				= loop;
+		gapless_			= gapless;
+		field_order_inverted_ = field_order_inverted;
+		hints_				= alpha_mode ? core::frame_producer::ALPHA_HINT : core::frame_producer::NO_HINT;
+		decode_scheduled_	= false;
+		capture_loop_frames_ = false;
+		last_frame_number_	= last_frame_->get_timecode();
+
 		graph_->set_color("frame-time", diagnostics::color(0.1f, 1.0f, 0.1f));
+		graph_->set_color("decode-time", diagnostics::color(0.0f, 0.6f, 0.3f));
+		graph_->set_color("buffer-fill", diagnostics::color(0.7f, 0.4f, 0.4f));
 		graph_->set_color("underflow", diagnostics::color(0.6f, 0.3f, 0.9f));	
+		graph_->set_color("splice", diagnostics::color(0.2f, 0.6f, 0.9f));	
 		diagnostics::register_graph(graph_);
-		try
-		{
-			video_decoder_.reset(new video_decoder(input_, field_order_inverted));
-		}
-		catch(averror_stream_not_found&)
-		{
-			CASPAR_LOG(warning) << print() << " No video-stream found. Running without video.";	
-		}
-		catch(...)
-		{
-			CASPAR_LOG_CURRENT_EXCEPTION();
-			CASPAR_LOG(warning) << print() << "Failed to open video-stream. Running without video.";	
-		}
-
-		audio_channel_layout_ = core::default_channel_layout_repository().get_by_name(L"STEREO");
 
-		try
-		{
-			audio_decoder_.reset(new audio_decoder(input_, frame_factory->get_video_format_desc(), custom_channel_order));
-			audio_channel_layout_ = audio_decoder_->channel_layout();
-		}
-		catch(averror_stream_not_found&)
-		{
-			CASPAR_LOG(warning) << print() << " No audio-stream found. Running without audio.";	
-		}
-		catch(...)
-		{
-			CASPAR_LOG_CURRENT_EXCEPTION();
-			CASPAR_LOG(warning) << print() << " Failed to open audio-stream. Running without audio.";		
-		}
+		source_ = std::make_shared<decode_source>(graph_, filename_, start_time_, length_, format_desc_, custom_channel_order_, field_order_inverted);
+		muxer_ = create_muxer(*source_);
 
-		if(!video_decoder_ && !audio_decoder_)
-			BOOST_THROW_EXCEPTION(averror_stream_not_found() << msg_info("No streams found"));
-		muxer_.reset(new frame_muxer(video_decoder_ ? video_decoder_->frame_rate() : boost::rational<int>(format_desc_.time_scale, format_desc_.duration),
-			video_decoder_ ? video_decoder_->time_base() : boost::rational<int>(format_desc_.duration, format_desc_.time_scale),
-			frame_factory, audio_channel_layout_, filter_str_));
 		if (is_stream)
-			input_.tick();
+			source_->get_input().tick();
 		else
 			if (!seek(start_time_, false))
 				CASPAR_LOG(warning) << print() << " Initial seek failed.";
 		for (int n = 0; n < 32 && frame_buffer_.size() < 2 && !is_eof_; ++n)
-			try_decode_frame(alpha_mode ? core::frame_producer::ALPHA_HINT : core::frame_producer::NO_HINT);
+			try_decode_frame(hints_);
+
+		schedule_decode();
+	}
+
+	~ffmpeg_producer()
+	{
+		executor_.clear();
+		executor_.stop();
+		executor_.join();
 	}
 
 	// frame_producer
@@ -199,13 +382,18 @@ public:
 	safe_ptr<core::basic_frame> render_frame(int hints)
 	{		
 		frame_timer_.restart();
-				
-		for (int n = 0; n < 32 && frame_buffer_.size() < 2 && !is_eof_; ++n)
-			try_decode_frame(hints);
+
+		hints_ = hints;
+
+		safe_ptr<core::basic_frame> frame;
+		bool has_frame = frame_buffer_.try_pop(frame);
+
+		schedule_decode();
 		
 		graph_->set_value("frame-time", frame_timer_.elapsed()*format_desc_.fps*0.5);
+		graph_->set_value("buffer-fill", static_cast<double>(buffer_fill())/static_cast<double>(prefetch_depth_));
 
-		if (frame_buffer_.empty())
+		if (!has_frame)
 		{
 			
 			if (is_eof_)
@@ -221,9 +409,8 @@ public:
 			}
 		}
 		
-		auto frame = frame_buffer_.front(); 
 		last_frame_ = frame;
-		frame_buffer_.pop();
+		last_frame_number_ = frame->get_timecode();
 
 		graph_->set_text(print());
 		send_osc();
@@ -233,37 +420,34 @@ public:
 
 	void send_osc()
 	{
+		auto source = current_source();
 		monitor_subject_	<< core::monitor::message("/profiler/time")		% frame_timer_.elapsed() % (1.0/format_desc_.fps);			
-		auto duration = file_duration();
-		monitor_subject_	<< core::monitor::message("/file/time")			% frame_to_time(last_frame_->get_timecode())
+		auto duration = source->duration();
+		monitor_subject_	<< core::monitor::message("/file/time")			% frame_to_time(last_frame_number_)
 																			% duration
-							<< core::monitor::message("/file/frame")		% static_cast<int32_t>(last_frame_->get_timecode())
+							<< core::monitor::message("/file/frame")		% static_cast<int32_t>(last_frame_number_)
 																			% static_cast<int32_t>(time_to_frame(duration))
 							<< core::monitor::message("/file/fps")			% out_fps_
-							<< core::monitor::message("/file/path")			% path_relative_to_media_
-							<< core::monitor::message("/loop")				% loop_;
+							<< core::monitor::message("/file/path")			% source->path_relative_to_media()
+							<< core::monitor::message("/loop")				% static_cast<bool>(loop_);
 	}
 	
 	virtual uint32_t nb_frames() const override
 	{
-		if(loop_) 
+		if(loop_ || has_playlist()) 
 			return std::numeric_limits<uint32_t>::max();
 
-		uint32_t nb_frames = time_to_frame(file_duration());
+		auto source = current_source();
+		uint32_t nb_frames = time_to_frame(source->duration());
 
-		if (length_ != AV_NOPTS_VALUE)
-			nb_frames = std::min(time_to_frame(length_), nb_frames);
+		if (source->length() != AV_NOPTS_VALUE)
+			nb_frames = std::min(time_to_frame(source->length()), nb_frames);
 		return nb_frames;
 	}
 
 	int64_t file_duration() const
 	{
-		if (video_decoder_)
-			return video_decoder_->duration();
-		else
-			if (audio_decoder_)
-				return audio_decoder_->duration();
-		return AV_NOPTS_VALUE;
+		return current_source()->duration();
 	}
 	
 	virtual boost::unique_future<std::wstring> call(const std::wstring& param) override
@@ -275,44 +459,82 @@ public:
 				
 	virtual std::wstring print() const override
 	{
-		return L"ffmpeg[" + boost::filesystem::wpath(filename_).filename() + L"|" 
+		return L"ffmpeg[" + boost::filesystem::wpath(current_source()->filename()).filename() + L"|" 
 						  + print_mode() + L"|" 
-						  + boost::lexical_cast<std::wstring>(last_frame_->get_timecode()) + L"/" + boost::lexical_cast<std::wstring>(time_to_frame(file_duration())) + L"]";
+						  + boost::lexical_cast<std::wstring>(static_cast<int>(last_frame_number_)) + L"/" + boost::lexical_cast<std::wstring>(time_to_frame(file_duration())) + L"]";
 	}
 
 	boost::property_tree::wptree info() const override
 	{
+		auto source = current_source();
 		boost::property_tree::wptree info;
 		info.add(L"type",				L"ffmpeg-producer");
-		info.add(L"filename",			filename_);
-		if (video_decoder_)
+		info.add(L"filename",			source->filename());
+		if (source->video())
 		{
-			info.add(L"file-width", video_decoder_ ? video_decoder_->width() : 0);
-			info.add(L"file-height", video_decoder_ ? video_decoder_->height() : 0);
-			info.add(L"file-fps", static_cast<double>(video_decoder_->frame_rate().numerator()) / video_decoder_->frame_rate().denominator());
-			info.add(L"file-progressive", video_decoder_ ? video_decoder_->is_progressive() : false);
+			info.add(L"file-width", source->video()->width());
+			info.add(L"file-height", source->video()->height());
+			info.add(L"file-fps", static_cast<double>(source->video()->frame_rate().numerator()) / source->video()->frame_rate().denominator());
+			info.add(L"file-progressive", source->video()->is_progressive());
 		}
 		info.add(L"fps", static_cast<double>(out_fps_.numerator()) / out_fps_.denominator());
-		info.add(L"loop", loop_);
+		info.add(L"loop", static_cast<bool>(loop_));
+		info.add(L"gapless", static_cast<bool>(gapless_));
 		info.add(L"nb-frames",	static_cast<int32_t>(nb_frames()));
-		info.add(L"frame-number", last_frame_->get_timecode() - time_to_frame(start_time_));
-		info.add(L"file-nb-frames", static_cast<int32_t>(time_to_frame(file_duration())));
-		info.add(L"file-frame-number", last_frame_->get_timecode());
+		info.add(L"frame-number", static_cast<int>(last_frame_number_) - time_to_frame(source->start_time()));
+		info.add(L"file-nb-frames", static_cast<int32_t>(time_to_frame(source->duration())));
+		info.add(L"file-frame-number", static_cast<int>(last_frame_number_));
+		info.add(L"buffer-fill", static_cast<int32_t>(buffer_fill()));
+		info.add(L"buffer-capacity", static_cast<int32_t>(prefetch_depth_));
+		info.add(L"io-bytes-read", source->get_input().bytes_read());
+		info.add(L"io-stall-time", source->get_input().stall_time());
+		{
+			tbb::spin_mutex::scoped_lock lock(playlist_mutex_);
+			BOOST_FOREACH(auto& item, playlist_)
+				info.add(L"playlist.file", item.filename);
+		}
+		info.add_child(L"pools", pool_info());
 		return info;
 	}
 
 	// ffmpeg_producer
 
+	std::shared_ptr<decode_source> current_source() const
+	{
+		tbb::spin_mutex::scoped_lock lock(source_mutex_);
+		return source_;
+	}
+
+	bool has_playlist() const
+	{
+		tbb::spin_mutex::scoped_lock lock(playlist_mutex_);
+		return !playlist_.empty();
+	}
+
 	std::wstring print_mode() const
 	{
-		return video_decoder_ ? ffmpeg::print_mode(video_decoder_->width(), video_decoder_->height(), video_decoder_->frame_rate(), !video_decoder_->is_progressive()) : L"";
+		auto video = current_source()->video();
+		return video ? ffmpeg::print_mode(video->width(), video->height(), video->frame_rate(), !video->is_progressive()) : L"";
+	}
+
+	std::unique_ptr<frame_muxer> create_muxer(const decode_source& source)
+	{
+		audio_channel_layout_ = source.audio() ? source.audio()->channel_layout() : core::default_channel_layout_repository().get_by_name(L"STEREO");
+
+		return std::unique_ptr<frame_muxer>(new frame_muxer(
+			source.video() ? source.video()->frame_rate() : boost::rational<int>(format_desc_.time_scale, format_desc_.duration),
+			source.video() ? source.video()->time_base() : boost::rational<int>(format_desc_.duration, format_desc_.time_scale),
+			frame_factory_, audio_channel_layout_, filter_str_));
 	}
 					
 	std::wstring do_call(const std::wstring& param)
 	{
 		static const boost::wregex loop_exp(L"LOOP\\s*(?<VALUE>\\d?)?", boost::regex::icase);
+		static const boost::wregex gapless_exp(L"GAPLESS\\s*(?<VALUE>\\d?)?", boost::regex::icase);
 		static const boost::wregex seek_exp(L"SEEK\\s+(?<VALUE>\\d+)", boost::regex::icase);
 		static const boost::wregex field_order_inverted_exp(L"FIELD_ORDER_INVERTED\\s+(?<VALUE>\\d+)", boost::regex::icase);
+		static const boost::wregex queue_exp(L"QUEUE\\s+(?<CLIP>\"[^\"]+\"|\\S+)(\\s+SEEK\\s+(?<SEEK>\\d+))?(\\s+LENGTH\\s+(?<LENGTH>\\d+))?", boost::regex::icase);
+		static const boost::wregex clear_queue_exp(L"CLEAR_QUEUE", boost::regex::icase);
 		
 		boost::wsmatch what;
 		if(boost::regex_match(param, what, loop_exp))
@@ -324,65 +546,243 @@ public:
 			}
 		}
 
+		if(boost::regex_match(param, what, gapless_exp))
+		{
+			if (!what["VALUE"].str().empty())
+				gapless_ = (boost::lexical_cast<bool>(what["VALUE"].str()));
+			schedule_decode();
+			return L"GAPLESS OK";
+		}
+
 		if(boost::regex_match(param, what, seek_exp))
 		{
-			if (seek(frame_to_time(boost::lexical_cast<uint32_t>(what["VALUE"].str())), true))
+			auto time = frame_to_time(boost::lexical_cast<uint32_t>(what["VALUE"].str()));
+			auto result = executor_.invoke([=]{ return seek(time, true); }, high_priority);
+			schedule_decode();
+			if (result)
 				return L"SEEK OK";
 			else
 				return L"SEEK FAILED";
 		}
 		if(boost::regex_match(param, what, field_order_inverted_exp))
 		{
-			if (video_decoder_)
-				video_decoder_->invert_field_order(boost::lexical_cast<bool>(what["VALUE"].str()));
+			auto value = boost::lexical_cast<bool>(what["VALUE"].str());
+			field_order_inverted_ = value;
+			executor_.invoke([=]
+			{
+				if (source_->video())
+					source_->video()->invert_field_order(value);
+				loop_frames_.clear();
+			}, high_priority);
 			return L"FIELD_ORDER_INVERTED OK";
 		}
+		if(boost::regex_match(param, what, queue_exp))
+		{
+			auto filename = resolve_filename(boost::trim_copy_if(what["CLIP"].str(), boost::is_any_of(L"\"")));
+			if (filename.empty())
+				BOOST_THROW_EXCEPTION(file_not_found() << msg_info(narrow(what["CLIP"].str())));
+
+			playlist_item item;
+			item.filename	= filename;
+			item.start_time	= frame_to_time(what["SEEK"].matched ? boost::lexical_cast<uint32_t>(what["SEEK"].str()) : 0);
+			item.length		= frame_to_time(what["LENGTH"].matched ? boost::lexical_cast<uint32_t>(what["LENGTH"].str()) : std::numeric_limits<uint32_t>::max());
+			{
+				tbb::spin_mutex::scoped_lock lock(playlist_mutex_);
+				playlist_.push_back(item);
+			}
+			schedule_decode();
+			return L"QUEUE OK";
+		}
+		if(boost::regex_match(param, what, clear_queue_exp))
+		{
+			{
+				tbb::spin_mutex::scoped_lock lock(playlist_mutex_);
+				playlist_.clear();
+			}
+			return L"CLEAR_QUEUE OK";
+		}
 		
 		BOOST_THROW_EXCEPTION(invalid_argument());
 	}
 
 	bool seek(int64_t time_to_seek, bool clear_buffer_and_muxer)
 	{
-		if (!input_.seek(time_to_seek))
+		if (!source_->seek(time_to_seek))
 			return false;
 		if (clear_buffer_and_muxer)
 		{
-			while (!frame_buffer_.empty())
-				frame_buffer_.pop();
+			clear_frame_buffer();
 			muxer_->clear();
 		}
-		if (video_decoder_)
-			video_decoder_->seek(time_to_seek);
-		if (audio_decoder_)
-			audio_decoder_->seek(time_to_seek);
 		is_eof_ = false;
+		capture_loop_frames_ = loop_ && time_to_seek == source_->start_time() && loop_frames_.empty();
 		return true;
 	}
 
+	// concurrent_bounded_queue::clear is not safe against the try_pop in render_frame, so frames are popped one by one.
+	void clear_frame_buffer()
+	{
+		safe_ptr<core::basic_frame> frame;
+		while (frame_buffer_.try_pop(frame))
+		{
+		}
+	}
+
+	// Replays the frames captured at the loop point while the input seeks to the keyframe after them, so the wrap 
+	// does not wait for the decoders to get through the GOP before start_time_.
+	void loop_to_start()
+	{
+		if (loop_frames_.size() < prefetch_depth_)
+		{
+			loop_frames_.clear();
+			seek(source_->start_time(), false);
+			return;
+		}
+
+		muxer_->clear(); // The unfinished tail of this pass would otherwise be mixed with the next.
+
+		BOOST_FOREACH(auto& frame, loop_frames_)
+			frame_buffer_.push(frame);
+
+		seek(source_->start_time() + frame_to_time(static_cast<uint32_t>(loop_frames_.size())), false);
+	}
+
+	// Starts opening and pre-rolling the next queued clip or, in gapless loop mode, the loop point of the current one.
+	void schedule_preroll()
+	{
+		bool has_queued = has_playlist();
+
+		if (next_source_pending_ && !(next_source_is_loop_ && has_queued))
+			return;
+
+		playlist_item item;
+		bool is_loop = false;
+
+		std::shared_ptr<decode_source> loop_source;
+
+		if (has_queued)
+		{
+			tbb::spin_mutex::scoped_lock lock(playlist_mutex_);
+			if (playlist_.empty())
+				return;
+			item = playlist_.front();
+			playlist_.pop_front();
+			loop_source_.reset();
+		}
+		else if (gapless_ && loop_)
+		{
+			item.filename	= source_->filename();
+			item.start_time = source_->start_time();
+			item.length		= source_->length();
+			is_loop			= true;
+			loop_source		= std::move(loop_source_);
+		}
+		else
+			return;
+
+		auto graph					= graph_;
+		auto format_desc			= format_desc_;
+		auto custom_channel_order	= custom_channel_order_;
+		bool field_order_inverted	= field_order_inverted_;
+
+		next_source_is_loop_	= is_loop;
+		next_source_pending_	= true;
+		if (!preroll_executor_)
+			preroll_executor_.reset(new executor(L"ffmpeg_producer preroll " + filename_));
+
+		next_source_			= preroll_executor_->begin_invoke([=]() -> std::shared_ptr<decode_source>
+		{
+			try
+			{
+				auto source = loop_source;
+				if (source)
+				{
+					if (source->video())
+						source->video()->invert_field_order(field_order_inverted);
+				}
+				else
+					source = std::make_shared<decode_source>(graph, item.filename, item.start_time, item.length, format_desc, custom_channel_order, field_order_inverted);
+				source->preroll();
+				return source;
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+				CASPAR_LOG(warning) << L"[ffmpeg_producer] Failed to pre-roll " << item.filename << L".";
+				return nullptr;
+			}
+		});
+	}
+
+	// Continues with the pre-rolled source in the same muxer, so audio cadence carries on from the previous clip.
+	bool splice()
+	{
+		if (!next_source_pending_)
+			return false;
+
+		if (next_source_is_loop_)
+		{
+			if (!loop_ || has_playlist())
+			{
+				next_source_pending_ = false; // Superseded, the result is dropped when ready.
+				return false;
+			}
+
+			if (!next_source_.is_ready())
+				return false; // Loop by seeking this time.
+		}
+
+		next_source_pending_ = false;
+
+		auto next = next_source_.get();
+		if (!next)
+			return false;
+
+		if (next_source_is_loop_)
+			loop_source_ = source_; // Only seeked by the next loop pre-roll, once executor_ has moved on to next.
+
+		if (!next->is_compatible(*source_))
+		{
+			CASPAR_LOG(warning) << print() << L" " << next->filename() << L" differs in frame rate or channels, the switch is not gapless.";
+			muxer_ = create_muxer(*next);
+		}
+
+		{
+			tbb::spin_mutex::scoped_lock lock(source_mutex_);
+			source_ = next;
+		}
+
+		loop_frames_.clear();
+		capture_loop_frames_ = false;
+		is_eof_ = false;
+
+		graph_->set_tag("splice");
+		return true;
+	}
 
 	void decode_frame(const int hints)
 	{
 		std::shared_ptr<AVFrame>			video;
-		std::shared_ptr<core::audio_buffer> audio;
+		bool								audio = false;
+
+		auto& source = *source_;
 
 		tbb::parallel_invoke(
 			[&]
 		{
-			if (!muxer_->video_ready() && video_decoder_)
-				video = video_decoder_->poll();
+			if (!muxer_->video_ready() && source.video())
+				video = source.poll_video();
 		},
 			[&]
 		{
-			if (!muxer_->audio_ready() && audio_decoder_)
-				audio = audio_decoder_->poll();
+			if (!muxer_->audio_ready() && source.audio())
+				audio = source.poll_audio(muxer_->audio_input());
 		});
 
-		if ((!audio_decoder_ || (!audio && audio_decoder_->eof())) && !muxer_->audio_ready())
+		if ((!source.audio() || (!audio && source.audio()->eof())) && !muxer_->audio_ready())
 			muxer_->push(empty_audio());
-		else
-			muxer_->push(audio);
 
-		if (!video_decoder_)
+		if (!source.video())
 		{
 			if (!muxer_->video_ready())
 				muxer_->push(empty_video(), 0);
@@ -391,47 +791,80 @@ public:
 		{
 			if (video)
 			{
-				int64_t time = av_rescale(video->pts, video_decoder_->time_base().numerator() * AV_TIME_BASE, video_decoder_->time_base().denominator());
+				int64_t time = av_rescale(video->pts, source.video()->time_base().numerator() * AV_TIME_BASE, source.video()->time_base().denominator());
 				auto opaque_time = new frame_time(time_to_frame(time));
 				video->opaque_ref = av_buffer_create(NULL, 0, av_buffer_free, opaque_time, AV_BUFFER_FLAG_READONLY);
-				if (length_ == AV_NOPTS_VALUE || time < start_time_ + length_)
+				if (source.length() == AV_NOPTS_VALUE || time < source.start_time() + source.length())
 					muxer_->push(video, hints);
 			}
 		}
 	}
+	
+	size_t buffer_fill() const
+	{
+		return static_cast<size_t>(std::max<std::ptrdiff_t>(0, frame_buffer_.size()));
+	}
 
-	int64_t decoded_time() const
+	void schedule_decode()
 	{
-		if (video_decoder_)
-			return video_decoder_->time();
-		else
-			if (audio_decoder_)
-				return audio_decoder_->time();
-		return AV_NOPTS_VALUE;
+		if (decode_scheduled_.fetch_and_store(true) || !executor_.is_running())
+			return;
+
+		executor_.post([=]
+		{
+			decode_scheduled_ = false;
+			decode_ahead();
+		});
 	}
 
-	bool decoder_eof() const
+	// Runs on executor_. Decodes in small batches so that seeks and other calls are not held back by a full refill.
+	void decode_ahead()
 	{
-		return video_decoder_ ? video_decoder_->eof() : audio_decoder_->eof();
+		boost::timer decode_timer;
+
+		schedule_preroll();
+
+		for (int n = 0; n < 8 && buffer_fill() < prefetch_depth_ && !is_eof_; ++n)
+			try_decode_frame(hints_);
+
+		graph_->set_value("decode-time", decode_timer.elapsed()*format_desc_.fps*0.5);
+		graph_->set_value("buffer-fill", static_cast<double>(buffer_fill())/static_cast<double>(prefetch_depth_));
+
+		if (buffer_fill() < prefetch_depth_ && !is_eof_)
+			schedule_decode();
 	}
-	
+
 	void try_decode_frame(int hints)
 	{
-		int64_t time = decoded_time();
+		int64_t time = source_->decoded_time();
 		if (time != AV_NOPTS_VALUE)
 		{
-			if (loop_ &&
-				((length_ != AV_NOPTS_VALUE && time >= start_time_ + length_) || decoder_eof()))
-				seek(start_time_, false);
-			if (!loop_ && ((length_ != AV_NOPTS_VALUE && time >= start_time_ + length_) || decoder_eof()))
-				is_eof_ = true;
+			auto& source = *source_;
+			if ((source.length() != AV_NOPTS_VALUE && time >= source.start_time() + source.length()) || source.eof())
+			{
+				if (!splice())
+				{
+					if (loop_)
+						loop_to_start();
+					else
+						is_eof_ = true;
+				}
+			}
 		}
 		if (is_eof_)
 			muxer_->flush();
 		else
 			decode_frame(hints);
 		for (auto frame = muxer_->poll(); frame; frame = muxer_->poll())
+		{
 			frame_buffer_.push(make_safe_ptr(frame));
+
+			if (capture_loop_frames_)
+			{
+				loop_frames_.push_back(make_safe_ptr(frame));
+				capture_loop_frames_ = loop_frames_.size() < prefetch_depth_;
+			}
+		}
 	}
 
 	core::monitor::subject& monitor_output()
@@ -459,12 +892,9 @@ safe_ptr<core::frame_producer> create_producer(
 		const safe_ptr<core::frame_factory>& frame_factory,
 		const core::parameters& params)
 {		
-	static const std::vector<std::wstring> invalid_exts = boost::assign::list_of(L".png")(L".tga")(L".bmp")(L".jpg")(L".jpeg")(L".gif")(L".tiff")(L".tif")(L".jp2")(L".jpx")(L".j2k")(L".j2c")(L".swf")(L".ct");
-
 	// Infer the resource type from the resource_name
 	auto tokens = core::parameters::protocol_split(params.at_original(0));
 	auto protocol = tokens[0];
-	auto filename = tokens[1];
 
 	auto filter_str = params.get(L"FILTER", L"");
 	boost::replace_all(filter_str, L"DEINTERLACE", L"YADIF=0:-1");
@@ -474,20 +904,18 @@ safe_ptr<core::frame_producer> create_producer(
 	bool is_alpha = params.has(L"IS_ALPHA");
 	if (protocol.empty())
 	{
-		if (!is_valid_file(filename, invalid_exts))
-			filename = env::media_folder() + L"\\" + tokens[1];
-		if (!boost::filesystem::exists(filename))
-			filename = probe_stem(filename, invalid_exts);
+		auto filename = resolve_filename(tokens[1]);
 		if (filename.empty())
 			return core::frame_producer::empty();
 
 		auto loop = params.has(L"LOOP");
+		auto gapless = params.has(L"GAPLESS");
 		auto start = params.get(L"SEEK", static_cast<uint32_t>(0));
 		auto length = params.get(L"LENGTH", std::numeric_limits<uint32_t>::max());
-		return create_producer_destroy_proxy(make_safe<ffmpeg_producer>(frame_factory, filename, filter_str, loop, start, length, is_alpha, custom_channel_order, field_order_inverted, false));
+		return create_producer_destroy_proxy(make_safe<ffmpeg_producer>(frame_factory, filename, filter_str, loop, gapless, start, length, is_alpha, custom_channel_order, field_order_inverted, false));
 	}
 	else
-		return create_producer_destroy_proxy(make_safe<ffmpeg_producer>(frame_factory, params.at_original(0), filter_str, false, 0, -1, is_alpha, custom_channel_order, field_order_inverted, true));
+		return create_producer_destroy_proxy(make_safe<ffmpeg_producer>(frame_factory, params.at_original(0), filter_str, false, false, 0, -1, is_alpha, custom_channel_order, field_order_inverted, true));
 }
 
 }}
\ No newline at end of file
@@ -26,9 +26,14 @@
 //#include "parallel_yadif.h"
 
 #include "../../ffmpeg_error.h"
+#include "../../decoder_threads.h"
 #include "../util/util.h"
 
+#include <common/concurrency/executor.h>
 #include <common/exception/exceptions.h>
+#include <common/log/log.h>
+
+#include <tbb/mutex.h>
 
 #include <boost/assign.hpp>
 #include <boost/range/iterator_range.hpp>
@@ -38,7 +43,10 @@
 #include <boost/foreach.hpp>
 #include <boost/format.hpp>
 
+#include <algorithm>
 #include <cstdio>
+#include <list>
+#include <queue>
 #include <sstream>
 
 #if defined(_MSC_VER)
@@ -66,19 +74,351 @@ extern "C"
 
 namespace caspar { namespace ffmpeg {
 
+namespace {
+
+// Everything a configured graph depends on. The field mode of the source is part of the filter string, which 
+// the muxer derives from it.
+struct graph_desc
+{
+	int							in_width;
+	int							in_height;
+	AVRational					in_time_base;
+	AVRational					in_frame_rate;
+	AVRational					in_sample_aspect_ratio;
+	AVPixelFormat				in_pix_fmt;
+	std::vector<AVPixelFormat>	out_pix_fmts; // Terminated by AV_PIX_FMT_NONE.
+	std::string					filtergraph;
+
+	std::string key() const
+	{
+		std::ostringstream key;
+		key << in_width << "x" << in_height << ":" << in_pix_fmt 
+			<< ":" << in_time_base.num << "/" << in_time_base.den
+			<< ":" << in_frame_rate.num << "/" << in_frame_rate.den
+			<< ":" << in_sample_aspect_ratio.num << "/" << in_sample_aspect_ratio.den << ":";
+		BOOST_FOREACH(auto pix_fmt, out_pix_fmts)
+			key << pix_fmt << ",";
+		key << ":" << filtergraph;
+		return key.str();
+	}
+};
+
+struct configured_graph
+{
+	std::shared_ptr<AVFilterGraph>	graph;
+	AVFilterContext*				in;
+	AVFilterContext*				out;
+};
+
+// yadif and scale split frames into slices, a graph in use asks the decoder thread budget for this many threads.
+const int FILTER_THREADS = 4;
+
+void link_filtergraph(
+	AVFilterGraph& graph, 
+	const std::string& filtergraph, 
+	AVFilterContext& source_ctx, 
+	AVFilterContext& sink_ctx)
+{
+	AVFilterInOut* outputs = nullptr;
+	AVFilterInOut* inputs = nullptr;
+
+	try
+	{
+		if(!filtergraph.empty()) 
+		{
+			outputs = avfilter_inout_alloc();
+			inputs  = avfilter_inout_alloc();
+
+			CASPAR_VERIFY(outputs && inputs);
+
+			outputs->name       = av_strdup("in");
+			outputs->filter_ctx = &source_ctx;
+			outputs->pad_idx    = 0;
+			outputs->next       = nullptr;
+
+			inputs->name        = av_strdup("out");
+			inputs->filter_ctx  = &sink_ctx;
+			inputs->pad_idx     = 0;
+			inputs->next        = nullptr;
+
+			FF(avfilter_graph_parse(
+				&graph, 
+				filtergraph.c_str(), 
+				inputs,
+				outputs,
+				nullptr));
+		} 
+		else 
+		{
+			FF(avfilter_link(
+				&source_ctx, 
+				0, 
+				&sink_ctx, 
+				0));
+		}
+
+		FF(avfilter_graph_config(
+			&graph, 
+			nullptr));
+	}
+	catch(...)
+	{
+		avfilter_inout_free(&outputs);
+		avfilter_inout_free(&inputs);
+		throw;
+	}
+}
+
+// The graph holds a lease on the decoder thread budget until it is freed.
+std::shared_ptr<configured_graph> build_graph(const graph_desc& desc)
+{
+	auto result = std::make_shared<configured_graph>();
+
+	result->graph.reset(
+		avfilter_graph_alloc(),
+		[](AVFilterGraph* p)
+		{
+			release_threads(p);
+			avfilter_graph_free(&p);
+		});
+	if(!result->graph)
+		throw std::bad_alloc();
+	result->graph->nb_threads = reserve_threads(result->graph.get(), FILTER_THREADS);
+
+	const auto vsrc_options = (boost::format("video_size=%1%x%2%:pix_fmt=%3%:time_base=%4%/%5%:pixel_aspect=%6%/%7%")
+		% desc.in_width % desc.in_height
+		% desc.in_pix_fmt
+		% desc.in_time_base.num % desc.in_time_base.den
+		% desc.in_sample_aspect_ratio.num % desc.in_sample_aspect_ratio.den).str();
+
+	AVFilterContext* filt_vsrc = nullptr;
+	FF(avfilter_graph_create_filter(
+		&filt_vsrc,
+		avfilter_get_by_name("buffer"),
+		"filter_buffer",
+		vsrc_options.c_str(),
+		nullptr,
+		result->graph.get()));
+			
+	AVFilterContext* filt_vsink = nullptr;
+	FF(avfilter_graph_create_filter(
+		&filt_vsink,
+		avfilter_get_by_name("buffersink"),
+		"filter_buffersink",
+		nullptr,
+		nullptr,
+		result->graph.get()));
+	
+#pragma warning (push)
+#pragma warning (disable : 4245)
+
+	FF(av_opt_set_int_list(
+		filt_vsink, 
+		"pix_fmts", 
+		desc.out_pix_fmts.data(), 
+		-1,
+		AV_OPT_SEARCH_CHILDREN));
+
+#pragma warning (pop)
+
+	link_filtergraph(
+		*result->graph,
+		desc.filtergraph,
+		*filt_vsrc,
+		*filt_vsink);
+	result->in	= filt_vsrc;
+	result->out = filt_vsink;
+
+	CASPAR_LOG(trace) << L"Filter configured: " << desc.filtergraph.c_str();
+	CASPAR_LOG(trace) << L"Options: " << vsrc_options.c_str();
+
+	return result;
+}
+
+// Configured graphs which have not been fed yet. A graph cannot be rewound once frames have passed through it 
+// (yadif, fps and interlace keep state), so a filter takes a fresh spare on every clear and a replacement is 
+// configured in the background. Seeks and deinterlace changes then swap graphs instead of building them.
+// Spares are threaded like the graphs they replace and hold their thread lease while waiting. There is one per active 
+// filter, and once auto-deinterlace prepares graphs a second one for the other deinterlace hint.
+class graph_cache : boost::noncopyable
+{
+	static const size_t MAX_KEYS = 32;
+
+	struct entry
+	{
+		std::string									key;
+		graph_desc									desc;
+		std::shared_ptr<configured_graph>			spare;
+		bool										building;
+	};
+
+	tbb::mutex					mutex_;
+	std::list<entry>			entries_; // Most recently used first.
+	size_t						active_filters_;
+	bool						preparing_; // Set by the first prepare, filters then alternate between two keys.
+	bool						stopped_;
+	std::unique_ptr<executor>	builder_; // Created on the first build, destroyed by uninit.
+public:
+	graph_cache()
+		: active_filters_(0)
+		, preparing_(false)
+		, stopped_(false)
+	{
+	}
+
+	~graph_cache()
+	{
+		uninit();
+	}
+
+	std::shared_ptr<configured_graph> acquire(const graph_desc& desc)
+	{
+		auto key = desc.key();
+
+		{
+			tbb::mutex::scoped_lock lock(mutex_);
+
+			auto& e = touch(key, desc);
+			if(e.spare)
+			{
+				auto result = std::move(e.spare);
+				e.spare.reset();
+				schedule_build(e);
+				return result;
+			}
+		}
+
+		auto result = build_graph(desc);
+
+		{
+			tbb::mutex::scoped_lock lock(mutex_);
+			schedule_build(touch(key, desc));
+		}
+
+		return result;
+	}
+
+	void prepare(const graph_desc& desc)
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+		preparing_ = true;
+		schedule_build(touch(desc.key(), desc));
+	}
+
+	void add_filter()
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+		++active_filters_;
+	}
+
+	// Drops the least recently used spares beyond the limit for the remaining filters.
+	void remove_filter()
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		--active_filters_;
+
+		for(auto it = entries_.rbegin(); it != entries_.rend() && spare_count() > spare_limit(); ++it)
+			it->spare.reset();
+	}
+
+	// Stops the builder and frees the spares. Called from ffmpeg::uninit, before the static destruction of the cache.
+	void uninit()
+	{
+		std::unique_ptr<executor> builder;
+
+		{
+			tbb::mutex::scoped_lock lock(mutex_);
+			stopped_ = true;
+			builder = std::move(builder_);
+		}
+
+		builder.reset(); // Waits for a running build outside the lock, the build takes the lock when it completes.
+
+		tbb::mutex::scoped_lock lock(mutex_);
+		entries_.clear();
+	}
+private:
+	// Requires mutex_.
+	entry& touch(const std::string& key, const graph_desc& desc)
+	{
+		auto it = std::find_if(entries_.begin(), entries_.end(), [&](const entry& e){ return e.key == key; });
+		if(it != entries_.end())
+		{
+			entries_.splice(entries_.begin(), entries_, it);
+			return entries_.front();
+		}
+
+		entry e;
+		e.key		= key;
+		e.desc		= desc;
+		e.building	= false;
+		entries_.push_front(std::move(e));
+
+		if(entries_.size() > MAX_KEYS)
+			entries_.pop_back();
+
+		return entries_.front();
+	}
+
+	// Requires mutex_. Counts the graphs being built as well.
+	size_t spare_count() const
+	{
+		return static_cast<size_t>(std::count_if(entries_.begin(), entries_.end(), [](const entry& e){ return e.spare || e.building; }));
+	}
+
+	// Requires mutex_. One spare per key a filter may switch to.
+	size_t spare_limit() const
+	{
+		return std::max<size_t>(1, active_filters_) * (preparing_ ? 2 : 1);
+	}
+
+	// Requires mutex_.
+	void schedule_build(entry& e)
+	{
+		if(stopped_ || e.spare || e.building || spare_count() >= spare_limit())
+			return;
+
+		if(!builder_)
+			builder_.reset(new executor(L"filter_graph_cache"));
+
+		e.building = true;
+
+		auto key  = e.key;
+		auto desc = e.desc;
+		builder_->post([=]
+		{
+			std::shared_ptr<configured_graph> graph;
+			try
+			{
+				graph = build_graph(desc);
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+			}
+
+			tbb::mutex::scoped_lock lock(mutex_);
+
+			auto it = std::find_if(entries_.begin(), entries_.end(), [&](const entry& e){ return e.key == key; });
+			if(it == entries_.end()) // Evicted meanwhile.
+				return;
+
+			it->building = false;
+			it->spare	 = graph;
+		});
+	}
+};
+
+graph_cache g_graph_cache;
+
+}
+
 struct filter::implementation
 {
 	std::string						filtergraph_;
-	std::shared_ptr<AVFilterGraph>	video_graph_;
-    AVFilterContext*				video_graph_in_;
-    AVFilterContext*				video_graph_out_;
-	std::vector<AVPixelFormat>		out_pix_fmts_;
-	const AVPixelFormat				in_pix_format_;
-	const int						in_width_;
-	const int						in_height_;
-	const AVRational		in_time_base_;
-	const AVRational		in_frame_rate_;
-	const AVRational		in_sample_aspect_ratio_;
+	graph_desc						desc_;
+	std::shared_ptr<configured_graph>	graph_;
 	std::queue<std::shared_ptr<AVFrame>>	fast_path_;
 	std::shared_ptr<AVFrame> last_frame_;
 
@@ -93,17 +433,41 @@ struct filter::implementation
 		const std::string& filtergraph
 		) 
 		: filtergraph_(boost::to_lower_copy(filtergraph))
-		, in_pix_format_(in_pix_fmt)
-		, in_width_(in_width)
-		, in_height_(in_height)
-		, in_time_base_(in_time_base)
-		, in_frame_rate_(in_frame_rate)
-		, in_sample_aspect_ratio_(in_sample_aspect_ratio)
-		, out_pix_fmts_(out_pix_fmts)
+		, desc_(make_desc(in_width, in_height, in_time_base, in_frame_rate, in_sample_aspect_ratio, in_pix_fmt, std::move(out_pix_fmts), filtergraph))
+	{
+		g_graph_cache.add_filter();
+		configure_filtergraph();
+	}
+
+	~implementation()
 	{
-		if(out_pix_fmts_.empty())
+		graph_.reset();
+		g_graph_cache.remove_filter();
+	}
+
+	static graph_desc make_desc(
+		int in_width,
+		int in_height,
+		AVRational in_time_base,
+		AVRational in_frame_rate,
+		AVRational in_sample_aspect_ratio,
+		AVPixelFormat in_pix_fmt,
+		std::vector<AVPixelFormat> out_pix_fmts,
+		const std::string& filtergraph)
+	{
+		graph_desc desc;
+		desc.in_width				= in_width;
+		desc.in_height				= in_height;
+		desc.in_time_base			= in_time_base;
+		desc.in_frame_rate			= in_frame_rate;
+		desc.in_sample_aspect_ratio = in_sample_aspect_ratio;
+		desc.in_pix_fmt				= in_pix_fmt;
+		desc.out_pix_fmts			= std::move(out_pix_fmts);
+		desc.filtergraph			= boost::to_lower_copy(filtergraph);
+
+		if(desc.out_pix_fmts.empty())
 		{
-			out_pix_fmts_ = boost::assign::list_of
+			desc.out_pix_fmts = boost::assign::list_of
 				(AV_PIX_FMT_YUVA420P)
 				(AV_PIX_FMT_YUV444P)
 				(AV_PIX_FMT_YUV422P)
@@ -115,136 +479,29 @@ struct filter::implementation
 				(AV_PIX_FMT_ABGR)
 				(AV_PIX_FMT_GRAY8);
 		}		
-		out_pix_fmts_.push_back(AV_PIX_FMT_NONE);
-
-		configure_filtergraph();
+		desc.out_pix_fmts.push_back(AV_PIX_FMT_NONE);
+		return desc;
 	}
+
 	void configure_filtergraph()
 	{
 		if (filtergraph_.empty())
 		{
-			video_graph_.reset();
+			graph_.reset();
 			return;
 		}
 
-		video_graph_.reset(
-			avfilter_graph_alloc(),
-			[](AVFilterGraph* p)
-			{
-				avfilter_graph_free(&p);
-			});
-		video_graph_->nb_threads = 1; // significantly improves performace of creating the filter graph, important when seeking, not needed for normal playback
-		const auto vsrc_options = (boost::format("video_size=%1%x%2%:pix_fmt=%3%:time_base=%4%/%5%:pixel_aspect=%6%/%7%")
-			% in_width_ % in_height_
-			% in_pix_format_
-			% in_time_base_.num % in_time_base_.den
-			% in_sample_aspect_ratio_.num % in_sample_aspect_ratio_.den).str();
-
-		AVFilterContext* filt_vsrc = nullptr;
-		FF(avfilter_graph_create_filter(
-			&filt_vsrc,
-			avfilter_get_by_name("buffer"),
-			"filter_buffer",
-			vsrc_options.c_str(),
-			nullptr,
-			video_graph_.get()));
-				
-		AVFilterContext* filt_vsink = nullptr;
-		FF(avfilter_graph_create_filter(
-			&filt_vsink,
-			avfilter_get_by_name("buffersink"),
-			"filter_buffersink",
-			nullptr,
-			nullptr,
-			video_graph_.get()));
-		
-#pragma warning (push)
-#pragma warning (disable : 4245)
-
-		FF(av_opt_set_int_list(
-			filt_vsink, 
-			"pix_fmts", 
-			out_pix_fmts_.data(), 
-			-1,
-			AV_OPT_SEARCH_CHILDREN));
-
-#pragma warning (pop)
 		try
 		{
-			configure_filtergraph(
-				*video_graph_,
-				filtergraph_,
-				*filt_vsrc,
-				*filt_vsink);
-			video_graph_in_ = filt_vsrc;
-			video_graph_out_ = filt_vsink;
-
-			CASPAR_LOG(trace) << L"Filter configured: " << filtergraph_.c_str();
-			CASPAR_LOG(trace) << L"Options: " << vsrc_options.c_str();
+			graph_ = g_graph_cache.acquire(desc_);
 		}
 		catch (...)
 		{
 			CASPAR_LOG(error) << L"Cannot configure filtergraph: " << filtergraph_.c_str();
 			filtergraph_.clear(); // disable filtering on configure_filtergraph  failure
+			graph_.reset();
 		}
 	}
-	
-	void configure_filtergraph(
-		AVFilterGraph& graph, 
-		const std::string& filtergraph, 
-		AVFilterContext& source_ctx, 
-		AVFilterContext& sink_ctx)
-	{
-		AVFilterInOut* outputs = nullptr;
-		AVFilterInOut* inputs = nullptr;
-
-		try
-		{
-			if(!filtergraph.empty()) 
-			{
-				outputs = avfilter_inout_alloc();
-				inputs  = avfilter_inout_alloc();
-
-				CASPAR_VERIFY(outputs && inputs);
-
-				outputs->name       = av_strdup("in");
-				outputs->filter_ctx = &source_ctx;
-				outputs->pad_idx    = 0;
-				outputs->next       = nullptr;
-
-				inputs->name        = av_strdup("out");
-				inputs->filter_ctx  = &sink_ctx;
-				inputs->pad_idx     = 0;
-				inputs->next        = nullptr;
-
-				FF(avfilter_graph_parse(
-					&graph, 
-					filtergraph.c_str(), 
-					inputs,
-					outputs,
-					nullptr));
-			} 
-			else 
-			{
-				FF(avfilter_link(
-					&source_ctx, 
-					0, 
-					&sink_ctx, 
-					0));
-			}
-
-			FF(avfilter_graph_config(
-				&graph, 
-				nullptr));
-		}
-		catch(...)
-		{
-			avfilter_inout_free(&outputs);
-			avfilter_inout_free(&inputs);
-			throw;
-		}
-	}
-
 
 	bool fast_path() const
 	{
@@ -260,7 +517,7 @@ struct filter::implementation
 			fast_path_.push(frame);
 		else
 			FF(av_buffersrc_add_frame_flags(
-				video_graph_in_,
+				graph_->in,
 				frame.get(), AV_BUFFERSRC_FLAG_KEEP_REF));
 	}
 
@@ -269,7 +526,7 @@ struct filter::implementation
 		if (!last_frame_ || fast_path())
 			return;
 		FF(av_buffersrc_add_frame_flags(
-			video_graph_in_,
+			graph_->in,
 			last_frame_.get(), AV_BUFFERSRC_FLAG_KEEP_REF));
 	}
 
@@ -286,7 +543,7 @@ struct filter::implementation
 
 		auto filt_frame = ffmpeg::create_frame();
 		const auto ret = av_buffersink_get_frame(
-			video_graph_out_, 
+			graph_->out, 
 			filt_frame.get());
 		if(ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
 			return nullptr;
@@ -304,29 +561,29 @@ struct filter::implementation
 
 	bool is_frame_format_changed(const std::shared_ptr<AVFrame>& frame)
 	{
-		return in_pix_format_ != frame->format || in_width_ != frame->width || in_height_ != frame->height;
+		return desc_.in_pix_fmt != frame->format || desc_.in_width != frame->width || desc_.in_height != frame->height;
 	}
 
 	int out_width()
 	{
-		return fast_path() ? in_width_ : av_buffersink_get_w(video_graph_out_);
+		return fast_path() ? desc_.in_width : av_buffersink_get_w(graph_->out);
 	}
 
 	int out_height()
 	{
-		return fast_path() ? in_height_ : av_buffersink_get_h(video_graph_out_);
+		return fast_path() ? desc_.in_height : av_buffersink_get_h(graph_->out);
 	}
 
 	AVPixelFormat out_pixel_format()
 	{
-		return fast_path() ? in_pix_format_ : static_cast<AVPixelFormat>(av_buffersink_get_format(video_graph_out_));
+		return fast_path() ? desc_.in_pix_fmt : static_cast<AVPixelFormat>(av_buffersink_get_format(graph_->out));
 	}
 
 	AVRational out_frame_rate()
 	{
 		if (fast_path())
-			return in_frame_rate_;
-		AVRational frame_rate = av_buffersink_get_frame_rate(video_graph_out_);
+			return desc_.in_frame_rate;
+		AVRational frame_rate = av_buffersink_get_frame_rate(graph_->out);
 		if (frame_rate.num != 0)
 			return frame_rate;
 		return av_inv_q(out_time_base());
@@ -334,12 +591,12 @@ struct filter::implementation
 
 	AVRational out_time_base()
 	{
-		return fast_path() ? in_time_base_ : av_buffersink_get_time_base(video_graph_out_);
+		return fast_path() ? desc_.in_time_base : av_buffersink_get_time_base(graph_->out);
 	}
 
 	AVRational out_sample_aspect_ratio()
 	{
-		return fast_path() ? in_sample_aspect_ratio_ : av_buffersink_get_sample_aspect_ratio(video_graph_out_);
+		return fast_path() ? desc_.in_sample_aspect_ratio : av_buffersink_get_sample_aspect_ratio(graph_->out);
 	}
 	
 };
@@ -377,6 +634,24 @@ std::vector<safe_ptr<AVFrame>> filter::poll_all()
 std::shared_ptr<AVFrame>& filter::last_input_frame() const { return impl_->last_frame_; }
 void filter::clear() { impl_->clear(); }
 void filter::flush() { impl_->flush(); }
+void filter::prepare(
+		int in_width,
+		int in_height,
+		AVRational in_time_base,
+		AVRational in_frame_rate,
+		AVRational in_sample_aspect_ratio,
+		AVPixelFormat in_pix_fmt,
+		std::vector<AVPixelFormat> out_pix_fmts,
+		const std::string& filtergraph)
+{
+	if (filtergraph.empty())
+		return;
+	g_graph_cache.prepare(implementation::make_desc(in_width, in_height, in_time_base, in_frame_rate, in_sample_aspect_ratio, in_pix_fmt, std::move(out_pix_fmts), filtergraph));
+}
+void filter::uninit()
+{
+	g_graph_cache.uninit();
+}
 bool filter::is_frame_format_changed(const std::shared_ptr<AVFrame>& frame) { return impl_->is_frame_format_changed(frame);}
 int filter::out_width() { return impl_->out_width(); }
 int filter::out_height() { return impl_->out_height(); }
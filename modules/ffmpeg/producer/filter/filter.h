@@ -70,6 +70,21 @@ public:
 	AVRational out_sample_aspect_ratio();
 
 	std::string filter_str() const;
+
+	// Configures a graph for these parameters in the background, so that a filter created with them later 
+	// starts without building one.
+	static void prepare(
+		int in_width,
+		int in_height,
+		AVRational in_time_base,
+		AVRational in_frame_rate,
+		AVRational in_sample_aspect_ratio,
+		AVPixelFormat in_pix_fmt,
+		std::vector<AVPixelFormat> out_pix_fmts,
+		const std::string& filtergraph);
+
+	// Stops building graphs in the background and frees the prepared ones. Called from ffmpeg::uninit.
+	static void uninit();
 			
 private:
 	struct implementation;
@@ -1,429 +1,434 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*
+* The filter is the yadif algorithm of FFmpeg:
+* Copyright (C) 2006-2010 Michael Niedermayer <michaelni@gmx.at>
+*               2010      James Darnley <james.darnley@gmail.com>
+*/
+
 #include "../../../StdAfx.h"
 
 #include "scalable_yadif.h"
 
+#include "../../util/util.h"
+#include "../../../ffmpeg_error.h"
 
-/*
- * Copyright (C) 2006-2010 Michael Niedermayer <michaelni@gmx.at>
- *               2010      James Darnley <james.darnley@gmail.com>
- *
- * FFmpeg is free software; you can redistribute it and/or modify
- * it under the terms of the GNU General Public License as published by
- * the Free Software Foundation; either version 2 of the License, or
- * (at your option) any later version.
- *
- * FFmpeg is distributed in the hope that it will be useful,
- * but WITHOUT ANY WARRANTY; without even the implied warranty of
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
- * GNU General Public License for more details.
- *
- * You should have received a copy of the GNU General Public License along
- * with FFmpeg; if not, write to the Free Software Foundation, Inc.,
- * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
- */
-
-#pragma warning(push, 0)
-
-
-#undef NDEBUG
-#include <assert.h>
-
-typedef struct {
-    /**
-     * 0: send 1 frame for each frame
-     * 1: send 1 frame for each field
-     * 2: like 0 but skips spatial interlacing check
-     * 3: like 1 but skips spatial interlacing check
-     */
-    int mode;
-
-    /**
-     *  0: bottom field first
-     *  1: top field first
-     * -1: auto-detection
-     */
-    int parity;
-
-    int frame_pending;
-
-    /**
-     *  0: deinterlace all frames
-     *  1: only deinterlace frames marked as interlaced
-     */
-    int auto_enable;
-
-    AVFilterBufferRef *cur;
-    AVFilterBufferRef *next;
-    AVFilterBufferRef *prev;
-    AVFilterBufferRef *out;
-    void (*filter_line)(uint8_t *dst,
-                        uint8_t *prev, uint8_t *cur, uint8_t *next,
-                        int w, int prefs, int mrefs, int parity, int mode);
-
-    const AVPixFmtDescriptor *csp;
-} YADIFContext;
-
-#define CHECK(j)\
-    {   int score = FFABS(cur[mrefs-1+(j)] - cur[prefs-1-(j)])\
-                  + FFABS(cur[mrefs  +(j)] - cur[prefs  -(j)])\
-                  + FFABS(cur[mrefs+1+(j)] - cur[prefs+1-(j)]);\
-        if (score < spatial_score) {\
-            spatial_score= score;\
-            spatial_pred= (cur[mrefs  +(j)] + cur[prefs  -(j)])>>1;\
-
-#define FILTER \
-    for (x = 0;  x < w; x++) { \
-        int c = cur[mrefs]; \
-        int d = (prev2[0] + next2[0])>>1; \
-        int e = cur[prefs]; \
-        int temporal_diff0 = FFABS(prev2[0] - next2[0]); \
-        int temporal_diff1 =(FFABS(prev[mrefs] - c) + FFABS(prev[prefs] - e) )>>1; \
-        int temporal_diff2 =(FFABS(next[mrefs] - c) + FFABS(next[prefs] - e) )>>1; \
-        int diff = FFMAX3(temporal_diff0>>1, temporal_diff1, temporal_diff2); \
-        int spatial_pred = (c+e)>>1; \
-        int spatial_score = FFABS(cur[mrefs-1] - cur[prefs-1]) + FFABS(c-e) \
-                          + FFABS(cur[mrefs+1] - cur[prefs+1]) - 1; \
- \
-        CHECK(-1) CHECK(-2) }} }} \
-        CHECK( 1) CHECK( 2) }} }} \
- \
-        if (mode < 2) { \
-            int b = (prev2[2*mrefs] + next2[2*mrefs])>>1; \
-            int f = (prev2[2*prefs] + next2[2*prefs])>>1; \
-            int max = FFMAX3(d-e, d-c, FFMIN(b-c, f-e)); \
-            int min = FFMIN3(d-e, d-c, FFMAX(b-c, f-e)); \
- \
-            diff = FFMAX3(diff, min, -max); \
-        } \
- \
-        if (spatial_pred > d + diff) \
-           spatial_pred = d + diff; \
-        else if (spatial_pred < d - diff) \
-           spatial_pred = d - diff; \
- \
-        dst[0] = spatial_pred; \
- \
-        dst++; \
-        cur++; \
-        prev++; \
-        next++; \
-        prev2++; \
-        next2++; \
-    }
-
-void filter_line_c(uint8_t *dst,
-                          uint8_t *prev, uint8_t *cur, uint8_t *next,
-                          int w, int prefs, int mrefs, int parity, int mode)
-{
-    int x;
-    uint8_t *prev2 = parity ? prev : cur ;
-    uint8_t *next2 = parity ? cur  : next;
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
 
-    FILTER
-}
+#include <emmintrin.h>
 
-void filter_line_c_16bit(uint16_t *dst,
-                                uint16_t *prev, uint16_t *cur, uint16_t *next,
-                                int w, int prefs, int mrefs, int parity, int mode)
-{
-    int x;
-    uint16_t *prev2 = parity ? prev : cur ;
-    uint16_t *next2 = parity ? cur  : next;
-    mrefs /= 2;
-    prefs /= 2;
-
-    FILTER
-}
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <queue>
 
-void filter(AVFilterContext *ctx, AVFilterBufferRef *dstpic,
-                   int parity, int tff)
+#if defined(_MSC_VER)
+#pragma warning (push)
+#pragma warning (disable : 4244)
+#endif
+extern "C" 
 {
-    YADIFContext *yadif = (YADIFContext*)ctx->priv;
-    int y, i;
-
-    for (i = 0; i < yadif->csp->nb_components; i++) {
-        int w = dstpic->video->w;
-        int h = dstpic->video->h;
-        int refs = yadif->cur->linesize[i];
-        int df = (yadif->csp->comp[i].depth_minus1+1) / 8;
-
-        if (i) {
-        /* Why is this not part of the per-plane description thing? */
-            w >>= yadif->csp->log2_chroma_w;
-            h >>= yadif->csp->log2_chroma_h;
-        }
-
-        for (y = 0; y < h; y++) {
-            if ((y ^ parity) & 1) {
-                uint8_t *prev = &yadif->prev->data[i][y*refs];
-                uint8_t *cur  = &yadif->cur ->data[i][y*refs];
-                uint8_t *next = &yadif->next->data[i][y*refs];
-                uint8_t *dst  = &dstpic->data[i][y*dstpic->linesize[i]];
-                int     mode  = y==1 || y+2==h ? 2 : yadif->mode;
-                yadif->filter_line(dst, prev, cur, next, w, y+1<h ? refs : -refs, y ? -refs : refs, parity ^ tff, mode);
-            } else {
-                memcpy(&dstpic->data[i][y*dstpic->linesize[i]],
-                       &yadif->cur->data[i][y*refs], w*df);
-            }
-        }
-    }
-    //__asm__ volatile("emms \n\t" : : : "memory");
+	#define __STDC_CONSTANT_MACROS
+	#define __STDC_LIMIT_MACROS
+	#include <libavutil/frame.h>
+	#include <libavutil/pixdesc.h>
 }
+#if defined(_MSC_VER)
+#pragma warning (pop)
+#endif
 
-AVFilterBufferRef *get_video_buffer(AVFilterLink *link, int perms, int w, int h)
-{
-    AVFilterBufferRef *picref;
-    int width = FFALIGN(w, 32);
-    int height= FFALIGN(h+2, 32);
-    int i;
+namespace caspar { namespace ffmpeg {
 
-    picref = avfilter_default_get_video_buffer(link, perms, width, height);
+namespace {
 
-    picref->video->w = w;
-    picref->video->h = h;
-
-    for (i = 0; i < 3; i++)
-        picref->data[i] += picref->linesize[i];
+// Rows around the interpolated line y. "m" is the line above and "p" the line below, mirrored at the edges. 
+// prev2/next2 are the frames on either side of the field being rebuilt.
+struct line_refs
+{
+	const uint8_t* cur_m;
+	const uint8_t* cur_p;
+	const uint8_t* prev_m;
+	const uint8_t* prev_p;
+	const uint8_t* next_m;
+	const uint8_t* next_p;
+	const uint8_t* prev2;
+	const uint8_t* next2;
+	const uint8_t* prev2_m2;
+	const uint8_t* next2_m2;
+	const uint8_t* prev2_p2;
+	const uint8_t* next2_p2;
+};
 
-    return picref;
+inline int clamp_x(int x, int w)
+{
+	return std::min(std::max(x, 0), w - 1);
 }
 
-void return_frame(AVFilterContext *ctx, int is_second)
+void filter_pixel(uint8_t* dst, const line_refs& r, int x, int w, bool spatial_check)
 {
-    YADIFContext *yadif = (YADIFContext*)ctx->priv;
-    AVFilterLink *link= ctx->outputs[0];
-    int tff;
-
-    if (yadif->parity == -1) {
-        tff = yadif->cur->video->interlaced ?
-            yadif->cur->video->top_field_first : 1;
-    } else {
-        tff = yadif->parity^1;
-    }
-
-    if (is_second)
-        yadif->out = avfilter_get_video_buffer(link, AV_PERM_WRITE | AV_PERM_PRESERVE |
-                                               AV_PERM_REUSE, link->w, link->h);
-
-    if (!yadif->csp)
-        yadif->csp = &av_pix_fmt_descriptors[link->format];
-    if (yadif->csp->comp[0].depth_minus1 == 15)
-        yadif->filter_line = (decltype(yadif->filter_line))filter_line_c_16bit;
-
-    filter(ctx, yadif->out, tff ^ !is_second, tff);
-
-    if (is_second) {
-        if (yadif->next->pts != AV_NOPTS_VALUE &&
-            yadif->cur->pts != AV_NOPTS_VALUE) {
-            yadif->out->pts =
-                (yadif->next->pts&yadif->cur->pts) +
-                ((yadif->next->pts^yadif->cur->pts)>>1);
-        } else {
-            yadif->out->pts = AV_NOPTS_VALUE;
-        }
-        avfilter_start_frame(ctx->outputs[0], yadif->out);
-    }
-    avfilter_draw_slice(ctx->outputs[0], 0, link->h, 1);
-    avfilter_end_frame(ctx->outputs[0]);
-
-    yadif->frame_pending = (yadif->mode&1) && !is_second;
+	#define M(dx) r.cur_m[clamp_x(x + (dx), w)]
+	#define P(dx) r.cur_p[clamp_x(x + (dx), w)]
+
+	const int c = r.cur_m[x];
+	const int d = (r.prev2[x] + r.next2[x]) >> 1;
+	const int e = r.cur_p[x];
+
+	const int temporal_diff0 = std::abs(r.prev2[x] - r.next2[x]);
+	const int temporal_diff1 = (std::abs(r.prev_m[x] - c) + std::abs(r.prev_p[x] - e)) >> 1;
+	const int temporal_diff2 = (std::abs(r.next_m[x] - c) + std::abs(r.next_p[x] - e)) >> 1;
+
+	int diff			= std::max(std::max(temporal_diff0 >> 1, temporal_diff1), temporal_diff2);
+	int spatial_pred	= (c + e) >> 1;
+	int spatial_score	= std::abs(M(-1) - P(-1)) + std::abs(c - e) + std::abs(M(1) - P(1)) - 1;
+
+	for(int sign = -1; sign <= 1; sign += 2) // Edge directions, the second step is only tried if the first one improved.
+	{
+		for(int j = sign; std::abs(j) <= 2; j += sign)
+		{
+			const int score = std::abs(M(j - 1) - P(-j - 1)) + std::abs(M(j) - P(-j)) + std::abs(M(j + 1) - P(-j + 1));
+			if(score >= spatial_score)
+				break;
+			spatial_score	= score;
+			spatial_pred	= (M(j) + P(-j)) >> 1;
+		}
+	}
+
+	#undef M
+	#undef P
+
+	if(spatial_check)
+	{
+		const int b = (r.prev2_m2[x] + r.next2_m2[x]) >> 1;
+		const int f = (r.prev2_p2[x] + r.next2_p2[x]) >> 1;
+		const int max = std::max(std::max(d - e, d - c), std::min(b - c, f - e));
+		const int min = std::min(std::min(d - e, d - c), std::max(b - c, f - e));
+
+		diff = std::max(std::max(diff, min), -max);
+	}
+
+	dst[x] = static_cast<uint8_t>(std::min(std::max(spatial_pred, d - diff), d + diff));
 }
 
-void start_frame(AVFilterLink *link, AVFilterBufferRef *picref)
+inline __m128i load8(const uint8_t* p)
 {
-    AVFilterContext *ctx = link->dst;
-    YADIFContext *yadif = (YADIFContext*)ctx->priv;
-
-    if (yadif->frame_pending)
-        return_frame(ctx, 1);
-
-    if (yadif->prev)
-        avfilter_unref_buffer(yadif->prev);
-    yadif->prev = yadif->cur;
-    yadif->cur  = yadif->next;
-    yadif->next = picref;
-
-    if (!yadif->cur)
-        return;
-
-    if (yadif->auto_enable && !yadif->cur->video->interlaced) {
-        yadif->out  = avfilter_ref_buffer(yadif->cur, AV_PERM_READ);
-        avfilter_unref_buffer(yadif->prev);
-        yadif->prev = NULL;
-        avfilter_start_frame(ctx->outputs[0], yadif->out);
-        return;
-    }
-
-    if (!yadif->prev)
-        yadif->prev = avfilter_ref_buffer(yadif->cur, AV_PERM_READ);
-
-    yadif->out = avfilter_get_video_buffer(ctx->outputs[0], AV_PERM_WRITE | AV_PERM_PRESERVE |
-                                       AV_PERM_REUSE, link->w, link->h);
-
-    avfilter_copy_buffer_ref_props(yadif->out, yadif->cur);
-    yadif->out->video->interlaced = 0;
-    avfilter_start_frame(ctx->outputs[0], yadif->out);
+	return _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)), _mm_setzero_si128());
 }
 
-void end_frame(AVFilterLink *link)
+inline __m128i abs_diff(__m128i a, __m128i b)
 {
-    AVFilterContext *ctx = link->dst;
-    YADIFContext *yadif = (YADIFContext*)ctx->priv;
-
-    if (!yadif->out)
-        return;
-
-    if (yadif->auto_enable && !yadif->cur->video->interlaced) {
-        avfilter_draw_slice(ctx->outputs[0], 0, link->h, 1);
-        avfilter_end_frame(ctx->outputs[0]);
-        return;
-    }
-
-    return_frame(ctx, 0);
+	return _mm_max_epi16(_mm_sub_epi16(a, b), _mm_sub_epi16(b, a));
 }
 
-int request_frame(AVFilterLink *link)
+inline __m128i average(__m128i a, __m128i b)
 {
-    AVFilterContext *ctx = link->src;
-    YADIFContext *yadif = (YADIFContext*)ctx->priv;
-
-    if (yadif->frame_pending) {
-        return_frame(ctx, 1);
-        return 0;
-    }
-
-    do {
-        int ret;
-		ret = avfilter_request_frame(link->src->inputs[0]);
-        if (ret)
-            return ret;
-    } while (!yadif->cur);
-
-    return 0;
+	return _mm_srli_epi16(_mm_add_epi16(a, b), 1);
 }
 
-int poll_frame(AVFilterLink *link)
+inline __m128i select(__m128i mask, __m128i a, __m128i b)
 {
-    YADIFContext *yadif = (YADIFContext*)link->src->priv;
-    int ret, val;
-
-    if (yadif->frame_pending)
-        return 1;
-
-    val = avfilter_poll_frame(link->src->inputs[0]);
-
-    if (val==1 && !yadif->next) { //FIXME change API to not requre this red tape
-        if ((ret = avfilter_request_frame(link->src->inputs[0])) < 0)
-            return ret;
-        val = avfilter_poll_frame(link->src->inputs[0]);
-    }
-    assert(yadif->next || !val);
-
-    if (yadif->auto_enable && yadif->next && !yadif->next->video->interlaced)
-        return val;
-
-    return val * ((yadif->mode&1)+1);
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
 }
 
-void uninit(AVFilterContext *ctx)
+// Same as filter_pixel for 8 pixels in 16-bit lanes. Requires 3 pixels of margin on both sides of [x, x+8).
+void filter_line(uint8_t* dst, const line_refs& r, int w, bool spatial_check)
 {
-    YADIFContext *yadif = (YADIFContext*)ctx->priv;
-
-    if (yadif->prev) avfilter_unref_buffer(yadif->prev);
-    if (yadif->cur ) avfilter_unref_buffer(yadif->cur );
-    if (yadif->next) avfilter_unref_buffer(yadif->next);
+	const int margin = 3;
+
+	int x = 0;
+	for(; x < std::min(margin, w); ++x)
+		filter_pixel(dst, r, x, w, spatial_check);
+
+	const __m128i one = _mm_set1_epi16(1);
+
+	for(; x + 8 + margin <= w; x += 8)
+	{
+		const auto cm = r.cur_m + x;
+		const auto cp = r.cur_p + x;
+
+		const auto c	= load8(cm);
+		const auto e	= load8(cp);
+		const auto p2	= load8(r.prev2 + x);
+		const auto n2	= load8(r.next2 + x);
+		const auto d	= average(p2, n2);
+
+		const auto temporal_diff0 = abs_diff(p2, n2);
+		const auto temporal_diff1 = _mm_srli_epi16(_mm_add_epi16(abs_diff(load8(r.prev_m + x), c), abs_diff(load8(r.prev_p + x), e)), 1);
+		const auto temporal_diff2 = _mm_srli_epi16(_mm_add_epi16(abs_diff(load8(r.next_m + x), c), abs_diff(load8(r.next_p + x), e)), 1);
+
+		auto diff			= _mm_max_epi16(_mm_max_epi16(_mm_srli_epi16(temporal_diff0, 1), temporal_diff1), temporal_diff2);
+		auto spatial_pred	= average(c, e);
+		auto spatial_score	= _mm_sub_epi16(_mm_add_epi16(_mm_add_epi16(abs_diff(load8(cm - 1), load8(cp - 1)), abs_diff(c, e)), abs_diff(load8(cm + 1), load8(cp + 1))), one);
+
+		for(int sign = -1; sign <= 1; sign += 2)
+		{
+			auto improved = _mm_cmpeq_epi16(one, one);
+			for(int j = sign; std::abs(j) <= 2; j += sign)
+			{
+				const auto score = _mm_add_epi16(_mm_add_epi16(
+					abs_diff(load8(cm + j - 1), load8(cp - j - 1)), 
+					abs_diff(load8(cm + j),		load8(cp - j))), 
+					abs_diff(load8(cm + j + 1), load8(cp - j + 1)));
+
+				improved		= _mm_and_si128(improved, _mm_cmplt_epi16(score, spatial_score));
+				spatial_score	= select(improved, score, spatial_score);
+				spatial_pred	= select(improved, average(load8(cm + j), load8(cp - j)), spatial_pred);
+			}
+		}
+
+		if(spatial_check)
+		{
+			const auto b = average(load8(r.prev2_m2 + x), load8(r.next2_m2 + x));
+			const auto f = average(load8(r.prev2_p2 + x), load8(r.next2_p2 + x));
+
+			const auto de = _mm_sub_epi16(d, e);
+			const auto dc = _mm_sub_epi16(d, c);
+			const auto bc = _mm_sub_epi16(b, c);
+			const auto fe = _mm_sub_epi16(f, e);
+
+			const auto max = _mm_max_epi16(_mm_max_epi16(de, dc), _mm_min_epi16(bc, fe));
+			const auto min = _mm_min_epi16(_mm_min_epi16(de, dc), _mm_max_epi16(bc, fe));
+
+			diff = _mm_max_epi16(_mm_max_epi16(diff, min), _mm_sub_epi16(_mm_setzero_si128(), max));
+		}
+
+		spatial_pred = _mm_min_epi16(_mm_max_epi16(spatial_pred, _mm_sub_epi16(d, diff)), _mm_add_epi16(d, diff));
+
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(dst + x), _mm_packus_epi16(spatial_pred, spatial_pred));
+	}
+
+	for(; x < w; ++x)
+		filter_pixel(dst, r, x, w, spatial_check);
 }
 
-int query_formats(AVFilterContext *ctx)
+const uint8_t* row(const AVFrame& frame, int plane, int y)
 {
-    static const enum PixelFormat pix_fmts[] = {
-        PIX_FMT_YUV420P,
-        PIX_FMT_YUV422P,
-        PIX_FMT_YUV444P,
-        PIX_FMT_YUV410P,
-        PIX_FMT_YUV411P,
-        PIX_FMT_GRAY8,
-        PIX_FMT_YUVJ420P,
-        PIX_FMT_YUVJ422P,
-        PIX_FMT_YUVJ444P,
-        AV_NE( PIX_FMT_GRAY16BE, PIX_FMT_GRAY16LE ),
-        PIX_FMT_YUV440P,
-        PIX_FMT_YUVJ440P,
-        AV_NE( PIX_FMT_YUV420P16BE, PIX_FMT_YUV420P16LE ),
-        AV_NE( PIX_FMT_YUV422P16BE, PIX_FMT_YUV422P16LE ),
-        AV_NE( PIX_FMT_YUV444P16BE, PIX_FMT_YUV444P16LE ),
-        PIX_FMT_NONE
-    };
-
-    avfilter_set_common_pixel_formats(ctx, avfilter_make_format_list((const int*)pix_fmts));
-
-    return 0;
+	return frame.data[plane] + y * frame.linesize[plane];
 }
 
-int init(AVFilterContext *ctx, const char *args, void *opaque)
+// Keeps the lines of one field of cur and rebuilds the others. parity is the field that is kept, 0 for the top field.
+void filter_frame(AVFrame& dst, const AVFrame& prev, const AVFrame& cur, const AVFrame& next, int parity, int tff)
 {
-    YADIFContext *yadif = (YADIFContext*)ctx->priv;
-    av_unused int cpu_flags = av_get_cpu_flags();
-
-    yadif->mode = 0;
-    yadif->parity = -1;
-    yadif->auto_enable = 0;
-    yadif->csp = NULL;
+	const auto desc			= av_pix_fmt_desc_get(static_cast<AVPixelFormat>(cur.format));
+	const int nb_planes		= av_pix_fmt_count_planes(static_cast<AVPixelFormat>(cur.format));
+	const bool use_prev		= (parity ^ tff) != 0; // Which neighbour shares a moment in time with the rebuilt field.
+
+	for(int plane = 0; plane < nb_planes; ++plane)
+	{
+		const bool is_chroma	= plane == 1 || plane == 2;
+		const int w				= is_chroma ? -((-cur.width)  >> desc->log2_chroma_w) : cur.width;
+		const int h				= is_chroma ? -((-cur.height) >> desc->log2_chroma_h) : cur.height;
+
+		const auto& prev2 = use_prev ? prev : cur;
+		const auto& next2 = use_prev ? cur  : next;
+
+		tbb::parallel_for(tbb::blocked_range<int>(0, h, 16), [&](const tbb::blocked_range<int>& rows)
+		{
+			for(int y = rows.begin(); y != rows.end(); ++y)
+			{
+				auto out = dst.data[plane] + y * dst.linesize[plane];
+
+				if(((y ^ parity) & 1) == 0 || h < 4)
+				{
+					std::memcpy(out, row(cur, plane, y), w);
+					continue;
+				}
+
+				const int ym = y > 0 ? y - 1 : y + 1;
+				const int yp = y + 1 < h ? y + 1 : y - 1;
+
+				const bool spatial_check = y != 1 && y + 2 != h; // Lines two rows away are out of the picture otherwise.
+
+				line_refs r;
+				r.cur_m		= row(cur, plane, ym);
+				r.cur_p		= row(cur, plane, yp);
+				r.prev_m	= row(prev, plane, ym);
+				r.prev_p	= row(prev, plane, yp);
+				r.next_m	= row(next, plane, ym);
+				r.next_p	= row(next, plane, yp);
+				r.prev2		= row(prev2, plane, y);
+				r.next2		= row(next2, plane, y);
+				r.prev2_m2	= spatial_check ? row(prev2, plane, 2*ym - y) : r.prev2;
+				r.next2_m2	= spatial_check ? row(next2, plane, 2*ym - y) : r.next2;
+				r.prev2_p2	= spatial_check ? row(prev2, plane, 2*yp - y) : r.prev2;
+				r.next2_p2	= spatial_check ? row(next2, plane, 2*yp - y) : r.next2;
+
+				filter_line(out, r, w, spatial_check);
+			}
+		});
+	}
+}
 
-    if (args) sscanf(args, "%d:%d:%d", &yadif->mode, &yadif->parity, &yadif->auto_enable);
+// Weaves the lines of parity from first with the other lines from second.
+void merge_fields(AVFrame& dst, const AVFrame& first, const AVFrame& second, int parity)
+{
+	const auto desc			= av_pix_fmt_desc_get(static_cast<AVPixelFormat>(first.format));
+	const int nb_planes		= av_pix_fmt_count_planes(static_cast<AVPixelFormat>(first.format));
+
+	for(int plane = 0; plane < nb_planes; ++plane)
+	{
+		const bool is_chroma	= plane == 1 || plane == 2;
+		const int w				= is_chroma ? -((-first.width)  >> desc->log2_chroma_w) : first.width;
+		const int h				= is_chroma ? -((-first.height) >> desc->log2_chroma_h) : first.height;
+
+		tbb::parallel_for(tbb::blocked_range<int>(0, h, 64), [&](const tbb::blocked_range<int>& rows)
+		{
+			for(int y = rows.begin(); y != rows.end(); ++y)
+				std::memcpy(dst.data[plane] + y * dst.linesize[plane], row(((y ^ parity) & 1) == 0 ? first : second, plane, y), w);
+		});
+	}
+}
 
-	
-	auto module = LoadLibrary(L"avfilter-2.dll");
-	static std::shared_ptr<void> lib(module, FreeLibrary);
-    yadif->filter_line = (decltype(yadif->filter_line))(GetProcAddress(module, "ff_yadif_filter_line_ssse3"));
+}
 
-    //yadif->filter_line = filter_line_c;
-    //if (HAVE_SSSE3 && cpu_flags & AV_CPU_FLAG_SSSE3)
-    //    yadif->filter_line = ff_yadif_filter_line_ssse3;
-    //else if (HAVE_SSE && cpu_flags & AV_CPU_FLAG_SSE2)
-    //    yadif->filter_line = ff_yadif_filter_line_sse2;
-    //else if (HAVE_MMX && cpu_flags & AV_CPU_FLAG_MMX)
-    //    yadif->filter_line = ff_yadif_filter_line_mmx;
+struct scalable_yadif::implementation : boost::noncopyable
+{
+	const deinterlace_mode::type			mode_;
+	std::shared_ptr<AVFrame>				prev_;
+	std::shared_ptr<AVFrame>				cur_;
+	std::shared_ptr<AVFrame>				next_;
+	std::queue<safe_ptr<AVFrame>>			output_;
+
+	implementation(deinterlace_mode::type mode)
+		: mode_(mode)
+	{
+	}
+
+	void push(const std::shared_ptr<AVFrame>& frame)
+	{
+		if(!frame || frame->width < 1 || frame->height < 1)
+			return;
+
+		if(cur_ && (frame->width != cur_->width || frame->height != cur_->height || frame->format != cur_->format))
+			clear();
+
+		prev_ = cur_;
+		cur_  = next_;
+		next_ = frame;
+
+		if(!cur_)
+			return;
+
+		if(!prev_)
+			prev_ = cur_;
+
+		const int tff = (cur_->flags & AV_FRAME_FLAG_INTERLACED) ? ((cur_->flags & AV_FRAME_FLAG_TOP_FIELD_FIRST) ? 1 : 0) : 1;
+
+		if(mode_ == deinterlace_mode::field_merge)
+			output_.push(make_merged_frame(tff));
+		else if(mode_ == deinterlace_mode::send_frame)
+			output_.push(make_frame(tff ^ 1, tff, cur_->pts));
+		else
+		{
+			const bool has_pts = cur_->pts != AV_NOPTS_VALUE && next_->pts != AV_NOPTS_VALUE;
+			output_.push(make_frame(tff ^ 1, tff, has_pts ? cur_->pts * 2 : AV_NOPTS_VALUE));
+			output_.push(make_frame(tff, tff, has_pts ? cur_->pts + next_->pts : AV_NOPTS_VALUE));
+		}
+	}
+
+	safe_ptr<AVFrame> make_frame(int parity, int tff, int64_t pts)
+	{
+		auto frame = create_frame();
+		frame->format	= cur_->format;
+		frame->width	= cur_->width;
+		frame->height	= cur_->height;
+		FF_RET(av_frame_get_buffer(frame.get(), 32), "scalable_yadif.av_frame_get_buffer");
+		FF_RET(av_frame_copy_props(frame.get(), cur_.get()), "scalable_yadif.av_frame_copy_props");
+
+		filter_frame(*frame, *prev_, *cur_, *next_, parity, tff);
+
+		frame->pts		= pts;
+		frame->flags	&= ~(AV_FRAME_FLAG_INTERLACED | AV_FRAME_FLAG_TOP_FIELD_FIRST);
+		return make_safe_ptr(frame);
+	}
+
+	// The second field of cur_ comes first, followed by the first field of next_. The field order is inverted.
+	safe_ptr<AVFrame> make_merged_frame(int tff)
+	{
+		auto frame = create_frame();
+		frame->format	= cur_->format;
+		frame->width	= cur_->width;
+		frame->height	= cur_->height;
+		FF_RET(av_frame_get_buffer(frame.get(), 32), "scalable_yadif.av_frame_get_buffer");
+		FF_RET(av_frame_copy_props(frame.get(), cur_.get()), "scalable_yadif.av_frame_copy_props");
+
+		merge_fields(*frame, *cur_, *next_, tff); // The second field of a top field first frame is the bottom one.
+
+		frame->flags |= AV_FRAME_FLAG_INTERLACED;
+		if(tff)
+			frame->flags &= ~AV_FRAME_FLAG_TOP_FIELD_FIRST;
+		else
+			frame->flags |= AV_FRAME_FLAG_TOP_FIELD_FIRST;
+		return make_safe_ptr(frame);
+	}
+
+	void flush()
+	{
+		if(next_)
+			push(next_); // The last frame is its own successor.
+	}
+
+	void clear()
+	{
+		prev_.reset();
+		cur_.reset();
+		next_.reset();
+		while(!output_.empty())
+			output_.pop();
+	}
+
+	std::vector<safe_ptr<AVFrame>> poll_all()
+	{
+		std::vector<safe_ptr<AVFrame>> frames;
+		while(!output_.empty())
+		{
+			frames.push_back(output_.front());
+			output_.pop();
+		}
+		return frames;
+	}
+};
 
-    av_log(ctx, AV_LOG_INFO, "mode:%d parity:%d auto_enable:%d\n", yadif->mode, yadif->parity, yadif->auto_enable);
+scalable_yadif::scalable_yadif(deinterlace_mode::type mode) : impl_(new implementation(mode)){}
+void scalable_yadif::push(const std::shared_ptr<AVFrame>& frame){impl_->push(frame);}
+void scalable_yadif::flush(){impl_->flush();}
+void scalable_yadif::clear(){impl_->clear();}
+std::vector<safe_ptr<AVFrame>> scalable_yadif::poll_all(){return impl_->poll_all();}
 
-    return 0;
+bool scalable_yadif::is_supported(int pix_fmt)
+{
+	switch(pix_fmt)
+	{
+	case AV_PIX_FMT_YUV420P:
+	case AV_PIX_FMT_YUV422P:
+	case AV_PIX_FMT_YUV444P:
+	case AV_PIX_FMT_YUV411P:
+	case AV_PIX_FMT_YUVJ420P:
+	case AV_PIX_FMT_YUVJ422P:
+	case AV_PIX_FMT_YUVJ444P:
+	case AV_PIX_FMT_YUVA420P:
+	case AV_PIX_FMT_YUVA422P:
+	case AV_PIX_FMT_YUVA444P:
+	case AV_PIX_FMT_GRAY8:
+		return true;
+	default:
+		return false;
+	}
 }
 
-void null_draw_slice(AVFilterLink *link, int y, int h, int slice_dir) { }
-
-void register_scalable_yadif()
-{
-	static AVFilter avfilter_vf_syadif;
-    avfilter_vf_syadif.name          = "syadif";
-    avfilter_vf_syadif .description   = "Deinterlace the input image";
-
-    avfilter_vf_syadif.priv_size     = sizeof(YADIFContext);
-    avfilter_vf_syadif.init          = init;
-    avfilter_vf_syadif.uninit        = uninit;
-    avfilter_vf_syadif.query_formats = query_formats;
-
-	static AVFilterPad inputs[2];
-
-	inputs[0].name				= "default";         
-	inputs[0].type				= AVMEDIA_TYPE_VIDEO,
-    inputs[0].start_frame		= start_frame;
-    inputs[0].get_video_buffer	= get_video_buffer;
-    inputs[0].draw_slice		= null_draw_slice;
-    inputs[0].end_frame			= end_frame;
-	inputs[1].name				= nullptr;
-	
-	avfilter_vf_syadif.inputs = inputs;
-
-	static AVFilterPad outputs[2];
-
-	outputs[0].name				= "default";
-	outputs[0].type				= AVMEDIA_TYPE_VIDEO;
-	outputs[0].poll_frame		= poll_frame;
-	outputs[0].request_frame	= request_frame;
-	outputs[1].name				= nullptr;
-	
-	avfilter_vf_syadif.outputs = outputs;
-	
-	avfilter_register(&avfilter_vf_syadif);
-};
+}}
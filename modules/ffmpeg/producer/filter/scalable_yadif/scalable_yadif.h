@@ -1,23 +1,60 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
 #pragma once
 
-extern "C" 
+#include <common/memory/safe_ptr.h>
+
+#include <boost/noncopyable.hpp>
+
+#include <vector>
+
+struct AVFrame;
+
+namespace caspar { namespace ffmpeg {
+
+struct deinterlace_mode
 {
-	#define __STDC_CONSTANT_MACROS
-	#define __STDC_LIMIT_MACROS
-	#include <libavutil/cpu.h>
-	#include <libavutil/common.h>
-	#include <libavutil/pixdesc.h>
-	#include <libavfilter/avfilter.h>
-}
-
-int init(AVFilterContext *ctx, const char *args, void *opaque);
-void uninit(AVFilterContext *ctx);
-int query_formats(AVFilterContext *ctx);
-int poll_frame(AVFilterLink *link);
-int request_frame(AVFilterLink *link);
-void start_frame(AVFilterLink *link, AVFilterBufferRef *picref);
-void end_frame(AVFilterLink *link);
-void return_frame(AVFilterContext *ctx, int is_second);
-AVFilterBufferRef *get_video_buffer(AVFilterLink *link, int perms, int w, int h);
-
-void register_scalable_yadif();
\ No newline at end of file
+	enum type
+	{
+		send_frame = 0,	// yadif mode 0. One frame per frame, the first field is kept and the second is interpolated from it and its neighbours.
+		send_field,		// yadif mode 1. One frame per field, at twice the input rate. Timestamps are in half the input time base.
+		field_merge		// Weave. One interlaced frame per frame from the second field of a frame and the first field of the next one, 
+						// which swaps the field order without filtering.
+	};
+};
+
+// yadif on 8-bit planar YUV, run row parallel with SSE2 line kernels, and field merging. Output lags input by one frame.
+class scalable_yadif : boost::noncopyable
+{
+public:
+	explicit scalable_yadif(deinterlace_mode::type mode);
+
+	static bool is_supported(int pix_fmt);
+
+	void push(const std::shared_ptr<AVFrame>& frame);
+	void flush();
+	void clear();
+	std::vector<safe_ptr<AVFrame>> poll_all();
+private:
+	struct implementation;
+	safe_ptr<implementation> impl_;
+};
+
+}}
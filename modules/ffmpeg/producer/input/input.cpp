@@ -22,12 +22,14 @@
 #include "../../stdafx.h"
 
 #include "input.h"
+#include "keyframe_index.h"
+#include "read_ahead_io.h"
 
 #include "../util/util.h"
 #include "../util/flv.h"
 #include "../../ffmpeg_error.h"
 #include "../../ffmpeg.h"
-#include "../../tbb_avcodec.h"
+#include "../../decoder_threads.h"
 
 #include <core/video_format.h>
 
@@ -37,9 +39,7 @@
 #include <common/exception/exceptions.h>
 #include <common/exception/win32_exception.h>
 
-#include <tbb/concurrent_queue.h>
 #include <tbb/atomic.h>
-#include <tbb/recursive_mutex.h>
 
 #include <boost/rational.hpp>
 #include <boost/range/algorithm.hpp>
@@ -47,6 +47,8 @@
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/thread.hpp>
 
+#include <deque>
+
 #if defined(_MSC_VER)
 #pragma warning (push)
 #pragma warning (disable : 4244)
@@ -61,23 +63,91 @@ extern "C"
 #pragma warning (pop)
 #endif
 
-static const size_t MAX_BUFFER_COUNT    = 500;
+// Reading pauses once every queue holds MIN_BUFFER_COUNT packets or MIN_BUFFER_SIZE bytes, or once a queue holds 
+// MAX_BUFFER_SIZE bytes and its consumer is left to drain it. Only while the consumer of the other stream waits for packets 
+// does reading go on, with the demuxer skipping the packets of the overflowed stream. Queued packets are never dropped.
 static const size_t MIN_BUFFER_COUNT    = 50;
+static const size_t MIN_BUFFER_SIZE     = 16 * 1024 * 1024;
+static const size_t MAX_BUFFER_SIZE     = 64 * 1024 * 1024;
+
+static const boost::posix_time::time_duration MAX_POP_WAIT = boost::posix_time::milliseconds(320);
 
 namespace caspar { namespace ffmpeg {
 
+struct packet_queue
+{
+	std::deque<std::shared_ptr<AVPacket>>	packets;
+	size_t									size;
+	int										waiters; // Consumers waiting for a packet.
+
+	packet_queue()
+		: size(0)
+		, waiters(0)
+	{
+	}
+
+	void push(const std::shared_ptr<AVPacket>& packet)
+	{
+		packets.push_back(packet);
+		size += packet->size;
+	}
+
+	bool try_pop(std::shared_ptr<AVPacket>& packet)
+	{
+		if(packets.empty())
+			return false;
+
+		packet = std::move(packets.front());
+		packets.pop_front();
+		size -= packet->size;
+		return true;
+	}
+
+	void clear()
+	{
+		packets.clear();
+		size = 0;
+	}
+
+	bool satisfied() const
+	{
+		return packets.size() >= MIN_BUFFER_COUNT || size >= MIN_BUFFER_SIZE;
+	}
+
+	bool overflowed() const
+	{
+		return size >= MAX_BUFFER_SIZE;
+	}
+
+	bool starving() const
+	{
+		return waiters > 0 && packets.empty();
+	}
+};
+
 struct input::implementation : boost::noncopyable
 {		
 	const safe_ptr<diagnostics::graph>							graph_;
 
+	std::shared_ptr<read_ahead_io>								io_; // Set by open_input for local files.
 	const safe_ptr<AVFormatContext>								format_context_; // Destroy this last
 			
 	const std::wstring											filename_;
 	tbb::atomic<bool>											is_eof_;
 	tbb::atomic<int>											video_stream_index_;
 	tbb::atomic<int>											audio_stream_index_;
-	tbb::concurrent_bounded_queue<std::shared_ptr<AVPacket>>	audio_buffer_;
-	tbb::concurrent_bounded_queue<std::shared_ptr<AVPacket>>	video_buffer_;
+	tbb::atomic<bool>											is_seeking_;
+
+	boost::mutex												mutex_;
+	boost::condition_variable									packet_available_;
+	packet_queue												audio_buffer_;
+	packet_queue												video_buffer_;
+	bool														is_reading_;
+	bool														audio_discarded_; // Only accessed on executor_.
+	bool														video_discarded_; // Only accessed on executor_.
+
+	std::shared_ptr<const keyframe_index>						keyframe_index_; // Only accessed on executor_ once reading has started.
+
 	executor													executor_;
 
 	explicit implementation(const safe_ptr<diagnostics::graph> graph, 
@@ -86,15 +156,19 @@ struct input::implementation : boost::noncopyable
 		: graph_(graph)
 		, filename_(filename)
 		, format_context_(open_input(filename))
+		, is_reading_(false)
+		, audio_discarded_(false)
+		, video_discarded_(false)
 		, executor_(print())
 	{
 		is_eof_			= false;
-		video_buffer_.set_capacity(MAX_BUFFER_COUNT);
-		audio_buffer_.set_capacity(MAX_BUFFER_COUNT);
+		is_seeking_		= false;
 		video_stream_index_ = -1;
 		audio_stream_index_ = -1;
 		graph_->set_color("audio-buffer-count", diagnostics::color(0.7f, 0.4f, 0.4f));
+		graph_->set_color("audio-buffer-size", diagnostics::color(0.5f, 0.3f, 0.3f));
 		graph_->set_color("video-buffer-count", diagnostics::color(1.0f, 1.0f, 0.0f));
+		graph_->set_color("video-buffer-size", diagnostics::color(0.7f, 0.7f, 0.0f));
 	}
 
 	safe_ptr<AVCodecContext> open_audio_codec(AVStream** stream)
@@ -124,56 +198,46 @@ struct input::implementation : boost::noncopyable
 		if (!ctx)
 			BOOST_THROW_EXCEPTION(caspar_exception() << msg_info(narrow(print()) + " Video codec context not created."));
 		avcodec_parameters_to_context(ctx, format_context_->streams[index]->codecpar);
-		if (tbb_avcodec_open(ctx, decoder, NULL) < 0)
-		{
-			CASPAR_LOG(debug) << print() << L" Multithreaded avcodec_open2 failed";
-			ctx->thread_count = 2;
-			THROW_ON_ERROR2(avcodec_open2(ctx, decoder, NULL), print());
-		}
+		THROW_ON_ERROR2(open_decoder(ctx, decoder, NULL), print());
+		keyframe_index_ = keyframe_index::get(filename_, format_context_.get(), index); // Before reading starts, the demuxer may add to its index while reading.
 		video_stream_index_ = index;
 		*stream = format_context_->streams[index];
 		ctx->opaque = format_context_->url;
-		return safe_ptr<AVCodecContext>(ctx, [](AVCodecContext* c) { avcodec_free_context(&c); });
+		return safe_ptr<AVCodecContext>(ctx, close_decoder);
 	}
 
 	void try_pop_audio(std::shared_ptr<AVPacket>& packet)
 	{	
-		bool result = false;
-		for (int i = 0; i < 32 && !result; ++i)
-		{
-			result = audio_buffer_.try_pop(packet);
-			if (!result)
-				if (is_eof_)
-					return;
-				else
-				{
-					boost::this_thread::sleep(boost::posix_time::milliseconds(10));
-					result = audio_buffer_.try_pop(packet);
-				}
-		}
-		if(result)
-			tick();
-		graph_->set_value("audio-buffer-count", (static_cast<double>(audio_buffer_.size())+0.001)/MAX_BUFFER_COUNT);
+		try_pop(audio_buffer_, packet);
 	}
 
 	void try_pop_video(std::shared_ptr<AVPacket>& packet)
 	{
-		bool result = false;
-		for (int i = 0; i < 32 && !result; ++i)
+		try_pop(video_buffer_, packet);
+	}
+
+	// Waits up to MAX_POP_WAIT for a packet, leaves packet empty on eof or timeout.
+	void try_pop(packet_queue& queue, std::shared_ptr<AVPacket>& packet)
+	{
 		{
-			result = video_buffer_.try_pop(packet);
-			if (!result)
-				if (is_eof_)
-					return;
-				else
-				{
-					boost::this_thread::sleep(boost::posix_time::milliseconds(10));
-					result = video_buffer_.try_pop(packet);
-				}
+			boost::unique_lock<boost::mutex> lock(mutex_);
+
+			auto deadline = boost::get_system_time() + MAX_POP_WAIT;
+
+			++queue.waiters;
+			while(!queue.try_pop(packet) && !is_eof_)
+			{
+				schedule_read(lock);
+
+				if(!packet_available_.timed_wait(lock, deadline))
+					break;
+			}
+			--queue.waiters;
+
+			schedule_read(lock);
 		}
-		if(result)
-			tick();
-		graph_->set_value("video-buffer-count", (static_cast<double>(video_buffer_.size()) + 0.001)/MAX_BUFFER_COUNT);
+
+		update_graph();
 	}
 
 	std::wstring print() const
@@ -181,10 +245,14 @@ struct input::implementation : boost::noncopyable
 		return L"ffmpeg_input[" + filename_ + L")]";
 	}
 	
+	// Requires mutex_.
 	bool full() const
 	{
-		return (audio_stream_index_ == -1 || audio_buffer_.size() > MIN_BUFFER_COUNT)
-			&& (video_stream_index_ == -1 || video_buffer_.size() > MIN_BUFFER_COUNT);
+		if((audio_stream_index_ == -1 || audio_buffer_.satisfied()) && (video_stream_index_ == -1 || video_buffer_.satisfied()))
+			return true;
+
+		return (audio_buffer_.overflowed() && !video_buffer_.starving())
+			|| (video_buffer_.overflowed() && !audio_buffer_.starving());
 	}
 
 	bool is_eof() const
@@ -194,75 +262,196 @@ struct input::implementation : boost::noncopyable
 
 	void tick()
 	{	
-		if(is_eof_)
+		boost::unique_lock<boost::mutex> lock(mutex_);
+		schedule_read(lock);
+	}
+
+	// Starts the reader unless it is already running. The reader stops by itself once the queues are full and 
+	// is started again by the consumers, so there is no polling on either side.
+	void schedule_read(boost::unique_lock<boost::mutex>&)
+	{
+		if(is_reading_ || is_eof_ || full())
 			return;
+
+		is_reading_ = true;
+
 		executor_.begin_invoke([this]
-		{			
-			while (!is_eof_ && !full())
+		{
+			read_packets();
+		});
+	}
+
+	void read_packets()
+	{
+		while(true)
+		{
+			bool discard_audio, discard_video;
 			{
-				try
+				boost::lock_guard<boost::mutex> lock(mutex_);
+
+				if(is_seeking_ || is_eof_ || full())
 				{
-					auto packet = create_packet();
-					auto ret = av_read_frame(format_context_.get(), packet.get()); 
-					is_eof_ = ret == AVERROR(EIO) || ret == AVERROR_EOF;
-					if (is_eof_)
-						CASPAR_LOG(trace) << print() << " Reached EOF.";
-					else
-					{
-						THROW_ON_ERROR(ret, "av_read_frame", print());
-						if (packet->stream_index == video_stream_index_ && packet->size > 0)
-						{
-							if (!video_buffer_.try_push(packet))
-							{
-								video_buffer_.clear();
-								video_buffer_.push(packet);
-								CASPAR_LOG(warning) << print() << " Video packet queue cleared due to overflow.";
-							}
-							graph_->set_value("video-buffer-count", (static_cast<double>(video_buffer_.size()) + 0.001) / MAX_BUFFER_COUNT);
-						}
-						if (packet->stream_index == audio_stream_index_ && packet->size > 0)
-						{
-							if (!audio_buffer_.try_push(packet))
-							{
-								audio_buffer_.clear();
-								audio_buffer_.push(packet);
-								CASPAR_LOG(warning) << print() << " Audio packet queue cleared due to overflow.";
-							}
-							graph_->set_value("audio-buffer-count", (static_cast<double>(audio_buffer_.size()) + 0.001) / MAX_BUFFER_COUNT);
-						}
-					}
+					is_reading_ = false;
+					return;
+				}
+
+				discard_audio = audio_buffer_.overflowed();
+				discard_video = video_buffer_.overflowed();
+			}
+
+			try
+			{
+				set_discard(audio_stream_index_, audio_discarded_, discard_audio);
+				set_discard(video_stream_index_, video_discarded_, discard_video);
+
+				auto packet = create_packet();
+				auto ret = av_read_frame(format_context_.get(), packet.get()); 
+
+				if (ret == AVERROR(EIO) || ret == AVERROR_EOF)
+				{
+					CASPAR_LOG(trace) << print() << " Reached EOF.";
+
+					boost::lock_guard<boost::mutex> lock(mutex_);
+					is_eof_ = true;
+					packet_available_.notify_all();
+					continue;
 				}
-				catch (...)
+
+				THROW_ON_ERROR(ret, "av_read_frame", print());
+
+				const bool is_video = packet->stream_index == video_stream_index_;
+				const bool is_audio = packet->stream_index == audio_stream_index_;
+
+				if (packet->size > 0 && ((is_video && !video_discarded_) || (is_audio && !audio_discarded_))) // Not every demuxer honours discard.
 				{
-					CASPAR_LOG_CURRENT_EXCEPTION();
+					{
+						boost::lock_guard<boost::mutex> lock(mutex_);
+						(is_video ? video_buffer_ : audio_buffer_).push(packet);
+						packet_available_.notify_all();
+					}
+
+					update_graph();
 				}
 			}
-		});
-	}	
+			catch (...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+			}
+		}
+	}
+
+	// Makes the demuxer skip the packets of a stream whose queue has overflowed while the other stream is starving.
+	void set_discard(int stream_index, bool& discarded, bool discard)
+	{
+		if(stream_index == -1 || discarded == discard)
+			return;
+
+		format_context_->streams[stream_index]->discard = discard ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+		discarded = discard;
+
+		if(discard)
+			CASPAR_LOG(warning) << print() << (stream_index == video_stream_index_ ? L" Video" : L" Audio") << L" packet queue overflowed while the other stream is starving. Skipping its packets until it drains.";
+	}
+
+	void update_graph()
+	{
+		size_t audio_count, audio_size, video_count, video_size;
+		{
+			boost::lock_guard<boost::mutex> lock(mutex_);
+			audio_count = audio_buffer_.packets.size();
+			audio_size	= audio_buffer_.size;
+			video_count = video_buffer_.packets.size();
+			video_size	= video_buffer_.size;
+		}
+
+		graph_->set_value("audio-buffer-count", (static_cast<double>(audio_count) + 0.001) / MIN_BUFFER_COUNT);
+		graph_->set_value("audio-buffer-size", (static_cast<double>(audio_size) + 0.001) / MAX_BUFFER_SIZE);
+		graph_->set_value("video-buffer-count", (static_cast<double>(video_count) + 0.001) / MIN_BUFFER_COUNT);
+		graph_->set_value("video-buffer-size", (static_cast<double>(video_size) + 0.001) / MAX_BUFFER_SIZE);
+	}
 
 	safe_ptr<AVFormatContext> open_input(const std::wstring resource_name)
 	{
 		AVFormatContext* weak_context = nullptr;
+
+		io_ = read_ahead_io::open(resource_name);
+		if (io_)
+		{
+			weak_context = avformat_alloc_context();
+			if (!weak_context)
+				throw std::bad_alloc();
+			weak_context->pb	 = io_->context();
+			weak_context->flags |= AVFMT_FLAG_CUSTOM_IO;
+		}
+
 		THROW_ON_ERROR2(avformat_open_input(&weak_context, narrow(resource_name).c_str(), nullptr, nullptr), resource_name);
-		safe_ptr<AVFormatContext> context(weak_context, [](AVFormatContext* ctx){avformat_close_input(&ctx);});      
+		auto io = io_;
+		safe_ptr<AVFormatContext> context(weak_context, [io](AVFormatContext* ctx){avformat_close_input(&ctx);}); // Keeps the custom io alive as long as the context.
 		THROW_ON_ERROR2(avformat_find_stream_info(weak_context, nullptr), resource_name);
 		return context;
 	}
 
+	// Seeks straight to the last keyframe before target_time when the file is indexed, otherwise to one second before target_time.
+	int seek_keyframe(int64_t target_time)
+	{
+		if(!keyframe_index_ && video_stream_index_ != -1)
+			keyframe_index_ = keyframe_index::get(filename_, nullptr, video_stream_index_);
+
+		if(keyframe_index_)
+		{
+			auto stream		= format_context_->streams[keyframe_index_->stream_index()];
+			auto start		= stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+			auto target_pts	= start + av_rescale(target_time, stream->time_base.den, static_cast<int64_t>(stream->time_base.num) * AV_TIME_BASE);
+			auto keyframe	= keyframe_index_->find(target_pts);
+
+			if(keyframe)
+			{
+				auto ret = av_seek_frame(format_context_.get(), keyframe_index_->stream_index(), keyframe->pts, AVSEEK_FLAG_BACKWARD);
+
+				// Scanned indexes come from formats without a seek index of their own, some of which can only seek by byte.
+				if(ret < 0 && !keyframe_index_->from_container() && keyframe->pos >= 0 && !(format_context_->iformat->flags & AVFMT_NO_BYTE_SEEK))
+					ret = av_seek_frame(format_context_.get(), -1, keyframe->pos, AVSEEK_FLAG_BYTE);
+
+				return ret;
+			}
+		}
+
+		return av_seek_frame(format_context_.get(), -1, target_time - AV_TIME_BASE, AVSEEK_FLAG_BACKWARD);
+	}
+
+	int64_t bytes_read() const
+	{
+		return io_ ? io_->bytes_read() : (format_context_->pb ? format_context_->pb->bytes_read : 0);
+	}
+
+	double stall_time() const
+	{
+		return io_ ? io_->stall_time() : 0.0;
+	}
+
 	bool seek(int64_t target_time)
 	{
+		is_seeking_ = true; // Makes a running reader yield to the seek.
+
 		return executor_.invoke([this, target_time]() -> bool
 		{
-			audio_buffer_.clear();
-			video_buffer_.clear();
+			{
+				boost::lock_guard<boost::mutex> lock(mutex_);
+				audio_buffer_.clear();
+				video_buffer_.clear();
+				is_eof_ = false;
+			}
+
+			update_graph();
+			set_discard(audio_stream_index_, audio_discarded_, false);
+			set_discard(video_stream_index_, video_discarded_, false);
 			LOG_ON_ERROR2(avformat_flush(format_context_.get()), "FFMpeg input avformat_flush");
-			graph_->set_value("audio-buffer-count", (static_cast<double>(audio_buffer_.size()) + 0.001) / MAX_BUFFER_COUNT);
-			graph_->set_value("video-buffer-count", (static_cast<double>(video_buffer_.size()) + 0.001) / MAX_BUFFER_COUNT);
 			CASPAR_LOG(trace) << print() << " Seeking: " << target_time / 1000 << " ms";
-			is_eof_ = false;
-			int ret = av_seek_frame(format_context_.get(), -1, target_time - AV_TIME_BASE, AVSEEK_FLAG_BACKWARD);
+			int ret = seek_keyframe(target_time);
 			if (ret < 0)
 				CASPAR_LOG(error) << print() << " Seek failed";
+
+			is_seeking_ = false;
 			tick();
 			return ret >= 0;
 		}, high_priority);
@@ -277,6 +466,8 @@ void input::try_pop_video(std::shared_ptr<AVPacket>& packet) { impl_->try_pop_vi
 safe_ptr<AVFormatContext> input::format_context(){return impl_->format_context_;}
 bool input::seek(int64_t target_time) { return impl_->seek(target_time); }
 void input::tick() { impl_->tick(); }
+int64_t input::bytes_read() const { return impl_->bytes_read(); }
+double input::stall_time() const { return impl_->stall_time(); }
 safe_ptr<AVCodecContext> input::open_audio_codec(AVStream** stream) { return impl_->open_audio_codec(stream);}
 safe_ptr<AVCodecContext> input::open_video_codec(AVStream** stream) { return impl_->open_video_codec(stream); }
 
@@ -58,6 +58,9 @@ public:
 	void tick();
 	safe_ptr<AVFormatContext> format_context();
 
+	int64_t bytes_read() const;
+	double stall_time() const; // Seconds the demuxer waited for file reads.
+
 private:
 	struct implementation;
 	std::shared_ptr<implementation> impl_;
@@ -0,0 +1,418 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../../stdafx.h"
+
+#include "keyframe_index.h"
+
+#include "../util/util.h"
+#include "../../ffmpeg_error.h"
+
+#include <common/env.h>
+#include <common/concurrency/executor.h>
+#include <common/exception/exceptions.h>
+#include <common/log/log.h>
+#include <common/utility/string.h>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/timer.hpp>
+
+#include <tbb/atomic.h>
+
+#include <algorithm>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <set>
+
+#if defined(_MSC_VER)
+#pragma warning (push)
+#pragma warning (disable : 4244)
+#endif
+extern "C" 
+{
+	#define __STDC_CONSTANT_MACROS
+	#define __STDC_LIMIT_MACROS
+	#include <libavformat/avformat.h>
+}
+#if defined(_MSC_VER)
+#pragma warning (pop)
+#endif
+
+namespace caspar { namespace ffmpeg {
+
+namespace {
+
+const char* const INDEX_HEADER = "casparcg-keyframe-index 1";
+
+// A container index is only trusted if it reaches this close to the end of the stream, some demuxers index lazily while reading.
+const int64_t MAX_INDEX_GAP = 10 * AV_TIME_BASE;
+
+// Indexes kept in memory, the least recently used is evicted first.
+const size_t MAX_CACHED_INDEXES = 64;
+
+struct file_stamp
+{
+	std::uint64_t	size;
+	std::time_t		write_time;
+
+	file_stamp()
+		: size(0)
+		, write_time(0)
+	{
+	}
+
+	bool operator==(const file_stamp& other) const
+	{
+		return size == other.size && write_time == other.write_time;
+	}
+};
+
+bool stat_file(const std::wstring& filename, file_stamp& stamp)
+{
+	try
+	{
+		boost::filesystem::wpath path(filename);
+		stamp.size			= boost::filesystem::file_size(path);
+		stamp.write_time	= boost::filesystem::last_write_time(path);
+		return true;
+	}
+	catch(...)
+	{
+		return false;
+	}
+}
+
+struct cached_index
+{
+	file_stamp								stamp;
+	std::shared_ptr<const keyframe_index>	index; // nullptr if the file could not be indexed.
+	std::uint64_t							last_used;
+};
+
+struct index_registry
+{
+	boost::mutex							mutex;
+	std::map<std::wstring, cached_index>	indexes;
+	std::uint64_t							use_count;
+	std::set<std::wstring>					scanning;
+	std::unique_ptr<executor>				scanner; // Created on the first scan, destroyed by keyframe_index::uninit.
+	tbb::atomic<bool>						stopped;
+
+	index_registry()
+		: use_count(0)
+	{
+		stopped = false;
+	}
+} g_registry;
+
+// Requires g_registry.mutex.
+void cache(const std::wstring& filename, const file_stamp& stamp, const std::shared_ptr<const keyframe_index>& index)
+{
+	cached_index cached;
+	cached.stamp		= stamp;
+	cached.index		= index;
+	cached.last_used	= ++g_registry.use_count;
+	g_registry.indexes[filename] = cached;
+
+	if(g_registry.indexes.size() <= MAX_CACHED_INDEXES)
+		return;
+
+	auto oldest = std::min_element(g_registry.indexes.begin(), g_registry.indexes.end(), [](const std::pair<const std::wstring, cached_index>& lhs, const std::pair<const std::wstring, cached_index>& rhs)
+	{
+		return lhs.second.last_used < rhs.second.last_used;
+	});
+
+	g_registry.indexes.erase(oldest);
+}
+
+std::wstring index_file(const std::wstring& filename)
+{
+	return env::data_folder() + L"keyframe-index/" + boost::lexical_cast<std::wstring>(boost::hash<std::wstring>()(filename)) + L".txt";
+}
+
+std::shared_ptr<const keyframe_index> from_container(AVFormatContext* context, int stream_index)
+{
+	auto stream = context->streams[stream_index];
+
+	if(stream->duration == AV_NOPTS_VALUE)
+		return nullptr;
+
+	std::vector<keyframe_index::entry> entries;
+
+	const int count = avformat_index_get_entries_count(stream);
+	for(int n = 0; n < count; ++n)
+	{
+		auto index_entry = avformat_index_get_entry(stream, n);
+
+		if(!(index_entry->flags & AVINDEX_KEYFRAME))
+			continue;
+
+		keyframe_index::entry entry = {index_entry->timestamp, index_entry->pos};
+		entries.push_back(entry);
+	}
+
+	if(entries.empty())
+		return nullptr;
+
+	const auto start	= stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+	const auto gap		= start + stream->duration - entries.back().pts;
+
+	if(av_rescale(gap, stream->time_base.num * AV_TIME_BASE, stream->time_base.den) > MAX_INDEX_GAP)
+		return nullptr;
+
+	return std::make_shared<keyframe_index>(stream_index, true, std::move(entries));
+}
+
+std::shared_ptr<const keyframe_index> load(const std::wstring& filename, const file_stamp& stamp, int stream_index)
+{
+	std::ifstream stream(index_file(filename).c_str());
+
+	if(!stream)
+		return nullptr;
+
+	std::string line;
+
+	if(!std::getline(stream, line) || line != INDEX_HEADER)
+		return nullptr;
+
+	try
+	{
+		if(!std::getline(stream, line))
+			return nullptr;
+
+		std::vector<std::string> fields;
+		boost::split(fields, line, boost::is_any_of("\t"));
+
+		if(fields.size() != 4 
+			|| widen(fields[0]) != filename
+			|| boost::lexical_cast<std::uint64_t>(fields[1]) != stamp.size
+			|| boost::lexical_cast<std::time_t>(fields[2]) != stamp.write_time
+			|| boost::lexical_cast<int>(fields[3]) != stream_index)
+			return nullptr;
+
+		std::vector<keyframe_index::entry> entries;
+
+		while(std::getline(stream, line))
+		{
+			boost::split(fields, line, boost::is_any_of("\t"));
+
+			if(fields.size() != 2)
+				continue;
+
+			keyframe_index::entry entry = {boost::lexical_cast<std::int64_t>(fields[0]), boost::lexical_cast<std::int64_t>(fields[1])};
+			entries.push_back(entry);
+		}
+
+		return std::make_shared<keyframe_index>(stream_index, false, std::move(entries));
+	}
+	catch(...)
+	{
+		return nullptr;
+	}
+}
+
+void save(const std::wstring& filename, const file_stamp& stamp, int stream_index, const std::vector<keyframe_index::entry>& entries)
+{
+	auto file		= index_file(filename);
+	auto temp_file	= file + L".tmp";
+
+	boost::filesystem::create_directories(boost::filesystem::wpath(file).parent_path());
+
+	{
+		std::ofstream stream(temp_file.c_str(), std::ios::out | std::ios::trunc);
+
+		stream	<< INDEX_HEADER << "\n"
+				<< narrow(filename) << "\t" << stamp.size << "\t" << stamp.write_time << "\t" << stream_index << "\n";
+
+		BOOST_FOREACH(auto& entry, entries)
+			stream << entry.pts << "\t" << entry.pos << "\n";
+
+		if(!stream)
+			BOOST_THROW_EXCEPTION(io_error() << msg_info("Failed to write " + narrow(temp_file)));
+	}
+
+	boost::filesystem::remove(boost::filesystem::wpath(file));
+	boost::filesystem::rename(boost::filesystem::wpath(temp_file), boost::filesystem::wpath(file));
+}
+
+// Demuxes every packet of the video stream, all other streams are discarded and nothing is decoded.
+// Returns early with a partial index when g_registry.stopped is set.
+std::vector<keyframe_index::entry> scan(const std::wstring& filename, int stream_index)
+{
+	AVFormatContext* weak_context = nullptr;
+	THROW_ON_ERROR2(avformat_open_input(&weak_context, narrow(filename).c_str(), nullptr, nullptr), filename);
+	std::shared_ptr<AVFormatContext> context(weak_context, [](AVFormatContext* ctx){avformat_close_input(&ctx);});
+	THROW_ON_ERROR2(avformat_find_stream_info(weak_context, nullptr), filename);
+
+	if(stream_index >= static_cast<int>(context->nb_streams))
+		BOOST_THROW_EXCEPTION(invalid_argument() << msg_info("Stream not found") << arg_value_info(narrow(filename)));
+
+	for(unsigned int n = 0; n < context->nb_streams; ++n)
+		context->streams[n]->discard = static_cast<int>(n) == stream_index ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+
+	std::vector<keyframe_index::entry> entries;
+	auto packet = create_packet();
+
+	while(!g_registry.stopped && av_read_frame(context.get(), packet.get()) >= 0)
+	{
+		if(packet->stream_index == stream_index && (packet->flags & AV_PKT_FLAG_KEY))
+		{
+			auto pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+
+			if(pts != AV_NOPTS_VALUE)
+			{
+				keyframe_index::entry entry = {pts, packet->pos};
+				entries.push_back(entry);
+			}
+		}
+
+		av_packet_unref(packet.get());
+	}
+
+	std::sort(entries.begin(), entries.end(), [](const keyframe_index::entry& lhs, const keyframe_index::entry& rhs)
+	{
+		return lhs.pts < rhs.pts;
+	});
+
+	return entries;
+}
+
+// Requires g_registry.mutex.
+void schedule_scan(const std::wstring& filename, const file_stamp& stamp, int stream_index)
+{
+	if(g_registry.stopped || !g_registry.scanning.insert(filename).second)
+		return;
+
+	if(!g_registry.scanner)
+	{
+		g_registry.scanner.reset(new executor(L"keyframe_index"));
+		g_registry.scanner->set_priority_class(below_normal_priority_class);
+	}
+
+	g_registry.scanner->begin_invoke([=]
+	{
+		std::shared_ptr<const keyframe_index> index;
+
+		try
+		{
+			boost::timer timer;
+			auto entries = scan(filename, stream_index);
+
+			if(g_registry.stopped)
+				return;
+
+			CASPAR_LOG(info) << L"[keyframe_index] Indexed " << entries.size() << L" keyframes of " << filename << L" in " << timer.elapsed() << L" s.";
+
+			save(filename, stamp, stream_index, entries);
+			index = std::make_shared<keyframe_index>(stream_index, false, std::move(entries));
+		}
+		catch(...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+		}
+
+		boost::lock_guard<boost::mutex> lock(g_registry.mutex);
+
+		cache(filename, stamp, index);
+		g_registry.scanning.erase(filename);
+	});
+}
+
+}
+
+keyframe_index::keyframe_index(int stream_index, bool from_container, std::vector<entry>&& entries)
+	: stream_index_(stream_index)
+	, from_container_(from_container)
+	, entries_(std::move(entries))
+{
+}
+
+std::shared_ptr<const keyframe_index> keyframe_index::get(const std::wstring& filename, AVFormatContext* context, int stream_index)
+{
+	file_stamp stamp;
+	if(!stat_file(filename, stamp))
+		return nullptr;
+
+	{
+		boost::lock_guard<boost::mutex> lock(g_registry.mutex);
+
+		auto it = g_registry.indexes.find(filename);
+		if(it != g_registry.indexes.end() && it->second.stamp == stamp)
+		{
+			it->second.last_used = ++g_registry.use_count;
+			return it->second.index && it->second.index->stream_index() == stream_index ? it->second.index : nullptr;
+		}
+	}
+
+	auto index = context ? from_container(context, stream_index) : nullptr;
+
+	if(!index)
+		index = load(filename, stamp, stream_index);
+
+	boost::lock_guard<boost::mutex> lock(g_registry.mutex);
+
+	if(index)
+		cache(filename, stamp, index);
+	else if(env::properties().get(L"configuration.ffmpeg.keyframe-index", true))
+		schedule_scan(filename, stamp, stream_index);
+
+	return index;
+}
+
+void keyframe_index::uninit()
+{
+	std::unique_ptr<executor> scanner;
+
+	{
+		boost::lock_guard<boost::mutex> lock(g_registry.mutex);
+
+		g_registry.stopped = true;
+		scanner = std::move(g_registry.scanner);
+	}
+
+	scanner.reset(); // Waits for a running scan outside the lock, the scan takes the lock when it completes.
+}
+
+const keyframe_index::entry* keyframe_index::find(std::int64_t pts) const
+{
+	auto it = std::upper_bound(entries_.begin(), entries_.end(), pts, [](std::int64_t pts, const entry& e)
+	{
+		return pts < e.pts;
+	});
+
+	return it == entries_.begin() ? nullptr : &*(it - 1);
+}
+
+int keyframe_index::stream_index() const
+{
+	return stream_index_;
+}
+
+bool keyframe_index::from_container() const
+{
+	return from_container_;
+}
+
+}}
@@ -0,0 +1,65 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct AVFormatContext;
+
+namespace caspar { namespace ffmpeg {
+
+// Keyframe positions of the video stream of a file. Taken from the demuxer when the container has a seek index, 
+// otherwise scanned once in the background and persisted in the data folder.
+class keyframe_index : boost::noncopyable
+{
+public:
+	struct entry
+	{
+		std::int64_t pts;	// In the time base of the stream.
+		std::int64_t pos;	// Byte position, -1 if unknown.
+	};
+
+	keyframe_index(int stream_index, bool from_container, std::vector<entry>&& entries);
+
+	// Returns nullptr while the index is not available yet.
+	static std::shared_ptr<const keyframe_index> get(const std::wstring& filename, AVFormatContext* context, int stream_index);
+
+	// Aborts a running background scan and stops the scanner. Called from ffmpeg::uninit.
+	static void uninit();
+
+	// The last keyframe at or before pts, nullptr if there is none.
+	const entry* find(std::int64_t pts) const;
+
+	int stream_index() const;
+
+	// True if the demuxer has its own index and seeks by timestamp land exactly on keyframes.
+	bool from_container() const;
+private:
+	const int					stream_index_;
+	const bool					from_container_;
+	const std::vector<entry>	entries_;
+};
+
+}}
@@ -0,0 +1,398 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../../stdafx.h"
+
+#include "read_ahead_io.h"
+
+#include <common/env.h>
+#include <common/concurrency/executor.h>
+
+#include <tbb/atomic.h>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/once.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(_MSC_VER)
+#pragma warning (push)
+#pragma warning (disable : 4244)
+#endif
+extern "C" 
+{
+	#include <libavformat/avio.h>
+	#include <libavutil/error.h>
+	#include <libavutil/mem.h>
+}
+#if defined(_MSC_VER)
+#pragma warning (pop)
+#endif
+
+namespace caspar { namespace ffmpeg {
+
+namespace {
+
+const int AVIO_BUFFER_SIZE = 64 * 1024;
+
+// Positional reads, so that prefetches running on different io threads do not share a file pointer. The os is told 
+// that the file is read sequentially, which widens its own read-ahead.
+class block_file : boost::noncopyable
+{
+#if defined(_WIN32)
+	HANDLE	handle_;
+#else
+	int		fd_;
+#endif
+	int64_t	size_;
+public:
+	explicit block_file(const std::wstring& filename)
+		: size_(0)
+	{
+#if defined(_WIN32)
+		handle_ = CreateFileW(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (handle_ == INVALID_HANDLE_VALUE)
+			BOOST_THROW_EXCEPTION(file_read_error() << msg_info("Could not open file.") << boost::errinfo_file_name(narrow(filename)));
+
+		LARGE_INTEGER size;
+		if (GetFileSizeEx(handle_, &size))
+			size_ = size.QuadPart;
+#else
+		fd_ = ::open(narrow(filename).c_str(), O_RDONLY);
+		if (fd_ < 0)
+			BOOST_THROW_EXCEPTION(file_read_error() << msg_info("Could not open file.") << boost::errinfo_file_name(narrow(filename)));
+
+		struct stat st;
+		if (::fstat(fd_, &st) == 0)
+			size_ = st.st_size;
+#if defined(POSIX_FADV_SEQUENTIAL)
+		::posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#endif
+	}
+
+	~block_file()
+	{
+#if defined(_WIN32)
+		CloseHandle(handle_);
+#else
+		::close(fd_);
+#endif
+	}
+
+	int64_t size() const
+	{
+		return size_;
+	}
+
+	// Returns the number of bytes read, which is only short at the end of the file, or -1 on error.
+	int read(int64_t offset, uint8_t* dest, int count)
+	{
+		int total = 0;
+		while (total < count)
+		{
+#if defined(_WIN32)
+			OVERLAPPED overlapped = {0};
+			overlapped.Offset		= static_cast<DWORD>(offset + total);
+			overlapped.OffsetHigh	= static_cast<DWORD>((offset + total) >> 32);
+			DWORD n = 0;
+			if (!ReadFile(handle_, dest + total, static_cast<DWORD>(count - total), &n, &overlapped))
+				return GetLastError() == ERROR_HANDLE_EOF ? total : -1;
+#else
+			auto n = ::pread(fd_, dest + total, count - total, offset + total);
+			if (n < 0)
+				return -1;
+#endif
+			if (n == 0)
+				break;
+			total += static_cast<int>(n);
+		}
+		return total;
+	}
+};
+
+// Block reads block on file io, so they run on dedicated threads (configuration.ffmpeg.io-threads) rather than on
+// the executor pool.
+class io_pool : boost::noncopyable
+{
+	std::vector<std::shared_ptr<executor>>	executors_;
+	tbb::atomic<size_t>						next_;
+public:
+	explicit io_pool(size_t thread_count)
+	{
+		next_ = 0;
+		for (size_t n = 0; n < thread_count; ++n)
+			executors_.push_back(std::make_shared<executor>(L"ffmpeg_io " + boost::lexical_cast<std::wstring>(n)));
+	}
+
+	template<typename Func>
+	void post(Func&& func)
+	{
+		executors_[next_.fetch_and_increment() % executors_.size()]->post(std::forward<Func>(func));
+	}
+};
+
+io_pool*			g_io_pool = nullptr; // Lives for the duration of the process.
+boost::once_flag	g_io_pool_flag = BOOST_ONCE_INIT;
+
+void init_io_pool()
+{
+	g_io_pool = new io_pool(static_cast<size_t>(std::max(1, env::properties().get(L"configuration.ffmpeg.io-threads", 4))));
+}
+
+io_pool& get_io_pool()
+{
+	boost::call_once(g_io_pool_flag, &init_io_pool);
+	return *g_io_pool;
+}
+
+bool is_local_file(const std::wstring& filename)
+{
+	return filename.find(L"://") == std::wstring::npos && boost::filesystem::is_regular_file(filename);
+}
+
+// Shared with the block reads in flight, which may outlive the producer.
+struct block_cache : boost::noncopyable
+{
+	struct block
+	{
+		int64_t					index;	// -1 when the slot is unused.
+		bool					ready;
+		int						size;	// -1 when the read failed.
+		std::vector<uint8_t>	data;
+	};
+
+	block_file								file_;
+	const int								block_size_;
+	std::vector<block>						blocks_;
+	boost::mutex							mutex_;
+	boost::condition_variable				block_ready_;
+	tbb::atomic<int64_t>					bytes_read_;
+	tbb::atomic<int64_t>					stall_us_;
+
+	block_cache(const std::wstring& filename, int block_size, int block_count)
+		: file_(filename)
+		, block_size_(block_size)
+		, blocks_(block_count)
+	{
+		BOOST_FOREACH(auto& b, blocks_)
+		{
+			b.index = -1;
+			b.ready = true;
+			b.size	= 0;
+			b.data.resize(block_size);
+		}
+		bytes_read_ = 0;
+		stall_us_	= 0;
+	}
+
+	int64_t size() const
+	{
+		return file_.size();
+	}
+
+	block* find(int64_t index)
+	{
+		BOOST_FOREACH(auto& b, blocks_)
+		{
+			if (b.index == index)
+				return &b;
+		}
+		return nullptr;
+	}
+
+	// Requires mutex_. Reuses a slot outside of [first, first + blocks_.size()) which is not being read into.
+	block* evict(int64_t first)
+	{
+		BOOST_FOREACH(auto& b, blocks_)
+		{
+			if (b.ready && (b.index < first || b.index >= first + static_cast<int64_t>(blocks_.size())))
+				return &b;
+		}
+		return nullptr;
+	}
+
+	// Requires mutex_. first is the block being read by the demuxer.
+	block* load(int64_t index, int64_t first, const std::shared_ptr<block_cache>& self)
+	{
+		auto b = evict(first);
+		if (!b)
+			return nullptr;
+
+		b->index = index;
+		b->ready = false;
+		b->size	 = 0;
+
+		get_io_pool().post([=]
+		{
+			// The slot is not reused before ready is set, so its data can be written without the lock.
+			auto n = self->file_.read(index * self->block_size_, b->data.data(), self->block_size_);
+
+			boost::lock_guard<boost::mutex> lock(self->mutex_);
+			b->size	 = n;
+			b->ready = true;
+			if (n > 0)
+				self->bytes_read_ += n;
+			self->block_ready_.notify_all();
+		});
+
+		return b;
+	}
+
+	int read(int64_t pos, uint8_t* buf, int size, const std::shared_ptr<block_cache>& self)
+	{
+		if (pos >= file_.size())
+			return AVERROR_EOF;
+
+		const auto index	= pos / block_size_;
+		const auto offset	= static_cast<int>(pos - index * block_size_);
+		const auto last		= (file_.size() - 1) / block_size_;
+
+		boost::unique_lock<boost::mutex> lock(mutex_);
+
+		block* b = nullptr;
+		boost::posix_time::ptime stall_start;
+
+		while (true)
+		{
+			b = find(index);
+			if (!b)
+				b = load(index, index, self);
+
+			if (b && b->ready)
+				break;
+
+			if (stall_start.is_not_a_date_time())
+				stall_start = boost::posix_time::microsec_clock::universal_time();
+
+			block_ready_.wait(lock);
+		}
+
+		if (!stall_start.is_not_a_date_time())
+			stall_us_ += (boost::posix_time::microsec_clock::universal_time() - stall_start).total_microseconds();
+
+		for (auto next = index + 1; next <= last && next < index + static_cast<int64_t>(blocks_.size()); ++next)
+		{
+			if (!find(next) && !load(next, index, self))
+				break;
+		}
+
+		if (b->size < 0)
+		{
+			b->index = -1; // Read again on retry.
+			return AVERROR(EIO);
+		}
+
+		const auto count = std::min(size, b->size - offset);
+		if (count <= 0)
+			return AVERROR_EOF;
+
+		std::memcpy(buf, b->data.data() + offset, count);
+		return count;
+	}
+};
+
+}
+
+struct read_ahead_io::implementation : boost::noncopyable
+{
+	const std::shared_ptr<block_cache>	cache_;
+	int64_t								pos_;
+	AVIOContext*						context_;
+
+	implementation(const std::wstring& filename, int block_size, int block_count)
+		: cache_(std::make_shared<block_cache>(filename, block_size, block_count))
+		, pos_(0)
+		, context_(nullptr)
+	{
+		auto buffer = static_cast<unsigned char*>(av_malloc(AVIO_BUFFER_SIZE));
+		if (!buffer)
+			throw std::bad_alloc();
+
+		context_ = avio_alloc_context(buffer, AVIO_BUFFER_SIZE, 0, this, &implementation::read_packet, nullptr, &implementation::seek);
+		if (!context_)
+		{
+			av_free(buffer);
+			throw std::bad_alloc();
+		}
+	}
+
+	~implementation()
+	{
+		av_freep(&context_->buffer);
+		avio_context_free(&context_);
+	}
+
+	static int read_packet(void* opaque, uint8_t* buf, int size)
+	{
+		auto self = static_cast<implementation*>(opaque);
+		auto n = self->cache_->read(self->pos_, buf, size, self->cache_);
+		if (n > 0)
+			self->pos_ += n;
+		return n;
+	}
+
+	static int64_t seek(void* opaque, int64_t offset, int whence)
+	{
+		auto self = static_cast<implementation*>(opaque);
+
+		switch (whence & ~AVSEEK_FORCE)
+		{
+		case AVSEEK_SIZE:	return self->cache_->size();
+		case SEEK_SET:		self->pos_ = offset;						break;
+		case SEEK_CUR:		self->pos_ += offset;						break;
+		case SEEK_END:		self->pos_ = self->cache_->size() + offset;	break;
+		default:			return AVERROR(EINVAL);
+		}
+
+		return self->pos_;
+	}
+};
+
+read_ahead_io::read_ahead_io(const std::wstring& filename, int block_size, int block_count) : impl_(new implementation(filename, block_size, block_count)){}
+read_ahead_io::~read_ahead_io(){}
+AVIOContext* read_ahead_io::context(){return impl_->context_;}
+int64_t read_ahead_io::bytes_read() const{return impl_->cache_->bytes_read_;}
+double read_ahead_io::stall_time() const{return static_cast<double>(impl_->cache_->stall_us_) / 1000000.0;}
+
+std::shared_ptr<read_ahead_io> read_ahead_io::open(const std::wstring& filename)
+{
+	const int block_count	= env::properties().get(L"configuration.ffmpeg.read-ahead-blocks", 4);
+	const int block_size	= env::properties().get(L"configuration.ffmpeg.read-ahead-block-size", 4096) * 1024;
+
+	if (block_count < 1 || block_size < AVIO_BUFFER_SIZE || !is_local_file(filename))
+		return nullptr;
+
+	return std::shared_ptr<read_ahead_io>(new read_ahead_io(filename, block_size, block_count));
+}
+
+}}
@@ -0,0 +1,56 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <common/memory/safe_ptr.h>
+
+#include <boost/noncopyable.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+struct AVIOContext;
+
+namespace caspar { namespace ffmpeg {
+
+// AVIOContext for local files which reads in large blocks (configuration.ffmpeg.read-ahead-block-size) and 
+// prefetches the next configuration.ffmpeg.read-ahead-blocks on io threads shared by all files, so that the 
+// demuxer does not wait for a round trip to network storage on every small read.
+class read_ahead_io : boost::noncopyable
+{
+public:
+	// Returns nullptr for urls and when read-ahead is disabled.
+	static std::shared_ptr<read_ahead_io> open(const std::wstring& filename);
+
+	~read_ahead_io();
+
+	AVIOContext* context();
+
+	int64_t bytes_read() const;
+	double stall_time() const; // Seconds the demuxer spent waiting for blocks.
+private:
+	explicit read_ahead_io(const std::wstring& filename, int block_size, int block_count);
+
+	struct implementation;
+	safe_ptr<implementation> impl_;
+};
+
+}}
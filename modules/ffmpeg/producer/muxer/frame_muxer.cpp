@@ -23,7 +23,9 @@
 
 #include "frame_muxer.h"
 
+#include "../audio/audio_ring.h"
 #include "../filter/filter.h"
+#include "../filter/scalable_yadif/scalable_yadif.h"
 #include "../util/util.h"
 
 #include <core/producer/frame_producer.h>
@@ -54,9 +56,10 @@ extern "C"
 #endif
 
 #include <boost/foreach.hpp>
-#include <boost/range/algorithm_ext/push_back.hpp>
+#include <boost/range/algorithm/max_element.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/format.hpp>
+#include <boost/optional.hpp>
 
 #include <deque>
 #include <queue>
@@ -69,18 +72,22 @@ namespace caspar { namespace ffmpeg {
 struct frame_muxer::implementation : boost::noncopyable
 {	
 	std::queue<std::queue<safe_ptr<write_frame>>>	video_streams_;
-	std::queue<core::audio_buffer>					audio_streams_;
+	audio_ring										audio_ring_; // Samples of all audio streams, the open stream last.
+	std::deque<size_t>								closed_audio_streams_; // Sizes of the streams ahead of the open one.
+	size_t											closed_audio_samples_;
 	std::queue<safe_ptr<basic_frame>>				frame_buffer_;
 	const boost::rational<int>						in_fps_;
 	const boost::rational<int>						in_timebase_;
 	const video_format_desc							format_desc_;
 	bool											auto_transcode_;
 	bool											auto_deinterlace_;
+	bool											planar_passthrough_;
 	
 	std::vector<size_t>								audio_cadence_;
 			
 	safe_ptr<core::frame_factory>					frame_factory_;
 	
+	std::unique_ptr<scalable_yadif>					deinterlacer_; // Runs ahead of filter_ when the auto mode deinterlaces or swaps the field order of 8-bit planar video.
 	std::shared_ptr<filter>							filter_;
 	const std::string								filter_str_;
 	bool											force_deinterlacing_;
@@ -93,11 +100,14 @@ struct frame_muxer::implementation : boost::noncopyable
 			const std::string& filter_str,
 			const core::channel_layout& audio_channel_layout
 			)
-		: in_fps_(in_fps)
+		: audio_ring_(audio_ring_capacity(frame_factory->get_video_format_desc(), audio_channel_layout), *boost::max_element(frame_factory->get_video_format_desc().audio_cadence) * audio_channel_layout.num_channels)
+		, closed_audio_samples_(0)
+		, in_fps_(in_fps)
 		, in_timebase_(in_timebase)
 		, format_desc_(frame_factory->get_video_format_desc())
 		, auto_transcode_(env::properties().get(L"configuration.auto-transcode", true))
 		, auto_deinterlace_(env::properties().get(L"configuration.auto-deinterlace", true))
+		, planar_passthrough_(env::properties().get(L"configuration.planar-passthrough", true))
 		, audio_cadence_(format_desc_.audio_cadence)
 		, frame_factory_(frame_factory)
 		, filter_str_(filter_str)
@@ -105,10 +115,17 @@ struct frame_muxer::implementation : boost::noncopyable
 		, audio_channel_layout_(audio_channel_layout)
 	{
 		video_streams_.push(std::queue<safe_ptr<write_frame>>());
-		audio_streams_.push(core::audio_buffer());
 		// Note: Uses 1 step rotated cadence for 1001 modes (1602, 1602, 1601, 1602, 1601)
 		// This cadence fills the audio mixer most optimally.
 		boost::range::rotate(audio_cadence_, std::end(audio_cadence_)-1);
+		update_audio_limit();
+	}
+
+	// At least a second and 64 frames of audio, so that neither long packets nor a stalled video stream fill it.
+	static size_t audio_ring_capacity(const video_format_desc& format_desc, const core::channel_layout& layout)
+	{
+		const size_t frames = std::max<size_t>(format_desc.audio_sample_rate, 64 * *boost::max_element(format_desc.audio_cadence));
+		return frames * layout.num_channels;
 	}
 
 
@@ -152,7 +169,14 @@ struct frame_muxer::implementation : boost::noncopyable
 			if(!filter_ || need_update_filter)
 				update_filter(video_frame, force_deinterlacing_);
 
-			filter_->push(video_frame);
+			if (deinterlacer_)
+			{
+				deinterlacer_->push(video_frame);
+				BOOST_FOREACH(auto& deinterlaced, deinterlacer_->poll_all())
+					filter_->push(deinterlaced);
+			}
+			else
+				filter_->push(video_frame);
 
 			BOOST_FOREACH(auto& av_frame, filter_->poll_all())
 			{
@@ -173,29 +197,74 @@ struct frame_muxer::implementation : boost::noncopyable
 
 		if(audio == flush_audio())
 		{
-			audio_streams_.push(core::audio_buffer());
-		}
-		else if(audio == empty_audio())
-		{
-			boost::range::push_back(audio_streams_.back(), core::audio_buffer(audio_cadence_.front() * audio_channel_layout_.num_channels, 0));
+			closed_audio_streams_.push_back(open_audio_samples());
+			closed_audio_samples_ += closed_audio_streams_.back();
+			update_audio_limit();
+			return;
 		}
+		
+		const auto count = audio == empty_audio() ? audio_cadence_.front() * audio_channel_layout_.num_channels : audio->size();
+
+		if(open_audio_samples() + count > max_open_audio_samples() || count > audio_ring_.space())
+			BOOST_THROW_EXCEPTION(invalid_operation() << source_info("frame_muxer") << msg_info("audio-stream overflow. This can be caused by incorrect frame-rate. Check clip meta-data."));
+
+		if(audio == empty_audio())
+			audio_ring_.write_silence(count);
 		else
+			audio_ring_.write(audio->data(), count);
+	}
+
+	audio_ring& audio_input()
+	{
+		return audio_ring_;
+	}
+
+	size_t max_open_audio_samples() const
+	{
+		return 32 * audio_cadence_.front() * audio_channel_layout_.num_channels;
+	}
+
+	// audio_decoder writes to the ring directly and checks this limit, which push checks through open_audio_samples.
+	void update_audio_limit()
+	{
+		audio_ring_.set_limit(closed_audio_samples_ + max_open_audio_samples());
+	}
+
+	size_t audio_stream_count() const
+	{
+		return closed_audio_streams_.size() + 1;
+	}
+
+	size_t open_audio_samples() const
+	{
+		return audio_ring_.size() - closed_audio_samples_;
+	}
+
+	size_t front_audio_samples() const
+	{
+		return closed_audio_streams_.empty() ? audio_ring_.size() : closed_audio_streams_.front();
+	}
+
+	void pop_audio_stream()
+	{
+		const auto count = front_audio_samples();
+		audio_ring_.consume(count);
+		if (!closed_audio_streams_.empty())
 		{
-			boost::range::push_back(audio_streams_.back(), *audio);
+			closed_audio_streams_.pop_front();
+			closed_audio_samples_ -= count;
 		}
-
-		if(audio_streams_.back().size() > 32*audio_cadence_.front() * audio_channel_layout_.num_channels)
-			BOOST_THROW_EXCEPTION(invalid_operation() << source_info("frame_muxer") << msg_info("audio-stream overflow. This can be caused by incorrect frame-rate. Check clip meta-data."));
+		update_audio_limit();
 	}
 	
 	bool video_ready() const
 	{		
-		return video_streams_.size() > 1 || (video_streams_.size() >= audio_streams_.size() && video_ready2());
+		return video_streams_.size() > 1 || (video_streams_.size() >= audio_stream_count() && video_ready2());
 	}
 	
 	bool audio_ready() const
 	{
-		return audio_streams_.size() > 1 || (audio_streams_.size() >= video_streams_.size() && audio_ready2());
+		return audio_stream_count() > 1 || (audio_stream_count() >= video_streams_.size() && audio_ready2());
 	}
 
 	bool video_ready2() const
@@ -205,7 +274,7 @@ struct frame_muxer::implementation : boost::noncopyable
 	
 	bool audio_ready2() const
 	{
-		return audio_streams_.front().size() >= audio_cadence_.front() * audio_channel_layout_.num_channels;
+		return front_audio_samples() >= audio_cadence_.front() * audio_channel_layout_.num_channels;
 	}
 		
 	std::shared_ptr<basic_frame> poll()
@@ -217,20 +286,20 @@ struct frame_muxer::implementation : boost::noncopyable
 			return frame;
 		}
 
-		if (video_streams_.size() > 1 && audio_streams_.size() > 1 && (!video_ready2() || !audio_ready2()))
+		if (video_streams_.size() > 1 && audio_stream_count() > 1 && (!video_ready2() || !audio_ready2()))
 		{
-			if (!video_streams_.front().empty() || !audio_streams_.front().empty())
-				CASPAR_LOG(trace) << "Truncating: " << video_streams_.front().size() << L" video-frames, " << audio_streams_.front().size() << L" audio-samples.";
+			if (!video_streams_.front().empty() || front_audio_samples() > 0)
+				CASPAR_LOG(trace) << "Truncating: " << video_streams_.front().size() << L" video-frames, " << front_audio_samples() << L" audio-samples.";
 
 			video_streams_.pop();
-			audio_streams_.pop();
+			pop_audio_stream();
 		}
 
 		if (!video_ready2() || !audio_ready2())
 			return nullptr;
 
 		auto frame1 = pop_video();
-		frame1->audio_data() = pop_audio();
+		pop_audio(frame1->audio_data());
 		frame_buffer_.push(frame1);
 		return frame_buffer_.empty() ? nullptr : poll();
 	}
@@ -242,46 +311,70 @@ struct frame_muxer::implementation : boost::noncopyable
 		return frame;
 	}
 
-	core::audio_buffer pop_audio()
+	// Copies one cadence of samples from the ring into the frame's audio_buffer. The frame owns its audio from here on, 
+	// so that buffer is still allocated per frame.
+	void pop_audio(core::audio_buffer& dest)
 	{
-		CASPAR_VERIFY(audio_streams_.front().size() >= audio_cadence_.front() * audio_channel_layout_.num_channels);
+		const auto count = audio_cadence_.front() * audio_channel_layout_.num_channels;
+
+		CASPAR_VERIFY(front_audio_samples() >= count);
 
-		auto begin = audio_streams_.front().begin();
-		auto end   = begin + (audio_cadence_.front() * audio_channel_layout_.num_channels);
+		const auto samples = audio_ring_.peek(count);
+		dest.assign(samples, samples + count);
+		audio_ring_.consume(count);
 
-		core::audio_buffer samples(begin, end);
-		audio_streams_.front().erase(begin, end);
+		if (!closed_audio_streams_.empty())
+		{
+			closed_audio_streams_.front() -= count;
+			closed_audio_samples_ -= count;
+		}
 		
 		boost::range::rotate(audio_cadence_, std::begin(audio_cadence_)+1);
-
-		return samples;
+		update_audio_limit();
 	}
 				
-	void update_filter(const std::shared_ptr<AVFrame>& frame, bool force_deinterlace)
+	// native is set when the deinterlacing is left to scalable_yadif, which runs ahead of the returned graph.
+	std::string get_filter_str(const AVFrame& frame, bool force_deinterlace, boost::optional<deinterlace_mode::type>& native) const
 	{
 		std::string filter_str = narrow(filter_str_);
 
+		const bool native_allowed = filter_str_.empty() && scalable_yadif::is_supported(frame.format);
+		native.reset();
 
-		auto frame_mode = get_mode(*frame);
-		int fixed_height = frame->height;
-		if (fixed_height == 608 && frame->width == 720) // fix for IMX frames with VBI lines
+		// Once scalable_yadif deinterlaces, later requests only switch it to one frame per field when they need that.
+		auto deinterlace = [&](const char* av_filter, bool bob)
+		{
+			if (native)
+			{
+				if (bob)
+					native = deinterlace_mode::send_field;
+			}
+			else if (native_allowed)
+				native = bob ? deinterlace_mode::send_field : deinterlace_mode::send_frame;
+			else
+				filter_str = append_filter(filter_str, av_filter);
+		};
+
+		auto frame_mode = get_mode(frame);
+		int fixed_height = frame.height;
+		if (fixed_height == 608 && frame.width == 720) // fix for IMX frames with VBI lines
 		{
 			filter_str = append_filter(filter_str, "crop=720:576:0:32");
 			fixed_height = 576;
 		}
 
 		if (force_deinterlace)
-			filter_str = append_filter(filter_str, "yadif");
+			deinterlace("yadif", false);
 
 		if (filter_str_.empty())
 		{
 			auto filtered_fps = in_fps_;
 			auto format_fps = boost::rational<int>(format_desc_.time_scale, format_desc_.duration);
-			if ((format_desc_.width > static_cast<uint32_t>(frame->width) || format_desc_.height > static_cast<uint32_t>(fixed_height))) // upscaling
+			if ((format_desc_.width > static_cast<uint32_t>(frame.width) || format_desc_.height > static_cast<uint32_t>(fixed_height))) // upscaling
 			{
 				if (frame_mode != field_mode::progressive)
 				{
-					filter_str = append_filter(filter_str, "bwdif");
+					deinterlace("bwdif", true);
 					filtered_fps *= 2;
 				}
 				filter_str = append_filter(filter_str, (boost::format("scale=w=%1%:h=%2%") % format_desc_.width % format_desc_.height).str());
@@ -291,78 +384,158 @@ struct frame_muxer::implementation : boost::noncopyable
 					filtered_fps /= 2;
 				}
 			}
-			else if (format_desc_.width != static_cast<uint32_t>(frame->width) || format_desc_.height != static_cast<uint32_t>(fixed_height)) // downscaling
+			else if (format_desc_.width != static_cast<uint32_t>(frame.width) || format_desc_.height != static_cast<uint32_t>(fixed_height)) // downscaling
 			{
-				if (frame_mode == field_mode::progressive)
+				const bool reinterlace			= format_fps * 2 == filtered_fps && format_desc_.field_mode != field_mode::progressive;
+				const bool deinterlace_frame	= !reinterlace && frame_mode != field_mode::progressive && format_desc_.field_mode == field_mode::progressive;
+				const bool bob					= format_fps != filtered_fps && format_fps * 2 != filtered_fps;
+				const bool deinterlace_first	= deinterlace_frame && native_allowed; // scalable_yadif runs before the graph, so the scaler gets progressive frames.
+
+				if (deinterlace_first)
+					deinterlace(bob ? "yadif=mode=1" : "yadif", bob);
+
+				if (frame_mode == field_mode::progressive || native)
 					filter_str = append_filter(filter_str, (boost::format("scale=w=%1%:h=%2%") % format_desc_.width % format_desc_.height).str());
 				else
 					filter_str = append_filter(filter_str, (boost::format("scale=w=%1%:h=%2%:interl=1") % format_desc_.width % format_desc_.height).str());
 
-				if (format_fps * 2 == filtered_fps && format_desc_.field_mode != field_mode::progressive)
+				if (reinterlace)
 				{
 					filter_str = append_filter(filter_str, format_desc_.field_mode == field_mode::lower ? "interlace=scan=bff" : "interlace=scan=tff");
 					filtered_fps /= 2;
 				}
-				else if (frame_mode != field_mode::progressive && format_desc_.field_mode == field_mode::progressive)
+				else if (deinterlace_frame)
 				{
-					if (format_fps == filtered_fps || format_fps * 2 == filtered_fps)
-						filter_str = append_filter(filter_str, "yadif");
-					else
-					{
-						filter_str = append_filter(filter_str, "yadif=mode=1");
+					if (!deinterlace_first)
+						deinterlace(bob ? "yadif=mode=1" : "yadif", bob);
+					if (bob)
 						filtered_fps *= 2;
-					}
 				}
 			}
 			else // no scaling
 				if (frame_mode != field_mode::progressive && format_desc_.field_mode == field_mode::progressive)
 				{
 					if (format_fps == filtered_fps || format_fps * 2 == filtered_fps)
-						filter_str = append_filter(filter_str, "yadif");
+						deinterlace("yadif", false);
 					else
 					{
-						filter_str = append_filter(filter_str, "yadif=mode=1");
+						deinterlace("yadif=mode=1", true);
 						filtered_fps *= 2;
 					}
 				}
+				else if (frame_mode != field_mode::progressive && format_desc_.field_mode != field_mode::progressive && frame_mode != format_desc_.field_mode && format_fps == filtered_fps && !native)
+				{
+					// Opposite field order, delaying one field by merging it with the next frame swaps the order without deinterlacing.
+					if (native_allowed)
+						native = deinterlace_mode::field_merge;
+					else
+						filter_str = append_filter(filter_str, format_desc_.field_mode == field_mode::upper ? "phase=b,setfield=tff" : "phase=t,setfield=bff");
+				}
 			if (format_fps != filtered_fps) // fps adjust
 			{
 				filter_str = append_filter(filter_str, (boost::format("fps=fps=%1%/%2%") % format_desc_.time_scale % format_desc_.duration).str());
 			}
 		}
+		return filter_str;
+	}
+
+	std::vector<AVPixelFormat> get_out_pix_fmts() const
+	{
 		auto out_pix_fmts = std::vector<AVPixelFormat>();
+		if (planar_passthrough_)
+		{
+			// Formats the image mixer can convert itself. The filter graph keeps the decoded format when it is in this list.
+			out_pix_fmts.push_back(AV_PIX_FMT_YUV420P);
+			out_pix_fmts.push_back(AV_PIX_FMT_YUV422P);
+			out_pix_fmts.push_back(AV_PIX_FMT_YUV444P);
+			out_pix_fmts.push_back(AV_PIX_FMT_YUV411P);
+			out_pix_fmts.push_back(AV_PIX_FMT_YUV410P);
+			out_pix_fmts.push_back(AV_PIX_FMT_YUVA420P);
+			out_pix_fmts.push_back(AV_PIX_FMT_YUV420P10LE);
+			out_pix_fmts.push_back(AV_PIX_FMT_YUV422P10LE);
+			out_pix_fmts.push_back(AV_PIX_FMT_YUV444P10LE);
+			out_pix_fmts.push_back(AV_PIX_FMT_GRAY8);
+			out_pix_fmts.push_back(AV_PIX_FMT_ARGB);
+			out_pix_fmts.push_back(AV_PIX_FMT_RGBA);
+			out_pix_fmts.push_back(AV_PIX_FMT_ABGR);
+		}
 		out_pix_fmts.push_back(AV_PIX_FMT_BGRA);
-		
+		return out_pix_fmts;
+	}
+
+	// Time base and frame rate at the input of the graph, bob doubles both.
+	AVRational graph_time_base(const boost::optional<deinterlace_mode::type>& native) const
+	{
+		return av_make_q(in_timebase_.numerator(), in_timebase_.denominator() * (native && *native == deinterlace_mode::send_field ? 2 : 1));
+	}
+
+	AVRational graph_frame_rate(const boost::optional<deinterlace_mode::type>& native) const
+	{
+		return av_make_q(in_fps_.numerator() * (native && *native == deinterlace_mode::send_field ? 2 : 1), in_fps_.denominator());
+	}
+
+	void update_filter(const std::shared_ptr<AVFrame>& frame, bool force_deinterlace)
+	{
+		auto out_pix_fmts	= get_out_pix_fmts();
+
+		boost::optional<deinterlace_mode::type> native;
+		auto filter_str = get_filter_str(*frame, force_deinterlace, native);
+
+		deinterlacer_.reset(native ? new scalable_yadif(*native) : nullptr);
 		filter_.reset (new filter(
 			frame->width,
 			frame->height,
-			av_make_q(in_timebase_.numerator(), in_timebase_.denominator()),
-			av_make_q(in_fps_.numerator(), in_fps_.denominator()),
+			graph_time_base(native),
+			graph_frame_rate(native),
 			frame->sample_aspect_ratio,
 			static_cast<AVPixelFormat>(frame->format),
 			out_pix_fmts,
 			filter_str));
 
-			CASPAR_LOG(debug) << L"[frame_muxer] " << print_mode(frame->width, fixed_height, in_fps_, (frame->flags & AV_FRAME_FLAG_INTERLACED) != 0);
+		if (auto_deinterlace_) // The deinterlace hint follows the transform, have the other graph ready for when it changes.
+		{
+			boost::optional<deinterlace_mode::type> other_native;
+			auto other_filter_str = get_filter_str(*frame, !force_deinterlace, other_native);
+
+			filter::prepare(
+				frame->width,
+				frame->height,
+				graph_time_base(other_native),
+				graph_frame_rate(other_native),
+				frame->sample_aspect_ratio,
+				static_cast<AVPixelFormat>(frame->format),
+				out_pix_fmts,
+				other_filter_str);
+		}
+
+		CASPAR_LOG(debug) << L"[frame_muxer] " << print_mode(frame->width, frame->height == 608 && frame->width == 720 ? 576 : frame->height, in_fps_, (frame->flags & AV_FRAME_FLAG_INTERLACED) != 0);
 	}
 	
 	void clear()
 	{
 		while(!video_streams_.empty())
 			video_streams_.pop();
-		audio_streams_.back().clear();
-		while (!audio_streams_.empty())
-			audio_streams_.pop();	
+		audio_ring_.clear();
+		closed_audio_streams_.clear();
+		closed_audio_samples_ = 0;
+		update_audio_limit();
 		while(!frame_buffer_.empty())
 			frame_buffer_.pop();
+		if (deinterlacer_)
+			deinterlacer_->clear();
 		if (filter_)
 			filter_->clear();
 		video_streams_.push(std::queue<safe_ptr<write_frame>>());
-		audio_streams_.push(core::audio_buffer());
 	}
 
 	void flush()
 	{
+		if (deinterlacer_)
+		{
+			deinterlacer_->flush();
+			BOOST_FOREACH(auto& deinterlaced, deinterlacer_->poll_all())
+				filter_->push(deinterlaced);
+		}
 		filter_->flush();
 		auto frame = filter_->last_input_frame();
 		BOOST_FOREACH(auto & av_frame, filter_->poll_all())
@@ -389,5 +562,6 @@ void frame_muxer::clear(){return impl_->clear();}
 std::shared_ptr<basic_frame> frame_muxer::poll(){return impl_->poll();}
 bool frame_muxer::video_ready() const{return impl_->video_ready();}
 bool frame_muxer::audio_ready() const{return impl_->audio_ready();}
+audio_ring& frame_muxer::audio_input(){return impl_->audio_input();}
 
 }}
\ No newline at end of file
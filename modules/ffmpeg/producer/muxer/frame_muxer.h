@@ -45,6 +45,8 @@ struct channel_layout;
 
 namespace ffmpeg {
 
+class audio_ring;
+
 class frame_muxer : boost::noncopyable
 {
 public:
@@ -57,6 +59,8 @@ public:
 	
 	void push(const std::shared_ptr<AVFrame>& video_frame, int hints = 0);
 	void push(const std::shared_ptr<core::audio_buffer>& audio_samples);
+	// Samples written here belong to the open audio stream, like the ones pushed above.
+	audio_ring& audio_input();
 	void clear();
 	void flush();
 
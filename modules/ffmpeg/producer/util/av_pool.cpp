@@ -0,0 +1,316 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "../../stdafx.h"
+
+#include "av_pool.h"
+
+#include <tbb/atomic.h>
+#include <tbb/spin_mutex.h>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/thread/once.hpp>
+
+#include <new>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning (push)
+#pragma warning (disable : 4244)
+#endif
+extern "C" 
+{
+	#include <libavcodec/avcodec.h>
+	#include <libavutil/frame.h>
+}
+#if defined(_MSC_VER)
+#pragma warning (pop)
+#endif
+
+namespace caspar { namespace ffmpeg {
+
+namespace {
+
+// Bounded free list of T, Traits provides alloc, reset and free. Objects beyond the bound are freed on return.
+template<typename T, typename Traits>
+class object_pool : boost::noncopyable
+{
+	const size_t		max_idle_;
+	tbb::spin_mutex		mutex_;
+	std::vector<T*>		idle_;
+	tbb::atomic<int64_t> hits_;
+	tbb::atomic<int64_t> misses_;
+public:
+	explicit object_pool(size_t max_idle)
+		: max_idle_(max_idle)
+	{
+		idle_.reserve(max_idle);
+		hits_	= 0;
+		misses_	= 0;
+	}
+
+	T* acquire()
+	{
+		{
+			tbb::spin_mutex::scoped_lock lock(mutex_);
+			if (!idle_.empty())
+			{
+				auto obj = idle_.back();
+				idle_.pop_back();
+				++hits_;
+				return obj;
+			}
+		}
+
+		++misses_;
+		auto obj = Traits::alloc();
+		if (!obj)
+			throw std::bad_alloc();
+		return obj;
+	}
+
+	void release(T* obj)
+	{
+		Traits::reset(obj);
+		{
+			tbb::spin_mutex::scoped_lock lock(mutex_);
+			if (idle_.size() < max_idle_)
+			{
+				idle_.push_back(obj);
+				return;
+			}
+		}
+		Traits::free(obj);
+	}
+
+	pool_statistics statistics()
+	{
+		pool_statistics stats;
+		stats.hits		= hits_;
+		stats.misses	= misses_;
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+		stats.idle		= static_cast<int64_t>(idle_.size());
+		return stats;
+	}
+};
+
+struct packet_traits
+{
+	static AVPacket* alloc()			{return av_packet_alloc();}
+	static void reset(AVPacket* p)		{av_packet_unref(p);}
+	static void free(AVPacket* p)		{av_packet_free(&p);}
+};
+
+struct frame_traits
+{
+	static AVFrame* alloc()				{return av_frame_alloc();}
+	static void reset(AVFrame* f)		{av_frame_unref(f);}
+	static void free(AVFrame* f)		{av_frame_free(&f);}
+};
+
+// Blocks for shared_ptr control blocks, which for a function pointer deleter and a stateless allocator are far 
+// smaller than BLOCK_SIZE. Larger requests go to operator new.
+class block_pool : boost::noncopyable
+{
+	static const size_t BLOCK_SIZE = 64;
+
+	struct block
+	{
+		block* next;
+	};
+
+	const size_t		 max_idle_;
+	tbb::spin_mutex		 mutex_;
+	block*				 head_;
+	size_t				 idle_;
+	tbb::atomic<int64_t> hits_;
+	tbb::atomic<int64_t> misses_;
+public:
+	explicit block_pool(size_t max_idle)
+		: max_idle_(max_idle)
+		, head_(nullptr)
+		, idle_(0)
+	{
+		hits_	= 0;
+		misses_	= 0;
+	}
+
+	void* allocate(size_t size)
+	{
+		if (size > BLOCK_SIZE)
+			return ::operator new(size);
+
+		{
+			tbb::spin_mutex::scoped_lock lock(mutex_);
+			if (head_)
+			{
+				auto b = head_;
+				head_ = b->next;
+				--idle_;
+				++hits_;
+				return b;
+			}
+		}
+
+		++misses_;
+		return ::operator new(BLOCK_SIZE);
+	}
+
+	void deallocate(void* p, size_t size)
+	{
+		if (size <= BLOCK_SIZE)
+		{
+			tbb::spin_mutex::scoped_lock lock(mutex_);
+			if (idle_ < max_idle_)
+			{
+				auto b = static_cast<block*>(p);
+				b->next = head_;
+				head_ = b;
+				++idle_;
+				return;
+			}
+		}
+		::operator delete(p);
+	}
+
+	pool_statistics statistics()
+	{
+		pool_statistics stats;
+		stats.hits		= hits_;
+		stats.misses	= misses_;
+		tbb::spin_mutex::scoped_lock lock(mutex_);
+		stats.idle		= static_cast<int64_t>(idle_);
+		return stats;
+	}
+};
+
+// The pools are never destroyed, pooled objects may be released by other static objects during shutdown.
+object_pool<AVPacket, packet_traits>*	g_packet_pool	= nullptr;
+object_pool<AVFrame, frame_traits>*		g_frame_pool	= nullptr;
+block_pool*								g_block_pool	= nullptr;
+boost::once_flag						g_pools_flag	= BOOST_ONCE_INIT;
+
+void init_pools()
+{
+	g_packet_pool	= new object_pool<AVPacket, packet_traits>(1024);
+	g_frame_pool	= new object_pool<AVFrame, frame_traits>(512);
+	g_block_pool	= new block_pool(2048);
+}
+
+void ensure_pools()
+{
+	boost::call_once(g_pools_flag, &init_pools);
+}
+
+template<typename T>
+struct block_allocator
+{
+	typedef T			value_type;
+	typedef T*			pointer;
+	typedef const T*	const_pointer;
+	typedef T&			reference;
+	typedef const T&	const_reference;
+	typedef size_t		size_type;
+	typedef ptrdiff_t	difference_type;
+
+	template<typename U>
+	struct rebind
+	{
+		typedef block_allocator<U> other;
+	};
+
+	block_allocator(){}
+	template<typename U>
+	block_allocator(const block_allocator<U>&){}
+
+	pointer allocate(size_type n, const void* = 0)
+	{
+		return static_cast<pointer>(g_block_pool->allocate(n * sizeof(T)));
+	}
+
+	void deallocate(pointer p, size_type n)
+	{
+		g_block_pool->deallocate(p, n * sizeof(T));
+	}
+
+	void construct(pointer p, const T& val)	{new(p) T(val);}
+	void destroy(pointer p)					{p->~T();}
+	size_type max_size() const				{return static_cast<size_type>(-1) / sizeof(T);}
+};
+
+template<typename T, typename U>
+bool operator==(const block_allocator<T>&, const block_allocator<U>&) {return true;}
+
+template<typename T, typename U>
+bool operator!=(const block_allocator<T>&, const block_allocator<U>&) {return false;}
+
+void release_packet(AVPacket* p)	{g_packet_pool->release(p);}
+void release_frame(AVFrame* f)		{g_frame_pool->release(f);}
+
+}
+
+safe_ptr<AVPacket> acquire_packet()
+{
+	ensure_pools();
+	return safe_ptr<AVPacket>(std::shared_ptr<AVPacket>(g_packet_pool->acquire(), &release_packet, block_allocator<AVPacket>()));
+}
+
+std::shared_ptr<AVFrame> acquire_frame()
+{
+	ensure_pools();
+	return std::shared_ptr<AVFrame>(g_frame_pool->acquire(), &release_frame, block_allocator<AVFrame>());
+}
+
+pool_statistics packet_pool_statistics()
+{
+	ensure_pools();
+	return g_packet_pool->statistics();
+}
+
+pool_statistics frame_pool_statistics()
+{
+	ensure_pools();
+	return g_frame_pool->statistics();
+}
+
+pool_statistics control_block_pool_statistics()
+{
+	ensure_pools();
+	return g_block_pool->statistics();
+}
+
+boost::property_tree::wptree pool_info()
+{
+	boost::property_tree::wptree info;
+
+	auto add = [&](const std::wstring& name, const pool_statistics& stats)
+	{
+		info.add(name + L".hits",	stats.hits);
+		info.add(name + L".misses",	stats.misses);
+		info.add(name + L".idle",	stats.idle);
+	};
+
+	add(L"packet",			packet_pool_statistics());
+	add(L"frame",			frame_pool_statistics());
+	add(L"control-block",	control_block_pool_statistics());
+
+	return info;
+}
+
+}}
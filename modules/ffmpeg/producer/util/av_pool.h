@@ -0,0 +1,53 @@
+/*
+* Copyright 2013 Sveriges Television AB http://casparcg.com/
+*
+* This file is part of CasparCG (www.casparcg.com).
+*
+* CasparCG is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* CasparCG is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with CasparCG. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <common/memory/safe_ptr.h>
+
+#include <boost/property_tree/ptree_fwd.hpp>
+
+#include <cstdint>
+#include <memory>
+
+struct AVPacket;
+struct AVFrame;
+
+namespace caspar { namespace ffmpeg {
+
+// Packets and frames are unreferenced when their last owner lets go and kept for reuse instead of being freed. 
+// The shared_ptr control blocks come from a pool of fixed size blocks, so that demuxing, decoding and encoding 
+// do not allocate once the pools are warm.
+safe_ptr<AVPacket> acquire_packet();
+std::shared_ptr<AVFrame> acquire_frame();
+
+struct pool_statistics
+{
+	int64_t hits;
+	int64_t misses;
+	int64_t idle;
+};
+
+pool_statistics packet_pool_statistics();
+pool_statistics frame_pool_statistics();
+pool_statistics control_block_pool_statistics();
+
+boost::property_tree::wptree pool_info();
+
+}}
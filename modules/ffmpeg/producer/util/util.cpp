@@ -23,12 +23,13 @@
 
 #include "util.h"
 
+#include "av_pool.h"
 #include "flv.h"
 
 #include "../../ffmpeg_error.h"
 
-#include <tbb/concurrent_unordered_map.h>
-#include <tbb/concurrent_queue.h>
+#include <tbb/mutex.h>
+#include <tbb/tbb_thread.h>
 
 #include <core/producer/frame/frame_transform.h>
 #include <core/producer/frame/frame_factory.h>
@@ -41,12 +42,20 @@
 #include <common/memory/memcpy.h>
 
 #include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+#include <emmintrin.h>
 
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/tokenizer.hpp>
 
+#include <algorithm>
+#include <list>
+#include <tuple>
+#include <vector>
+
 namespace caspar { namespace ffmpeg {
 		
 std::shared_ptr<core::audio_buffer> flush_audio()
@@ -86,16 +95,12 @@ std::shared_ptr<AVPacket>			flush_packet()
 
 safe_ptr<AVPacket> create_packet()
 {
-	safe_ptr<AVPacket> packet(av_packet_alloc(), [](AVPacket* p)
-	{
-		av_packet_free(&p);
-	});
-	return packet;
+	return acquire_packet();
 }
 
 std::shared_ptr<AVFrame> create_frame()
 {
-	return std::shared_ptr<AVFrame>(av_frame_alloc(), [](AVFrame* f) { av_frame_free(&f); });
+	return acquire_frame();
 }
 
 core::field_mode::type get_mode(const AVFrame& frame)
@@ -121,6 +126,8 @@ core::pixel_format::type get_pixel_format(AVPixelFormat pix_fmt)
 	case AV_PIX_FMT_YUV411P:		return core::pixel_format::ycbcr;
 	case AV_PIX_FMT_YUV410P:		return core::pixel_format::ycbcr;
 	case AV_PIX_FMT_YUVA420P:		return core::pixel_format::ycbcra;
+	case AV_PIX_FMT_YUVA422P:		return core::pixel_format::ycbcra;
+	case AV_PIX_FMT_YUVA444P:		return core::pixel_format::ycbcra;
 	default:						return core::pixel_format::invalid;
 	}
 }
@@ -182,10 +189,240 @@ int make_alpha_format(int format)
 	}
 }
 
+AVPixelFormat get_narrow_pixel_format(AVPixelFormat pix_fmt)
+{
+	switch(pix_fmt)
+	{
+	case AV_PIX_FMT_YUV420P10LE:	return AV_PIX_FMT_YUV420P;
+	case AV_PIX_FMT_YUV422P10LE:	return AV_PIX_FMT_YUV422P;
+	case AV_PIX_FMT_YUV444P10LE:	return AV_PIX_FMT_YUV444P;
+	case AV_PIX_FMT_YUV420P12LE:	return AV_PIX_FMT_YUV420P;
+	case AV_PIX_FMT_YUV422P12LE:	return AV_PIX_FMT_YUV422P;
+	case AV_PIX_FMT_YUV444P12LE:	return AV_PIX_FMT_YUV444P;
+	case AV_PIX_FMT_YUVA420P10LE:	return AV_PIX_FMT_YUVA420P;
+	case AV_PIX_FMT_YUVA422P10LE:	return AV_PIX_FMT_YUVA422P;
+	case AV_PIX_FMT_YUVA444P10LE:	return AV_PIX_FMT_YUVA444P;
+	case AV_PIX_FMT_YUVA422P12LE:	return AV_PIX_FMT_YUVA422P;
+	case AV_PIX_FMT_YUVA444P12LE:	return AV_PIX_FMT_YUVA444P;
+	default:						return AV_PIX_FMT_NONE;
+	}
+}
+
+namespace {
+
+// Rounds 10 or 12-bit little endian samples into 8-bit while copying, 16 samples per iteration.
+void narrow_plane(uint8_t* dest, const uint8_t* source, size_t width, size_t height, size_t dest_linesize, size_t source_linesize, int depth)
+{
+	const int shift = depth - 8;
+
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, height, 16), [&](const tbb::blocked_range<size_t>& r)
+	{
+		const __m128i round = _mm_set1_epi16(static_cast<short>(1 << (shift - 1)));
+		const __m128i count = _mm_cvtsi32_si128(shift);
+
+		for(auto y = r.begin(); y != r.end(); ++y)
+		{
+			auto src = reinterpret_cast<const uint16_t*>(source + y*source_linesize);
+			auto dst = dest + y*dest_linesize;
+
+			size_t x = 0;
+			for(; x + 16 <= width; x += 16)
+			{
+				auto lo = _mm_srl_epi16(_mm_add_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x)), round), count);
+				auto hi = _mm_srl_epi16(_mm_add_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x + 8)), round), count);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_packus_epi16(lo, hi));
+			}
+
+			for(; x < width; ++x)
+				dst[x] = static_cast<uint8_t>(std::min(255, (src[x] + (1 << (shift - 1))) >> shift));
+		}
+	});
+}
+
+// Splits packed 4:2:2 (UYVY or YUYV) into Y, Cb and Cr planes, 16 pixels per iteration.
+void unpack_422(uint8_t* y_plane, uint8_t* cb_plane, uint8_t* cr_plane, const int dest_linesize[3], const uint8_t* source, size_t source_linesize, size_t width, size_t height, bool luma_first)
+{
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, height, 16), [&](const tbb::blocked_range<size_t>& r)
+	{
+		const __m128i low_bytes = _mm_set1_epi16(0x00FF);
+
+		for(auto line = r.begin(); line != r.end(); ++line)
+		{
+			auto src	= source + line*source_linesize;
+			auto y_dst	= y_plane  + line*dest_linesize[0];
+			auto cb_dst	= cb_plane + line*dest_linesize[1];
+			auto cr_dst	= cr_plane + line*dest_linesize[2];
+
+			size_t x = 0;
+			for(; x + 16 <= width; x += 16)
+			{
+				auto p0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x*2));
+				auto p1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x*2 + 16));
+
+				__m128i y, c;
+				if(luma_first)
+				{
+					y = _mm_packus_epi16(_mm_and_si128(p0, low_bytes), _mm_and_si128(p1, low_bytes));
+					c = _mm_packus_epi16(_mm_srli_epi16(p0, 8), _mm_srli_epi16(p1, 8));
+				}
+				else
+				{
+					y = _mm_packus_epi16(_mm_srli_epi16(p0, 8), _mm_srli_epi16(p1, 8));
+					c = _mm_packus_epi16(_mm_and_si128(p0, low_bytes), _mm_and_si128(p1, low_bytes));
+				}
+
+				// c is Cb0 Cr0 Cb1 Cr1 ..., split into 8 Cb followed by 8 Cr.
+				auto cbcr = _mm_packus_epi16(_mm_and_si128(c, low_bytes), _mm_srli_epi16(c, 8));
+
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(y_dst + x), y);
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(cb_dst + x/2), cbcr);
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(cr_dst + x/2), _mm_srli_si128(cbcr, 8));
+			}
+
+			const int y_offset = luma_first ? 0 : 1;
+			const int c_offset = luma_first ? 1 : 0;
+			for(; x + 2 <= width; x += 2)
+			{
+				y_dst[x]		= src[x*2 + y_offset];
+				y_dst[x + 1]	= src[x*2 + 2 + y_offset];
+				cb_dst[x/2]		= src[x*2 + c_offset];
+				cr_dst[x/2]		= src[x*2 + 2 + c_offset];
+			}
+		}
+	});
+}
+
+typedef std::tuple<int, int, AVPixelFormat, AVPixelFormat> sws_key; // width, slice height, source and target format.
+
+// Idle SwsContexts by geometry and format. Only the most recently used keys are kept so that clips of changing 
+// resolution do not accumulate contexts for the lifetime of the process.
+class sws_context_cache : boost::noncopyable
+{
+	static const size_t MAX_KEYS			= 16;
+	static const size_t MAX_IDLE_PER_KEY	= 64;
+
+	struct entry
+	{
+		sws_key									key;
+		std::vector<std::shared_ptr<SwsContext>>	idle;
+	};
+
+	tbb::mutex			mutex_;
+	std::list<entry>	entries_; // Most recently used first.
+public:
+	std::shared_ptr<SwsContext> acquire(const sws_key& key)
+	{
+		{
+			tbb::mutex::scoped_lock lock(mutex_);
+
+			auto it = find(key);
+			if(it != entries_.end())
+			{
+				entries_.splice(entries_.begin(), entries_, it);
+				if(!it->idle.empty())
+				{
+					auto context = std::move(it->idle.back());
+					it->idle.pop_back();
+					return context;
+				}
+			}
+		}
+
+		std::shared_ptr<SwsContext> context(sws_getContext(std::get<0>(key), std::get<1>(key), std::get<2>(key), std::get<0>(key), std::get<1>(key), std::get<3>(key), SWS_FAST_BILINEAR, nullptr, nullptr, NULL), sws_freeContext);
+		if(!context)
+		{
+			BOOST_THROW_EXCEPTION(operation_failed() << msg_info("Could not create software scaling context.") << 
+									boost::errinfo_api_function("sws_getContext"));
+		}
+		CASPAR_LOG(trace) << L"Created new SWS context w=" << std::get<0>(key) << L", h=" << std::get<1>(key) << ", input pix_fmt=" << std::get<2>(key) << L", output pix_fmt=" << std::get<3>(key);
+		return context;
+	}
+
+	void release(const sws_key& key, const std::shared_ptr<SwsContext>& context)
+	{
+		tbb::mutex::scoped_lock lock(mutex_);
+
+		auto it = find(key);
+		if(it == entries_.end())
+		{
+			entry e;
+			e.key = key;
+			entries_.push_front(std::move(e));
+			it = entries_.begin();
+
+			if(entries_.size() > MAX_KEYS)
+				entries_.pop_back();
+		}
+
+		if(it->idle.size() < MAX_IDLE_PER_KEY)
+			it->idle.push_back(context);
+	}
+private:
+	std::list<entry>::iterator find(const sws_key& key)
+	{
+		return std::find_if(entries_.begin(), entries_.end(), [&](const entry& e){ return e.key == key; });
+	}
+};
+
+sws_context_cache g_sws_contexts;
+
+// Number of horizontal bands a conversion is split into. Band heights are kept a multiple of the vertical chroma 
+// subsampling of both formats so that every band starts on a whole chroma line.
+int get_slice_count(int height, int alignment)
+{
+	static const int MIN_SLICE_HEIGHT = 64;
+
+	int count = std::min(static_cast<int>(tbb::tbb_thread::hardware_concurrency()), height / MIN_SLICE_HEIGHT);
+	while(count > 1 && (height % (count * alignment)) != 0)
+		--count;
+	return std::max(1, count);
+}
+
+// Converts with sws_scale, one SwsContext per band of rows so that the bands run in parallel.
+void sliced_scale(const AVFrame& source, AVPixelFormat target_pix_fmt, uint8_t* const target_data[4], const int target_linesize[4])
+{
+	const auto pix_fmt		= static_cast<AVPixelFormat>(source.format);
+	const auto source_desc	= av_pix_fmt_desc_get(pix_fmt);
+	const auto target_desc	= av_pix_fmt_desc_get(target_pix_fmt);
+	const int alignment		= 1 << std::max(source_desc->log2_chroma_h, target_desc->log2_chroma_h);
+	const int slices		= get_slice_count(source.height, alignment);
+	const int slice_height	= source.height / slices;
+	const sws_key key(source.width, slice_height, pix_fmt, target_pix_fmt);
+
+	tbb::parallel_for(0, slices, [&](int slice)
+	{
+		const int y = slice * slice_height;
+
+		const uint8_t*	src[4] = {};
+		uint8_t*		dst[4] = {};
+		for(int n = 0; n < 4; ++n)
+		{
+			if(source.data[n])
+				src[n] = source.data[n] + (n == 1 || n == 2 ? y >> source_desc->log2_chroma_h : y) * source.linesize[n];
+			if(target_data[n])
+				dst[n] = target_data[n] + (n == 1 || n == 2 ? y >> target_desc->log2_chroma_h : y) * target_linesize[n];
+		}
+
+		auto context = g_sws_contexts.acquire(key);
+		sws_scale(context.get(), src, source.linesize, 0, slice_height, dst, target_linesize);
+		g_sws_contexts.release(key, context);
+	});
+}
+
+void set_timecode(core::write_frame& write, const AVFrame& decoded_frame)
+{
+	if (decoded_frame.opaque_ref)
+	{
+		auto time = static_cast<frame_time*>(av_buffer_get_opaque(decoded_frame.opaque_ref));
+		if (time)
+			write.set_timecode(time->FrameNumber);
+	}
+}
+
+}
+
 safe_ptr<core::write_frame> make_write_frame(const void* tag, const safe_ptr<AVFrame>& decoded_frame, const safe_ptr<core::frame_factory>& frame_factory, int hints, const core::channel_layout& audio_channel_layout)
 {
-	static tbb::concurrent_unordered_map<int64_t, tbb::concurrent_queue<std::shared_ptr<SwsContext>>> sws_contexts_;
-	
 	if(decoded_frame->width < 1 || decoded_frame->height < 1)
 		return make_safe<core::write_frame>(tag, audio_channel_layout);
 
@@ -198,77 +435,73 @@ safe_ptr<core::write_frame> make_write_frame(const void* tag, const safe_ptr<AVF
 
 	std::shared_ptr<core::write_frame> write;
 
-	if(desc.pix_fmt == core::pixel_format::invalid)
-	{
-		auto pix_fmt = static_cast<AVPixelFormat>(decoded_frame->format);
-		auto target_pix_fmt = AV_PIX_FMT_BGRA;
+	auto pix_fmt		= static_cast<AVPixelFormat>(decoded_frame->format);
+	auto narrow_pix_fmt = get_narrow_pixel_format(pix_fmt);
 
-		if(pix_fmt == AV_PIX_FMT_UYVY422)
-			target_pix_fmt = AV_PIX_FMT_YUV422P;
-		else if(pix_fmt == AV_PIX_FMT_YUYV422)
-			target_pix_fmt = AV_PIX_FMT_YUV422P;
-		else if(pix_fmt == AV_PIX_FMT_UYYVYY411)
-			target_pix_fmt = AV_PIX_FMT_YUV411P;
-		else if(pix_fmt == AV_PIX_FMT_YUV420P10)
-			target_pix_fmt = AV_PIX_FMT_YUV420P;
-		else if(pix_fmt == AV_PIX_FMT_YUV422P10)
-			target_pix_fmt = AV_PIX_FMT_YUV422P;
-		else if(pix_fmt == AV_PIX_FMT_YUV444P10)
-			target_pix_fmt = AV_PIX_FMT_YUV444P;
-		
-		auto target_desc = get_pixel_format_desc(static_cast<AVPixelFormat>(target_pix_fmt), width, height);
+	if(desc.pix_fmt == core::pixel_format::invalid && narrow_pix_fmt != AV_PIX_FMT_NONE)
+	{
+		// 10 and 12-bit planar passthrough (v210, ProRes, DNxHR), only the sample depth is reduced. Colour conversion is done by the image mixer.
+		auto target_desc = get_pixel_format_desc(hints & core::frame_producer::ALPHA_HINT ? static_cast<AVPixelFormat>(CASPAR_PIX_FMT_LUMA) : narrow_pix_fmt, width, height);
+		auto depth		 = av_pix_fmt_desc_get(pix_fmt)->comp[0].depth;
 
 		write = frame_factory->create_frame(tag, target_desc, audio_channel_layout);
 		write->set_type(get_mode(*decoded_frame));
-		if (decoded_frame->opaque_ref)
+		set_timecode(*write, *decoded_frame);
+
+		for(int n = 0; n < static_cast<int>(target_desc.planes.size()); ++n)
 		{
-			auto time = static_cast<frame_time*>(av_buffer_get_opaque(decoded_frame->opaque_ref));
-			if (time)
-				write->set_timecode(time->FrameNumber);
+			auto plane = target_desc.planes[n];
+
+			CASPAR_ASSERT(decoded_frame->data[n]);
+
+			narrow_plane(write->image_data(n).begin(), decoded_frame->data[n], plane.linesize, plane.height, plane.linesize, decoded_frame->linesize[n], depth);
+
+			write->commit(n);
 		}
+	}
+	else if(desc.pix_fmt == core::pixel_format::invalid && (pix_fmt == AV_PIX_FMT_UYVY422 || pix_fmt == AV_PIX_FMT_YUYV422))
+	{
+		auto target_desc = get_pixel_format_desc(AV_PIX_FMT_YUV422P, width, height);
 
-		std::shared_ptr<SwsContext> sws_context;
+		write = frame_factory->create_frame(tag, target_desc, audio_channel_layout);
+		write->set_type(get_mode(*decoded_frame));
+		set_timecode(*write, *decoded_frame);
 
-		//CASPAR_LOG(warning) << "Hardware accelerated color transform not supported.";
-		
-		int64_t key = ((static_cast<int64_t>(width)			 << 32) & 0xFFFF00000000) | 
-					  ((static_cast<int64_t>(height)		 << 16) & 0xFFFF0000) | 
-					  ((static_cast<int64_t>(pix_fmt)		 <<  8) & 0xFF00) | 
-					  ((static_cast<int64_t>(target_pix_fmt) <<  0) & 0xFF);
+		const int linesize[3] = {static_cast<int>(target_desc.planes[0].linesize), static_cast<int>(target_desc.planes[1].linesize), static_cast<int>(target_desc.planes[2].linesize)};
+		unpack_422(write->image_data(0).begin(), write->image_data(1).begin(), write->image_data(2).begin(), linesize, decoded_frame->data[0], decoded_frame->linesize[0], width, height, pix_fmt == AV_PIX_FMT_YUYV422);
 
-		auto& pool = sws_contexts_[key];
+		write->commit();
+	}
+	else if(desc.pix_fmt == core::pixel_format::invalid)
+	{
+		auto target_pix_fmt = AV_PIX_FMT_BGRA;
 
-		if(!pool.try_pop(sws_context))
-		{
-			sws_context.reset(sws_getContext(width, height, static_cast<AVPixelFormat>(pix_fmt), width, height, target_pix_fmt, SWS_FAST_BILINEAR, nullptr, nullptr, NULL), sws_freeContext);
-			CASPAR_LOG(trace) << L"Created new SWS context w=" << width << L", h=" << height << ", input pix_fmt=" << pix_fmt << L", output pix_fmt=" << target_pix_fmt;
-		}
+		if(pix_fmt == AV_PIX_FMT_UYYVYY411)
+			target_pix_fmt = AV_PIX_FMT_YUV411P;
+		
+		auto target_desc = get_pixel_format_desc(static_cast<AVPixelFormat>(target_pix_fmt), width, height);
 
-		if(!sws_context)
-		{
-			BOOST_THROW_EXCEPTION(operation_failed() << msg_info("Could not create software scaling context.") << 
-									boost::errinfo_api_function("sws_getContext"));
-		}	
+		write = frame_factory->create_frame(tag, target_desc, audio_channel_layout);
+		write->set_type(get_mode(*decoded_frame));
+		set_timecode(*write, *decoded_frame);
 
-		std::shared_ptr<AVFrame> av_frame = create_frame();
+		uint8_t*	data[4]		= {};
+		int			linesize[4] = {};
 		if(target_pix_fmt == AV_PIX_FMT_BGRA)
 		{
-			auto size = av_image_fill_arrays(av_frame->data, av_frame->linesize, write->image_data().begin(), AV_PIX_FMT_BGRA, width, height, 1);
+			auto size = av_image_fill_arrays(data, linesize, write->image_data().begin(), AV_PIX_FMT_BGRA, width, height, 1);
 			CASPAR_VERIFY(size == write->image_data().size()); 
 		}
 		else
 		{
-			av_frame->width	 = width;
-			av_frame->height = height;
 			for(size_t n = 0; n < target_desc.planes.size(); ++n)
 			{
-				av_frame->data[n]		= write->image_data(n).begin();
-				av_frame->linesize[n]	= target_desc.planes[n].linesize;
+				data[n]		= write->image_data(n).begin();
+				linesize[n]	= target_desc.planes[n].linesize;
 			}
 		}
 
-		sws_scale(sws_context.get(), decoded_frame->data, decoded_frame->linesize, 0, height, av_frame->data, av_frame->linesize);	
-		pool.push(sws_context);
+		sliced_scale(*decoded_frame, target_pix_fmt, data, linesize);
 
 		write->commit();
 	}
@@ -276,10 +509,7 @@ safe_ptr<core::write_frame> make_write_frame(const void* tag, const safe_ptr<AVF
 	{
 		write = frame_factory->create_frame(tag, desc, audio_channel_layout);
 		write->set_type(get_mode(*decoded_frame));
-		auto time = static_cast<frame_time*>(av_buffer_get_opaque(decoded_frame->opaque_ref));
-		if (time)
-			write->set_timecode(time->FrameNumber);
-
+		set_timecode(*write, *decoded_frame);
 
 		for(int n = 0; n < static_cast<int>(desc.planes.size()); ++n)
 		{
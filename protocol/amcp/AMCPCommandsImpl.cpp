@@ -199,89 +199,122 @@ std::wstring read_file(const boost::filesystem::wpath& file)
 	return read_latin1_file(file);
 }
 
-std::wstring MediaInfo(const boost::filesystem::wpath& path, const std::shared_ptr<core::media_info_repository>& media_info_repo)
+std::wstring MediaInfo(const std::wstring& file, const core::media_info& media_info)
 {
-	if(boost::filesystem::is_regular_file(path))
+	boost::filesystem::wpath path(file);
+
+	std::wstring clipttype = TEXT(" N/A ");
+	std::wstring extension = boost::to_upper_copy(path.extension());
+	if(extension == TEXT(".TGA") || extension == TEXT(".COL") || extension == L".PNG" || extension == L".JPEG" || extension == L".JPG" ||
+		extension == L".GIF" || extension == L".BMP")
 	{
-		std::wstring clipttype = TEXT(" N/A ");
-		std::wstring extension = boost::to_upper_copy(path.extension());
-		if(extension == TEXT(".TGA") || extension == TEXT(".COL") || extension == L".PNG" || extension == L".JPEG" || extension == L".JPG" ||
-			extension == L".GIF" || extension == L".BMP")
-		{
-			clipttype = TEXT(" STILL ");			
-		}
-		else if(extension == TEXT(".WAV") || extension == TEXT(".MP3"))
-		{
-			clipttype = TEXT(" AUDIO ");
-		}
-		else if(extension == TEXT(".SWF") || extension == TEXT(".CT") ||
-				extension == TEXT(".DV") || extension == TEXT(".MOV") || 
-				extension == TEXT(".MPG") || extension == TEXT(".AVI") || 
-				extension == TEXT(".MP4") || extension == TEXT(".FLV") || 
-				caspar::ffmpeg::is_valid_file(path.file_string()))
+		clipttype = TEXT(" STILL ");			
+	}
+	else if(extension == TEXT(".WAV") || extension == TEXT(".MP3"))
+	{
+		clipttype = TEXT(" AUDIO ");
+	}
+	else if(extension == TEXT(".SWF") || extension == TEXT(".CT") ||
+			extension == TEXT(".DV") || extension == TEXT(".MOV") || 
+			extension == TEXT(".MPG") || extension == TEXT(".AVI") || 
+			extension == TEXT(".MP4") || extension == TEXT(".FLV") || 
+			media_info.recognized || caspar::ffmpeg::is_valid_file(file))
+	{
+		clipttype = TEXT(" MOVIE ");
+	}
+
+	if(clipttype != TEXT(" N/A "))
+	{		
+		auto relativePath = boost::filesystem::wpath(file.substr(env::media_folder().size()-1, file.size()));
+
+		auto writeTimeStr = boost::posix_time::to_iso_string(boost::posix_time::from_time_t(media_info.write_time));
+		writeTimeStr.erase(std::remove_if(writeTimeStr.begin(), writeTimeStr.end(), [](char c){ return std::isdigit(c) == 0; }), writeTimeStr.end());
+		auto writeTimeWStr = std::wstring(writeTimeStr.begin(), writeTimeStr.end());
+
+		auto sizeStr = boost::lexical_cast<std::wstring>(media_info.size);
+		sizeStr.erase(std::remove_if(sizeStr.begin(), sizeStr.end(), [](wchar_t c){ return std::iswdigit(c) == 0; }), sizeStr.end());
+				
+		auto str = relativePath.replace_extension(TEXT("")).external_file_string();
+		if(str[0] == '\\' || str[0] == '/')
+			str = std::wstring(str.begin() + 1, str.end());
+			
+		return std::wstring() 
+				+ L"\""		+ str +
+				+ L"\" "	+ clipttype +
+				+ L" "		+ sizeStr +
+				+ L" "		+ writeTimeWStr +
+				+ L" "		+ boost::lexical_cast<std::wstring>(media_info.duration) +
+				+ L" "		+ boost::lexical_cast<std::wstring>(media_info.time_base.numerator()) + L"/" + boost::lexical_cast<std::wstring>(media_info.time_base.denominator())
+				+ L"\r\n"; 	
+	}	
+	return L"";
+}
+
+// Files in folder from the media index, which is kept up to date by the filesystem monitors in the server.
+// Until the initial index update of folder has finished the folder is walked instead.
+std::vector<std::pair<std::wstring, core::media_info>> ListFiles(const std::wstring& folder, const std::shared_ptr<core::media_info_repository>& media_info_repo, bool extract)
+{
+	std::vector<std::pair<std::wstring, core::media_info>> files;
+
+	if(media_info_repo->is_indexed(folder))
+	{
+		BOOST_FOREACH(auto& entry, media_info_repo->get_all())
 		{
-			clipttype = TEXT(" MOVIE ");
+			if(boost::istarts_with(entry.first, folder))
+				files.push_back(entry);
 		}
 
-		if(clipttype != TEXT(" N/A "))
-		{		
-			auto is_not_digit = [](char c){ return std::isdigit(c) == 0; };
+		return files;
+	}
 
-			auto relativePath = boost::filesystem::wpath(path.file_string().substr(env::media_folder().size()-1, path.file_string().size()));
+	for (boost::filesystem::wrecursive_directory_iterator itr(folder), end; itr != end; ++itr)
+	{
+		if(!boost::filesystem::is_regular_file(itr->path()))
+			continue;
 
-			auto writeTimeStr = boost::posix_time::to_iso_string(boost::posix_time::from_time_t(boost::filesystem::last_write_time(path)));
-			writeTimeStr.erase(std::remove_if(writeTimeStr.begin(), writeTimeStr.end(), is_not_digit), writeTimeStr.end());
-			auto writeTimeWStr = std::wstring(writeTimeStr.begin(), writeTimeStr.end());
+		core::media_info info;
 
-			auto sizeStr = boost::lexical_cast<std::wstring>(boost::filesystem::file_size(path));
-			sizeStr.erase(std::remove_if(sizeStr.begin(), sizeStr.end(), is_not_digit), sizeStr.end());
-			auto sizeWStr = std::wstring(sizeStr.begin(), sizeStr.end());
-				
-			auto str = relativePath.replace_extension(TEXT("")).external_file_string();
-			if(str[0] == '\\' || str[0] == '/')
-				str = std::wstring(str.begin() + 1, str.end());
-			auto media_info = media_info_repo->get(path.file_string());
-			
-			return std::wstring() 
-					+ L"\""		+ str +
-					+ L"\" "	+ clipttype +
-					+ L" "		+ sizeStr +
-					+ L" "		+ writeTimeWStr +
-					+ L" "		+ boost::lexical_cast<std::wstring>(media_info.duration) +
-					+ L" "		+ boost::lexical_cast<std::wstring>(media_info.time_base.numerator()) + L"/" + boost::lexical_cast<std::wstring>(media_info.time_base.denominator())
-					+ L"\r\n"; 	
-		}	
+		if(extract)
+			info = media_info_repo->get(itr->path().file_string());
+		else
+		{
+			info.size = boost::filesystem::file_size(itr->path());
+			info.write_time = boost::filesystem::last_write_time(itr->path());
+		}
+
+		files.push_back(std::make_pair(itr->path().file_string(), info));
 	}
-	return L"";
+
+	return files;
 }
 
 std::wstring ListMedia(const std::shared_ptr<core::media_info_repository>& media_info_repo)
 {		
 	std::wstringstream replyString;
-	for (boost::filesystem::wrecursive_directory_iterator itr(env::media_folder()), end; itr != end; ++itr)	
-		replyString << MediaInfo(itr->path(), media_info_repo);
+	BOOST_FOREACH(auto& entry, ListFiles(env::media_folder(), media_info_repo, true))
+		replyString << MediaInfo(entry.first, entry.second);
 	
 	return boost::to_upper_copy(replyString.str());
 }
 
-std::wstring ListTemplates() 
+std::wstring ListTemplates(const std::shared_ptr<core::media_info_repository>& media_info_repo) 
 {
 	std::wstringstream replyString;
 
-	for (boost::filesystem::wrecursive_directory_iterator itr(env::template_folder()), end; itr != end; ++itr)
+	BOOST_FOREACH(auto& entry, ListFiles(env::template_folder(), media_info_repo, false))
 	{		
-		if(boost::filesystem::is_regular_file(itr->path()) && (itr->path().extension() == L".ft" || itr->path().extension() == L".ct"))
+		boost::filesystem::wpath path(entry.first);
+
+		if(path.extension() == L".ft" || path.extension() == L".ct")
 		{
-			auto relativePath = boost::filesystem::wpath(itr->path().file_string().substr(env::template_folder().size()-1, itr->path().file_string().size()));
+			auto relativePath = boost::filesystem::wpath(entry.first.substr(env::template_folder().size()-1, entry.first.size()));
 
-			auto writeTimeStr = boost::posix_time::to_iso_string(boost::posix_time::from_time_t(boost::filesystem::last_write_time(itr->path())));
+			auto writeTimeStr = boost::posix_time::to_iso_string(boost::posix_time::from_time_t(entry.second.write_time));
 			writeTimeStr.erase(std::remove_if(writeTimeStr.begin(), writeTimeStr.end(), [](char c){ return std::isdigit(c) == 0;}), writeTimeStr.end());
 			auto writeTimeWStr = std::wstring(writeTimeStr.begin(), writeTimeStr.end());
 
-			auto sizeStr = boost::lexical_cast<std::string>(boost::filesystem::file_size(itr->path()));
-			sizeStr.erase(std::remove_if(sizeStr.begin(), sizeStr.end(), [](char c){ return std::isdigit(c) == 0;}), sizeStr.end());
-
-			auto sizeWStr = std::wstring(sizeStr.begin(), sizeStr.end());
+			auto sizeWStr = boost::lexical_cast<std::wstring>(entry.second.size);
+			sizeWStr.erase(std::remove_if(sizeWStr.begin(), sizeWStr.end(), [](wchar_t c){ return std::iswdigit(c) == 0;}), sizeWStr.end());
 
 			std::wstring dir = relativePath.parent_path().external_directory_string();
 			std::wstring file = boost::to_upper_copy(relativePath.filename());
@@ -1790,12 +1823,11 @@ bool CinfCommand::DoExecute()
 	try
 	{
 		std::wstring info;
-		for (boost::filesystem::wrecursive_directory_iterator itr(env::media_folder()), end; itr != end; ++itr)
+		BOOST_FOREACH(auto& entry, ListFiles(env::media_folder(), GetMediaInfoRepo(), true))
 		{
-			auto path = itr->path();
-			auto file = path.replace_extension(L"").filename();
+			auto file = boost::filesystem::wpath(entry.first).replace_extension(L"").filename();
 			if(boost::iequals(file, _parameters.at(0)))
-				info += MediaInfo(itr->path(), GetMediaInfoRepo()) + L"\r\n";
+				info += MediaInfo(entry.first, entry.second) + L"\r\n";
 		}
 
 		if(info.empty())
@@ -2020,7 +2052,7 @@ bool TlsCommand::DoExecute()
 	std::wstringstream replyString;
 	replyString << TEXT("200 TLS OK\r\n");
 
-	replyString << ListTemplates();
+	replyString << ListTemplates(GetMediaInfoRepo());
 	replyString << TEXT("\r\n");
 
 	SetReplyString(replyString.str());
@@ -34,8 +34,8 @@ namespace core {
 
 namespace protocol {
 
-std::wstring ListMedia();
-std::wstring ListTemplates();
+std::wstring ListMedia(const std::shared_ptr<core::media_info_repository>& media_info_repo);
+std::wstring ListTemplates(const std::shared_ptr<core::media_info_repository>& media_info_repo);
 
 namespace amcp {
 	
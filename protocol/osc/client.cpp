@@ -33,15 +33,18 @@
 
 #include <core/monitor/monitor.h>
 
+#include <array>
+#include <cstring>
 #include <functional>
 #include <vector>
-#include <unordered_map>
 
 #include <boost/asio.hpp>
 #include <boost/foreach.hpp>
 #include <boost/bind.hpp>
 #include <boost/thread.hpp>
 
+#include <tbb/atomic.h>
+#include <tbb/concurrent_queue.h>
 #include <tbb/spin_mutex.h>
 #include <tbb/cache_aligned_allocator.h>
 
@@ -63,42 +66,145 @@ struct no_init_proxy
 
 typedef std::vector<no_init_proxy<char>, tbb::cache_aligned_allocator<no_init_proxy<char>>> byte_vector;
 
+// Latest OSC packet of one address, the padded address is written once and the arguments are overwritten by every message.
+struct slot
+{
+	tbb::spin_mutex		mutex;
+	byte_vector			packet;
+	size_t				address_size;
+	tbb::atomic<bool>	dirty;
+
+	slot()
+		: address_size(0)
+	{
+		dirty = false;
+	}
+};
+
+// Slots indexed by address. Blocks of slots are allocated on first use and never freed, so a lookup is lock free.
+class slot_table : boost::noncopyable
+{
+	static const size_t BLOCK_SIZE = 256;
+	static const size_t MAX_BLOCKS = 4096;
+
+	typedef std::array<slot, BLOCK_SIZE> block;
+
+	std::array<tbb::atomic<block*>, MAX_BLOCKS> blocks_;
+public:
+	slot_table()
+	{
+		BOOST_FOREACH(auto& entry, blocks_)
+			entry = nullptr;
+	}
+
+	~slot_table()
+	{
+		BOOST_FOREACH(auto& entry, blocks_)
+			delete entry.fetch_and_store(nullptr);
+	}
+
+	slot* get(core::monitor::address addr)
+	{
+		const auto index = addr / BLOCK_SIZE;
+
+		if(index >= MAX_BLOCKS)
+			return nullptr;
+
+		block* result = blocks_[index];
+
+		if(!result)
+		{
+			auto new_block = new block();
+
+			result = blocks_[index].compare_and_swap(new_block, nullptr);
+
+			if(result)
+				delete new_block;
+			else
+				result = new_block;
+		}
+
+		return &(*result)[addr % BLOCK_SIZE];
+	}
+};
+
+void write_padded(byte_vector& destination, const void* data, size_t size, size_t padded_size)
+{
+	const auto offset = destination.size();
+
+	destination.resize(offset + padded_size);
+	std::memcpy(destination.data() + offset, data, size);
+	std::memset(destination.data() + offset + size, 0, padded_size - size);
+}
+
+void write_osc_string(byte_vector& destination, const char* value, size_t size)
+{
+	write_padded(destination, value, size, (size + 4) & ~3);
+}
+
 template<typename T>
-struct param_visitor : public boost::static_visitor<void>
+void write_osc_value(byte_vector& destination, T value)
 {
-	T& o;
+#ifdef OSC_HOST_LITTLE_ENDIAN
+	value = swap_byte_order(value);
+#endif
+	write_padded(destination, &value, sizeof(T), sizeof(T));
+}
 
-	param_visitor(T& o)
-		: o(o)
+// Fills in the type tags reserved after the address and appends the arguments, encoded the same way as oscpack.
+class argument_writer : public boost::static_visitor<void>
+{
+	byte_vector&	packet_;
+	size_t			tag_offset_;
+public:
+	argument_writer(byte_vector& packet, size_t tag_offset)
+		: packet_(packet)
+		, tag_offset_(tag_offset)
 	{
-	}		
-		
-	void operator()(const bool value)					{o << value;}
-	void operator()(const int32_t value)				{o << static_cast<int64_t>(value);}
-	void operator()(const uint32_t value)				{o << static_cast<int64_t>(value);}
-	void operator()(const int64_t value)				{o << static_cast<int64_t>(value);}
-	void operator()(const uint64_t value)				{o << static_cast<int64_t>(value);}
-	void operator()(const float value)					{o << value;}
-	void operator()(const double value)					{o << static_cast<float>(value);}
-	void operator()(const std::string& value)			{o << value.c_str();}
-	void operator()(const std::wstring& value)			{o << narrow(value).c_str();}
-	void operator()(const std::vector<int8_t>& value)	{o << ::osc::Blob(value.data(), static_cast<unsigned long>(value.size()));}
+	}
+
+	void operator()(const bool value)					{tag(value ? 'T' : 'F');}
+	void operator()(const int32_t value)				{tag('h'); write_osc_value(packet_, static_cast<int64_t>(value));}
+	void operator()(const int64_t value)				{tag('h'); write_osc_value(packet_, value);}
+	void operator()(const float value)					{tag('f'); write_osc_value(packet_, value);}
+	void operator()(const double value)					{tag('f'); write_osc_value(packet_, static_cast<float>(value));}
+	void operator()(const std::string& value)			{tag('s'); write_osc_string(packet_, value.data(), value.size());}
+	void operator()(const std::wstring& value)			{(*this)(narrow(value));}
+
+	void operator()(const std::vector<int8_t>& value)
+	{
+		tag('b');
+		write_osc_value(packet_, static_cast<int32_t>(value.size()));
+		write_padded(packet_, value.data(), value.size(), (value.size() + 3) & ~3);
+	}
+private:
+	void tag(char type)
+	{
+		packet_[tag_offset_++].value = type;
+	}
 };
 
-void write_osc_event(byte_vector& destination, const core::monitor::message& e)
-{		
-	destination.resize(4096);
+void write_osc_event(slot& destination, core::monitor::address addr, const core::monitor::message& e)
+{
+	auto& packet = destination.packet;
 
-	::osc::OutboundPacketStream o(reinterpret_cast<char*>(destination.data()), static_cast<unsigned long>(destination.size()));
-	o << ::osc::BeginMessage(e.path().c_str());
+	if(destination.address_size == 0)
+	{
+		const auto& path = core::monitor::address_path(addr);
+
+		packet.clear();
+		write_osc_string(packet, path.data(), path.size());
+		destination.address_size = packet.size();
+	}
+
+	packet.resize(destination.address_size);
+
+	const char type_tags[4] = {',', 0, 0, 0};
+	write_padded(packet, type_tags, 1, (static_cast<size_t>(e.data().size()) + 1 + 4) & ~3);
 				
-	param_visitor<decltype(o)> param_visitor(o);
+	argument_writer writer(packet, destination.address_size + 1);
 	BOOST_FOREACH(const auto& data, e.data())
-		boost::apply_visitor(param_visitor, data);
-				
-	o << ::osc::EndMessage;
-		
-	destination.resize(o.Size());
+		boost::apply_visitor(writer, data);
 }
 
 byte_vector write_osc_bundle_start()
@@ -114,19 +220,6 @@ byte_vector write_osc_bundle_start()
 	return destination;
 }
 
-void write_osc_bundle_element_start(byte_vector& destination, const byte_vector& message)
-{		
-	destination.resize(4);
-
-	int32_t* bundle_element_size = reinterpret_cast<int32_t*>(destination.data());
-
-#ifdef OSC_HOST_LITTLE_ENDIAN
-	*bundle_element_size = swap_byte_order(static_cast<int32_t>(message.size()));
-#else
-	*bundle_element_size = static_cast<int32_t>(bundle.size());
-#endif
-}
-
 struct client::impl : public std::enable_shared_from_this<client::impl>, core::monitor::sink
 {
 	std::shared_ptr<boost::asio::io_service>		service_;
@@ -134,7 +227,9 @@ struct client::impl : public std::enable_shared_from_this<client::impl>, core::m
 	tbb::spin_mutex									endpoints_mutex_;
 	std::map<udp::endpoint, int>					reference_counts_by_endpoint_;
 
-	std::unordered_map<std::string, byte_vector>	updates_;
+	slot_table										slots_;
+	tbb::concurrent_queue<core::monitor::address>	dirty_slots_;
+	tbb::atomic<int>								pending_;
 	boost::mutex									updates_mutex_;								
 	boost::condition_variable						updates_cond_;
 
@@ -148,13 +243,17 @@ public:
 		, socket_(*service_, udp::v4())
 		, thread_(boost::bind(&impl::run, this))
 	{
+		pending_ = 0;
 	}
 
 	~impl()
 	{
 		is_running_ = false;
 
-		updates_cond_.notify_one();
+		{
+			boost::lock_guard<boost::mutex> lock(updates_mutex_);
+			updates_cond_.notify_one();
+		}
 
 		thread_.join();
 	}
@@ -187,31 +286,47 @@ public:
 		});
 	}
 private:
-	void propagate(const core::monitor::message& msg)
+	void propagate(core::monitor::address addr, const core::monitor::message& msg)
 	{
-		boost::lock_guard<boost::mutex> lock(updates_mutex_);
+		auto slot = slots_.get(addr);
+
+		if (!slot)
+			return;
 
-		try 
 		{
-			write_osc_event(updates_[msg.path()], msg);
+			tbb::spin_mutex::scoped_lock lock(slot->mutex);
+
+			try 
+			{
+				write_osc_event(*slot, addr, msg);
+			}
+			catch(...)
+			{
+				CASPAR_LOG_CURRENT_EXCEPTION();
+				slot->packet.clear();
+				slot->address_size = 0;
+			}
 		}
-		catch(...)
+
+		if (slot->dirty.fetch_and_store(true))
+			return; // Already queued, the sender picks up the latest packet.
+
+		dirty_slots_.push(addr);
+
+		if (pending_.fetch_and_increment() == 0)
 		{
-			CASPAR_LOG_CURRENT_EXCEPTION();
-			updates_.erase(msg.path());
+			boost::lock_guard<boost::mutex> lock(updates_mutex_);
+			updates_cond_.notify_one();
 		}
-
-		updates_cond_.notify_one();
 	}
 
-	template<typename T>
 	void do_send(
-			const T& buffers, const std::vector<udp::endpoint>& destinations)
+			const byte_vector& datagram, const std::vector<udp::endpoint>& destinations)
 	{
 		boost::system::error_code ec;
 
 		BOOST_FOREACH(const auto& endpoint, destinations)
-			socket_.send_to(buffers, endpoint, 0, ec);
+			socket_.send_to(boost::asio::buffer(datagram.data(), datagram.size()), endpoint, 0, ec);
 	}
 
 	void run()
@@ -223,25 +338,24 @@ private:
 		{
 			is_running_ = true;
 
-			std::unordered_map<std::string, byte_vector> updates;
 			std::vector<udp::endpoint> destinations;
 			const byte_vector bundle_header = write_osc_bundle_start();
-			std::vector<byte_vector> element_headers;
+			byte_vector datagram;
+			byte_vector packet;
 
 			while (is_running_)
 			{		
-				updates.clear();
 				destinations.clear();
 
 				{			
 					boost::unique_lock<boost::mutex> cond_lock(updates_mutex_);
 
-					if (updates_.empty())
+					while (pending_ == 0 && is_running_)
 						updates_cond_.wait(cond_lock);
-
-					std::swap(updates, updates_);
 				}
 
+				pending_ = 0;
+
 				{
 					tbb::spin_mutex::scoped_lock lock(endpoints_mutex_);
 
@@ -249,41 +363,40 @@ private:
 						destinations.push_back(endpoint.first);
 				}
 
-				if (destinations.empty())
-					continue;
+				datagram = bundle_header;
 
-				std::vector<boost::asio::const_buffers_1> buffers;
-				element_headers.resize(
-						std::max(element_headers.size(), updates.size()));
+				core::monitor::address addr;
+				while (dirty_slots_.try_pop(addr))
+				{
+					auto& slot = *slots_.get(addr);
 
-				int i = 0;
-				int datagram_size = bundle_header.size();
-				buffers.push_back(boost::asio::buffer(bundle_header));
+					slot.dirty = false;
 
-				BOOST_FOREACH(const auto& slot, updates)
-				{
-					write_osc_bundle_element_start(element_headers[i], slot.second);
-					const auto& headers = element_headers;
+					if (destinations.empty())
+						continue;
 
-					auto size_of_element = headers[i].size() + slot.second.size();
-	
-					if (datagram_size + size_of_element >= SAFE_DATAGRAM_SIZE)
 					{
-						do_send(buffers, destinations);
-						buffers.clear();
-						buffers.push_back(boost::asio::buffer(bundle_header));
-						datagram_size = bundle_header.size();
+						tbb::spin_mutex::scoped_lock lock(slot.mutex);
+						packet = slot.packet;
 					}
 
-					buffers.push_back(boost::asio::buffer(headers[i]));
-					buffers.push_back(boost::asio::buffer(slot.second));
+					if (packet.empty())
+						continue;
+
+					auto size_of_element = 4 + packet.size();
+	
+					if (datagram.size() + size_of_element >= SAFE_DATAGRAM_SIZE && datagram.size() > bundle_header.size())
+					{
+						do_send(datagram, destinations);
+						datagram = bundle_header;
+					}
 
-					datagram_size += size_of_element;
-					++i;
+					write_osc_value(datagram, static_cast<int32_t>(packet.size()));
+					write_padded(datagram, packet.data(), packet.size(), packet.size());
 				}
 			
-				if (!buffers.empty())
-					do_send(buffers, destinations);
+				if (datagram.size() > bundle_header.size())
+					do_send(datagram, destinations);
 			}
 		}
 		catch (...)
@@ -27,289 +27,32 @@
 #include "../stdafx.h"
 
 #include "AsyncEventServer.h"
-#include "SocketInfo.h"
 
 #include <common/log/log.h>
+#include <common/exception/win32_exception.h>
+
 #include <string>
 #include <algorithm>
-#include <boost/algorithm/string/replace.hpp>
-
-#if defined(_MSC_VER)
-#pragma warning (push, 1) // TODO: Legacy code, just disable warnings, will replace with boost::asio in future
-#endif
-
-namespace caspar { namespace IO {
-	
-#define CASPAR_MAXIMUM_SOCKET_CLIENTS	(MAXIMUM_WAIT_OBJECTS-1)	
-
-long AsyncEventServer::instanceCount_ = 0;
-//////////////////////////////
-// AsyncEventServer constructor
-// PARAMS: port(TCP-port the server should listen to)
-// COMMENT: Initializes the WinSock2 library
-AsyncEventServer::AsyncEventServer(const safe_ptr<IProtocolStrategy>& pProtocol, int port) : port_(port), pProtocolStrategy_(pProtocol)
-{
-	if(instanceCount_ == 0) {
-		WSADATA wsaData;
-		if(WSAStartup(MAKEWORD(2,2), &wsaData) != NO_ERROR)
-			throw std::exception("Error initializing WinSock2");
-		else {
-			CASPAR_LOG(info) << "WinSock2 Initialized.";
-		}
-	}
-
-	InterlockedIncrement(&instanceCount_);
-}
-
-/////////////////////////////
-// AsyncEventServer destructor
-AsyncEventServer::~AsyncEventServer() {
-	Stop();
-
-	InterlockedDecrement(&instanceCount_);
-	if(instanceCount_ == 0)
-		WSACleanup();
-}
-
-void AsyncEventServer::SetClientDisconnectHandler(ClientDisconnectEvent handler) {
-	socketInfoCollection_.onSocketInfoRemoved = handler;
-}
-
-void AsyncEventServer::add_lifecycle_factory(const lifecycle_factory_t& factory)
-{
-	tbb::mutex::scoped_lock lock(mutex_);
-
-	lifecycle_factories_.push_back(factory);
-}
-
-//////////////////////////////
-// AsyncEventServer::Start
-// RETURNS: true at successful startup
-bool AsyncEventServer::Start() {
-	if(listenThread_.IsRunning())
-		return false;
-
-	socketInfoCollection_.Clear();
-
-	sockaddr_in sockAddr;
-	ZeroMemory(&sockAddr, sizeof(sockAddr));
-	sockAddr.sin_family = AF_INET;
-	sockAddr.sin_addr.s_addr = INADDR_ANY;
-	sockAddr.sin_port = htons(port_);
-	
-	SOCKET listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if(listenSocket == INVALID_SOCKET) {
-		CASPAR_LOG(error) << "Failed to create listenSocket";
-		return false;
-	}
-	
-	pListenSocketInfo_ = SocketInfoPtr(new SocketInfo(listenSocket, this));
-
-	if(WSAEventSelect(pListenSocketInfo_->socket_, pListenSocketInfo_->event_, FD_ACCEPT|FD_CLOSE) == SOCKET_ERROR) {
-		CASPAR_LOG(error) << "Failed to enter EventSelect-mode for listenSocket";
-		return false;
-	}
-
-	if(bind(pListenSocketInfo_->socket_, (sockaddr*)&sockAddr, sizeof(sockAddr)) == SOCKET_ERROR) {
-		CASPAR_LOG(error) << "Failed to bind listenSocket";
-		return false;
-	}
-
-	if(listen(pListenSocketInfo_->socket_, SOMAXCONN) == SOCKET_ERROR) {
-		CASPAR_LOG(error) << "Failed to listen";
-		return false;
-	}
-
-	socketInfoCollection_.AddSocketInfo(pListenSocketInfo_);
-
-	//start thread: the entrypoint is Run(EVENT stopEvent)
-	if(!listenThread_.Start(this)) {
-		CASPAR_LOG(error) << "Failed to create ListenThread";
-		return false;
-	}
-
-	CASPAR_LOG(info) << "Listener successfully initialized";
-	return true;
-}
-
-void AsyncEventServer::Run(HANDLE stopEvent)
-{
-	WSANETWORKEVENTS networkEvents;
-
-	HANDLE waitHandlesCopy[MAXIMUM_WAIT_OBJECTS];
-	waitHandlesCopy[0] = stopEvent;
-
-	while(true)	{
-		//Update local copy of the array of wait-handles if nessecery
-		if(socketInfoCollection_.IsDirty()) {
-			socketInfoCollection_.CopyCollectionToArray(&(waitHandlesCopy[1]), CASPAR_MAXIMUM_SOCKET_CLIENTS);
-			socketInfoCollection_.ClearDirty();
-		}
-
-		DWORD waitResult = WSAWaitForMultipleEvents(std::min<DWORD>(static_cast<DWORD>(socketInfoCollection_.Size()+1), MAXIMUM_WAIT_OBJECTS), waitHandlesCopy, FALSE, 1500, FALSE);
-		if(waitResult == WAIT_TIMEOUT)
-			continue;
-		else if(waitResult == WAIT_FAILED)
-			break;
-		else {
-			DWORD eventIndex = waitResult - WAIT_OBJECT_0;
-
-			HANDLE waitEvent = waitHandlesCopy[eventIndex];
-			SocketInfoPtr pSocketInfo;
-
-			if(eventIndex == 0)	//stopEvent
-				break;
-			else if(socketInfoCollection_.FindSocketInfo(waitEvent, pSocketInfo)) {
-				WSAEnumNetworkEvents(pSocketInfo->socket_, waitEvent, &networkEvents);
-
-				if(networkEvents.lNetworkEvents & FD_ACCEPT) {
-					if(networkEvents.iErrorCode[FD_ACCEPT_BIT] == 0)
-						OnAccept(pSocketInfo);
-					else {
-						CASPAR_LOG(debug) << "OnAccept (ErrorCode: " << networkEvents.iErrorCode[FD_ACCEPT_BIT] << TEXT(")");
-						OnError(waitEvent, networkEvents.iErrorCode[FD_ACCEPT_BIT]);
-					}
-				}
-
-				if(networkEvents.lNetworkEvents & FD_CLOSE) {
-					if(networkEvents.iErrorCode[FD_CLOSE_BIT] == 0)
-						OnClose(pSocketInfo);
-					else {
-						CASPAR_LOG(debug) << "OnClose (ErrorCode: " << networkEvents.iErrorCode[FD_CLOSE_BIT] << TEXT(")");
-						OnError(waitEvent, networkEvents.iErrorCode[FD_CLOSE_BIT]);
-					}
-					continue;
-				}
-
-				if(networkEvents.lNetworkEvents & FD_READ) {
-					if(networkEvents.iErrorCode[FD_READ_BIT] == 0)
-						OnRead(pSocketInfo);
-					else {
-						CASPAR_LOG(debug) << "OnRead (ErrorCode: " << networkEvents.iErrorCode[FD_READ_BIT] << TEXT(")");
-						OnError(waitEvent, networkEvents.iErrorCode[FD_READ_BIT]);
-					}
-				}
-
-				if(networkEvents.lNetworkEvents & FD_WRITE) {
-					if(networkEvents.iErrorCode[FD_WRITE_BIT] == 0)
-						OnWrite(pSocketInfo);
-					else {
-						CASPAR_LOG(debug) << "OnWrite (ErrorCode: " << networkEvents.iErrorCode[FD_WRITE_BIT] << TEXT(")");
-						OnError(waitEvent, networkEvents.iErrorCode[FD_WRITE_BIT]);
-					}
-				}
-			}
-			else {
-				//Could not find the waitHandle in the SocketInfoCollection.
-				//It must have been removed during the last call to WSAWaitForMultipleEvents
-			}
-		}
-	}
-}
-
-bool AsyncEventServer::OnUnhandledException(const std::exception& ex) throw() {
-	bool bDoRestart = true;
-
-	try 
-	{
-		CASPAR_LOG(fatal) << "UNHANDLED EXCEPTION in TCPServers listeningthread. Message: " << ex.what();
-	}
-	catch(...)
-	{
-		bDoRestart = false;
-	}
+#include <deque>
+#include <set>
+#include <vector>
 
-	return bDoRestart;
-}
-
-///////////////////////////////
-// AsyncEventServer:Stop
-// COMMENT: Shuts down
-void AsyncEventServer::Stop()
-{
-	//TODO: initiate shutdown on all clients connected
-//	for(int i=0; i < _totalActiveSockets; ++i) {
-//		shutdown(_pSocketInfo[i]->_socket, SD_SEND);
-//	}
-
-	if(!listenThread_.Stop()) {
-		CASPAR_LOG(warning) << "Wait for listenThread timed out.";
-	}
-
-	socketInfoCollection_.Clear();
-}
-
-////////////////////////////////////////////////////////////////////
-//
-// MESSAGE HANDLERS   
-//
-////////////////////////////////////////////////////////////////////
-
-
-//////////////////////////////
-// AsyncEventServer::OnAccept
-// PARAMS: ...
-// COMMENT: Called when a new client connects
-bool AsyncEventServer::OnAccept(SocketInfoPtr& pSI) {
-	sockaddr_in	clientAddr;
-	int addrSize = sizeof(clientAddr);
-	SOCKET clientSocket = WSAAccept(pSI->socket_, (sockaddr*)&clientAddr, &addrSize, NULL, NULL);
-	if(clientSocket == INVALID_SOCKET) {
-		LogSocketError(TEXT("Accept"));
-		return false;
-	}
-
-	SocketInfoPtr pClientSocket(new SocketInfo(clientSocket, this));
-
-	try
-	{ // !!!!!!!!!!!!
-		if(socketInfoCollection_.Size() >= 50) 
-		{
-			HANDLE handle = nullptr;
-			{
-				tbb::mutex::scoped_lock lock(socketInfoCollection_.mutex_);				
-				handle = *(socketInfoCollection_.waitEvents_.begin()+0);
-				if(handle == pListenSocketInfo_->event_)
-					handle = *(socketInfoCollection_.waitEvents_.begin()+1);
-			}
-			socketInfoCollection_.RemoveSocketInfo(handle);
-			CASPAR_LOG(error) << " Too many connections. Removed last used connection.";
-		}
-	}catch(...){}
-
-	//Determine if we can handle one more client
-	if(socketInfoCollection_.Size() >= CASPAR_MAXIMUM_SOCKET_CLIENTS) {
-		CASPAR_LOG(error) << "Could not accept ) << too many connections).";
-		return true;
-	}
-
-	if(WSAEventSelect(pClientSocket->socket_, pClientSocket->event_, FD_READ | FD_WRITE | FD_CLOSE) == SOCKET_ERROR) {
-		LogSocketError(TEXT("Accept (failed create event for new client)"));
-		return false;
-	}
-
-	TCHAR addressBuffer[32];
-	auto ipv4_address = inet_ntoa(clientAddr.sin_addr);
-	MultiByteToWideChar(CP_ACP, 0, ipv4_address, -1, addressBuffer, 32);
-	pClientSocket->host_ = addressBuffer;
-
-	{
-		tbb::mutex::scoped_lock lock(mutex_);
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <boost/foreach.hpp>
+#include <boost/algorithm/string/replace.hpp>
 
-		BOOST_FOREACH(auto& lifecycle_factory, lifecycle_factories_)
-		{
-			auto lifecycle_bound = lifecycle_factory(ipv4_address);
+#include <tbb/mutex.h>
 
-			pClientSocket->bind_to_lifecycle(lifecycle_bound);
-		}
-	}
+using boost::asio::ip::tcp;
 
-	socketInfoCollection_.AddSocketInfo(pClientSocket);
+namespace caspar { namespace IO {
 
-	CASPAR_LOG(info) << "Accepted connection from " << pClientSocket->host_.c_str() << " " << socketInfoCollection_.Size();
+namespace {
 
-	return true;
-}
+// Reading from a client is paused while more than this is waiting to be sent to it, e.g. a client which polls INFO without reading the replies.
+const size_t MAX_PENDING_SEND_BYTES = 4 * 1024 * 1024;
+const size_t MAX_BUFFERS_PER_SEND = 64;
 
 bool ConvertMultiByteToWideChar(UINT codePage, char* pSource, int sourceLength, std::vector<wchar_t>& wideBuffer, int& countLeftovers)
 {
@@ -371,265 +114,421 @@ bool ConvertMultiByteToWideChar(UINT codePage, char* pSource, int sourceLength,
 	return (charsWritten > 0);
 }
 
-//////////////////////////////
-// AsyncEventServer::OnRead
-// PARAMS: ...
-// COMMENT: Called then something arrives on the socket that has to be read
-bool AsyncEventServer::OnRead(SocketInfoPtr& pSI) {
-	int recvResult = SOCKET_ERROR;
-	
-	try
-	{ // !!!!!!!!!!!!
-		if(pSI)
-		{
-			tbb::mutex::scoped_lock lock(socketInfoCollection_.mutex_);
-			auto it = std::find(socketInfoCollection_.waitEvents_.begin(), socketInfoCollection_.waitEvents_.end(), pSI->event_);
-			if(it != socketInfoCollection_.waitEvents_.end())
-			{
-				auto handle = *it;
-				socketInfoCollection_.waitEvents_.erase(it);
-				socketInfoCollection_.waitEvents_.push_back(handle);
-			}
-		}
-	}catch(...){}
-
-	int maxRecvLength = sizeof(pSI->recvBuffer_)-pSI->recvLeftoverOffset_;
-	recvResult = recv(pSI->socket_, pSI->recvBuffer_+pSI->recvLeftoverOffset_, maxRecvLength, 0);
-	while(recvResult != SOCKET_ERROR) {
-		if(recvResult == 0) {
-			CASPAR_LOG(info) << "Client " << pSI->host_.c_str() << TEXT(" disconnected");
-
-			socketInfoCollection_.RemoveSocketInfo(pSI);
-			return true;
-		}
-
-		//Convert to widechar
-		if(ConvertMultiByteToWideChar(pProtocolStrategy_->GetCodepage(), pSI->recvBuffer_, recvResult + pSI->recvLeftoverOffset_, pSI->wideRecvBuffer_, pSI->recvLeftoverOffset_))		
-			pProtocolStrategy_->Parse(&pSI->wideRecvBuffer_[0], pSI->wideRecvBuffer_.size(), pSI);		
-		else			
-			CASPAR_LOG(error) << "Read from " << pSI->host_.c_str() << TEXT(" failed, could not convert command to UNICODE");
-			
-		maxRecvLength = sizeof(pSI->recvBuffer_)-pSI->recvLeftoverOffset_;
-		recvResult = recv(pSI->socket_, pSI->recvBuffer_+pSI->recvLeftoverOffset_, maxRecvLength, 0);
-	}
-			
-	if(recvResult == SOCKET_ERROR) {
-		int errorCode = WSAGetLastError();
-		if(errorCode == WSAEWOULDBLOCK)
-			return true;
-		else {
-			LogSocketError(TEXT("Read"), errorCode);
-			OnError(pSI->event_, errorCode);
-		}
-	}
-
-	return false;
-}
-
-//////////////////////////////
-// AsyncEventServer::OnWrite
-// PARAMS: ...
-// COMMENT: Called when the socket is ready to send more data
-void AsyncEventServer::OnWrite(SocketInfoPtr& pSI) {		
-	DoSend(*pSI);	
-}
-
-bool ConvertWideCharToMultiByte(UINT codePage, const std::wstring& wideString, std::vector<char>& destBuffer)
+bool ConvertWideCharToMultiByte(UINT codePage, const std::wstring& wideString, std::string& destBuffer)
 {
 	int bytesWritten = 0;
 	int multibyteBufferCapacity = WideCharToMultiByte(codePage, 0, wideString.c_str(), static_cast<int>(wideString.length()), 0, 0, NULL, NULL);
 	if(multibyteBufferCapacity > 0) 
 	{
 		destBuffer.resize(multibyteBufferCapacity);
-		bytesWritten = WideCharToMultiByte(codePage, 0, wideString.c_str(), static_cast<int>(wideString.length()), &destBuffer[0], destBuffer.size(), NULL, NULL);
+		bytesWritten = WideCharToMultiByte(codePage, 0, wideString.c_str(), static_cast<int>(wideString.length()), &destBuffer[0], static_cast<int>(destBuffer.size()), NULL, NULL);
 	}
 	destBuffer.resize(bytesWritten);
 	return (bytesWritten > 0);
 }
 
-void AsyncEventServer::DoSend(SocketInfo& socketInfo) {
-	//Locks the socketInfo-object so that no one else tampers with the sendqueue at the same time
-	tbb::mutex::scoped_lock lock(socketInfo.mutex_);
+}
+
+class connection;
+
+// State shared between the server and its connections. A connection may outlive the server, e.g. when a command still holds its ClientInfo.
+struct server_context
+{
+	std::shared_ptr<boost::asio::io_service>	service;
+	tbb::mutex									mutex;
+	safe_ptr<IProtocolStrategy>					protocol;
+	ClientDisconnectEvent						on_disconnect;
+	std::vector<lifecycle_factory_t>			lifecycle_factories;
+	std::set<std::shared_ptr<connection>>		connections; // Only accessed on the io_service thread.
+
+	server_context(const safe_ptr<IProtocolStrategy>& protocol)
+		: service(std::make_shared<boost::asio::io_service>())
+		, protocol(protocol)
+	{
+	}
 
-	while(!socketInfo.sendQueue_.empty() || socketInfo.currentlySending_.size() > 0) {
-		if(socketInfo.currentlySending_.size() == 0) {
-			//Read the next string in the queue and convert to UTF-8
-			if(!ConvertWideCharToMultiByte(pProtocolStrategy_->GetCodepage(), socketInfo.sendQueue_.front(), socketInfo.currentlySending_))
+	safe_ptr<IProtocolStrategy> get_protocol()
+	{
+		tbb::mutex::scoped_lock lock(mutex);
+		return protocol;
+	}
+};
+
+// Reads straight into a fixed per connection buffer and sends everything queued with one gathered write.
+// Unless noted otherwise members are only accessed on the io_service thread.
+class connection : public ClientInfo, public std::enable_shared_from_this<connection>
+{
+	const std::shared_ptr<server_context>	context_;
+	tcp::socket								socket_;
+	std::wstring							host_;
+	std::vector<std::shared_ptr<void>>		lifecycle_bound_items_;
+
+	char									receive_buffer_[8192];
+	int										receive_leftover_;
+	std::vector<wchar_t>					wide_receive_buffer_;
+
+	std::deque<std::shared_ptr<std::string>>	send_queue_;
+	size_t									pending_send_bytes_;
+	size_t									sending_count_;
+
+	bool									is_reading_;
+	bool									shutdown_after_send_;
+	bool									is_closed_;
+public:
+	connection(const std::shared_ptr<server_context>& context)
+		: context_(context)
+		, socket_(*context->service)
+		, receive_leftover_(0)
+		, pending_send_bytes_(0)
+		, sending_count_(0)
+		, is_reading_(false)
+		, shutdown_after_send_(false)
+		, is_closed_(false)
+	{
+	}
+
+	tcp::socket& socket()
+	{
+		return socket_;
+	}
+
+	void start(const std::string& ipv4_address)
+	{
+		host_ = std::wstring(ipv4_address.begin(), ipv4_address.end());
+
+		boost::system::error_code ec;
+		socket_.set_option(tcp::no_delay(true), ec);
+
+		{
+			tbb::mutex::scoped_lock lock(context_->mutex);
+
+			BOOST_FOREACH(auto& lifecycle_factory, context_->lifecycle_factories)
+				lifecycle_bound_items_.push_back(lifecycle_factory(ipv4_address));
+		}
+
+		read();
+	}
+
+	// May be called from any thread.
+	virtual void Send(const std::wstring& data) override
+	{
+		if(data.empty())
+			return;
+
+		auto encoded = std::make_shared<std::string>();
+		if(!ConvertWideCharToMultiByte(context_->get_protocol()->GetCodepage(), data, *encoded))
+		{
+			CASPAR_LOG(error) << "Send to " << host_.c_str() << TEXT(" failed, could not convert response to UTF-8");
+			return;
+		}
+
+		if(data.size() < 512)
+		{
+			auto message = data;
+			boost::replace_all(message, L"\n", L"\\n");
+			boost::replace_all(message, L"\r", L"\\r");
+			CASPAR_LOG(info) << L"Sent message to " << host_.c_str() << L": " << message.c_str();
+		}
+		else
+			CASPAR_LOG(info) << "Sent more than 512 bytes to " << host_.c_str();
+
+		auto self = shared_from_this();
+		context_->service->post([=]
+		{
+			self->enqueue(encoded);
+		});
+	}
+
+	// May be called from any thread. Queued replies are sent before the connection is shut down.
+	virtual void Disconnect() override
+	{
+		auto self = shared_from_this();
+		context_->service->post([=]
+		{
+			if(self->sending_count_ > 0)
+				self->shutdown_after_send_ = true;
+			else
 			{
-				CASPAR_LOG(error) << "Send to " << socketInfo.host_.c_str() << TEXT(" failed, could not convert response to UTF-8");
+				boost::system::error_code ec;
+				self->socket_.shutdown(tcp::socket::shutdown_send, ec);
 			}
-			socketInfo.currentlySendingOffset_ = 0;
+		});
+	}
+
+	virtual std::wstring print() const override
+	{
+		return host_;
+	}
+
+	void close()
+	{
+		if(is_closed_)
+			return;
+
+		is_closed_ = true;
+
+		boost::system::error_code ec;
+		socket_.shutdown(tcp::socket::shutdown_both, ec);
+		socket_.close(ec);
+
+		lifecycle_bound_items_.clear();
+		send_queue_.clear();
+
+		auto self = shared_from_this();
+		context_->connections.erase(self);
+
+		ClientDisconnectEvent on_disconnect;
+		{
+			tbb::mutex::scoped_lock lock(context_->mutex);
+			on_disconnect = context_->on_disconnect;
 		}
 
-		if(socketInfo.currentlySending_.size() > 0) {
-			int bytesToSend = static_cast<int>(socketInfo.currentlySending_.size()-socketInfo.currentlySendingOffset_);
-			int sentBytes = send(socketInfo.socket_, &socketInfo.currentlySending_[0] + socketInfo.currentlySendingOffset_, bytesToSend, 0);
-			if(sentBytes == SOCKET_ERROR) {
-				int errorCode = WSAGetLastError();
-				if(errorCode == WSAEWOULDBLOCK) {
-					CASPAR_LOG(debug) << "Send to " << socketInfo.host_.c_str() << TEXT(" would block, sending later");
-					break;
-				}
-				else {
-					LogSocketError(TEXT("Send"), errorCode);
-					OnError(socketInfo.event_, errorCode);
+		if(on_disconnect)
+			on_disconnect(self);
+	}
+private:
+	void read()
+	{
+		if(is_reading_ || is_closed_ || pending_send_bytes_ > MAX_PENDING_SEND_BYTES)
+			return;
+
+		is_reading_ = true;
+
+		auto self = shared_from_this();
+		socket_.async_read_some(
+				boost::asio::buffer(receive_buffer_ + receive_leftover_, sizeof(receive_buffer_) - receive_leftover_),
+				[self](const boost::system::error_code& error, size_t bytes_transferred)
+				{
+					self->on_read(error, bytes_transferred);
+				});
+	}
 
-					socketInfo.currentlySending_.resize(0);
-					socketInfo.currentlySendingOffset_ = 0;
-					socketInfo.sendQueue_.pop();
-					break;
-				}
-			}
-			else {
-				if(sentBytes == bytesToSend) {
-					
-					if(sentBytes < 512)
-					{
-						boost::replace_all(socketInfo.sendQueue_.front(), L"\n", L"\\n");
-						boost::replace_all(socketInfo.sendQueue_.front(), L"\r", L"\\r");
-						CASPAR_LOG(info) << L"Sent message to " << socketInfo.host_.c_str() << L": " << socketInfo.sendQueue_.front().c_str();
-					}
-					else
-						CASPAR_LOG(info) << "Sent more than 512 bytes to " << socketInfo.host_.c_str();
+	void on_read(const boost::system::error_code& error, size_t bytes_transferred)
+	{
+		is_reading_ = false;
 
-					socketInfo.currentlySending_.resize(0);
-					socketInfo.currentlySendingOffset_ = 0;
-					socketInfo.sendQueue_.pop();
-				}
-				else {
-					socketInfo.currentlySendingOffset_ += sentBytes;
-					CASPAR_LOG(info) << "Sent partial message to " << socketInfo.host_.c_str();
-				}
+		if(error)
+		{
+			if(error != boost::asio::error::operation_aborted)
+			{
+				if(error == boost::asio::error::eof)
+					CASPAR_LOG(info) << "Client " << host_.c_str() << TEXT(" disconnected");
+				else
+					CASPAR_LOG(info) << "Client " << host_.c_str() << TEXT(" was disconnected, ") << error.message().c_str();
 			}
+
+			close();
+			return;
 		}
+
+		auto protocol = context_->get_protocol();
+
+		if(ConvertMultiByteToWideChar(protocol->GetCodepage(), receive_buffer_, static_cast<int>(bytes_transferred) + receive_leftover_, wide_receive_buffer_, receive_leftover_))
+			protocol->Parse(&wide_receive_buffer_[0], static_cast<int>(wide_receive_buffer_.size()), shared_from_this());
 		else
-			socketInfo.sendQueue_.pop();
+			CASPAR_LOG(error) << "Read from " << host_.c_str() << TEXT(" failed, could not convert command to UNICODE");
+
+		read();
 	}
-}
 
-//////////////////////////////
-// AsyncEventServer::OnClose
-// PARAMS: ...
-// COMMENT: Called when a client disconnects / is disconnected
-void AsyncEventServer::OnClose(SocketInfoPtr& pSI) {
-	CASPAR_LOG(info) << "Client " << pSI->host_.c_str() << TEXT(" was disconnected");
+	void enqueue(const std::shared_ptr<std::string>& data)
+	{
+		if(is_closed_)
+			return;
 
-	socketInfoCollection_.RemoveSocketInfo(pSI);
-}
+		send_queue_.push_back(data);
+		pending_send_bytes_ += data->size();
 
-//////////////////////////////
-// AsyncEventServer::OnError
-// PARAMS: ...
-// COMMENT: Called when an errorcode is recieved
-void AsyncEventServer::OnError(HANDLE waitEvent, int errorCode) {
-	if(errorCode == WSAENETDOWN || errorCode == WSAECONNABORTED || errorCode == WSAECONNRESET || errorCode == WSAESHUTDOWN || errorCode == WSAETIMEDOUT || errorCode == WSAENOTCONN || errorCode == WSAENETRESET) {
-		SocketInfoPtr pSocketInfo;
-		if(socketInfoCollection_.FindSocketInfo(waitEvent, pSocketInfo)) {
-			CASPAR_LOG(info) << "Client " << pSocketInfo->host_.c_str() << TEXT(" was disconnected, Errorcode ") << errorCode;
+		if(sending_count_ == 0)
+			write();
+	}
+
+	void write()
+	{
+		std::vector<boost::asio::const_buffer> buffers;
+
+		sending_count_ = std::min(send_queue_.size(), MAX_BUFFERS_PER_SEND);
+		for(size_t n = 0; n < sending_count_; ++n)
+			buffers.push_back(boost::asio::buffer(*send_queue_[n]));
+
+		auto self = shared_from_this();
+		boost::asio::async_write(socket_, buffers, [self](const boost::system::error_code& error, size_t bytes_transferred)
+		{
+			self->on_write(error, bytes_transferred);
+		});
+	}
+
+	void on_write(const boost::system::error_code& error, size_t bytes_transferred)
+	{
+		if(is_closed_)
+			return;
+
+		if(error)
+		{
+			if(error != boost::asio::error::operation_aborted)
+				CASPAR_LOG(error) << "Failed to Send to " << host_.c_str() << TEXT(" ") << error.message().c_str();
+
+			close();
+			return;
+		}
+
+		send_queue_.erase(send_queue_.begin(), send_queue_.begin() + sending_count_);
+		pending_send_bytes_ -= bytes_transferred;
+		sending_count_ = 0;
+
+		if(!send_queue_.empty())
+			write();
+		else if(shutdown_after_send_)
+		{
+			boost::system::error_code ec;
+			socket_.shutdown(tcp::socket::shutdown_send, ec);
 		}
 
-		socketInfoCollection_.RemoveSocketInfo(waitEvent);
+		read(); // Resumes reading if it was paused by a full send queue.
 	}
-}
+};
 
-//////////////////////////////
-// AsyncEventServer::DisconnectClient
-// PARAMS: ...
-// COMMENT: The client is removed from the actual client-list when an FD_CLOSE notification is recieved
-void AsyncEventServer::DisconnectClient(SocketInfo& socketInfo) {
-	int result = shutdown(socketInfo.socket_, SD_SEND);
-	if(result == SOCKET_ERROR)
-		OnError(socketInfo.event_, result);
-}
+struct AsyncEventServer::implementation : boost::noncopyable
+{
+	const int									port_;
+	const std::shared_ptr<server_context>		context_;
+	std::unique_ptr<tcp::acceptor>				acceptor_;
+	std::unique_ptr<boost::asio::io_service::work>	work_;
+	boost::thread								thread_;
+
+	implementation(const safe_ptr<IProtocolStrategy>& protocol, int port)
+		: port_(port)
+		, context_(std::make_shared<server_context>(protocol))
+	{
+	}
 
-//////////////////////////////
-// AsyncEventServer::LogSocketError
-void AsyncEventServer::LogSocketError(const TCHAR* pStr, int socketError) {
-	if(socketError == 0)
-		socketError = WSAGetLastError();
+	~implementation()
+	{
+		stop();
+	}
 
-	CASPAR_LOG(error) << "Failed to " << pStr << TEXT(" Errorcode: ") << socketError;
-}
+	bool start()
+	{
+		if(acceptor_)
+			return false;
 
+		try
+		{
+			acceptor_.reset(new tcp::acceptor(*context_->service, tcp::endpoint(tcp::v4(), static_cast<unsigned short>(port_))));
+		}
+		catch(...)
+		{
+			CASPAR_LOG_CURRENT_EXCEPTION();
+			CASPAR_LOG(error) << "Failed to listen on port " << port_;
+			return false;
+		}
 
-//////////////////////////////
-//  SocketInfoCollection
-//////////////////////////////
+		context_->service->reset();
+		work_.reset(new boost::asio::io_service::work(*context_->service));
 
-AsyncEventServer::SocketInfoCollection::SocketInfoCollection() : bDirty_(false) {
-}
+		accept();
 
-AsyncEventServer::SocketInfoCollection::~SocketInfoCollection() {
-}
+		auto service = context_->service;
+		thread_ = boost::thread([service]
+		{
+			win32_exception::ensure_handler_installed_for_thread("tcp-server");
 
-bool AsyncEventServer::SocketInfoCollection::AddSocketInfo(SocketInfoPtr& pSocketInfo) {
-	tbb::mutex::scoped_lock lock(mutex_);
+			while(true)
+			{
+				try
+				{
+					service->run();
+					break;
+				}
+				catch(...)
+				{
+					CASPAR_LOG(fatal) << "UNHANDLED EXCEPTION in TCPServers io thread.";
+					CASPAR_LOG_CURRENT_EXCEPTION();
+				}
+			}
+		});
 
-	waitEvents_.resize(waitEvents_.size()+1);
-	bool bSuccess = socketInfoMap_.insert(SocketInfoMap::value_type(pSocketInfo->event_, pSocketInfo)).second;
-	if(bSuccess) {
-		waitEvents_[waitEvents_.size()-1] = pSocketInfo->event_;
-		bDirty_ = true;
+		CASPAR_LOG(info) << "Listener successfully initialized";
+		return true;
 	}
 
-	return bSuccess;
-}
+	void stop()
+	{
+		if(!acceptor_)
+			return;
 
-void AsyncEventServer::SocketInfoCollection::RemoveSocketInfo(SocketInfoPtr& pSocketInfo) {
-	if(pSocketInfo != 0) {
-		RemoveSocketInfo(pSocketInfo->event_);
-	}
-}
-void AsyncEventServer::SocketInfoCollection::RemoveSocketInfo(HANDLE waitEvent) {
-	tbb::mutex::scoped_lock lock(mutex_);
+		auto context = context_;
+		auto acceptor = acceptor_.get();
+		context_->service->post([context, acceptor]
+		{
+			boost::system::error_code ec;
+			acceptor->close(ec);
 
-	//Find instance
-	SocketInfoPtr pSocketInfo;
-	SocketInfoMap::iterator it = socketInfoMap_.find(waitEvent);
-	SocketInfoMap::iterator end = socketInfoMap_.end();
-	if(it != end)
-		pSocketInfo = it->second;
+			auto connections = context->connections;
+			BOOST_FOREACH(auto& connection, connections)
+				connection->close();
+		});
 
-	if(pSocketInfo) {
-		pSocketInfo->pServer_ = NULL;
+		work_.reset();
+		thread_.join();
 
-		socketInfoMap_.erase(waitEvent);
+		acceptor_.reset();
+	}
 
-		HandleVector::iterator it = std::find(waitEvents_.begin(), waitEvents_.end(), waitEvent);
-		if(it != waitEvents_.end()) {
-			std::swap((*it), waitEvents_.back());
-			waitEvents_.resize(waitEvents_.size()-1);
+	void accept()
+	{
+		auto new_connection = std::make_shared<connection>(context_);
 
-			bDirty_ = true;
-		}
+		acceptor_->async_accept(new_connection->socket(), [=](const boost::system::error_code& error)
+		{
+			on_accept(new_connection, error);
+		});
 	}
-	if(onSocketInfoRemoved)
-		onSocketInfoRemoved(pSocketInfo);
-}
 
-bool AsyncEventServer::SocketInfoCollection::FindSocketInfo(HANDLE key, SocketInfoPtr& pResult) {
-	tbb::mutex::scoped_lock lock(mutex_);
+	void on_accept(const std::shared_ptr<connection>& new_connection, const boost::system::error_code& error)
+	{
+		if(error == boost::asio::error::operation_aborted)
+			return;
 
-	SocketInfoMap::iterator it = socketInfoMap_.find(key);
-	SocketInfoMap::iterator end = socketInfoMap_.end();
-	if(it != end)
-		pResult = it->second;
+		if(error)
+			CASPAR_LOG(error) << "Failed to Accept " << error.message().c_str();
+		else
+		{
+			boost::system::error_code ec;
+			auto ipv4_address = new_connection->socket().remote_endpoint(ec).address().to_string();
 
-	return (it != end);
-}
+			context_->connections.insert(new_connection);
+			new_connection->start(ipv4_address);
 
-void AsyncEventServer::SocketInfoCollection::CopyCollectionToArray(HANDLE* pDest, int maxCount) {
-	tbb::mutex::scoped_lock lock(mutex_);
+			CASPAR_LOG(info) << "Accepted connection from " << new_connection->print().c_str() << " " << context_->connections.size();
+		}
 
-	memcpy(pDest, &(waitEvents_[0]), std::min( maxCount, static_cast<int>(waitEvents_.size()) ) * sizeof(HANDLE) );
+		accept();
+	}
+};
+
+AsyncEventServer::AsyncEventServer(const safe_ptr<IProtocolStrategy>& pProtocol, int port) : impl_(new implementation(pProtocol, port)){}
+AsyncEventServer::~AsyncEventServer(){}
+bool AsyncEventServer::Start(){return impl_->start();}
+void AsyncEventServer::Stop(){impl_->stop();}
+
+void AsyncEventServer::SetProtocolStrategy(safe_ptr<IProtocolStrategy> pPS)
+{
+	tbb::mutex::scoped_lock lock(impl_->context_->mutex);
+	impl_->context_->protocol = pPS;
 }
 
-void AsyncEventServer::SocketInfoCollection::Clear() {
-	tbb::mutex::scoped_lock lock(mutex_);
+void AsyncEventServer::SetClientDisconnectHandler(ClientDisconnectEvent handler)
+{
+	tbb::mutex::scoped_lock lock(impl_->context_->mutex);
+	impl_->context_->on_disconnect = handler;
+}
 
-	socketInfoMap_.clear();
-	waitEvents_.clear();
+void AsyncEventServer::add_lifecycle_factory(const lifecycle_factory_t& factory)
+{
+	tbb::mutex::scoped_lock lock(impl_->context_->mutex);
+	impl_->context_->lifecycle_factories.push_back(factory);
 }
 
 }	//namespace IO
-}	//namespace caspar
\ No newline at end of file
+}	//namespace caspar
@@ -39,7 +39,7 @@
 #include <core/consumer/synchronizing/synchronizing_consumer.h>
 #include <core/producer/media_info/media_info.h>
 #include <core/producer/media_info/media_info_repository.h>
-#include <core/producer/media_info/in_memory_media_info_repository.h>
+#include <core/producer/media_info/persistent_media_info_repository.h>
 #include <core/system_watcher.h>
 #include <windows.h>
 
@@ -114,7 +114,7 @@ struct server::implementation : boost::noncopyable
 {
 	std::shared_ptr<boost::asio::io_service>	io_service_;
 	safe_ptr<core::monitor::subject>			monitor_subject_;
-	safe_ptr<ogl_device>						ogl_;
+	std::shared_ptr<ogl_device>					ogl_;
 	std::vector<safe_ptr<IO::AsyncEventServer>> async_servers_;
 	std::shared_ptr<IO::AsyncEventServer>		primary_amcp_server_;
 	osc::client									osc_client_;
@@ -122,14 +122,15 @@ struct server::implementation : boost::noncopyable
 	std::vector<safe_ptr<video_channel>>		channels_;
 	std::vector<safe_ptr<recorder>>				recorders_;
 	safe_ptr<media_info_repository>				media_info_repo_;
-	boost::thread								initial_media_info_thread_;
+	polling_filesystem_monitor_factory			monitor_factory_;
+	std::vector<filesystem_monitor::ptr>		media_monitors_;
 	tbb::atomic<bool>							running_;
 
 	implementation()
 		: io_service_(create_running_io_service())
-		, ogl_(ogl_device::create())
 		, osc_client_(io_service_)
-		, media_info_repo_(create_in_memory_media_info_repository())
+		, media_info_repo_(create_persistent_media_info_repository(env::data_folder() + L"media-index.txt"))
+		, monitor_factory_(io_service_)
 	{
 		running_ = true;
 		setup_audio(env::properties());
@@ -178,14 +179,14 @@ struct server::implementation : boost::noncopyable
 		CASPAR_LOG(info) << L"Initialized system watcher.";
 		*/
 
-		start_initial_media_info_scan();
-		CASPAR_LOG(info) << L"Started initial media information retrieval.";
+		start_media_monitors();
+		CASPAR_LOG(info) << L"Started media information retrieval.";
 	}
 
 	~implementation()
 	{
 		running_ = false;
-		initial_media_info_thread_.join();
+		media_monitors_.clear();
 		primary_amcp_server_.reset();
 		async_servers_.clear();
 		destroy_producers_synchronously();
@@ -224,7 +225,13 @@ struct server::implementation : boost::noncopyable
 			auto audio_channel_layout = default_channel_layout_repository().get_by_name(
 				boost::to_upper_copy(xml_channel.second.get(L"channel-layout", L"STEREO")));
 
-			channels_.push_back(make_safe<video_channel>(channels_.size() + 1, format_desc, ogl_, audio_channel_layout));
+			auto image_mixer = xml_channel.second.get(L"image-mixer", L"gpu");
+			if (image_mixer != L"gpu" && image_mixer != L"cpu")
+				BOOST_THROW_EXCEPTION(caspar_exception() << msg_info("Invalid image-mixer, expected gpu or cpu."));
+
+			auto ogl = image_mixer == L"cpu" ? std::shared_ptr<ogl_device>() : get_ogl();
+
+			channels_.push_back(make_safe<video_channel>(channels_.size() + 1, format_desc, ogl, audio_channel_layout));
 
 			channels_.back()->monitor_output().attach_parent(monitor_subject_);
 			channels_.back()->mixer()->set_straight_alpha_output(
@@ -248,7 +255,16 @@ struct server::implementation : boost::noncopyable
 
 		// Dummy diagnostics channel
 		if(env::properties().get(L"configuration.channel-grid", false))
-			channels_.push_back(make_safe<video_channel>(channels_.size()+1, core::video_format_desc::get(core::video_format::x576p2500), ogl_, default_channel_layout_repository().get_by_name(L"STEREO")));
+			channels_.push_back(make_safe<video_channel>(channels_.size()+1, core::video_format_desc::get(core::video_format::x576p2500), get_ogl(), default_channel_layout_repository().get_by_name(L"STEREO")));
+	}
+
+	std::shared_ptr<ogl_device> get_ogl()
+	{
+		// Created on first use so that hosts running only cpu channels do not need an OpenGL capable device.
+		if (!ogl_)
+			ogl_ = ogl_device::create();
+
+		return ogl_;
 	}
 
 	template<typename Base>
@@ -454,23 +470,43 @@ struct server::implementation : boost::noncopyable
 		BOOST_THROW_EXCEPTION(caspar_exception() << arg_name_info("name") << arg_value_info(narrow(name)) << msg_info("Invalid protocol"));
 	}
 
-	void start_initial_media_info_scan()
+	void start_media_monitors()
 	{
-		initial_media_info_thread_ = boost::thread([this]
-		{
-			for (boost::filesystem::wrecursive_directory_iterator iter(env::media_folder()), end; iter != end; ++iter)
-			{
-				if (running_)
-					media_info_repo_->get(iter->path().file_string());
-				else
+		monitor_folder(env::media_folder());
+
+		if (!boost::istarts_with(env::template_folder(), env::media_folder()))
+			monitor_folder(env::template_folder());
+	}
+
+	// Keeps media_info_repo_ in line with folder, so that CLS, CINF and TLS never have to walk the filesystem.
+	void monitor_folder(const std::wstring& folder)
+	{
+		auto media_info_repo = media_info_repo_;
+
+		media_monitors_.push_back(monitor_factory_.create(
+				folder,
+				ALL,
+				false,
+				[media_info_repo](filesystem_event event, const boost::filesystem::wpath& file)
 				{
-					CASPAR_LOG(info) << L"Initial media information retrieval aborted.";
-					return;
-				}
-			}
+					if (event == REMOVED)
+						media_info_repo->remove(file.file_string());
+					else
+						media_info_repo->get(file.file_string());
+				},
+				[this, media_info_repo, folder](const std::set<boost::filesystem::wpath>& initial_files)
+				{
+					std::vector<std::wstring> files;
+					BOOST_FOREACH(auto& file, initial_files)
+						files.push_back(file.file_string());
 
-			CASPAR_LOG(info) << L"Initial media information retrieval finished.";
-		});
+					media_info_repo->update_all(folder, files, [this] { return !running_; });
+
+					if (running_)
+						CASPAR_LOG(info) << L"Initial media information retrieval finished for " << folder << L".";
+					else
+						CASPAR_LOG(info) << L"Initial media information retrieval aborted.";
+				}));
 	}
 };
 